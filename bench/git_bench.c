@@ -0,0 +1,995 @@
+// End-to-end benchmark: builds synthetic repositories in a temp dir, runs the
+// git binary against them and reports latency percentiles, throughput and
+// peak RSS per command. Everything is generated locally from a fixed seed,
+// so runs on different commits are comparable.
+//
+//   git-bench [--git PATH] [--runs N] [--scale F] [--scenario NAME] [--json FILE|-]
+//
+// "git-bench --scenario import-100k" compares a 100k-file import into loose
+// objects against write-tree --bulk, including the inodes each leaves behind,
+// and then hashes the same files with one hash-object --stdin-paths process
+// (names only, loose and --bulk) against one hash-object -w per file.
+// Every other scenario times a cold write-tree at 1, 2, 4, 8 and 16 jobs, so
+// the curve can be read off a machine with that many cores, and ends with a
+// repack of its objects; "history" first writes several revisions of its
+// files so there are deltas to find. The packed repository is then committed
+// and cloned through `git upload-pack` (which has to be on PATH): time to a
+// checked-out work tree, with the peak RSS of the clone and its upload-pack
+// together. Last, the clone's work tree is emptied and checked out again with
+// read-tree -u at 1, 2, 4 and 8 jobs.
+// "ignored" puts ten times the tracked content in node_modules/ directories
+// and only times write-tree, with and without a .gitignore that names them.
+// "mixed" is half text and half random bytes, written cold as loose objects
+// and with --bulk under several compression settings in .git/config.
+// "history" finally replays commits of two changed files each through
+// fast-import, in commits per second, and times rev-list and merge-base on
+// the imported history with and without a commit-graph. Last, it imports
+// 100k commits and times a path-limited log on them: without a graph, with
+// one, and with one that carries changed-path Bloom filters.
+// "packs" spreads one blob per file over 1, 10 and then 100 packs and times
+// cat-file --batch-check on the name of every blob, and on as many names
+// that aren't in the repository, before and after a multi-pack-index write.
+// "git-bench --scenario big-blobs" runs hash-object -w on one file of 1 MiB,
+// 1 GiB and 4.5 GiB (times --scale) and reports each run's peak RSS.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "hash.h"
+
+#ifndef GIT_BINARY
+#define GIT_BINARY "./git"
+#endif
+
+#define MAX_SAMPLES 4096
+#define SAMPLE_FILES 100 // per-invocation commands run on this many files
+#define PER_FILE_SAMPLE 1000 // hash-object processes timed against --stdin-paths
+
+typedef struct Bench Bench;
+
+typedef struct {
+    const char *name;
+    int (*run)(Bench *b); // the commands timed on the generated files
+    int dirs;          // directories per level
+    int depth;         // levels of nesting
+    int files;         // files per directory
+    size_t min_size, max_size;
+    int scale_size;    // --scale grows the files rather than their number
+    int by_name;       // only run when asked for with --scenario
+    int revisions;     // edit rounds before the repack, each touching 1 file in 20
+    int ignored;       // bytes under ignored node_modules/ dirs per tracked byte
+    int binary;        // percent of files that are incompressible, like media or archives
+    int packs;         // object lookups over up to this many packs
+} Scenario;
+
+typedef struct {
+    double wall[MAX_SAMPLES];
+    size_t count;
+    long peak_rss_kb;
+    long inodes;       // files and directories under .git/objects afterwards, 0 if not measured
+    long disk_kb;      // their allocated size
+} Samples;
+
+static const char *git_path = GIT_BINARY;
+static int runs = 5;
+static double scale = 1.0;
+static FILE *json;
+static FILE *table;  // the human-readable report goes wherever the JSON doesn't
+static int json_first = 1;
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+
+// Text-like content: compressible, but never the same twice
+static int write_file(const char *path, size_t size) {
+    static const char *const words[] = { "alpha ", "beta ", "gamma ", "delta ", "struct ", "return ",
+                                         "int ", "0x1f ", "{\n", "}\n", "// note\n", "\n" };
+    FILE *f = fopen(path, "w");
+    if (!f) { perror(path); return -1; }
+    char buf[1 << 16];
+    size_t done = 0;
+    while (done < size) {
+        size_t n = 0;
+        while (n < sizeof(buf) - 16 && done + n < size) {
+            const char *w = words[rng() % (sizeof(words) / sizeof(words[0]))];
+            size_t len = strlen(w);
+            if (done + n + len > size) len = size - done - n;
+            memcpy(buf + n, w, len);
+            n += len;
+        }
+        fwrite(buf, 1, n, f);
+        done += n;
+    }
+    return fclose(f);
+}
+
+
+// Random bytes: what compressed formats look like to deflate
+static int write_binary_file(const char *path, size_t size) {
+    FILE *f = fopen(path, "w");
+    if (!f) { perror(path); return -1; }
+    uint64_t buf[1 << 13];
+    for (size_t done = 0; done < size; ) {
+        for (size_t i = 0; i < sizeof(buf) / sizeof(buf[0]); i++) buf[i] = rng();
+        size_t n = size - done < sizeof(buf) ? size - done : sizeof(buf);
+        fwrite(buf, 1, n, f);
+        done += n;
+    }
+    return fclose(f);
+}
+
+
+static int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st; (void)flag; (void)ftw;
+    if (remove(path) < 0) perror(path);
+    return 0;
+}
+
+
+static void rm_rf(const char *path) {
+    nftw(path, rm_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+
+// Everything but .git, so the next checkout starts from an empty work tree
+static void clear_work_tree(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) return;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 || strcmp(de->d_name, ".git") == 0) continue;
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >= (int)sizeof(path)) continue;
+        rm_rf(path);
+    }
+    closedir(d);
+}
+
+
+static long inode_count, block_count;
+
+static int count_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)path; (void)flag; (void)ftw;
+    inode_count++;
+    block_count += st->st_blocks;
+    return 0;
+}
+
+
+// What an object database costs the filesystem: inodes and allocated KB
+static void measure_disk(const char *path, Samples *s) {
+    inode_count = block_count = 0;
+    nftw(path, count_entry, 64, FTW_PHYS);
+    s->inodes = inode_count;
+    s->disk_kb = block_count / 2; // st_blocks counts 512-byte units
+}
+
+
+// A revision of a file: a few words overwritten at a random spot
+static int edit_file(const char *path) {
+    static const char *const words[] = { "edited ", "changed ", "fixed ", "renamed ", "moved ", "\n" };
+    FILE *f = fopen(path, "r+");
+    if (!f) { perror(path); return -1; }
+    struct stat st;
+    if (fstat(fileno(f), &st) == 0 && st.st_size > 0) fseek(f, (long)(rng() % (uint64_t)st.st_size), SEEK_SET);
+    for (int i = 0; i < 8; i++) fputs(words[rng() % (sizeof(words) / sizeof(words[0]))], f);
+    return fclose(f);
+}
+
+
+// Run git in `dir` with stdin/stdout redirected; records wall time and peak RSS.
+// Setup steps (no samples) also have their chatter on stderr silenced.
+static int run_git(const char *dir, char *const args[], const char *in_path, const char *out_path,
+                   Samples *samples) {
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); return -1; }
+    if (pid == 0) {
+        if (chdir(dir) < 0) _exit(127);
+        int in = open(in_path ? in_path : "/dev/null", O_RDONLY);
+        int out = open(out_path ? out_path : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (in < 0 || out < 0) _exit(127);
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        if (!samples) dup2(out, STDERR_FILENO);
+        char *argv[16] = { (char *)git_path };
+        for (int i = 0; args[i] && i < 14; i++) argv[i + 1] = args[i];
+        execv(git_path, argv);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0) { perror("wait4"); return -1; }
+    double wall = now() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "git %s failed in %s\n", args[0], dir);
+        return -1;
+    }
+    if (samples) {
+        if (samples->count < MAX_SAMPLES) samples->wall[samples->count++] = wall;
+        if (ru.ru_maxrss > samples->peak_rss_kb) samples->peak_rss_kb = ru.ru_maxrss;
+    }
+    return 0;
+}
+
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+static double percentile(const Samples *s, double p) {
+    size_t rank = (size_t)(p / 100.0 * s->count + 0.999999);
+    if (rank == 0) rank = 1;
+    return s->wall[rank - 1];
+}
+
+
+// `units` is the work one sample does (files, bytes, entries...)
+static void report(const char *scenario, const char *command, Samples *s, double units, const char *unit) {
+    if (s->count == 0) return;
+    qsort(s->wall, s->count, sizeof(double), cmp_double);
+    double total = 0;
+    for (size_t i = 0; i < s->count; i++) total += s->wall[i];
+    double throughput = units * s->count / total;
+
+    char inodes[24] = "-", disk[24] = "-";
+    if (s->inodes) {
+        snprintf(inodes, sizeof(inodes), "%ld", s->inodes);
+        snprintf(disk, sizeof(disk), "%ld", s->disk_kb);
+    }
+    fprintf(table, "%-11s %-24s %5zu %9.2f %9.2f %9.2f %9.2f %12.1f %-9s %8ld %8s %9s\n", scenario, command,
+           s->count, percentile(s, 50) * 1e3, percentile(s, 90) * 1e3, percentile(s, 99) * 1e3,
+           s->wall[s->count - 1] * 1e3, throughput, unit, s->peak_rss_kb, inodes, disk);
+
+    if (!json) return;
+    fprintf(json, "%s\n    {\"scenario\": \"%s\", \"command\": \"%s\", \"samples\": %zu, "
+                  "\"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f, "
+                  "\"throughput\": %.1f, \"unit\": \"%s\", \"peak_rss_kb\": %ld, \"inodes\": %s, "
+                  "\"disk_kb\": %s}",
+            json_first ? "" : ",", scenario, command, s->count, percentile(s, 50) * 1e3,
+            percentile(s, 90) * 1e3, percentile(s, 99) * 1e3, s->wall[s->count - 1] * 1e3,
+            throughput, unit, s->peak_rss_kb, s->inodes ? inodes : "null", s->inodes ? disk : "null");
+    json_first = 0;
+}
+
+
+typedef struct {
+    char **paths;              // relative to the repo root
+    size_t count, cap;
+    size_t bytes;
+} FileList;
+
+
+// A fast-import stream of `commits` commits to main, each rewriting two of
+// the files with a line of inline data, and then `side` commits to a branch
+// forked from main halfway, dated in between main's later commits
+static int write_import_stream(const char *path, const FileList *files, int commits, int side) {
+    FILE *f = fopen(path, "w");
+    if (!f) { perror(path); return -1; }
+    for (int c = 0; c < commits + side; c++) {
+        int on_side = c >= commits;
+        if (c == commits) fprintf(f, "reset refs/heads/side\nfrom :%d\n\n", commits / 2 + 1);
+        int date = on_side ? commits / 2 + (c - commits) * 5 : c;
+        fprintf(f, "commit refs/heads/%s\nmark :%d\ncommitter Bench <bench@example.com> %d +0000\n"
+                   "data 9\nrevision\n", on_side ? "side" : "main", c + 1, 1700000000 + date);
+        for (int k = 0; k < 2; k++) {
+            char line[64];
+            int len = snprintf(line, sizeof(line), "revision %d.%d\n", c, k);
+            fprintf(f, "M 100644 inline %s\ndata %d\n%s\n", files->paths[rng() % files->count], len, line);
+        }
+    }
+    return fclose(f);
+}
+
+
+static int generate(const char *root, const Scenario *sc, FileList *files) {
+    int files_per_dir = sc->scale_size ? sc->files : (int)(sc->files * scale);
+    if (files_per_dir < 1) files_per_dir = 1;
+    size_t min_size = sc->min_size, max_size = sc->max_size;
+    if (sc->scale_size) {
+        min_size = (size_t)(min_size * scale);
+        max_size = (size_t)(max_size * scale);
+    }
+
+    for (int d = 0; d < sc->dirs; d++) {
+        char rel[PATH_MAX] = "";
+        for (int level = 0; level < sc->depth; level++) {
+            size_t len = strlen(rel);
+            if (sc->dirs > 1 || sc->depth > 1) {
+                snprintf(rel + len, sizeof(rel) - len, "%sd%03d", len ? "/" : "", sc->depth > 1 ? level : d);
+            }
+            char abs[PATH_MAX];
+            if (snprintf(abs, sizeof(abs), "%s/%s", root, rel) >= (int)sizeof(abs)) {
+                fprintf(stderr, "path too long: %s/%s\n", root, rel);
+                return -1;
+            }
+            if (rel[0] && mkdir(abs, 0755) < 0 && errno != EEXIST) { perror(abs); return -1; }
+
+            for (int f = 0; f < files_per_dir; f++) {
+                if (files->count == files->cap) {
+                    files->cap = files->cap ? files->cap * 2 : 1024;
+                    files->paths = realloc(files->paths, files->cap * sizeof(*files->paths));
+                    if (!files->paths) { perror("realloc"); return -1; }
+                }
+                char path[PATH_MAX];
+                snprintf(path, sizeof(path), "%s%sf%05d.txt", rel, rel[0] ? "/" : "", f);
+                files->paths[files->count] = strdup(path);
+                if (!files->paths[files->count++]) { perror("strdup"); return -1; }
+                size_t size = min_size + (max_size > min_size ? rng() % (max_size - min_size + 1) : 0);
+                if (snprintf(abs, sizeof(abs), "%s/%s", root, path) >= (int)sizeof(abs)) {
+                    fprintf(stderr, "path too long: %s/%s\n", root, path);
+                    return -1;
+                }
+                int binary = sc->binary && (int)(rng() % 100) < sc->binary;
+                if ((binary ? write_binary_file(abs, size) : write_file(abs, size)) < 0) return -1;
+                files->bytes += size;
+            }
+        }
+    }
+    return 0;
+}
+
+
+// sc->ignored times the tracked files again, in packages under a
+// node_modules/ next to each directory's files, sized alike
+static int generate_ignored(const char *root, const Scenario *sc) {
+    int files_per_dir = (int)(sc->files * scale) > 1 ? (int)(sc->files * scale) : 1;
+    int packages = files_per_dir * sc->ignored / 10 > 0 ? files_per_dir * sc->ignored / 10 : 1;
+    for (int d = 0; d < sc->dirs; d++) {
+        char dir[PATH_MAX];
+        if (snprintf(dir, sizeof(dir), "%s/d%03d/node_modules", root, d) >= (int)sizeof(dir)) {
+            fprintf(stderr, "path too long: %s\n", root);
+            return -1;
+        }
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) { perror(dir); return -1; }
+        for (int p = 0; p < packages; p++) {
+            char pkg[PATH_MAX + 16], path[PATH_MAX + 32];
+            snprintf(pkg, sizeof(pkg), "%s/p%04d", dir, p);
+            if (mkdir(pkg, 0755) < 0 && errno != EEXIST) { perror(pkg); return -1; }
+            for (int f = 0; f < 10; f++) {
+                snprintf(path, sizeof(path), "%s/m%02d.js", pkg, f);
+                if (write_file(path, sc->min_size + rng() % (sc->max_size - sc->min_size + 1)) < 0) return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+// The packs scenario's blobs: blob i is "blob <i>\n", written into pack
+// i % pack_count by one fast-import run per pack. Its name goes to hits,
+// and a random name that no object has to misses.
+static int write_packs(const char *root, const char *tmp, size_t blobs, int pack_count,
+                       const char *hits, const char *misses) {
+    char stream[PATH_MAX + 16];
+    snprintf(stream, sizeof(stream), "%s/packs.stream", tmp);
+    for (int p = 0; p < pack_count; p++) {
+        FILE *f = fopen(stream, "w");
+        if (!f) { perror(stream); return -1; }
+        for (size_t i = (size_t)p; i < blobs; i += (size_t)pack_count) {
+            char data[32];
+            int len = snprintf(data, sizeof(data), "blob %zu\n", i);
+            fprintf(f, "blob\ndata %d\n%s\n", len, data);
+        }
+        fclose(f);
+        int status = run_git(root, (char *[]){ "fast-import", "--quiet", NULL }, stream, NULL, NULL);
+        unlink(stream);
+        if (status < 0) return -1;
+    }
+
+    FILE *h = fopen(hits, "w"), *m = fopen(misses, "w");
+    if (!h || !m) { perror("lookup names"); if (h) fclose(h); if (m) fclose(m); return -1; }
+    for (size_t i = 0; i < blobs; i++) {
+        char data[32], hex[41];
+        unsigned char raw_hash[20];
+        int len = snprintf(data, sizeof(data), "blob %zu\n", i);
+        hash_object("blob", data, (size_t)len, raw_hash);
+        hash_to_hex(hex, raw_hash);
+        fprintf(h, "%s\n", hex);
+        for (int k = 0; k < 20; k += 8) {
+            uint64_t r = rng();
+            memcpy(raw_hash + k, &r, k + 8 <= 20 ? 8 : 4);
+        }
+        hash_to_hex(hex, raw_hash);
+        fprintf(m, "%s\n", hex);
+    }
+    fclose(h);
+    return fclose(m);
+}
+
+
+static int read_line(const char *path, char *buf, size_t len) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    int ok = fgets(buf, (int)len, f) != NULL;
+    fclose(f);
+    buf[strcspn(buf, "\n")] = '\0';
+    return ok ? 0 : -1;
+}
+
+
+// A scenario's repository and the files generated in it
+struct Bench {
+    const Scenario *sc;
+    const char *tmp;      // scratch files go here, next to the repository
+    char root[PATH_MAX], objects[PATH_MAX + 16], cache[PATH_MAX + 16], tree_out[PATH_MAX + 16];
+    FileList files;
+    double n, mb;
+    double work;          // few big files are measured in bytes, many small ones in files
+    const char *unit;
+};
+
+
+// write-tree `runs` times, each into an empty object database and without a
+// stat cache. `option` may be NULL.
+static int write_tree_cold(Bench *b, char *option, Samples *s) {
+    for (int i = 0; i < runs; i++) {
+        rm_rf(b->objects);
+        unlink(b->cache);
+        mkdir(b->objects, 0755);
+        if (run_git(b->root, (char *[]){ "write-tree", option, NULL }, NULL, b->tree_out, s) < 0) return -1;
+    }
+    measure_disk(b->objects, s);
+    return 0;
+}
+
+
+// write-tree with an empty object database, loose and bulk
+static int bench_cold_writes(Bench *b) {
+    Samples s = { 0 };
+    if (write_tree_cold(b, NULL, &s) < 0) return -1;
+    report(b->sc->name, "write-tree (cold)", &s, b->work, b->unit);
+    s = (Samples){ 0 };
+    if (write_tree_cold(b, "--bulk", &s) < 0) return -1;
+    report(b->sc->name, "write-tree --bulk (cold)", &s, b->work, b->unit);
+    return 0;
+}
+
+
+// The cold write-tree again with a growing number of workers
+static int bench_write_jobs(Bench *b) {
+    for (int jobs = 1; jobs <= 16; jobs *= 2) {
+        char jobs_arg[32], command[48];
+        snprintf(jobs_arg, sizeof(jobs_arg), "--jobs=%d", jobs);
+        snprintf(command, sizeof(command), "write-tree %s", jobs_arg);
+        Samples s = { 0 };
+        if (write_tree_cold(b, jobs_arg, &s) < 0) return -1;
+        report(b->sc->name, command, &s, b->work, b->unit);
+    }
+    return 0;
+}
+
+
+// Reads of a warm repository: write-tree with everything cached, listing the
+// tree, cat-file --batch over every blob and single commands on a sample
+static int bench_reads(Bench *b) {
+    const char *name = b->sc->name;
+    char list_out[PATH_MAX + 16], names[PATH_MAX + 16], tree[64];
+    snprintf(list_out, sizeof(list_out), "%s/ls-tree.out", b->tmp);
+    snprintf(names, sizeof(names), "%s/names.in", b->tmp);
+
+    Samples s = { 0 };
+    for (int i = 0; i < runs; i++) {
+        if (run_git(b->root, (char *[]){ "write-tree", NULL }, NULL, b->tree_out, &s) < 0) return -1;
+    }
+    report(name, "write-tree (warm)", &s, b->n, "files/s");
+    if (read_line(b->tree_out, tree, sizeof(tree)) < 0) return -1;
+
+    s = (Samples){ 0 };
+    for (int i = 0; i < runs; i++) {
+        if (run_git(b->root, (char *[]){ "ls-tree", "-r", tree, NULL }, NULL, list_out, &s) < 0) return -1;
+    }
+    report(name, "ls-tree -r", &s, b->n, "entries/s");
+
+    // cat-file --batch over every blob: names are the third column of ls-tree
+    FILE *in = fopen(list_out, "r"), *out_names = fopen(names, "w");
+    if (!in || !out_names) {
+        perror("ls-tree output");
+        if (in) fclose(in);
+        if (out_names) fclose(out_names);
+        return -1;
+    }
+    char line[PATH_MAX + 128];
+    char (*blobs)[41] = malloc(SAMPLE_FILES * sizeof(*blobs));
+    size_t blob_count = 0;
+    while (fgets(line, sizeof(line), in)) {
+        char sha[41];
+        if (sscanf(line, "%*s %*s %40s", sha) != 1) continue;
+        fprintf(out_names, "%s\n", sha);
+        if (blobs && blob_count < SAMPLE_FILES) memcpy(blobs[blob_count++], sha, 41);
+    }
+    fclose(in);
+    fclose(out_names);
+
+    int ret = -1;
+    s = (Samples){ 0 };
+    for (int i = 0; i < runs; i++) {
+        if (run_git(b->root, (char *[]){ "cat-file", "--batch", NULL }, names, NULL, &s) < 0) goto out;
+    }
+    report(name, "cat-file --batch", &s, b->work, b->unit);
+
+    // Per-invocation latency on a sample of files
+    const FileList *files = &b->files;
+    size_t step = files->count > SAMPLE_FILES ? files->count / SAMPLE_FILES : 1;
+    s = (Samples){ 0 };
+    for (size_t i = 0; i < files->count; i += step) {
+        if (run_git(b->root, (char *[]){ "hash-object", "-w", files->paths[i], NULL }, NULL, NULL, &s) < 0) goto out;
+    }
+    report(name, "hash-object -w", &s, b->work / b->n, b->unit);
+
+    s = (Samples){ 0 };
+    for (size_t i = 0; i < blob_count; i++) {
+        if (run_git(b->root, (char *[]){ "cat-file", "-p", blobs[i], NULL }, NULL, NULL, &s) < 0) goto out;
+    }
+    report(name, "cat-file -p", &s, b->work / b->n, b->unit);
+    ret = 0;
+out:
+    free(blobs);
+    return ret;
+}
+
+
+// Repack a fresh loose database holding every revision. Timed runs keep the
+// loose objects so each one does the same work; a final -d leaves just the
+// pack for the size columns.
+static int bench_repack(Bench *b) {
+    rm_rf(b->objects);
+    unlink(b->cache);
+    mkdir(b->objects, 0755);
+    if (run_git(b->root, (char *[]){ "write-tree", NULL }, NULL, NULL, NULL) < 0) return -1;
+    for (int r = 0; r < b->sc->revisions; r++) {
+        for (size_t i = (size_t)r % 20; i < b->files.count; i += 20) {
+            char abs[PATH_MAX * 2];
+            snprintf(abs, sizeof(abs), "%s/%s", b->root, b->files.paths[i]);
+            if (edit_file(abs) < 0) return -1;
+        }
+        if (run_git(b->root, (char *[]){ "write-tree", NULL }, NULL, NULL, NULL) < 0) return -1;
+    }
+    Samples loose = { 0 };
+    measure_disk(b->objects, &loose);
+
+    Samples s = { 0 };
+    for (int i = 0; i < runs; i++) {
+        if (run_git(b->root, (char *[]){ "repack", "-q", NULL }, NULL, NULL, &s) < 0) return -1;
+    }
+    if (run_git(b->root, (char *[]){ "repack", "-q", "-d", NULL }, NULL, NULL, NULL) < 0) return -1;
+    measure_disk(b->objects, &s);
+    report(b->sc->name, "repack", &s, loose.disk_kb / 1e3, "MB/s");
+    return 0;
+}
+
+
+// Commit the packed repository and clone it to a checked-out work tree, then
+// check the clone's objects out again with a growing number of workers
+static int bench_clone(Bench *b) {
+    const char *name = b->sc->name;
+    char commit_out[PATH_MAX + 16], tree[64], commit[64], heads[PATH_MAX + 16], head[PATH_MAX + 32];
+    char clone_dir[PATH_MAX + 16];
+    snprintf(commit_out, sizeof(commit_out), "%s/commit.out", b->tmp);
+    snprintf(heads, sizeof(heads), "%s/.git/refs/heads", b->root);
+    snprintf(head, sizeof(head), "%s/main", heads);
+    snprintf(clone_dir, sizeof(clone_dir), "%s/clone", b->tmp);
+    if (run_git(b->root, (char *[]){ "write-tree", NULL }, NULL, b->tree_out, NULL) < 0) return -1;
+    if (read_line(b->tree_out, tree, sizeof(tree)) < 0) return -1;
+    if (run_git(b->root, (char *[]){ "commit-tree", tree, "-m", "bench", NULL }, NULL, commit_out, NULL) < 0) return -1;
+    if (read_line(commit_out, commit, sizeof(commit)) < 0) return -1;
+    mkdir(heads, 0755); // init only makes .git/refs
+    FILE *ref = fopen(head, "w");
+    if (!ref) { perror(head); return -1; }
+    fprintf(ref, "%s\n", commit);
+    fclose(ref);
+
+    Samples s = { 0 };
+    for (int i = 0; i < runs; i++) {
+        rm_rf(clone_dir);
+        if (run_git(b->tmp, (char *[]){ "clone", "-q", b->root, clone_dir, NULL }, NULL, NULL, &s) < 0) break;
+    }
+    report(name, "clone", &s, b->work, b->unit);
+
+    for (int jobs = 1; (int)s.count == runs && jobs <= 8; jobs *= 2) {
+        char jobs_arg[32], command[48];
+        snprintf(jobs_arg, sizeof(jobs_arg), "--jobs=%d", jobs);
+        snprintf(command, sizeof(command), "read-tree -u %s", jobs_arg);
+        Samples r = { 0 };
+        for (int i = 0; i < runs; i++) {
+            clear_work_tree(clone_dir);
+            if (run_git(clone_dir, (char *[]){ "read-tree", "-u", jobs_arg, tree, NULL }, NULL, NULL, &r) < 0) break;
+        }
+        report(name, command, &r, b->work, b->unit);
+    }
+    rm_rf(clone_dir);
+    return 0;
+}
+
+
+// Everything a plain work tree goes through: written cold at each job count,
+// read warm, repacked, committed and cloned
+static int bench_files(Bench *b) {
+    if (bench_cold_writes(b) < 0 || bench_write_jobs(b) < 0) return -1;
+    if (bench_reads(b) < 0 || bench_repack(b) < 0) return -1;
+    return bench_clone(b);
+}
+
+
+// Replay commits through fast-import, each run into an empty repository. The
+// last import's history is then walked and searched for the fork point, first
+// by inflating commits and then from a commit-graph.
+static int bench_fast_import(Bench *b) {
+    const char *name = b->sc->name;
+    char stream[PATH_MAX + 16], import_dir[PATH_MAX + 16], graph[PATH_MAX + 64];
+    snprintf(stream, sizeof(stream), "%s/import.stream", b->tmp);
+    snprintf(import_dir, sizeof(import_dir), "%s/import", b->tmp);
+    snprintf(graph, sizeof(graph), "%s/.git/objects/info/commit-graph", import_dir);
+    int commits = (int)(20000 * scale) > 1 ? (int)(20000 * scale) : 2;
+    int side = commits / 10 > 0 ? commits / 10 : 1;
+    if (write_import_stream(stream, &b->files, commits, side) < 0) return -1;
+    Samples s = { 0 };
+    for (int i = 0; i < runs; i++) {
+        rm_rf(import_dir);
+        if (mkdir(import_dir, 0755) < 0) { perror(import_dir); break; }
+        if (run_git(import_dir, (char *[]){ "init", NULL }, NULL, NULL, NULL) < 0 ||
+            run_git(import_dir, (char *[]){ "fast-import", "--quiet", NULL }, stream, NULL, &s) < 0) break;
+    }
+    report(name, "fast-import", &s, commits + side, "commits/s");
+    unlink(stream);
+
+    for (int with_graph = 0; (int)s.count == runs && with_graph <= 1; with_graph++) {
+        if (with_graph) {
+            Samples w = { 0 };
+            for (int i = 0; i < runs; i++) {
+                unlink(graph);
+                if (run_git(import_dir, (char *[]){ "commit-graph", "write", NULL }, NULL, NULL, &w) < 0) break;
+            }
+            report(name, "commit-graph write", &w, commits + side, "commits/s");
+            if ((int)w.count != runs) break;
+        }
+        Samples walk = { 0 }, base = { 0 };
+        for (int i = 0; i < runs; i++) {
+            if (run_git(import_dir, (char *[]){ "rev-list", "main", NULL }, NULL, NULL, &walk) < 0 ||
+                run_git(import_dir, (char *[]){ "merge-base", "main", "side", NULL }, NULL, NULL, &base) < 0) break;
+        }
+        report(name, with_graph ? "rev-list (graph)" : "rev-list", &walk, commits, "commits/s");
+        report(name, with_graph ? "merge-base (graph)" : "merge-base", &base, 1, "queries/s");
+    }
+    rm_rf(import_dir);
+    return 0;
+}
+
+
+// Path-limited log on a long history: every commit has to be compared to its
+// parent for the one path, by opening trees or by asking its Bloom filter
+static int bench_path_log(Bench *b) {
+    const char *name = b->sc->name;
+    char stream[PATH_MAX + 16], import_dir[PATH_MAX + 16], graph[PATH_MAX + 64];
+    snprintf(stream, sizeof(stream), "%s/import.stream", b->tmp);
+    snprintf(import_dir, sizeof(import_dir), "%s/import", b->tmp);
+    snprintf(graph, sizeof(graph), "%s/.git/objects/info/commit-graph", import_dir);
+    int long_history = (int)(100000 * scale) > 1 ? (int)(100000 * scale) : 2;
+    if (write_import_stream(stream, &b->files, long_history, 0) < 0) return -1;
+    if (mkdir(import_dir, 0755) < 0) { perror(import_dir); unlink(stream); return -1; }
+    int imported = run_git(import_dir, (char *[]){ "init", NULL }, NULL, NULL, NULL) == 0 &&
+                   run_git(import_dir, (char *[]){ "fast-import", "--quiet", NULL }, stream, NULL, NULL) == 0;
+    unlink(stream);
+    for (int setting = 0; imported && setting < 3; setting++) {
+        static const char *const labels[] = { "log -- path", "log -- path (graph)", "log -- path (bloom)" };
+        if (setting > 0) {
+            Samples w = { 0 };
+            char *changed_paths = setting == 2 ? "--changed-paths" : NULL;
+            for (int i = 0; i < runs; i++) {
+                unlink(graph);
+                if (run_git(import_dir, (char *[]){ "commit-graph", "write", changed_paths, NULL },
+                            NULL, NULL, &w) < 0) break;
+            }
+            report(name, setting == 2 ? "commit-graph write+bloom" : "commit-graph write",
+                   &w, long_history, "commits/s");
+            if ((int)w.count != runs) break;
+        }
+        Samples log = { 0 };
+        for (int i = 0; i < runs; i++) {
+            if (run_git(import_dir, (char *[]){ "log", "--oneline", "main", "--", b->files.paths[0], NULL },
+                        NULL, NULL, &log) < 0) break;
+        }
+        report(name, labels[setting], &log, long_history, "commits/s");
+    }
+    rm_rf(import_dir);
+    return 0;
+}
+
+
+// A work tree with several revisions behind it, then commit histories
+static int bench_history(Bench *b) {
+    if (bench_files(b) < 0 || bench_fast_import(b) < 0) return -1;
+    return bench_path_log(b);
+}
+
+
+// The same files as write-tree takes through hash-object, every run into an
+// empty database, with one process for all of them and then one per file
+static int bench_import(Bench *b) {
+    if (bench_cold_writes(b) < 0) return -1;
+
+    char paths[PATH_MAX + 16];
+    snprintf(paths, sizeof(paths), "%s/paths.in", b->tmp);
+    FILE *f = fopen(paths, "w");
+    if (!f) { perror(paths); return -1; }
+    for (size_t i = 0; i < b->files.count; i++) fprintf(f, "%s\n", b->files.paths[i]);
+    fclose(f);
+
+    static const struct { const char *label; char *args[5]; } modes[] = {
+        { "--stdin-paths", { "hash-object", "--stdin-paths", NULL } },
+        { "-w --stdin-paths", { "hash-object", "-w", "--stdin-paths", NULL } },
+        { "-w --bulk --stdin-paths", { "hash-object", "-w", "--bulk", "--stdin-paths", NULL } },
+    };
+    for (size_t k = 0; k < sizeof(modes) / sizeof(modes[0]); k++) {
+        Samples s = { 0 };
+        for (int i = 0; i < runs; i++) {
+            rm_rf(b->objects);
+            mkdir(b->objects, 0755);
+            if (run_git(b->root, modes[k].args, paths, NULL, &s) < 0) { unlink(paths); return -1; }
+        }
+        measure_disk(b->objects, &s);
+        report(b->sc->name, modes[k].label, &s, b->n, "files/s");
+    }
+    unlink(paths);
+
+    // One process per file, on a sample: a full run would take minutes
+    rm_rf(b->objects);
+    mkdir(b->objects, 0755);
+    size_t step = b->files.count > PER_FILE_SAMPLE ? b->files.count / PER_FILE_SAMPLE : 1;
+    Samples s = { 0 };
+    for (size_t i = 0; i < b->files.count; i += step) {
+        if (run_git(b->root, (char *[]){ "hash-object", "-w", b->files.paths[i], NULL }, NULL, NULL, &s) < 0) return -1;
+    }
+    report(b->sc->name, "-w, a process per file", &s, 1, "files/s");
+    return 0;
+}
+
+
+// Generated output next to the sources: write-tree hashing all of it, and
+// then with a .gitignore that keeps it from being opened at all
+static int bench_ignored(Bench *b) {
+    char gitignore[PATH_MAX + 16];
+    snprintf(gitignore, sizeof(gitignore), "%s/.gitignore", b->root);
+    if (generate_ignored(b->root, b->sc) < 0) return -1;
+    for (int rules = 0; rules <= 1; rules++) {
+        if (rules) {
+            FILE *f = fopen(gitignore, "w");
+            if (!f) { perror(gitignore); return -1; }
+            fputs("node_modules/\n*.o\n/build/\n", f);
+            fclose(f);
+        }
+        Samples s = { 0 };
+        if (write_tree_cold(b, NULL, &s) < 0) return -1;
+        report(b->sc->name, rules ? "write-tree (.gitignore)" : "write-tree (all)", &s, b->n, "files/s");
+        s = (Samples){ 0 };
+        for (int i = 0; i < runs; i++) {
+            if (run_git(b->root, (char *[]){ "write-tree", NULL }, NULL, b->tree_out, &s) < 0) return -1;
+        }
+        report(b->sc->name, rules ? "write-tree warm (ignore)" : "write-tree warm (all)", &s, b->n, "files/s");
+    }
+    return 0;
+}
+
+
+// Lookups, hits and misses, as the objects are spread over more packs
+static int bench_packs(Bench *b) {
+    char hits[PATH_MAX + 16], misses[PATH_MAX + 16];
+    snprintf(hits, sizeof(hits), "%s/hits.in", b->tmp);
+    snprintf(misses, sizeof(misses), "%s/misses.in", b->tmp);
+    int ret = -1;
+    for (int pack_count = 1; pack_count <= b->sc->packs; pack_count *= 10) {
+        rm_rf(b->objects);
+        mkdir(b->objects, 0755);
+        if (write_packs(b->root, b->tmp, b->files.count, pack_count, hits, misses) < 0) goto out;
+        for (int midx = 0; midx <= 1; midx++) {
+            if (midx && run_git(b->root, (char *[]){ "multi-pack-index", "write", NULL },
+                                NULL, NULL, NULL) < 0) goto out;
+            for (int miss = 0; miss <= 1; miss++) {
+                char command[64];
+                snprintf(command, sizeof(command), "%s, %d pack%s%s", miss ? "miss" : "hit", pack_count,
+                         pack_count > 1 ? "s" : "", midx ? " +midx" : "");
+                Samples s = { 0 };
+                for (int i = 0; i < runs; i++) {
+                    if (run_git(b->root, (char *[]){ "cat-file", "--batch-check", NULL }, miss ? misses : hits,
+                                NULL, &s) < 0) goto out;
+                }
+                report(b->sc->name, command, &s, b->n, "lookups/s");
+            }
+        }
+    }
+    ret = 0;
+out:
+    unlink(hits);
+    unlink(misses);
+    return ret;
+}
+
+
+// Mixed content under each compression setting: zlib's default level
+// everywhere, git's default levels, and both of those with the level picked
+// per object (the default here)
+static int bench_compression(Bench *b) {
+    static const struct { const char *label, *config; } settings[] = {
+        { "-1 fixed", "[core]\n\tcompression = -1\n\tadaptiveCompression = false\n" },
+        { "git fixed", "[core]\n\tadaptiveCompression = false\n" },
+        { "git auto", "" },
+        { "9 auto", "[core]\n\tcompression = 9\n" },
+    };
+    char config[PATH_MAX + 16];
+    snprintf(config, sizeof(config), "%s/.git/config", b->root);
+    for (size_t k = 0; k < sizeof(settings) / sizeof(settings[0]); k++) {
+        FILE *f = fopen(config, "w");
+        if (!f) { perror(config); return -1; }
+        fputs(settings[k].config, f);
+        fclose(f);
+        for (int bulk = 0; bulk <= 1; bulk++) {
+            char command[64];
+            snprintf(command, sizeof(command), "%s (%s)", bulk ? "--bulk" : "write-tree", settings[k].label);
+            Samples s = { 0 };
+            if (write_tree_cold(b, bulk ? "--bulk" : NULL, &s) < 0) return -1;
+            report(b->sc->name, command, &s, b->mb, "MB/s");
+        }
+    }
+    return 0;
+}
+
+
+// One file of each size through hash-object -w, into an empty database every
+// run: streamed, the peak RSS stays flat from 1 MiB to past 4 GiB
+static int bench_big_blobs(Bench *b) {
+    static const struct { const char *label; uint64_t size; } blobs[] = {
+        { "hash-object -w 1 MiB", 1ull << 20 },
+        { "hash-object -w 1 GiB", 1ull << 30 },
+        { "hash-object -w 4.5 GiB", 9ull << 29 },
+    };
+    char big[PATH_MAX];
+    if (snprintf(big, sizeof(big), "%s/big.txt", b->root) >= (int)sizeof(big)) {
+        fprintf(stderr, "path too long: %s\n", b->root);
+        return -1;
+    }
+    for (size_t k = 0; k < sizeof(blobs) / sizeof(blobs[0]); k++) {
+        size_t size = (size_t)(blobs[k].size * scale);
+        if (write_file(big, size) < 0) return -1;
+        Samples s = { 0 };
+        for (int i = 0; i < runs; i++) {
+            rm_rf(b->objects);
+            mkdir(b->objects, 0755);
+            if (run_git(b->root, (char *[]){ "hash-object", "-w", "big.txt", NULL }, NULL, NULL, &s) < 0) return -1;
+        }
+        measure_disk(b->objects, &s);
+        report(b->sc->name, blobs[k].label, &s, size / 1e6, "MB/s");
+    }
+    unlink(big);
+    return 0;
+}
+
+
+static const Scenario scenarios[] = {
+    { .name = "tiny-files", .dirs = 200, .depth = 1, .files = 100, .min_size = 16, .max_size = 512,
+      .run = bench_files },
+    { .name = "huge-files", .dirs = 1, .depth = 1, .files = 4, .min_size = 32 << 20, .max_size = 32 << 20,
+      .scale_size = 1, .run = bench_files },
+    { .name = "deep-tree", .dirs = 1, .depth = 100, .files = 10, .min_size = 64, .max_size = 4096,
+      .run = bench_files },
+    { .name = "wide-tree", .dirs = 1, .depth = 1, .files = 20000, .min_size = 16, .max_size = 512,
+      .run = bench_files },
+    { .name = "import-100k", .dirs = 100, .depth = 1, .files = 1000, .min_size = 16, .max_size = 512,
+      .by_name = 1, .run = bench_import },
+    { .name = "history", .dirs = 20, .depth = 1, .files = 100, .min_size = 512, .max_size = 16384,
+      .revisions = 10, .run = bench_history },
+    { .name = "ignored", .dirs = 20, .depth = 1, .files = 100, .min_size = 512, .max_size = 4096,
+      .ignored = 10, .run = bench_ignored },
+    { .name = "mixed", .dirs = 20, .depth = 1, .files = 50, .min_size = 4096, .max_size = 262144,
+      .binary = 50, .run = bench_compression },
+    { .name = "packs", .dirs = 100, .depth = 1, .files = 100, .min_size = 16, .max_size = 512,
+      .packs = 100, .run = bench_packs },
+    { .name = "big-blobs", .scale_size = 1, .by_name = 1, .run = bench_big_blobs },
+};
+
+
+// Sets up the scenario's repository and files, runs it and removes them again
+static int run_scenario(const char *tmp, const Scenario *sc) {
+    Bench b = { .sc = sc, .tmp = tmp };
+    snprintf(b.root, sizeof(b.root), "%s/%s", tmp, sc->name);
+    snprintf(b.objects, sizeof(b.objects), "%s/.git/objects", b.root);
+    snprintf(b.cache, sizeof(b.cache), "%s/.git/stat-cache", b.root);
+    snprintf(b.tree_out, sizeof(b.tree_out), "%s/tree.out", tmp);
+    if (mkdir(b.root, 0755) < 0) { perror(b.root); return -1; }
+
+    int ret = -1;
+    if (run_git(b.root, (char *[]){ "init", NULL }, NULL, NULL, NULL) == 0 && generate(b.root, sc, &b.files) == 0) {
+        b.n = (double)b.files.count;
+        b.mb = b.files.bytes / 1e6;
+        b.work = sc->scale_size ? b.mb : b.n;
+        b.unit = sc->scale_size ? "MB/s" : "files/s";
+        ret = sc->run(&b);
+    }
+    for (size_t i = 0; i < b.files.count; i++) free(b.files.paths[i]);
+    free(b.files.paths);
+    rm_rf(b.root);
+    return ret;
+}
+
+
+int main(int argc, char *argv[]) {
+    const char *only = NULL, *json_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--git") == 0 && i + 1 < argc) git_path = argv[++i];
+        else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) runs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) scale = atof(argv[++i]);
+        else if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc) only = argv[++i];
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) json_path = argv[++i];
+        else {
+            fprintf(stderr, "usage: git-bench [--git PATH] [--runs N] [--scale F] [--scenario NAME] [--json FILE|-]\n");
+            return 1;
+        }
+    }
+    if (runs < 1 || runs > MAX_SAMPLES || scale <= 0) {
+        fprintf(stderr, "git-bench: bad --runs or --scale\n");
+        return 1;
+    }
+
+    char resolved[PATH_MAX];
+    if (!realpath(git_path, resolved)) { perror(git_path); return 1; }
+    git_path = resolved;
+
+    const char *base = getenv("TMPDIR");
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s/git-bench-XXXXXX", base ? base : "/tmp");
+    if (!mkdtemp(tmp)) { perror("mkdtemp"); return 1; }
+
+    if (json_path) {
+        json = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+        if (!json) { perror(json_path); rm_rf(tmp); return 1; }
+        fprintf(json, "{\n  \"git\": \"%s\", \"runs\": %d, \"scale\": %g,\n  \"results\": [", git_path, runs, scale);
+    }
+    table = json == stdout ? stderr : stdout;
+
+    fprintf(table, "%-11s %-24s %5s %9s %9s %9s %9s %12s %-9s %8s %8s %9s\n", "scenario", "command", "n",
+           "p50 ms", "p90 ms", "p99 ms", "max ms", "throughput", "", "rss KB", "inodes", "disk KB");
+
+    int status = 0;
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        if (only ? strcmp(only, scenarios[i].name) != 0 : scenarios[i].by_name) continue;
+        if (run_scenario(tmp, &scenarios[i]) < 0) status = 1;
+        fflush(table);
+    }
+
+    if (json) {
+        fprintf(json, "\n  ]\n}\n");
+        if (json != stdout) fclose(json);
+    }
+    rm_rf(tmp);
+    return status;
+}
@@ -0,0 +1,111 @@
+// Throughput of each SHA-1 implementation the CPU supports, per object size
+// bucket, hashing one object at a time and in batches; then hex encoding.
+// All implementations must agree on every digest before anything is timed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+#define BATCH 64
+
+static const char *const impls[] = { "portable", "avx2", "sha-ni" };
+static const size_t buckets[] = { 32, 256, 1024, 4096, 65536, 1 << 20 };
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// Run one round of `count` objects until `seconds` pass; returns objects per second
+static double time_case(unsigned char *data, size_t size, int batched, double seconds) {
+    HashJob jobs[BATCH];
+    unsigned char out[BATCH][20];
+    for (int i = 0; i < BATCH; i++) jobs[i] = (HashJob){ "blob", data + (size_t)i * size, size, out[i] };
+
+    size_t done = 0;
+    double start = now(), elapsed;
+    do {
+        if (batched) {
+            hash_objects(jobs, BATCH);
+        } else {
+            for (int i = 0; i < BATCH; i++) hash_object("blob", jobs[i].data, size, out[i]);
+        }
+        done += BATCH;
+    } while ((elapsed = now() - start) < seconds);
+    return done / elapsed;
+}
+
+
+static int check_agreement(unsigned char *data, size_t size) {
+    unsigned char ref[BATCH][20], got[BATCH][20];
+    hash_use_impl("portable");
+    for (int i = 0; i < BATCH; i++) hash_object("blob", data + (size_t)i * size, size - (size_t)i % 7, ref[i]);
+
+    for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+        if (hash_use_impl(impls[k]) < 0) continue;
+        HashJob jobs[BATCH];
+        for (int i = 0; i < BATCH; i++) jobs[i] = (HashJob){ "blob", data + (size_t)i * size, size - (size_t)i % 7, got[i] };
+        hash_objects(jobs, BATCH);
+        if (memcmp(ref, got, sizeof(ref)) != 0) {
+            fprintf(stderr, "%s disagrees with portable at %zu bytes\n", impls[k], size);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 0.3;
+    size_t max_size = buckets[sizeof(buckets) / sizeof(buckets[0]) - 1];
+    unsigned char *data = malloc(max_size * BATCH);
+    if (!data) { perror("malloc"); return 1; }
+    srand(1);
+    for (size_t i = 0; i < max_size * BATCH; i++) data[i] = (unsigned char)rand();
+
+    for (size_t b = 0; b < sizeof(buckets) / sizeof(buckets[0]); b++) {
+        if (check_agreement(data, buckets[b]) < 0) return 1;
+    }
+
+    hash_use_impl(hash_impl_name());
+    printf("default implementation: %s\n\n", hash_impl_name());
+    printf("%-9s %-9s %-7s %12s %10s\n", "size", "impl", "mode", "objects/s", "MB/s");
+    for (size_t b = 0; b < sizeof(buckets) / sizeof(buckets[0]); b++) {
+        for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+            if (hash_use_impl(impls[k]) < 0) continue;
+            for (int batched = 0; batched <= 1; batched++) {
+                double rate = time_case(data, buckets[b], batched, seconds);
+                printf("%-9zu %-9s %-7s %12.0f %10.1f\n", buckets[b], impls[k],
+                       batched ? "batch" : "single", rate, rate * buckets[b] / 1e6);
+            }
+        }
+    }
+
+    unsigned char raw[20];
+    char hex[41];
+    memcpy(raw, data, 20);
+    size_t n = 0;
+    double start = now(), elapsed;
+    do {
+        for (int i = 0; i < 1000; i++) { raw[i % 20]++; for (int j = 0; j < 20; j++) sprintf(hex + 2 * j, "%02x", raw[j]); }
+        n += 1000;
+    } while ((elapsed = now() - start) < seconds);
+    printf("\nhex sprintf   %8.1f ns/digest\n", elapsed / n * 1e9);
+
+    n = 0;
+    start = now();
+    do {
+        for (int i = 0; i < 1000; i++) { raw[i % 20]++; hash_to_hex(hex, raw); }
+        n += 1000;
+    } while ((elapsed = now() - start) < seconds);
+    printf("hex table     %8.1f ns/digest (%s)\n", elapsed / n * 1e9, hex);
+
+    free(data);
+    return 0;
+}
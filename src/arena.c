@@ -0,0 +1,102 @@
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <string.h>
+
+#define MIN_BLOCK (16u << 10)
+#define MAX_GROWTH (1u << 20)   // blocks stop doubling past this
+#define ALIGN alignof(max_align_t)
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t size;
+    alignas(max_align_t) unsigned char data[];
+};
+
+
+static size_t align_up(size_t len) {
+    return (len + ALIGN - 1) & ~(ALIGN - 1);
+}
+
+
+void *arena_alloc(Arena *arena, size_t len) {
+    size_t need = align_up(len ? len : 1);
+    ArenaBlock *b = arena->current;
+    if (b && b->size - arena->used >= need) {
+        void *p = b->data + arena->used;
+        arena->used += need;
+        return p;
+    }
+
+    // Blocks after the current one are free: they were given back by a rewind
+    ArenaBlock *next = b ? b->next : arena->first;
+    while (next && next->size < need) next = next->next;
+    if (!next) {
+        size_t size = b ? (b->size < MAX_GROWTH ? b->size * 2 : b->size) : MIN_BLOCK;
+        if (size < need) size = need;
+        next = malloc(sizeof(ArenaBlock) + size);
+        if (!next) { perror("malloc"); return NULL; }
+        next->size = size;
+        if (b) {
+            next->next = b->next;
+            b->next = next;
+        } else {
+            next->next = arena->first;
+            arena->first = next;
+        }
+    }
+    arena->current = next;
+    arena->used = need;
+    return next->data;
+}
+
+
+void *arena_grow(Arena *arena, void *p, size_t old_len, size_t new_len) {
+    if (!p) return arena_alloc(arena, new_len);
+    ArenaBlock *b = arena->current;
+    size_t old_size = align_up(old_len ? old_len : 1);
+    if (b && arena->used >= old_size && (unsigned char *)p == b->data + arena->used - old_size) {
+        size_t start = arena->used - old_size, new_size = align_up(new_len ? new_len : 1);
+        if (b->size - start >= new_size) {
+            arena->used = start + new_size;
+            return p;
+        }
+    }
+    void *q = arena_alloc(arena, new_len);
+    if (q) memcpy(q, p, old_len < new_len ? old_len : new_len);
+    return q;
+}
+
+
+char *arena_strndup(Arena *arena, const char *s, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    if (copy) {
+        memcpy(copy, s, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+
+ArenaMark arena_mark(const Arena *arena) {
+    return (ArenaMark){ arena->current, arena->used };
+}
+
+
+void arena_rewind(Arena *arena, ArenaMark mark) {
+    arena->current = mark.block;
+    arena->used = mark.used;
+}
+
+
+void arena_release(Arena *arena) {
+    for (ArenaBlock *b = arena->first; b; ) {
+        ArenaBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+    *arena = (Arena){ 0 };
+}
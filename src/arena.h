@@ -0,0 +1,44 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Bump allocator for memory that is all released together, such as the
+// entries and names of trees being built. Blocks double in size as the arena
+// grows, an allocation is a pointer bump, and arena_release() frees every
+// block in one go. A mark taken with arena_mark() lets a caller hand back
+// everything allocated since (for work that nests like a stack); rewound
+// blocks are kept and reused rather than freed.
+//
+// A zeroed Arena is empty and ready to use. Arenas are not thread safe.
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+    ArenaBlock *first, *current;
+    size_t used;                // bytes taken from `current`
+} Arena;
+
+typedef struct {
+    ArenaBlock *block;
+    size_t used;
+} ArenaMark;
+
+// Aligned for any type. Returns NULL when out of memory (reported).
+void *arena_alloc(Arena *arena, size_t len);
+
+// Resizes p, the arena's allocation of old_len bytes: in place when it is
+// the most recent one and there is room, else by copying (the old space is
+// only reclaimed by a rewind or release). Returns NULL when out of memory
+// (reported), leaving p as it was.
+void *arena_grow(Arena *arena, void *p, size_t old_len, size_t new_len);
+
+// A NUL-terminated copy of s[0..len)
+char *arena_strndup(Arena *arena, const char *s, size_t len);
+
+ArenaMark arena_mark(const Arena *arena);
+void arena_rewind(Arena *arena, ArenaMark mark);
+
+void arena_release(Arena *arena);
+
+#endif
@@ -0,0 +1,172 @@
+#include "bloom.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diff_tree.h"
+
+#define SEED0 0x293ae76fu
+#define SEED1 0x7e646e2cu
+
+
+static uint32_t rotate_left(uint32_t v, int n) {
+    return v << n | v >> (32 - n);
+}
+
+
+// Murmur3 as git's version 1 filters compute it: bytes are read as signed
+// chars, which only matters for paths with bytes >= 0x80 but must match
+static uint32_t murmur3_seeded(uint32_t seed, const char *data, size_t len) {
+    const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
+    size_t blocks = len / 4;
+    for (size_t i = 0; i < blocks; i++) {
+        const signed char *b = (const signed char *)data + 4 * i;
+        uint32_t k = (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+        k *= c1;
+        k = rotate_left(k, 15);
+        k *= c2;
+        seed ^= k;
+        seed = rotate_left(seed, 13) * 5 + 0xe6546b64;
+    }
+
+    const signed char *tail = (const signed char *)data + 4 * blocks;
+    uint32_t k1 = 0;
+    switch (len & 3) {
+    case 3: k1 ^= (uint32_t)tail[2] << 16; // fall through
+    case 2: k1 ^= (uint32_t)tail[1] << 8;  // fall through
+    case 1:
+        k1 ^= (uint32_t)tail[0];
+        k1 *= c1;
+        k1 = rotate_left(k1, 15);
+        k1 *= c2;
+        seed ^= k1;
+        break;
+    }
+
+    seed ^= (uint32_t)len;
+    seed ^= seed >> 16;
+    seed *= 0x85ebca6b;
+    seed ^= seed >> 13;
+    seed *= 0xc2b2ae35;
+    seed ^= seed >> 16;
+    return seed;
+}
+
+
+void bloom_key_init(BloomKey *key, const char *path, size_t len) {
+    uint32_t h0 = murmur3_seeded(SEED0, path, len), h1 = murmur3_seeded(SEED1, path, len);
+    for (uint32_t i = 0; i < BLOOM_HASHES; i++) key->hashes[i] = h0 + i * h1;
+}
+
+
+int bloom_filter_contains(const BloomFilter *filter, const BloomKey *key) {
+    if (filter->len == 0) return 1;
+    uint64_t bits = (uint64_t)filter->len * 8;
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        uint64_t bit = key->hashes[i] % bits;
+        if (!(filter->data[bit / 8] & 1u << (bit & 7))) return 0;
+    }
+    return 1;
+}
+
+
+// The keys of one diff: each changed path and its leading directories
+typedef struct {
+    char *text;                 // NUL-terminated keys back to back
+    size_t len, cap;
+    size_t *starts;
+    size_t count, cap_starts;
+    size_t changes;
+} KeySet;
+
+
+static int add_key(KeySet *set, const char *path, size_t len) {
+    if (set->len + len + 1 > set->cap) {
+        size_t cap = set->cap ? set->cap * 2 : 4096;
+        while (cap < set->len + len + 1) cap *= 2;
+        char *grown = realloc(set->text, cap);
+        if (!grown) { perror("realloc"); return -1; }
+        set->text = grown;
+        set->cap = cap;
+    }
+    if (set->count == set->cap_starts) {
+        size_t cap = set->cap_starts ? set->cap_starts * 2 : 64;
+        size_t *grown = realloc(set->starts, cap * sizeof(size_t));
+        if (!grown) { perror("realloc"); return -1; }
+        set->starts = grown;
+        set->cap_starts = cap;
+    }
+    set->starts[set->count++] = set->len;
+    memcpy(set->text + set->len, path, len);
+    set->text[set->len + len] = '\0';
+    set->len += len + 1;
+    return 0;
+}
+
+
+static int collect_change(const TreeChange *change, void *arg) {
+    KeySet *set = arg;
+    if (++set->changes > BLOOM_MAX_CHANGES) return 1; // too many: stop here
+    size_t len = strlen(change->path);
+    if (add_key(set, change->path, len) < 0) return -1;
+    for (size_t i = len; i-- > 0; ) {
+        if (change->path[i] == '/' && add_key(set, change->path, i) < 0) return -1;
+    }
+    return 0;
+}
+
+
+static const char *sort_text; // qsort has no context argument
+
+static int cmp_key(const void *a, const void *b) {
+    return strcmp(sort_text + *(const size_t *)a, sort_text + *(const size_t *)b);
+}
+
+
+long bloom_filter_compute(const unsigned char *parent_tree, const unsigned char tree[20], unsigned char **data) {
+    static const DiffOptions recursive = { .recursive = 1 };
+    KeySet set = { 0 };
+    long ret = -1;
+    *data = NULL;
+
+    int status = diff_trees(parent_tree, tree, &recursive, collect_change, &set);
+    if (status < 0) goto out;
+    if (status > 0) {
+        // Too large to be worth it: one byte with every bit set
+        if (!(*data = malloc(1))) { perror("malloc"); goto out; }
+        **data = 0xff;
+        ret = 1;
+        goto out;
+    }
+
+    // A directory shows up once per change below it; git counts it once
+    sort_text = set.text;
+    qsort(set.starts, set.count, sizeof(size_t), cmp_key);
+    size_t unique = 0;
+    for (size_t i = 0; i < set.count; i++) {
+        if (unique == 0 || strcmp(set.text + set.starts[i], set.text + set.starts[unique - 1]) != 0) {
+            set.starts[unique++] = set.starts[i];
+        }
+    }
+
+    size_t len = (unique * BLOOM_BITS_PER_ENTRY + 7) / 8;
+    if (len == 0) len = 1;
+    if (!(*data = calloc(len, 1))) { perror("calloc"); goto out; }
+    uint64_t bits = (uint64_t)len * 8;
+    for (size_t i = 0; i < unique; i++) {
+        const char *key_text = set.text + set.starts[i];
+        BloomKey key;
+        bloom_key_init(&key, key_text, strlen(key_text));
+        for (int h = 0; h < BLOOM_HASHES; h++) {
+            uint64_t bit = key.hashes[h] % bits;
+            (*data)[bit / 8] |= (unsigned char)(1u << (bit & 7));
+        }
+    }
+    ret = (long)len;
+
+out:
+    free(set.text);
+    free(set.starts);
+    return ret;
+}
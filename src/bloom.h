@@ -0,0 +1,36 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// git's changed-path Bloom filters (version 1), one per commit, stored in the
+// commit-graph's BIDX/BDAT chunks. A commit's filter holds every path its
+// first-parent diff touches plus each of their leading directories, so "is
+// this commit TREESAME for dir/file" is answered by probing a few bits: a
+// miss means the trees need not be opened at all.
+
+#define BLOOM_HASHES 7           // bits set per key
+#define BLOOM_BITS_PER_ENTRY 10
+#define BLOOM_MAX_CHANGES 512    // past this a filter says "maybe" to everything
+
+typedef struct {
+    uint32_t hashes[BLOOM_HASHES];
+} BloomKey;
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;                  // bytes; 0 means no information
+} BloomFilter;
+
+void bloom_key_init(BloomKey *key, const char *path, size_t len);
+
+// 0 when the key is certainly not in the filter, else 1
+int bloom_filter_contains(const BloomFilter *filter, const BloomKey *key);
+
+// Builds the filter for the changes from parent_tree (NULL for a root
+// commit) to tree into a malloc'd buffer. Returns its length, or -1 on error
+// (reported).
+long bloom_filter_compute(const unsigned char *parent_tree, const unsigned char tree[20], unsigned char **data);
+
+#endif
@@ -0,0 +1,425 @@
+#include "bulk_checkin.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "pack.h"
+#include "pack_write.h"
+#include "trace.h"
+
+#define PACK_DIR ".git/objects/pack"
+
+// One bulk pack per process; every field is guarded by `lock`
+static struct {
+    int active;
+    char tmp_path[64];
+    PackWriter out;             // its running hash is unused: the count is patched in at the end
+    PackIndexEntry *entries;
+    size_t count, cap;
+    uint32_t *slots;            // open-addressed set of entry index + 1
+    size_t slot_mask;
+} bulk;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+
+static size_t slot_of(const unsigned char raw_hash[20]) {
+    uint32_t h;
+    memcpy(&h, raw_hash, 4); // SHA-1 bytes are already uniformly spread
+    return h & bulk.slot_mask;
+}
+
+
+// The entry's index + 1, or 0 when the pack doesn't have the object
+static size_t lookup_locked(const unsigned char raw_hash[20]) {
+    if (!bulk.slots) return 0;
+    for (size_t i = slot_of(raw_hash); bulk.slots[i]; i = (i + 1) & bulk.slot_mask) {
+        if (memcmp(bulk.entries[bulk.slots[i] - 1].raw_hash, raw_hash, 20) == 0) return bulk.slots[i];
+    }
+    return 0;
+}
+
+
+static int grow_slots(void) {
+    size_t size = bulk.slots ? (bulk.slot_mask + 1) * 2 : 4096;
+    uint32_t *slots = calloc(size, sizeof(uint32_t));
+    if (!slots) { perror("calloc"); return -1; }
+    free(bulk.slots);
+    bulk.slots = slots;
+    bulk.slot_mask = size - 1;
+    for (size_t e = 0; e < bulk.count; e++) {
+        size_t i = slot_of(bulk.entries[e].raw_hash);
+        while (bulk.slots[i]) i = (i + 1) & bulk.slot_mask;
+        bulk.slots[i] = (uint32_t)(e + 1);
+    }
+    return 0;
+}
+
+
+// Record an entry that starts at `offset` and whose bytes are fully appended
+static int add_entry_locked(const unsigned char raw_hash[20], uint64_t offset) {
+    if (bulk.count == bulk.cap) {
+        size_t cap = bulk.cap ? bulk.cap * 2 : 1024;
+        PackIndexEntry *grown = realloc(bulk.entries, cap * sizeof(PackIndexEntry));
+        if (!grown) { perror("realloc"); return -1; }
+        bulk.entries = grown;
+        bulk.cap = cap;
+    }
+    // Keep the set at most half full
+    if (!bulk.slots || (bulk.count + 1) * 2 > bulk.slot_mask + 1) {
+        if (grow_slots() < 0) return -1;
+    }
+
+    PackIndexEntry *e = &bulk.entries[bulk.count];
+    memcpy(e->raw_hash, raw_hash, 20);
+    e->crc = bulk.out.crc;
+    e->offset = offset;
+
+    size_t i = slot_of(raw_hash);
+    while (bulk.slots[i]) i = (i + 1) & bulk.slot_mask;
+    bulk.slots[i] = (uint32_t)(++bulk.count);
+    trace_count(TRACE_OBJECTS_WRITTEN, 1);
+    return 0;
+}
+
+
+int bulk_checkin_active(void) {
+    return bulk.active;
+}
+
+
+int bulk_checkin_contains(const unsigned char raw_hash[20]) {
+    if (!bulk.active) return 0;
+    pthread_mutex_lock(&lock);
+    int found = lookup_locked(raw_hash) != 0;
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+
+// Entries are appended in order, so one ends where the next begins, and an
+// OFS_DELTA's base is found by binary search on the offsets
+static int read_entry_locked(size_t e, ObjectType *type, unsigned char **data, size_t *size) {
+    uint64_t start = bulk.entries[e].offset;
+    uint64_t end = e + 1 < bulk.count ? bulk.entries[e + 1].offset : bulk.out.offset;
+    if (pack_writer_flush(&bulk.out) < 0) return -1;
+
+    size_t len = (size_t)(end - start);
+    unsigned char *raw = malloc(len);
+    if (!raw) { perror("malloc"); return -1; }
+    for (size_t got = 0; got < len; ) {
+        ssize_t n = pread(bulk.out.fd, raw + got, len - got, (off_t)(start + got));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { perror("pread"); free(raw); return -1; }
+        got += (size_t)n;
+    }
+
+    // Entry header: type in bits 4-6 of the first byte, size in 4 + 7n bits
+    size_t pos = 0;
+    *type = (ObjectType)((raw[0] >> 4) & 7);
+    uint64_t object_size = raw[0] & 15;
+    for (int shift = 4; raw[pos++] & 0x80 && pos < len; shift += 7) {
+        object_size |= (uint64_t)(raw[pos] & 0x7f) << shift;
+    }
+    uint64_t distance = 0;
+    if (*type == OBJ_OFS_DELTA && pos < len) {
+        unsigned char c = raw[pos++];
+        distance = c & 0x7f;
+        while (c & 0x80 && pos < len) {
+            c = raw[pos++];
+            distance = ((distance + 1) << 7) | (c & 0x7f);
+        }
+    }
+
+    *size = (size_t)object_size;
+    *data = malloc(*size + 1);
+    uLongf out_len = (uLongf)*size;
+    int status = *data ? uncompress(*data, &out_len, raw + pos, (uLong)(len - pos)) : Z_MEM_ERROR;
+    free(raw);
+    if (status != Z_OK || out_len != *size) goto corrupt;
+    (*data)[*size] = '\0';
+    if (*type != OBJ_OFS_DELTA) return 0;
+
+    size_t lo = 0, hi = e;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (bulk.entries[mid].offset < start - distance) lo = mid + 1;
+        else hi = mid;
+    }
+    unsigned char *base, *delta = *data;
+    size_t base_size;
+    if (distance == 0 || lo == e || bulk.entries[lo].offset != start - distance ||
+        read_entry_locked(lo, type, &base, &base_size) < 0) goto corrupt;
+    status = apply_delta(base, base_size, delta, *size, data, size);
+    free(base);
+    free(delta);
+    if (status == 0) return 0;
+    *data = NULL;
+
+corrupt:
+    fprintf(stderr, "bulk checkin: corrupt entry at offset %ju\n", (uintmax_t)start);
+    free(*data);
+    return -1;
+}
+
+
+int bulk_checkin_read(const unsigned char raw_hash[20], ObjectType *type, unsigned char **data, size_t *size) {
+    if (!bulk.active) return -1;
+    pthread_mutex_lock(&lock);
+    size_t found = lookup_locked(raw_hash);
+    int ret = found ? read_entry_locked(found - 1, type, data, size) : -1;
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+
+int bulk_checkin_begin(void) {
+    if (mkdir(PACK_DIR, 0755) < 0 && errno != EEXIST) { perror("mkdir " PACK_DIR); return -1; }
+
+    strcpy(bulk.tmp_path, PACK_DIR "/tmp_pack_XXXXXX");
+    int fd = mkstemp(bulk.tmp_path);
+    if (fd < 0) { perror("mkstemp"); return -1; }
+
+    // The object count is patched in once it is known
+    unsigned char header[12] = { 'P', 'A', 'C', 'K', 0, 0, 0, 2, 0, 0, 0, 0 };
+    if (pack_writer_init(&bulk.out, fd) < 0 || pack_writer_write(&bulk.out, header, sizeof(header)) < 0) {
+        pack_writer_release(&bulk.out);
+        close(fd);
+        unlink(bulk.tmp_path);
+        return -1;
+    }
+    bulk.active = 1;
+    return 0;
+}
+
+
+// Appends one entry unless another thread already did; `base` + 1 is the
+// index of an OFS_DELTA's base entry, 0 for a whole object
+static int append_locked(const unsigned char raw_hash[20], ObjectType type, size_t len, size_t base,
+                         const unsigned char *zdata, size_t zlen) {
+    if (lookup_locked(raw_hash)) {
+        trace_count(TRACE_OBJECTS_SKIPPED, 1); // another thread got there first
+        return 0;
+    }
+    unsigned char header[32];
+    uint64_t offset = bulk.out.offset;
+    size_t header_len = pack_encode_entry_header(header, type, len);
+    if (base) header_len += pack_encode_ofs_distance(header + header_len, offset - bulk.entries[base - 1].offset);
+    bulk.out.crc = 0;
+    if (pack_writer_write(&bulk.out, header, header_len) < 0 ||
+        pack_writer_write(&bulk.out, zdata, zlen) < 0) return -1;
+    return add_entry_locked(raw_hash, offset);
+}
+
+
+int bulk_checkin_write(ObjectType type, const unsigned char *payload, size_t len,
+                       const unsigned char raw_hash[20]) {
+    unsigned char *zdata;
+    size_t zlen;
+    if (compress_buffer(compress_level(COMPRESS_PACK, payload, len), payload, len, &zdata, &zlen) < 0) return -1;
+    int ret = bulk_checkin_write_deflated(type, len, zdata, zlen, raw_hash);
+    free(zdata);
+    return ret;
+}
+
+
+int bulk_checkin_write_deflated(ObjectType type, size_t len, const unsigned char *zdata, size_t zlen,
+                                const unsigned char raw_hash[20]) {
+    pthread_mutex_lock(&lock);
+    int ret = append_locked(raw_hash, type, len, 0, zdata, zlen);
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+
+int bulk_checkin_write_delta(const unsigned char raw_hash[20], const unsigned char base_hash[20],
+                             const unsigned char *delta, size_t delta_len) {
+    unsigned char *zdata;
+    size_t zlen;
+    int level = compress_level(COMPRESS_PACK, delta, delta_len);
+    if (compress_buffer(level, delta, delta_len, &zdata, &zlen) < 0) return -1;
+    pthread_mutex_lock(&lock);
+    size_t base = lookup_locked(base_hash);
+    int ret = base ? append_locked(raw_hash, OBJ_OFS_DELTA, delta_len, base, zdata, zlen) : 1;
+    pthread_mutex_unlock(&lock);
+    free(zdata);
+    return ret;
+}
+
+
+int bulk_checkin_write_fd(int fd, off_t size, unsigned char raw_hash[20]) {
+    unsigned char *in_buf = malloc(STREAM_CHUNK), *zbuf = malloc(STREAM_CHUNK);
+    z_stream stream;
+    int z_ready = 0;            // set up once the first chunk has picked the level
+    if (!in_buf || !zbuf) {
+        fprintf(stderr, "bulk checkin: out of memory\n");
+        free(in_buf);
+        free(zbuf);
+        return -1;
+    }
+
+    char object_header[64];
+    int object_header_len = snprintf(object_header, sizeof(object_header), "blob %jd", (intmax_t)size) + 1;
+    HashCtx ctx;
+    hash_init(&ctx);
+    hash_update(&ctx, object_header, object_header_len);
+
+    // Large blobs hold the pack for their whole length: entries can't interleave
+    pthread_mutex_lock(&lock);
+    uint64_t start = bulk.out.offset;
+    bulk.out.crc = 0;
+    unsigned char entry_header[16];
+    int ret = pack_writer_write(&bulk.out, entry_header,
+                                pack_encode_entry_header(entry_header, OBJ_BLOB, (uint64_t)size));
+
+    off_t remaining = size;
+    int flush = Z_NO_FLUSH;
+    while (ret == 0 && flush != Z_FINISH) {
+        size_t want = remaining < STREAM_CHUNK ? (size_t)remaining : STREAM_CHUNK;
+        size_t got = 0;
+        while (got < want) {
+            ssize_t n = read(fd, in_buf + got, want - got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            got += (size_t)n;
+        }
+        if (got != want) {
+            fprintf(stderr, "file changed size while hashing\n");
+            ret = -1;
+            break;
+        }
+        if (!z_ready && compress_init(&stream, compress_level(COMPRESS_PACK, in_buf, want)) < 0) {
+            ret = -1;
+            break;
+        }
+        z_ready = 1;
+        remaining -= (off_t)want;
+        hash_update(&ctx, in_buf, want);
+        trace_count(TRACE_BYTES_HASHED, want);
+        trace_count(TRACE_BYTES_DEFLATED, want);
+
+        flush = remaining == 0 ? Z_FINISH : Z_NO_FLUSH;
+        stream.next_in = in_buf;
+        stream.avail_in = (uInt)want;
+        int status;
+        do {
+            stream.next_out = zbuf;
+            stream.avail_out = STREAM_CHUNK;
+            status = deflate(&stream, flush);
+            if (status == Z_STREAM_ERROR ||
+                pack_writer_write(&bulk.out, zbuf, STREAM_CHUNK - stream.avail_out) < 0) {
+                ret = -1;
+                break;
+            }
+        } while (stream.avail_out == 0 || (flush == Z_FINISH && status != Z_STREAM_END));
+    }
+    hash_final(&ctx, raw_hash);
+
+    if (ret == 0 && !lookup_locked(raw_hash)) {
+        ret = add_entry_locked(raw_hash, start);
+    } else {
+        // Duplicate or failure: cut the entry back off the end of the pack
+        if (ret == 0) trace_count(TRACE_OBJECTS_SKIPPED, 1);
+        if (pack_writer_flush(&bulk.out) < 0 || ftruncate(bulk.out.fd, (off_t)start) < 0 ||
+            lseek(bulk.out.fd, (off_t)start, SEEK_SET) < 0) {
+            perror("truncate pack");
+            ret = -1;
+        }
+        bulk.out.offset = start;
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (z_ready) deflateEnd(&stream);
+    free(in_buf);
+    free(zbuf);
+    return ret;
+}
+
+
+// Patch the object count into the header, then checksum the finished stream
+static int finish_pack(unsigned char pack_hash[20]) {
+    PackWriter *w = &bulk.out;
+    if (pack_writer_flush(w) < 0) return -1;
+
+    unsigned char count[4];
+    put_be32(count, (uint32_t)bulk.count);
+    if (pwrite(w->fd, count, 4, 8) != 4) { perror("pwrite"); return -1; }
+
+    TraceSpan span;
+    trace_begin(&span, "sha1");
+    HashCtx ctx;
+    hash_init(&ctx);
+    for (uint64_t pos = 0; pos < w->offset; ) {
+        size_t want = w->offset - pos < STREAM_CHUNK ? (size_t)(w->offset - pos) : STREAM_CHUNK;
+        ssize_t n = pread(w->fd, w->buf, want, (off_t)pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { perror("pread"); trace_end(&span); return -1; }
+        hash_update(&ctx, w->buf, (size_t)n);
+        pos += (uint64_t)n;
+    }
+    hash_final(&ctx, pack_hash);
+    trace_end(&span);
+
+    if (pack_writer_write(w, pack_hash, 20) < 0 || pack_writer_flush(w) < 0) return -1;
+    fchmod(w->fd, 0444);
+    int fd = w->fd;
+    w->fd = -1;
+    if (close(fd) < 0) { perror("close pack"); return -1; }
+    return 0;
+}
+
+
+static void reset(void) {
+    compress_release();
+    if (bulk.out.fd >= 0) close(bulk.out.fd);
+    pack_writer_release(&bulk.out);
+    free(bulk.entries);
+    free(bulk.slots);
+    memset(&bulk, 0, sizeof(bulk));
+}
+
+
+int bulk_checkin_end(void) {
+    if (!bulk.active) return 0;
+    TraceSpan span;
+    trace_begin(&span, "bulk-checkin end");
+    bulk.active = 0;
+
+    int ret = -1;
+    unsigned char pack_hash[20];
+    if (bulk.count == 0) {
+        unlink(bulk.tmp_path); // nothing new: no pack at all
+        ret = 0;
+        goto out;
+    }
+    if (finish_pack(pack_hash) < 0) { unlink(bulk.tmp_path); goto out; }
+
+    char idx_tmp[PATH_MAX];
+    snprintf(idx_tmp, sizeof(idx_tmp), "%s.idx", bulk.tmp_path);
+    if (pack_write_index(idx_tmp, bulk.entries, bulk.count, pack_hash) < 0) { unlink(bulk.tmp_path); goto out; }
+    if (pack_install(bulk.tmp_path, idx_tmp, pack_hash) < 0) goto out;
+    ret = 0;
+
+out:
+    reset();
+    trace_end(&span);
+    return ret;
+}
@@ -0,0 +1,48 @@
+#ifndef BULK_CHECKIN_H
+#define BULK_CHECKIN_H
+
+#include <sys/types.h>
+
+#include "object_store.h"
+
+// Bulk mode: while a bulk checkin is open, new objects are appended to one
+// pack stream (.git/objects/pack/tmp_pack_XXXXXX) instead of becoming loose
+// files. bulk_checkin_end() fixes up the header and trailer, writes the
+// matching .idx and renames both into place, so an import of any size costs
+// two files and one sequential write. Objects written in bulk mode count as
+// existing for object_exists() and read_object() finds them, but streaming
+// readers (ObjectStream, ObjectReader) only see them once the pack is
+// finished. All functions return 0 on success and -1 on error (reported).
+
+int bulk_checkin_begin(void);
+int bulk_checkin_end(void);
+int bulk_checkin_active(void);
+
+// Already present in the pack being written
+int bulk_checkin_contains(const unsigned char raw_hash[20]);
+
+// Append an object whose name the caller has already computed. Compression
+// happens outside the pack lock, so threads only serialize on the append.
+int bulk_checkin_write(ObjectType type, const unsigned char *payload, size_t len,
+                       const unsigned char raw_hash[20]);
+
+// The same, for a payload of `len` bytes the caller deflated itself
+// (without the "<type> <len>\0" header, which packs don't store)
+int bulk_checkin_write_deflated(ObjectType type, size_t len, const unsigned char *zdata, size_t zlen,
+                                const unsigned char raw_hash[20]);
+
+// Append an object as an OFS_DELTA (see delta.h) against base_hash, which
+// has to be in this pack already. Returns 1 without writing when it isn't,
+// so the caller can write the object whole instead.
+int bulk_checkin_write_delta(const unsigned char raw_hash[20], const unsigned char base_hash[20],
+                             const unsigned char *delta, size_t delta_len);
+
+// Inflates an object from the pack being written, as read_object() does;
+// -1 without a message when it is not there
+int bulk_checkin_read(const unsigned char raw_hash[20], ObjectType *type, unsigned char **data, size_t *size);
+
+// Stream `size` bytes of blob content from fd into the pack, hashing on the
+// way; a duplicate is cut back off the end of the pack afterwards
+int bulk_checkin_write_fd(int fd, off_t size, unsigned char raw_hash[20]);
+
+#endif
@@ -0,0 +1,271 @@
+#define _GNU_SOURCE // fallocate
+#include "checkout.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+#include "object_store.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "tree.h"
+
+#define BATCH_FILES 64                  // files per task, all created through one directory fd
+#define PREALLOCATE_MIN (256 * 1024)    // smaller files come out contiguous without help
+
+typedef struct {
+    ThreadPool *pool;
+    StatCache *cache;
+    atomic_int failed;
+} Checkout;
+
+typedef struct {
+    char *name;
+    uint32_t mode;
+    unsigned char raw_hash[20];
+} FileEntry;
+
+// Up to BATCH_FILES files of one directory: the task opens the directory
+// once and creates every file relative to it, so the kernel resolves the
+// directory's path once per batch instead of once per file
+typedef struct {
+    Checkout *co;
+    char *dir;                   // "" for the root, otherwise "a/b/"
+    size_t count;
+    FileEntry files[BATCH_FILES];
+} FileBatch;
+
+
+static int write_all(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+
+static int write_symlink(int dirfd, const FileEntry *f, const char *path) {
+    ObjectType type;
+    unsigned char *target;
+    size_t size;
+    if (read_object(f->raw_hash, &type, &target, &size) < 0) target = NULL;
+    if (!target || type != OBJ_BLOB) {
+        fprintf(stderr, "error: unable to read symlink target for %s\n", path);
+        free(target);
+        return -1;
+    }
+    unlinkat(dirfd, f->name, 0);
+    int status = symlinkat((const char *)target, dirfd, f->name);
+    if (status < 0) perror(path);
+    free(target);
+    return status;
+}
+
+
+static int write_file(const FileBatch *b, int dirfd, const FileEntry *f, const char *path) {
+    ObjectStream s;
+    int opened = object_stream_open(&s, f->raw_hash) == 0;
+    if (!opened || s.type != OBJ_BLOB) {
+        char hex[41];
+        hash_to_hex(hex, f->raw_hash);
+        fprintf(stderr, "error: unable to read blob %s for %s\n", hex, path);
+        if (opened) object_stream_close(&s);
+        return -1;
+    }
+
+    // A symlink in the way is replaced, never followed
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC;
+    mode_t mode = f->mode == 0100755 ? 0777 : 0666;
+    int fd = openat(dirfd, f->name, flags, mode);
+    if (fd < 0 && errno == ELOOP && unlinkat(dirfd, f->name, 0) == 0) fd = openat(dirfd, f->name, flags, mode);
+    int ret = -1;
+    if (fd < 0) { perror(path); goto out; }
+
+    // The header gave the size: reserve the blocks in one go (best effort)
+    if (s.size >= PREALLOCATE_MIN) fallocate(fd, 0, 0, (off_t)s.size);
+
+    unsigned char buf[STREAM_CHUNK];
+    ssize_t n;
+    while ((n = object_stream_read(&s, buf, sizeof(buf))) > 0) {
+        if (write_all(fd, buf, (size_t)n) < 0) { perror(path); goto out; }
+    }
+    if (n < 0) goto out;
+
+    // What the file looks like now is what write-tree will compare against
+    struct stat st;
+    if (b->co->cache && f->mode == 0100644 && fstat(fd, &st) == 0) {
+        stat_cache_add(b->co->cache, path, &st, 0, f->raw_hash);
+    }
+    ret = 0;
+
+out:
+    if (fd >= 0 && close(fd) < 0 && ret == 0) { perror(path); ret = -1; }
+    object_stream_close(&s);
+    return ret;
+}
+
+
+static void batch_task(void *arg) {
+    FileBatch *b = arg;
+    int failed = 0;
+    int dirfd = open(*b->dir ? b->dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        perror(*b->dir ? b->dir : ".");
+        failed = 1;
+    }
+    for (size_t i = 0; i < b->count && dirfd >= 0; i++) {
+        const FileEntry *f = &b->files[i];
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s", b->dir, f->name);
+        int status = f->mode == 0120000 ? write_symlink(dirfd, f, path) : write_file(b, dirfd, f, path);
+        if (status < 0) failed = 1;
+    }
+    if (dirfd >= 0) close(dirfd);
+    if (failed) atomic_store(&b->co->failed, 1);
+
+    for (size_t i = 0; i < b->count; i++) free(b->files[i].name);
+    free(b->dir);
+    free(b);
+}
+
+
+// A tree from elsewhere must not write outside the directory it describes
+static int safe_name(const char *name) {
+    return *name && !strchr(name, '/') && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 &&
+           strcmp(name, ".git") != 0;
+}
+
+
+// A directory of the tree must be a real one, not a file or a symlink
+static int make_dir(const char *path) {
+    if (mkdir(path, 0777) == 0) return 0;
+    struct stat st;
+    if (errno == EEXIST && lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) return 0;
+    if (errno == EEXIST) fprintf(stderr, "error: '%s' is in the way of a directory\n", path);
+    else perror(path);
+    return -1;
+}
+
+
+// Creates the directories below the tree at `path` and queues its files in
+// batches; every directory exists before any of its files is queued.
+// Returns 1 when write-tree would rebuild exactly this tree from what gets
+// written (only plain files and such directories), 0 when not, -1 on error.
+static int walk(Checkout *co, const unsigned char raw_hash[20], char *path, size_t path_len) {
+    TreeIterator it;
+    if (tree_iter_open(&it, raw_hash) < 0) {
+        char hex[41];
+        hash_to_hex(hex, raw_hash);
+        fprintf(stderr, "error: unable to read tree %s\n", hex);
+        return -1;
+    }
+
+    int cacheable = 1;
+    uint32_t count = 0;
+    FileBatch *batch = NULL;
+    TreeEntryView entry;
+    int status;
+    while ((status = tree_iter_next(&it, &entry)) == 1) {
+        count++;
+        if (!safe_name(entry.name)) {
+            fprintf(stderr, "error: refusing to check out path '%.*s%s'\n", (int)path_len, path, entry.name);
+            goto fail;
+        }
+        if (path_len + entry.name_len + 2 > PATH_MAX) {
+            fprintf(stderr, "error: path too long under '%.*s'\n", (int)path_len, path);
+            goto fail;
+        }
+        memcpy(path + path_len, entry.name, entry.name_len + 1);
+
+        if (entry.mode == 040000 || entry.mode == 0160000) {
+            if (make_dir(path) < 0) goto fail;
+            if (entry.mode == 0160000) { // submodule: an empty directory stands in for it
+                cacheable = 0;
+                continue;
+            }
+            size_t sub_len = path_len + entry.name_len;
+            path[sub_len] = '/';
+            int sub = walk(co, entry.raw_hash, path, sub_len + 1);
+            if (sub < 0) goto fail;
+            cacheable &= sub;
+            continue;
+        }
+        if (entry.mode != 0100644 && entry.mode != 0100755 && entry.mode != 0120000) {
+            fprintf(stderr, "error: unknown mode %o for '%s'\n", entry.mode, path);
+            goto fail;
+        }
+
+        if (!batch) {
+            batch = malloc(sizeof(FileBatch));
+            if (batch) *batch = (FileBatch){ .co = co, .dir = strndup(path, path_len) };
+            if (!batch || !batch->dir) { perror("malloc"); free(batch); batch = NULL; goto fail; }
+        }
+        FileEntry *f = &batch->files[batch->count];
+        f->name = strdup(entry.name);
+        if (!f->name) { perror("strdup"); goto fail; }
+        f->mode = entry.mode;
+        memcpy(f->raw_hash, entry.raw_hash, 20);
+        if (++batch->count == BATCH_FILES) {
+            thread_pool_submit(co->pool, batch_task, batch);
+            batch = NULL;
+        }
+        cacheable &= entry.mode == 0100644;
+    }
+    if (status < 0) {
+        char hex[41];
+        hash_to_hex(hex, raw_hash);
+        fprintf(stderr, "error: corrupt tree object %s\n", hex);
+        goto fail;
+    }
+    tree_iter_close(&it);
+    if (batch) thread_pool_submit(co->pool, batch_task, batch);
+
+    if (cacheable && co->cache) {
+        path[path_len ? path_len - 1 : 0] = '\0'; // the directory's own key, "" for the root
+        stat_cache_add(co->cache, path, NULL, count, raw_hash);
+    }
+    return cacheable;
+
+fail:
+    if (batch) {
+        for (size_t i = 0; i < batch->count; i++) free(batch->files[i].name);
+        free(batch->dir);
+        free(batch);
+    }
+    tree_iter_close(&it);
+    atomic_store(&co->failed, 1);
+    return -1;
+}
+
+
+int checkout_tree(const unsigned char tree_hash[20], int threads, StatCache *cache) {
+    Checkout co = { .cache = cache };
+    co.pool = thread_pool_create(threads > 0 ? threads : 1);
+    if (!co.pool) return -1;
+
+    static char path[PATH_MAX];
+    TraceSpan span;
+    trace_begin(&span, "walk");
+    walk(&co, tree_hash, path, 0);
+    trace_end(&span);
+
+    // Destroying the pool waits for the last blob to be written
+    trace_begin(&span, "write files");
+    thread_pool_destroy(co.pool);
+    trace_end(&span);
+    return atomic_load(&co.failed) ? -1 : 0;
+}
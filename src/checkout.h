@@ -0,0 +1,21 @@
+#ifndef CHECKOUT_H
+#define CHECKOUT_H
+
+#include "stat_cache.h"
+
+// Writes the tree named by tree_hash out under the current directory. One
+// thread walks the tree and creates each directory as it reaches it, so a
+// directory always exists before any of its files is handed to the pool;
+// the workers then inflate and write blobs concurrently, each streamed from
+// the object database with constant memory. Files go to the pool in batches
+// of one directory that are created with openat() on a single directory fd,
+// and large blobs are preallocated at the size their header announces.
+// Existing files are overwritten; symlinks in the way are replaced.
+//
+// With a cache, every regular file written is recorded in it, and so is
+// every directory write-tree would rebuild identically, so that the next
+// write-tree finds the fresh work tree clean without rehashing it.
+// Returns 0, or -1 on error (reported).
+int checkout_tree(const unsigned char tree_hash[20], int threads, StatCache *cache);
+
+#endif
@@ -0,0 +1,695 @@
+#define _GNU_SOURCE // nftw
+#include "clone.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <signal.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "checkout.h"
+#include "hash.h"
+#include "index_pack.h"
+#include "object_store.h"
+#include "pack_write.h"
+#include "stat_cache.h"
+#include "trace.h"
+#include "tree.h"
+
+#define PACK_DIR ".git/objects/pack"
+#define PKT_MAX 65520            // longest pkt-line, its 4-byte length included
+
+// Reads pkt-lines from upload-pack. Once the pack starts it is either the
+// raw rest of the stream or, with side-band-64k, the payload of band 1
+// packets, with band 2 carrying progress and band 3 a fatal error.
+typedef struct {
+    int fd;
+    unsigned char buf[PKT_MAX];
+    size_t start, end;           // unread bytes are buf[start..end)
+    char line[PKT_MAX];          // the last line returned, NUL-terminated
+    size_t line_len;             // which may hold further NULs
+    int sideband;
+    size_t data_left;            // pack bytes still to come in the current band 1 packet
+    int quiet;
+} PktReader;
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+} PktBuf;
+
+typedef struct {
+    char *name;
+    unsigned char raw_hash[20];
+    unsigned char peeled[20];    // what an annotated tag points at
+    int has_peeled;
+} RemoteRef;
+
+typedef struct {
+    RemoteRef *refs;             // refs/heads/* and refs/tags/*, in advertised order
+    size_t count, cap;
+    char *caps;
+    int has_head;
+    unsigned char head[20];
+    char *head_target;           // from symref=HEAD:<ref>, when the server says
+} Advertisement;
+
+
+static int write_all(int fd, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+
+// Moves the unread bytes to the front and reads more behind them
+static ssize_t pkt_fill(PktReader *r) {
+    memmove(r->buf, r->buf + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+    ssize_t n;
+    do {
+        n = read(r->fd, r->buf + r->end, sizeof(r->buf) - r->end);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) perror("read from upload-pack");
+    if (n == 0) fprintf(stderr, "fatal: the remote end hung up unexpectedly\n");
+    if (n > 0) r->end += (size_t)n;
+    return n;
+}
+
+
+static int pkt_need(PktReader *r, size_t n) {
+    while (r->end - r->start < n) {
+        if (pkt_fill(r) <= 0) return -1;
+    }
+    return 0;
+}
+
+
+// Length of the packet at the front, its header included; 0 for a flush
+static int pkt_length(PktReader *r, size_t *len) {
+    if (pkt_need(r, 4) < 0) return -1;
+    size_t n = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = r->buf[r->start + i];
+        int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (digit < 0) goto bad;
+        n = n << 4 | (size_t)digit;
+    }
+    if (n != 0 && (n < 4 || n > PKT_MAX)) goto bad;
+    *len = n;
+    return 0;
+
+bad:
+    fprintf(stderr, "fatal: protocol error: bad line length\n");
+    return -1;
+}
+
+
+// Next line into r->line, without its newline; 1, 0 for a flush, -1 on error
+static int pkt_read_line(PktReader *r) {
+    size_t n;
+    if (pkt_length(r, &n) < 0) return -1;
+    if (n == 0) {
+        r->start += 4;
+        return 0;
+    }
+    if (pkt_need(r, n) < 0) return -1;
+    size_t len = n - 4;
+    memcpy(r->line, r->buf + r->start + 4, len);
+    r->start += n;
+    if (len > 0 && r->line[len - 1] == '\n') len--;
+    r->line[len] = '\0';
+    r->line_len = len;
+    if (strncmp(r->line, "ERR ", 4) == 0) {
+        fprintf(stderr, "fatal: remote error: %s\n", r->line + 4);
+        return -1;
+    }
+    return 1;
+}
+
+
+// pack_read_fn over what follows the NAK
+static ssize_t read_pack_data(void *ctx, unsigned char *out, size_t len) {
+    PktReader *r = ctx;
+    size_t want = len;
+    if (r->sideband) {
+        while (r->data_left == 0) {
+            size_t n;
+            if (pkt_length(r, &n) < 0) return -1;
+            if (n == 0) { // flush: the pack is complete
+                r->start += 4;
+                return 0;
+            }
+            if (n < 5 || pkt_need(r, 5) < 0) return -1;
+            int band = r->buf[r->start + 4];
+            if (band == 1) {
+                r->start += 5;
+                r->data_left = n - 5;
+                continue;
+            }
+            if (pkt_need(r, n) < 0) return -1;
+            const char *msg = (const char *)r->buf + r->start + 5;
+            r->start += n;
+            if (band == 2) {
+                if (!r->quiet) fwrite(msg, 1, n - 5, stderr);
+                continue;
+            }
+            if (band == 3) fprintf(stderr, "fatal: remote error: %.*s\n", (int)(n - 5), msg);
+            else fprintf(stderr, "fatal: protocol error: bad band #%d\n", band);
+            return -1;
+        }
+        if (want > r->data_left) want = r->data_left;
+    }
+
+    // Buffered bytes first; after that straight from the pipe into the caller's buffer
+    ssize_t got;
+    if (r->start < r->end) {
+        got = (ssize_t)(want < r->end - r->start ? want : r->end - r->start);
+        memcpy(out, r->buf + r->start, (size_t)got);
+        r->start += (size_t)got;
+    } else {
+        do {
+            got = read(r->fd, out, want);
+        } while (got < 0 && errno == EINTR);
+        if (got < 0) perror("read from upload-pack");
+        if (got == 0 && r->sideband) {
+            fprintf(stderr, "fatal: the remote end hung up unexpectedly\n");
+            return -1;
+        }
+    }
+    if (got > 0 && r->sideband) r->data_left -= (size_t)got;
+    return got;
+}
+
+
+static int pkt_reserve(PktBuf *b, size_t n) {
+    if (b->len + n <= b->cap) return 0;
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + n) cap *= 2;
+    char *grown = realloc(b->data, cap);
+    if (!grown) { perror("realloc"); return -1; }
+    b->data = grown;
+    b->cap = cap;
+    return 0;
+}
+
+
+static int pkt_append(PktBuf *b, const char *fmt, ...) {
+    char line[PKT_MAX + 1];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line + 4, sizeof(line) - 4, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n + 4 > PKT_MAX) {
+        fprintf(stderr, "fatal: pkt-line too long\n");
+        return -1;
+    }
+    char header[5];
+    snprintf(header, sizeof(header), "%04x", n + 4);
+    memcpy(line, header, 4);
+    if (pkt_reserve(b, (size_t)n + 4) < 0) return -1;
+    memcpy(b->data + b->len, line, (size_t)n + 4);
+    b->len += (size_t)n + 4;
+    return 0;
+}
+
+
+static int pkt_flush(PktBuf *b) {
+    if (pkt_reserve(b, 4) < 0) return -1;
+    memcpy(b->data + b->len, "0000", 4);
+    b->len += 4;
+    return 0;
+}
+
+
+// Whether the server offered `name` (as a whole word, or before a '=')
+static int has_cap(const char *caps, const char *name) {
+    size_t len = strlen(name);
+    for (const char *p = caps; p && *p; p = strchr(p, ' '), p = p ? p + 1 : NULL) {
+        if (strncmp(p, name, len) == 0 && (p[len] == ' ' || p[len] == '\0' || p[len] == '=')) return 1;
+    }
+    return 0;
+}
+
+
+static void free_advertisement(Advertisement *adv) {
+    for (size_t i = 0; i < adv->count; i++) free(adv->refs[i].name);
+    free(adv->refs);
+    free(adv->caps);
+    free(adv->head_target);
+}
+
+
+// "<sha> <name>" lines up to a flush; the first also carries the capabilities
+// after a NUL, and an annotated tag is followed by "<sha> <name>^{}"
+static int read_advertisement(PktReader *r, Advertisement *adv) {
+    int status;
+    while ((status = pkt_read_line(r)) == 1) {
+        char *line = r->line;
+        if (!adv->caps) {
+            size_t len = strlen(line);
+            adv->caps = len < r->line_len ? strndup(line + len + 1, r->line_len - len - 1) : strdup("");
+            if (!adv->caps) { perror("strdup"); return -1; }
+        }
+
+        unsigned char raw_hash[20];
+        if (line[0] == '\0' || strlen(line) < 42 || line[40] != ' ') goto bad;
+        line[40] = '\0';
+        if (hex_to_hash(raw_hash, line) < 0) goto bad;
+        const char *name = line + 41;
+        size_t name_len = strlen(name);
+
+        if (strcmp(name, "capabilities^{}") == 0) continue; // an empty repository
+        if (strcmp(name, "HEAD") == 0) {
+            adv->has_head = 1;
+            memcpy(adv->head, raw_hash, 20);
+            continue;
+        }
+        if (name_len > 3 && strcmp(name + name_len - 3, "^{}") == 0) {
+            RemoteRef *prev = adv->count ? &adv->refs[adv->count - 1] : NULL;
+            if (prev && strlen(prev->name) == name_len - 3 && strncmp(prev->name, name, name_len - 3) == 0) {
+                memcpy(prev->peeled, raw_hash, 20);
+                prev->has_peeled = 1;
+            }
+            continue;
+        }
+        if (strncmp(name, "refs/heads/", 11) != 0 && strncmp(name, "refs/tags/", 10) != 0) continue;
+
+        if (adv->count == adv->cap) {
+            size_t cap = adv->cap ? adv->cap * 2 : 64;
+            RemoteRef *grown = realloc(adv->refs, cap * sizeof(RemoteRef));
+            if (!grown) { perror("realloc"); return -1; }
+            adv->refs = grown;
+            adv->cap = cap;
+        }
+        RemoteRef *ref = &adv->refs[adv->count];
+        *ref = (RemoteRef){ strdup(name), { 0 }, { 0 }, 0 };
+        if (!ref->name) { perror("strdup"); return -1; }
+        memcpy(ref->raw_hash, raw_hash, 20);
+        adv->count++;
+    }
+    if (status < 0) return -1;
+
+    // symref=HEAD:refs/heads/main names the default branch
+    for (const char *p = adv->caps; p && *p; p = strchr(p, ' '), p = p ? p + 1 : NULL) {
+        if (strncmp(p, "symref=HEAD:", 12) != 0) continue;
+        adv->head_target = strndup(p + 12, strcspn(p + 12, " "));
+        break;
+    }
+    return 0;
+
+bad:
+    fprintf(stderr, "fatal: protocol error: bad ref advertisement '%s'\n", r->line);
+    return -1;
+}
+
+
+static int cmp_raw_hash(const void *a, const void *b) {
+    return memcmp(a, b, 20);
+}
+
+
+// One want per distinct object any branch, tag or HEAD points at; the
+// first carries the capabilities we use
+static int send_request(int fd, const Advertisement *adv, int sideband, int quiet) {
+    unsigned char (*wants)[20] = malloc((adv->count + 1) * 20);
+    if (!wants) { perror("malloc"); return -1; }
+    size_t n = 0;
+    for (size_t i = 0; i < adv->count; i++) memcpy(wants[n++], adv->refs[i].raw_hash, 20);
+    if (adv->has_head) memcpy(wants[n++], adv->head, 20);
+    qsort(wants, n, 20, cmp_raw_hash);
+
+    PktBuf req = { 0 };
+    int ret = -1;
+    for (size_t i = 0; i < n; i++) {
+        if (i > 0 && memcmp(wants[i], wants[i - 1], 20) == 0) continue;
+        char hex[41];
+        hash_to_hex(hex, wants[i]);
+        int status = req.len == 0
+            ? pkt_append(&req, "want %s%s%s%s agent=codecrafters-git\n", hex,
+                         sideband ? " side-band-64k" : "",
+                         has_cap(adv->caps, "ofs-delta") ? " ofs-delta" : "",
+                         quiet && has_cap(adv->caps, "no-progress") ? " no-progress" : "")
+            : pkt_append(&req, "want %s\n", hex);
+        if (status < 0) goto out;
+    }
+    if (pkt_flush(&req) < 0 || pkt_append(&req, "done\n") < 0) goto out;
+    if (write_all(fd, req.data, req.len) < 0) { perror("write to upload-pack"); goto out; }
+    ret = 0;
+
+out:
+    free(req.data);
+    free(wants);
+    return ret;
+}
+
+
+// /bin/sh -c '<command> "$1"' so --upload-pack can carry its own arguments
+static pid_t start_upload_pack(const char *command, const char *repo, int *to, int *from) {
+    int in[2], out[2];
+    if (pipe(in) < 0) { perror("pipe"); return -1; }
+    if (pipe(out) < 0) { perror("pipe"); close(in[0]); close(in[1]); return -1; }
+
+    char script[PATH_MAX + 16];
+    snprintf(script, sizeof(script), "%s \"$1\"", command);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+        execl("/bin/sh", "sh", "-c", script, "upload-pack", repo, (char *)NULL);
+        perror("exec /bin/sh");
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    *to = in[1];
+    *from = out[0];
+    return pid;
+}
+
+
+static int finish_upload_pack(pid_t pid) {
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) { perror("waitpid"); return -1; }
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) return 0;
+    fprintf(stderr, "fatal: upload-pack exited with status %d\n",
+            WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    return -1;
+}
+
+
+// Receives the pack into .git/objects/pack, indexing it on the way
+static int fetch_pack(PktReader *r, const CloneOptions *opts) {
+    if (mkdir(PACK_DIR, 0755) < 0 && errno != EEXIST) { perror("mkdir " PACK_DIR); return -1; }
+    char tmp_path[PATH_MAX], idx_tmp[PATH_MAX + 8];
+    strcpy(tmp_path, PACK_DIR "/tmp_pack_XXXXXX");
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) { perror("mkstemp"); return -1; }
+    snprintf(idx_tmp, sizeof(idx_tmp), "%s.idx", tmp_path);
+
+    IndexPackOptions index_opts = { opts->threads, opts->max_cache };
+    unsigned char pack_hash[20];
+    int status = index_pack_stream(read_pack_data, r, fd, idx_tmp, &index_opts, pack_hash);
+    fchmod(fd, 0444);
+    if (close(fd) < 0 && status == 0) { perror("close pack"); status = -1; }
+    if (status < 0) {
+        unlink(tmp_path);
+        unlink(idx_tmp);
+        return -1;
+    }
+    return pack_install(tmp_path, idx_tmp, pack_hash);
+}
+
+
+static int make_parents(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) { perror(dir); return -1; }
+        *p = '/';
+    }
+    return 0;
+}
+
+
+static int write_text(const char *path, const char *fmt, ...) {
+    if (make_parents(path) < 0) return -1;
+    FILE *f = fopen(path, "w");
+    if (!f) { perror(path); return -1; }
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(f, fmt, ap);
+    va_end(ap);
+    if (fclose(f) != 0) { perror(path); return -1; }
+    return 0;
+}
+
+
+typedef struct {
+    char *name;                  // as stored locally
+    const RemoteRef *ref;
+} PackedRef;
+
+static int cmp_packed_ref(const void *a, const void *b) {
+    return strcmp(((const PackedRef *)a)->name, ((const PackedRef *)b)->name);
+}
+
+
+// Branches become refs/remotes/origin/*, tags stay as they are; all of them
+// go into one sorted packed-refs file, with annotated tags peeled
+static int write_packed_refs(const Advertisement *adv) {
+    PackedRef *packed = calloc(adv->count + 1, sizeof(PackedRef));
+    if (!packed) { perror("calloc"); return -1; }
+    int ret = -1;
+    for (size_t i = 0; i < adv->count; i++) {
+        const char *name = adv->refs[i].name;
+        size_t len = strlen(name) + 16;
+        packed[i].ref = &adv->refs[i];
+        packed[i].name = malloc(len);
+        if (!packed[i].name) { perror("malloc"); goto out; }
+        if (strncmp(name, "refs/heads/", 11) == 0) snprintf(packed[i].name, len, "refs/remotes/origin/%s", name + 11);
+        else snprintf(packed[i].name, len, "%s", name);
+    }
+    qsort(packed, adv->count, sizeof(PackedRef), cmp_packed_ref);
+
+    FILE *f = fopen(".git/packed-refs", "w");
+    if (!f) { perror(".git/packed-refs"); goto out; }
+    fprintf(f, "# pack-refs with: peeled fully-peeled sorted \n");
+    for (size_t i = 0; i < adv->count; i++) {
+        char hex[41];
+        hash_to_hex(hex, packed[i].ref->raw_hash);
+        fprintf(f, "%s %s\n", hex, packed[i].name);
+        if (packed[i].ref->has_peeled) {
+            hash_to_hex(hex, packed[i].ref->peeled);
+            fprintf(f, "^%s\n", hex);
+        }
+    }
+    if (fclose(f) != 0) { perror(".git/packed-refs"); goto out; }
+    ret = 0;
+
+out:
+    for (size_t i = 0; i < adv->count; i++) free(packed[i].name);
+    free(packed);
+    return ret;
+}
+
+
+// The branch HEAD points at: the one the server names, or else the first
+// branch at HEAD's commit
+static const RemoteRef *default_branch(const Advertisement *adv) {
+    for (size_t i = 0; i < adv->count; i++) {
+        const RemoteRef *ref = &adv->refs[i];
+        if (strncmp(ref->name, "refs/heads/", 11) != 0) continue;
+        if (adv->head_target ? strcmp(ref->name, adv->head_target) == 0
+                             : adv->has_head && memcmp(ref->raw_hash, adv->head, 20) == 0) return ref;
+    }
+    return NULL;
+}
+
+
+static int write_refs(const Advertisement *adv, const RemoteRef *branch, const char *url) {
+    if (write_packed_refs(adv) < 0) return -1;
+
+    int status = 0;
+    if (branch) {
+        const char *short_name = branch->name + 11;
+        char hex[41], path[PATH_MAX];
+        hash_to_hex(hex, branch->raw_hash);
+        snprintf(path, sizeof(path), ".git/%s", branch->name);
+        status |= write_text(path, "%s\n", hex);
+        status |= write_text(".git/HEAD", "ref: %s\n", branch->name);
+        status |= write_text(".git/refs/remotes/origin/HEAD", "ref: refs/remotes/origin/%s\n", short_name);
+        status |= write_text(".git/config",
+                             "[core]\n\trepositoryformatversion = 0\n\tfilemode = true\n\tbare = false\n"
+                             "[remote \"origin\"]\n\turl = %s\n\tfetch = +refs/heads/*:refs/remotes/origin/*\n"
+                             "[branch \"%s\"]\n\tremote = origin\n\tmerge = %s\n", url, short_name, branch->name);
+    } else {
+        if (adv->has_head && !adv->head_target) { // detached
+            char hex[41];
+            hash_to_hex(hex, adv->head);
+            status |= write_text(".git/HEAD", "%s\n", hex);
+        } else {
+            status |= write_text(".git/HEAD", "ref: %s\n", adv->head_target ? adv->head_target : "refs/heads/main");
+        }
+        status |= write_text(".git/config",
+                             "[core]\n\trepositoryformatversion = 0\n\tfilemode = true\n\tbare = false\n"
+                             "[remote \"origin\"]\n\turl = %s\n\tfetch = +refs/heads/*:refs/remotes/origin/*\n", url);
+    }
+    return status ? -1 : 0;
+}
+
+
+static int checkout_head(const unsigned char commit[20], int threads) {
+    unsigned char tree[20];
+    if (peel_to_tree(commit, tree) < 0) return -1;
+
+    StatCache cache;
+    stat_cache_init(&cache);
+    TraceSpan span;
+    trace_begin(&span, "checkout");
+    int status = checkout_tree(tree, threads, &cache);
+    trace_end(&span);
+    // Best effort, as in write-tree: without it the first write-tree rehashes everything
+    if (status == 0) stat_cache_write(&cache, STAT_CACHE_FILE);
+    stat_cache_free(&cache);
+    return status;
+}
+
+
+static int init_layout(void) {
+    static const char *const dirs[] = { ".git", ".git/objects", ".git/objects/pack", ".git/refs",
+                                        ".git/refs/heads", ".git/refs/tags" };
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        if (mkdir(dirs[i], 0755) < 0) { perror(dirs[i]); return -1; }
+    }
+    return 0;
+}
+
+
+// "/a/b/repo.git" and "/a/b/repo/.git" both clone into "repo"
+static void guess_dir(const char *source, char *dir, size_t size) {
+    size_t len = strlen(source);
+    while (len > 1 && source[len - 1] == '/') len--;
+    if (len > 5 && strncmp(source + len - 5, "/.git", 5) == 0) len -= 5;
+    else if (len > 4 && strncmp(source + len - 4, ".git", 4) == 0) len -= 4;
+    while (len > 1 && source[len - 1] == '/') len--;
+    size_t start = len;
+    while (start > 0 && source[start - 1] != '/') start--;
+    snprintf(dir, size, "%.*s", (int)(len - start), source + start);
+}
+
+
+static int dir_is_empty(const char *path) {
+    DIR *d = opendir(path);
+    if (!d) return 0;
+    struct dirent *dent;
+    int empty = 1;
+    while (empty && (dent = readdir(d)) != NULL) {
+        empty = strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0;
+    }
+    closedir(d);
+    return empty;
+}
+
+
+static int keep_top;  // remove_entry spares the directory the walk started from
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st; (void)flag;
+    if (ftw->level > 0 || !keep_top) remove(path);
+    return 0;
+}
+
+
+int clone_repository(const char *source, const char *dir, const CloneOptions *opts) {
+    char url[PATH_MAX], dir_buf[PATH_MAX];
+    if (strncmp(source, "file://", 7) == 0) source += 7;
+    if (!realpath(source, url)) { perror(source); return -1; }
+    if (!dir) {
+        guess_dir(source, dir_buf, sizeof(dir_buf));
+        dir = dir_buf;
+    }
+
+    int created = mkdir(dir, 0777) == 0;
+    if (!created && (errno != EEXIST || !dir_is_empty(dir))) {
+        if (errno == EEXIST) fprintf(stderr, "fatal: destination path '%s' already exists and is not an empty directory.\n", dir);
+        else perror(dir);
+        return -1;
+    }
+    int cwd = open(".", O_RDONLY | O_DIRECTORY);
+    if (cwd < 0) { perror("open ."); goto cleanup; }
+    if (chdir(dir) < 0) { perror(dir); goto cleanup; }
+    if (!opts->quiet) fprintf(stderr, "Cloning into '%s'...\n", dir);
+
+    // A dead upload-pack shows up as EPIPE from write(), not as a signal
+    signal(SIGPIPE, SIG_IGN);
+
+    int ret = -1;
+    Advertisement adv = { 0 };
+    static PktReader r;
+    r = (PktReader){ .fd = -1, .quiet = opts->quiet };
+    int to = -1;
+    pid_t pid = -1;
+    if (init_layout() < 0) goto out;
+    pid = start_upload_pack(opts->upload_pack ? opts->upload_pack : "git upload-pack", url, &to, &r.fd);
+    if (pid < 0) goto out;
+
+    TraceSpan span;
+    trace_begin(&span, "advertisement");
+    int status = read_advertisement(&r, &adv);
+    trace_end(&span);
+    if (status < 0) goto out;
+
+    if (adv.count == 0 && !adv.has_head) {
+        // Nothing to fetch: hang up and leave an empty repository
+        if (write_all(to, "0000", 4) < 0) { perror("write to upload-pack"); goto out; }
+        fprintf(stderr, "warning: You appear to have cloned an empty repository.\n");
+    } else {
+        r.sideband = has_cap(adv.caps, "side-band-64k");
+        if (send_request(to, &adv, r.sideband, opts->quiet) < 0) goto out;
+        if (pkt_read_line(&r) != 1 || strcmp(r.line, "NAK") != 0) {
+            fprintf(stderr, "fatal: protocol error: expected NAK\n");
+            goto out;
+        }
+        trace_begin(&span, "receive pack");
+        status = fetch_pack(&r, opts);
+        trace_end(&span);
+        if (status < 0) goto out;
+    }
+    close(to);
+    to = -1;
+    close(r.fd);
+    r.fd = -1;
+    status = finish_upload_pack(pid);
+    pid = -1;
+    if (status < 0) goto out;
+
+    const RemoteRef *branch = default_branch(&adv);
+    if (write_refs(&adv, branch, url) < 0) goto out;
+    if (!opts->no_checkout && (branch || (adv.has_head && !adv.head_target))) {
+        if (checkout_head(branch ? branch->raw_hash : adv.head, opts->threads) < 0) goto out;
+    }
+    ret = 0;
+
+out:
+    if (to >= 0) close(to);
+    if (r.fd >= 0) close(r.fd);
+    if (pid > 0) finish_upload_pack(pid);
+    free_advertisement(&adv);
+    if (fchdir(cwd) < 0) perror("fchdir");
+    close(cwd);
+    if (ret == 0) return 0;
+
+cleanup:
+    // An empty directory that was already there stays, emptied again
+    keep_top = !created;
+    nftw(dir, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    return -1;
+}
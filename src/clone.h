@@ -0,0 +1,30 @@
+#ifndef CLONE_H
+#define CLONE_H
+
+#include <stddef.h>
+
+// Clone over git's smart protocol (version 0) from an upload-pack process
+// started on a local repository, so no network is involved. The pack is
+// parsed and hashed while it is still coming down the pipe (see
+// index_pack_stream), its deltas are then resolved on a thread pool, and the
+// work tree is checked out by a pool as well (see checkout_tree).
+//
+// The new repository gets the remote's branches as refs/remotes/origin/*
+// and its tags in .git/packed-refs, the remote's default branch as a local
+// branch with HEAD pointing at it, and a stat cache describing the fresh
+// work tree.
+
+typedef struct {
+    const char *upload_pack;   // run by /bin/sh with the repository appended; NULL: "git upload-pack"
+    int threads;               // for delta resolution and checkout
+    size_t max_cache;          // delta base cache, as for index-pack
+    int no_checkout;
+    int quiet;
+} CloneOptions;
+
+// `dir` may be NULL to derive it from the source's name as git does. Leaves
+// the process in the current directory it started in. Returns 0, or -1 on
+// error (reported), in which case a directory it created is removed again.
+int clone_repository(const char *source, const char *dir, const CloneOptions *opts);
+
+#endif
@@ -0,0 +1,675 @@
+#define _GNU_SOURCE // memrchr
+#include "commit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "commit_graph.h"
+#include "hash.h"
+#include "object_store.h"
+
+#define COMMIT_BLOCK 1024     // nodes per allocation
+#define PARENT_BLOCK 4096     // parent pointers per allocation
+#define MAX_TAG_DEPTH 8       // tags of tags of ... before we give up
+
+// Walk marks
+#define SEEN    (1u << 0)
+#define PARENT1 (1u << 1)
+#define PARENT2 (1u << 2)
+#define STALE   (1u << 3)
+#define RESULT  (1u << 4)
+
+struct QueueItem {
+    Commit *commit;
+    uint64_t order;
+};
+
+typedef struct CommitBlock {
+    struct CommitBlock *next;
+    size_t used;
+    Commit items[COMMIT_BLOCK];
+} CommitBlock;
+
+typedef struct ParentBlock {
+    struct ParentBlock *next;
+    size_t used, cap;
+    Commit *items[];
+} ParentBlock;
+
+// Every node of this run, and where parsing gets its data
+static struct {
+    Commit **slots;            // open addressing on the first bytes of the name
+    size_t cap, count;
+    CommitBlock *blocks;
+    ParentBlock *parent_blocks;
+    CommitGraph graph;
+    int graph_state;           // 0 not opened yet, 1 open, -1 none
+    Commit **by_pos;           // graph position -> node, filled as parents are met
+    ObjectReader reader;
+    int reader_ready;
+    uint32_t epoch;
+} store;
+
+
+static void open_graph(void) {
+    store.graph_state = -1;
+    if (commit_graph_open(&store.graph, COMMIT_GRAPH_FILE) != 0) return; // corrupt ones are reported
+    store.by_pos = calloc(store.graph.count ? store.graph.count : 1, sizeof(Commit *));
+    if (!store.by_pos) {
+        commit_graph_close(&store.graph);
+        return;
+    }
+    store.graph_state = 1;
+}
+
+
+static size_t slot_of(const unsigned char raw_hash[20], size_t cap) {
+    uint64_t h;
+    memcpy(&h, raw_hash, sizeof(h)); // object names are uniformly distributed already
+    return (size_t)h & (cap - 1);
+}
+
+
+static int grow_table(void) {
+    size_t cap = store.cap ? store.cap * 2 : 1024;
+    Commit **slots = calloc(cap, sizeof(Commit *));
+    if (!slots) { perror("calloc"); return -1; }
+    for (size_t i = 0; i < store.cap; i++) {
+        Commit *c = store.slots[i];
+        if (!c) continue;
+        size_t s = slot_of(c->raw_hash, cap);
+        while (slots[s]) s = (s + 1) & (cap - 1);
+        slots[s] = c;
+    }
+    free(store.slots);
+    store.slots = slots;
+    store.cap = cap;
+    return 0;
+}
+
+
+// Finds or creates the node; graph_pos is its position when the caller
+// already knows it, else UINT32_MAX to search the graph
+static Commit *get_node(const unsigned char raw_hash[20], uint32_t graph_pos) {
+    if (store.graph_state == 0) open_graph();
+    if ((store.count + 1) * 2 > store.cap && grow_table() < 0) return NULL;
+
+    size_t s = slot_of(raw_hash, store.cap);
+    for (; store.slots[s]; s = (s + 1) & (store.cap - 1)) {
+        if (memcmp(store.slots[s]->raw_hash, raw_hash, 20) == 0) return store.slots[s];
+    }
+
+    if (!store.blocks || store.blocks->used == COMMIT_BLOCK) {
+        CommitBlock *block = malloc(sizeof(CommitBlock));
+        if (!block) { perror("malloc"); return NULL; }
+        block->next = store.blocks;
+        block->used = 0;
+        store.blocks = block;
+    }
+    Commit *c = &store.blocks->items[store.blocks->used++];
+    memset(c, 0, sizeof(*c));
+    memcpy(c->raw_hash, raw_hash, 20);
+    c->generation = GENERATION_INFINITY;
+    c->graph_pos = UINT32_MAX;
+    if (graph_pos != UINT32_MAX) {
+        c->graph_pos = graph_pos;
+    } else if (store.graph_state == 1) {
+        uint32_t pos;
+        if (commit_graph_find(&store.graph, raw_hash, &pos)) c->graph_pos = pos;
+    }
+    if (c->graph_pos != UINT32_MAX) store.by_pos[c->graph_pos] = c;
+
+    store.slots[s] = c;
+    store.count++;
+    return c;
+}
+
+
+Commit *lookup_commit(const unsigned char raw_hash[20]) {
+    return get_node(raw_hash, UINT32_MAX);
+}
+
+
+// A parent named by its graph position: no hashing, no search
+static Commit *commit_at(uint32_t pos) {
+    if (store.by_pos[pos]) return store.by_pos[pos];
+    return get_node(commit_graph_name(&store.graph, pos), pos);
+}
+
+
+static Commit **alloc_parents(size_t count) {
+    ParentBlock *block = store.parent_blocks;
+    if (!block || block->cap - block->used < count) {
+        size_t cap = count > PARENT_BLOCK ? count : PARENT_BLOCK;
+        block = malloc(sizeof(ParentBlock) + cap * sizeof(Commit *));
+        if (!block) { perror("malloc"); return NULL; }
+        block->next = store.parent_blocks;
+        block->used = 0;
+        block->cap = cap;
+        store.parent_blocks = block;
+    }
+    Commit **parents = block->items + block->used;
+    block->used += count;
+    return parents;
+}
+
+
+static int parse_from_graph(Commit *c) {
+    CommitGraphEntry entry;
+    uint32_t small[8], *positions = small;
+    int n = commit_graph_entry(&store.graph, c->graph_pos, &entry, small, 8);
+    if (n > 8) { // octopus merge
+        positions = malloc((size_t)n * sizeof(uint32_t));
+        if (!positions) { perror("malloc"); return -1; }
+        n = commit_graph_entry(&store.graph, c->graph_pos, &entry, positions, (size_t)n);
+    }
+    int ret = -1;
+    if (n < 0) goto out;
+
+    c->parents = alloc_parents((size_t)n);
+    if (!c->parents && n > 0) goto out;
+    for (int i = 0; i < n; i++) {
+        if (!(c->parents[i] = commit_at(positions[i]))) goto out;
+    }
+    c->parent_count = (uint32_t)n;
+    memcpy(c->tree, entry.tree, 20);
+    c->generation = entry.generation;
+    c->date = entry.date;
+    c->parsed = 1;
+    ret = 0;
+
+out:
+    if (positions != small) free(positions);
+    return ret;
+}
+
+
+// "tree", then "parent" lines, then on to the committer's timestamp
+static int parse_buffer(Commit *c, const unsigned char *data, size_t size) {
+    const char *p = (const char *)data, *end = p + size;
+    char hex[41];
+    hex[40] = '\0';
+    if (size < 46 || memcmp(p, "tree ", 5) != 0 || p[45] != '\n') return -1;
+    memcpy(hex, p + 5, 40);
+    if (hex_to_hash(c->tree, hex) < 0) return -1;
+    p += 46;
+
+    const char *parents = p;
+    size_t count = 0;
+    while (end - p >= 48 && memcmp(p, "parent ", 7) == 0 && p[47] == '\n') {
+        count++;
+        p += 48;
+    }
+    c->parents = alloc_parents(count);
+    if (!c->parents && count > 0) return -1;
+    for (size_t i = 0; i < count; i++) {
+        unsigned char raw_hash[20];
+        memcpy(hex, parents + i * 48 + 7, 40);
+        if (hex_to_hash(raw_hash, hex) < 0 || !(c->parents[i] = lookup_commit(raw_hash))) return -1;
+    }
+    c->parent_count = (uint32_t)count;
+
+    // "committer <name> <email> <time> <tz>", among the headers before the blank line
+    c->date = 0;
+    while (p < end && *p != '\n') {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) eol = end;
+        if (eol - p > 10 && memcmp(p, "committer ", 10) == 0) {
+            const char *gt = memrchr(p, '>', (size_t)(eol - p));
+            if (gt) c->date = strtoll(gt + 1, NULL, 10);
+            break;
+        }
+        p = eol + 1;
+    }
+    c->generation = GENERATION_INFINITY;
+    c->parsed = 1;
+    return 0;
+}
+
+
+// Reads the object through the shared reader; *data is valid until the next call
+static int read_with_reader(const unsigned char raw_hash[20], ObjectType *type,
+                            const unsigned char **data, size_t *size) {
+    if (!store.reader_ready) {
+        object_reader_init(&store.reader);
+        store.reader_ready = 1;
+    }
+    return object_reader_read(&store.reader, raw_hash, type, data, size);
+}
+
+
+int parse_commit(Commit *c) {
+    if (c->parsed) return 0;
+    if (c->graph_pos != UINT32_MAX) return parse_from_graph(c);
+
+    ObjectType type;
+    const unsigned char *data;
+    size_t size;
+    char hex[41];
+    hash_to_hex(hex, c->raw_hash);
+    if (read_with_reader(c->raw_hash, &type, &data, &size) < 0) {
+        fprintf(stderr, "error: unable to read commit %s\n", hex);
+        return -1;
+    }
+    if (type != OBJ_COMMIT) {
+        fprintf(stderr, "error: object %s is a %s, not a commit\n", hex, object_type_name(type));
+        return -1;
+    }
+    if (parse_buffer(c, data, size) < 0) {
+        fprintf(stderr, "error: corrupt commit %s\n", hex);
+        return -1;
+    }
+    return 0;
+}
+
+
+Commit *lookup_commit_reference(const unsigned char raw_hash[20]) {
+    unsigned char name[20];
+    memcpy(name, raw_hash, 20);
+    char hex[41];
+    for (int depth = 0; depth < MAX_TAG_DEPTH; depth++) {
+        if (store.graph_state == 0) open_graph();
+        uint32_t pos;
+        if (store.graph_state == 1 && commit_graph_find(&store.graph, name, &pos)) {
+            Commit *c = commit_at(pos);
+            return c && parse_commit(c) == 0 ? c : NULL;
+        }
+
+        ObjectType type;
+        const unsigned char *data;
+        size_t size;
+        hash_to_hex(hex, name);
+        if (read_with_reader(name, &type, &data, &size) < 0) {
+            fprintf(stderr, "error: unable to read object %s\n", hex);
+            return NULL;
+        }
+        if (type == OBJ_COMMIT) {
+            Commit *c = lookup_commit(name);
+            if (!c || c->parsed) return c;
+            if (parse_buffer(c, data, size) < 0) {
+                fprintf(stderr, "error: corrupt commit %s\n", hex);
+                return NULL;
+            }
+            return c;
+        }
+        // An annotated tag opens with "object <hex>\n"
+        if (type != OBJ_TAG || size < 48 || memcmp(data, "object ", 7) != 0 || data[47] != '\n') break;
+        char target[41];
+        memcpy(target, data + 7, 40);
+        target[40] = '\0';
+        if (hex_to_hash(name, target) < 0) break;
+    }
+    hash_to_hex(hex, raw_hash);
+    fprintf(stderr, "error: %s does not name a commit\n", hex);
+    return NULL;
+}
+
+
+void commits_release(void) {
+    while (store.blocks) {
+        CommitBlock *next = store.blocks->next;
+        free(store.blocks);
+        store.blocks = next;
+    }
+    while (store.parent_blocks) {
+        ParentBlock *next = store.parent_blocks->next;
+        free(store.parent_blocks);
+        store.parent_blocks = next;
+    }
+    free(store.slots);
+    free(store.by_pos);
+    if (store.graph_state == 1) commit_graph_close(&store.graph);
+    if (store.reader_ready) object_reader_release(&store.reader);
+    memset(&store, 0, sizeof(store));
+}
+
+
+int commit_bloom_filter(const Commit *c, BloomFilter *filter) {
+    if (c->graph_pos == UINT32_MAX || store.graph_state != 1) return 0;
+    return commit_graph_bloom(&store.graph, c->graph_pos, filter);
+}
+
+
+int commit_graph_has_filters(void) {
+    if (store.graph_state == 0) open_graph();
+    return store.graph_state == 1 && store.graph.bloom_index != NULL;
+}
+
+
+static uint32_t get_flags(const Commit *c, uint32_t epoch) {
+    return c->epoch == epoch ? c->flags : 0;
+}
+
+
+static void add_flags(Commit *c, uint32_t epoch, uint32_t flags) {
+    if (c->epoch != epoch) {
+        c->epoch = epoch;
+        c->flags = 0;
+    }
+    c->flags |= flags;
+}
+
+
+// Whether a leaves the queue before b
+static int queue_before(const struct QueueItem *a, const struct QueueItem *b) {
+    if (a->commit->date != b->commit->date) return a->commit->date > b->commit->date;
+    return a->order < b->order;
+}
+
+
+static int queue_push(CommitQueue *q, Commit *c) {
+    if (q->count == q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : 64;
+        struct QueueItem *grown = realloc(q->items, cap * sizeof(struct QueueItem));
+        if (!grown) { perror("realloc"); return -1; }
+        q->items = grown;
+        q->cap = cap;
+    }
+    size_t i = q->count++;
+    struct QueueItem item = { c, q->inserted++ };
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!queue_before(&item, &q->items[parent])) break;
+        q->items[i] = q->items[parent];
+        i = parent;
+    }
+    q->items[i] = item;
+    return 0;
+}
+
+
+static Commit *queue_pop(CommitQueue *q) {
+    if (q->count == 0) return NULL;
+    Commit *top = q->items[0].commit;
+    struct QueueItem last = q->items[--q->count];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= q->count) break;
+        if (child + 1 < q->count && queue_before(&q->items[child + 1], &q->items[child])) child++;
+        if (!queue_before(&q->items[child], &last)) break;
+        q->items[i] = q->items[child];
+        i = child;
+    }
+    if (q->count > 0) q->items[i] = last;
+    return top;
+}
+
+
+void rev_walk_init(RevWalk *walk) {
+    memset(walk, 0, sizeof(*walk));
+    walk->epoch = ++store.epoch;
+}
+
+
+int rev_walk_set_paths(RevWalk *walk, const char *const *paths, size_t count) {
+    walk->prune.recursive = 1;
+    walk->prune.paths = paths;
+    walk->prune.path_count = count;
+
+    // Like git, filters are consulted for a single path only
+    if (count != 1) return 0;
+    const char *path = paths[0];
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/') len--;
+    if (len == 0) return 0;
+    size_t keys = 1;
+    for (size_t i = 0; i < len; i++) keys += path[i] == '/';
+    walk->bloom_keys = malloc(keys * sizeof(BloomKey));
+    if (!walk->bloom_keys) { perror("malloc"); return -1; }
+    bloom_key_init(&walk->bloom_keys[0], path, len);
+    walk->bloom_key_count = 1;
+    for (size_t i = len; i-- > 0; ) {
+        if (path[i] == '/') bloom_key_init(&walk->bloom_keys[walk->bloom_key_count++], path, i);
+    }
+    return 0;
+}
+
+
+int rev_walk_push(RevWalk *walk, Commit *c) {
+    if (get_flags(c, walk->epoch) & SEEN) return 0;
+    if (parse_commit(c) < 0) return -1;
+    add_flags(c, walk->epoch, SEEN);
+    return queue_push(&walk->queue, c);
+}
+
+
+static int first_change(const TreeChange *change, void *arg) {
+    (void)change;
+    (void)arg;
+    return 1; // one is enough
+}
+
+
+// Returns 1 when the paths are the same in both trees (old_tree NULL: empty),
+// 0 when not, -1 on error
+static int same_paths(const RevWalk *walk, const unsigned char *old_tree, const unsigned char *new_tree) {
+    int status = diff_trees(old_tree, new_tree, &walk->prune, first_change, NULL);
+    return status < 0 ? -1 : status == 0;
+}
+
+
+// A filter without one of the keys proves the path unchanged from the first parent
+static int filter_rules_out(const RevWalk *walk, const Commit *c) {
+    BloomFilter filter;
+    if (walk->bloom_key_count == 0 || !commit_bloom_filter(c, &filter)) return 0;
+    for (size_t i = 0; i < walk->bloom_key_count; i++) {
+        if (!bloom_filter_contains(&filter, &walk->bloom_keys[i])) return 1;
+    }
+    return 0;
+}
+
+
+// git's try_to_simplify_commit: returns 1 with *parent set to the first
+// parent c is TREESAME to (UINT32_MAX for a root with nothing under the
+// paths), 0 when it changes them against every parent, -1 on error
+static int find_treesame(const RevWalk *walk, Commit *c, uint32_t *parent) {
+    if (c->parent_count == 0) {
+        *parent = UINT32_MAX;
+        return same_paths(walk, NULL, c->tree);
+    }
+    for (uint32_t i = 0; i < c->parent_count; i++) {
+        Commit *p = c->parents[i];
+        int same = i == 0 && filter_rules_out(walk, c);
+        if (!same) {
+            if (parse_commit(p) < 0) return -1;
+            if ((same = same_paths(walk, p->tree, c->tree)) < 0) return -1;
+        }
+        if (same) {
+            *parent = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+int rev_walk_next(RevWalk *walk, Commit **commit) {
+    for (;;) {
+        Commit *c = queue_pop(&walk->queue);
+        if (!c) return 0;
+        if (walk->prune.path_count) {
+            uint32_t same;
+            int status = find_treesame(walk, c, &same);
+            if (status < 0) return -1;
+            if (status == 1) {
+                // Nothing to show here, and history through the other parents is irrelevant
+                if (same != UINT32_MAX && rev_walk_push(walk, c->parents[same]) < 0) return -1;
+                continue;
+            }
+        }
+        for (uint32_t i = 0; i < c->parent_count; i++) {
+            if (rev_walk_push(walk, c->parents[i]) < 0) return -1;
+        }
+        *commit = c;
+        return 1;
+    }
+}
+
+
+void rev_walk_release(RevWalk *walk) {
+    free(walk->queue.items);
+    free(walk->bloom_keys);
+    memset(walk, 0, sizeof(*walk));
+}
+
+
+static int queue_has_nonstale(const CommitQueue *q, uint32_t epoch) {
+    for (size_t i = 0; i < q->count; i++) {
+        if (!(get_flags(q->items[i].commit, epoch) & STALE)) return 1;
+    }
+    return 0;
+}
+
+
+// git's paint_down_to_common: walk down from both sides, newest first, until
+// every commit left in the queue is below a common ancestor already found.
+// Candidates go into *found. Like git with topological-level generations,
+// the queue goes by date: levels would also be a valid order, but candidates
+// with equal dates would then come out in a different order than git's.
+static int paint_down(Commit *a, Commit *b, Commit ***found, size_t *count) {
+    uint32_t epoch = ++store.epoch;
+    CommitQueue queue = { 0 };
+    size_t cap = 0;
+    int ret = -1;
+    *found = NULL;
+    *count = 0;
+
+    add_flags(a, epoch, PARENT1);
+    add_flags(b, epoch, PARENT2);
+    if (queue_push(&queue, a) < 0 || queue_push(&queue, b) < 0) goto out;
+
+    while (queue_has_nonstale(&queue, epoch)) {
+        Commit *c = queue_pop(&queue);
+        uint32_t flags = get_flags(c, epoch) & (PARENT1 | PARENT2 | STALE);
+        if (flags == (PARENT1 | PARENT2)) {
+            if (!(get_flags(c, epoch) & RESULT)) {
+                if (*count == cap) {
+                    cap = cap ? cap * 2 : 4;
+                    Commit **grown = realloc(*found, cap * sizeof(Commit *));
+                    if (!grown) { perror("realloc"); goto out; }
+                    *found = grown;
+                }
+                (*found)[(*count)++] = c;
+                add_flags(c, epoch, RESULT);
+            }
+            flags |= STALE; // its ancestors can't be best any more
+        }
+        for (uint32_t i = 0; i < c->parent_count; i++) {
+            Commit *p = c->parents[i];
+            if ((get_flags(p, epoch) & flags) == flags) continue;
+            if (parse_commit(p) < 0) goto out;
+            add_flags(p, epoch, flags);
+            if (queue_push(&queue, p) < 0) goto out;
+        }
+    }
+
+    // Keep the ones no other candidate's side reached after they were found
+    size_t kept = 0;
+    for (size_t i = 0; i < *count; i++) {
+        if (!(get_flags((*found)[i], epoch) & STALE)) (*found)[kept++] = (*found)[i];
+    }
+    *count = kept;
+    ret = 0;
+
+out:
+    free(queue.items);
+    if (ret < 0) {
+        free(*found);
+        *found = NULL;
+        *count = 0;
+    }
+    return ret;
+}
+
+
+static int cmp_by_date(const void *a, const void *b) {
+    const Commit *x = *(Commit *const *)a, *y = *(Commit *const *)b;
+    return (x->date < y->date) - (x->date > y->date);
+}
+
+
+int merge_bases(Commit *a, Commit *b, Commit ***bases, size_t *count) {
+    if (parse_commit(a) < 0 || parse_commit(b) < 0) return -1;
+    if (a == b) {
+        *bases = malloc(sizeof(Commit *));
+        if (!*bases) { perror("malloc"); return -1; }
+        (*bases)[0] = a;
+        *count = 1;
+        return 0;
+    }
+    if (paint_down(a, b, bases, count) < 0) return -1;
+
+    // With criss-cross merges a candidate can still be an ancestor of another
+    size_t kept = 0;
+    for (size_t i = 0; i < *count; i++) {
+        int redundant = 0;
+        for (size_t j = 0; j < *count && !redundant; j++) {
+            if (j == i || !(*bases)[j]) continue;
+            int status = commit_is_ancestor((*bases)[i], (*bases)[j]);
+            if (status < 0) {
+                free(*bases);
+                return -1;
+            }
+            redundant = status;
+        }
+        if (redundant) (*bases)[i] = NULL;
+    }
+    for (size_t i = 0; i < *count; i++) {
+        if ((*bases)[i]) (*bases)[kept++] = (*bases)[i];
+    }
+    *count = kept;
+
+    // Newest first; equal dates keep the order they were found in
+    for (size_t i = 1; i < *count; i++) {
+        for (size_t j = i; j > 0 && cmp_by_date(&(*bases)[j - 1], &(*bases)[j]) > 0; j--) {
+            Commit *t = (*bases)[j];
+            (*bases)[j] = (*bases)[j - 1];
+            (*bases)[j - 1] = t;
+        }
+    }
+    return 0;
+}
+
+
+int commit_is_ancestor(Commit *a, Commit *b) {
+    if (a == b) return 1;
+    if (parse_commit(a) < 0 || parse_commit(b) < 0) return -1;
+
+    // Everything below a's generation is too low to reach it. A commit
+    // outside the graph has infinite generation, and the graph holds only
+    // commits whose ancestors are all in it too, so that still holds.
+    uint32_t epoch = ++store.epoch;
+    Commit **stack = NULL;
+    size_t count = 0, cap = 0;
+    int ret = 0;
+    add_flags(b, epoch, SEEN);
+    Commit *c = b;
+    for (;;) {
+        if (c == a) {
+            ret = 1;
+            break;
+        }
+        if (c->generation >= a->generation) {
+            for (uint32_t i = 0; i < c->parent_count; i++) {
+                Commit *p = c->parents[i];
+                if (get_flags(p, epoch) & SEEN) continue;
+                if (parse_commit(p) < 0) { ret = -1; break; }
+                add_flags(p, epoch, SEEN);
+                if (count == cap) {
+                    cap = cap ? cap * 2 : 64;
+                    Commit **grown = realloc(stack, cap * sizeof(Commit *));
+                    if (!grown) { perror("realloc"); ret = -1; break; }
+                    stack = grown;
+                }
+                stack[count++] = p;
+            }
+            if (ret < 0) break;
+        }
+        if (count == 0) break;
+        c = stack[--count];
+    }
+    free(stack);
+    return ret;
+}
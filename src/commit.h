@@ -0,0 +1,93 @@
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bloom.h"
+#include "diff_tree.h"
+
+// Parsed commits for history walks. Each commit named during a run gets one
+// node, found again by name through a hash table, and parents point straight
+// at their nodes. Parsing fills a node from the commit-graph when the commit
+// is in it (see commit_graph.h) and only otherwise inflates the object.
+//
+// One walk or query runs at a time: each starts a new epoch, and marks left
+// on nodes by earlier ones are ignored instead of being cleared.
+
+#define GENERATION_INFINITY UINT32_MAX   // not in the commit-graph
+
+typedef struct Commit {
+    unsigned char raw_hash[20];
+    unsigned char tree[20];
+    struct Commit **parents;
+    uint32_t parent_count;
+    uint32_t generation;   // from the commit-graph, else GENERATION_INFINITY
+    uint32_t graph_pos;    // UINT32_MAX when not in the commit-graph
+    uint32_t epoch;        // flags belong to this walk
+    uint32_t flags;
+    int parsed;
+    int64_t date;          // committer time
+} Commit;
+
+// The node for raw_hash, created unparsed the first time; NULL when out of
+// memory (reported)
+Commit *lookup_commit(const unsigned char raw_hash[20]);
+
+// The commit raw_hash names, after peeling annotated tags, parsed. Returns
+// NULL when it is missing or no commit (reported).
+Commit *lookup_commit_reference(const unsigned char raw_hash[20]);
+
+// Returns 0, or -1 when the object is missing or corrupt (reported)
+int parse_commit(Commit *commit);
+
+// The commit's changed-path filter from the commit-graph: returns 1 and sets
+// *filter, or 0 when there is none for it
+int commit_bloom_filter(const Commit *commit, BloomFilter *filter);
+
+// Whether the commit-graph carries changed-path filters
+int commit_graph_has_filters(void);
+
+// Drops every node and closes the commit-graph; earlier Commit pointers die
+void commits_release(void);
+
+// Heap of commits, newest committer date first; ties leave in insertion order
+typedef struct {
+    struct QueueItem *items;
+    size_t count, cap;
+    uint64_t inserted;
+} CommitQueue;
+
+// A walk over everything reachable from the pushed commits, each returned
+// once, newest committer date first (git's default rev-list order)
+typedef struct {
+    CommitQueue queue;
+    uint32_t epoch;
+    DiffOptions prune;        // path_count 0: no path limiting
+    BloomKey *bloom_keys;     // the one path and its leading directories
+    size_t bloom_key_count;
+} RevWalk;
+
+void rev_walk_init(RevWalk *walk);
+
+// Limits the walk to commits that change something under paths, with git's
+// default history simplification: a commit whose paths are the same as in
+// one of its parents (TREESAME) is not returned, and only that parent is
+// followed. For a single path the parent comparison asks the commit's Bloom
+// filter first. paths must outlive the walk; call before the first
+// rev_walk_next(). Returns 0, or -1 when out of memory (reported).
+int rev_walk_set_paths(RevWalk *walk, const char *const *paths, size_t count);
+
+int rev_walk_push(RevWalk *walk, Commit *commit);  // 0, or -1 on error (reported)
+int rev_walk_next(RevWalk *walk, Commit **commit); // 1 with the next one, 0 at the end, -1 on error
+void rev_walk_release(RevWalk *walk);
+
+// The best common ancestors of a and b, newest first, in a malloc'd array.
+// Returns 0, or -1 on error (reported).
+int merge_bases(Commit *a, Commit *b, Commit ***bases, size_t *count);
+
+// Returns 1 when a is reachable from b (or is b), 0 when not, -1 on error.
+// Generation numbers prune the search to commits that could still reach a.
+int commit_is_ancestor(Commit *a, Commit *b);
+
+#endif
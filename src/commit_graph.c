@@ -0,0 +1,500 @@
+#include "commit_graph.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "commit.h"
+#include "hash.h"
+#include "refs.h"
+#include "trace.h"
+
+#define GRAPH_HEADER_SIZE 8         // "CGPH", version, hash version, chunk count, base graphs
+#define CHUNK_ENTRY_SIZE 12         // chunk id + 64-bit offset
+#define CDAT_SIZE (20 + 4 + 4 + 8)  // tree, parent 1, parent 2, generation and date
+#define NO_PARENT 0x70000000u
+#define EXTRA_EDGES 0x80000000u     // parent 2 is an index into EDGE instead
+#define LAST_EDGE 0x80000000u
+
+#define CHUNK_OIDF 0x4f494446u      // "OIDF"
+#define CHUNK_OIDL 0x4f49444cu      // "OIDL"
+#define CHUNK_CDAT 0x43444154u      // "CDAT"
+#define CHUNK_EDGE 0x45444745u      // "EDGE"
+#define CHUNK_BIDX 0x42494458u      // "BIDX"
+#define CHUNK_BDAT 0x42444154u      // "BDAT"
+#define BDAT_HEADER_SIZE 12         // hash version, hashes per key, bits per entry
+
+
+static uint32_t get_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+
+static uint64_t get_be64(const unsigned char *p) {
+    return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+
+static unsigned char *put_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+    return p + 4;
+}
+
+
+static unsigned char *put_be64(unsigned char *p, uint64_t v) {
+    return put_be32(put_be32(p, (uint32_t)(v >> 32)), (uint32_t)v);
+}
+
+
+int commit_graph_open(CommitGraph *graph, const char *path) {
+    memset(graph, 0, sizeof(*graph));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) return 1;
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) { perror(path); close(fd); return -1; }
+    if (st.st_size < GRAPH_HEADER_SIZE + CHUNK_ENTRY_SIZE + 20) {
+        close(fd);
+        fprintf(stderr, "error: %s is too short\n", path);
+        return -1;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping stays valid
+    if (map == MAP_FAILED) { perror("mmap"); return -1; }
+    graph->map = map;
+    graph->size = (size_t)st.st_size;
+
+    const unsigned char *p = graph->map;
+    int chunks = p[6];
+    if (memcmp(p, "CGPH", 4) != 0 || p[4] != 1 || p[5] != 1 || p[7] != 0 ||
+        GRAPH_HEADER_SIZE + (size_t)(chunks + 1) * CHUNK_ENTRY_SIZE + 20 > graph->size) {
+        fprintf(stderr, "error: %s is not a single version 1 SHA-1 commit-graph\n", path);
+        goto fail;
+    }
+
+    // Chunks lie back to back, each up to the next one's offset
+    size_t oidl_len = 0, cdat_len = 0, bidx_len = 0;
+    const unsigned char *bdat = NULL;
+    size_t bdat_len = 0;
+    for (int i = 0; i < chunks; i++) {
+        const unsigned char *e = p + GRAPH_HEADER_SIZE + (size_t)i * CHUNK_ENTRY_SIZE;
+        uint64_t start = get_be64(e + 4), end = get_be64(e + CHUNK_ENTRY_SIZE + 4);
+        if (start > end || end > graph->size - 20) {
+            fprintf(stderr, "error: %s: bad chunk offsets\n", path);
+            goto fail;
+        }
+        const unsigned char *data = p + start;
+        size_t len = (size_t)(end - start);
+        switch (get_be32(e)) {
+        case CHUNK_OIDF: if (len == 256 * 4) graph->fanout = data; break;
+        case CHUNK_OIDL: graph->names = data; oidl_len = len; break;
+        case CHUNK_CDAT: graph->data = data; cdat_len = len; break;
+        case CHUNK_EDGE: graph->edges = data; graph->edge_count = len / 4; break;
+        case CHUNK_BIDX: graph->bloom_index = data; bidx_len = len; break;
+        case CHUNK_BDAT: bdat = data; bdat_len = len; break;
+        default: break; // GDAT and friends: we manage without
+        }
+    }
+    if (!graph->fanout || !graph->names || !graph->data) {
+        fprintf(stderr, "error: %s lacks a required chunk\n", path);
+        goto fail;
+    }
+    graph->count = get_be32(graph->fanout + 255 * 4);
+    if (oidl_len != (size_t)graph->count * 20 || cdat_len != (size_t)graph->count * CDAT_SIZE) {
+        fprintf(stderr, "error: %s: chunk sizes don't match %u commits\n", path, graph->count);
+        goto fail;
+    }
+
+    // Filters made with other settings than ours are as good as none
+    if (graph->bloom_index && bdat && bidx_len == (size_t)graph->count * 4 && bdat_len >= BDAT_HEADER_SIZE &&
+        get_be32(bdat) == 1 && get_be32(bdat + 4) == BLOOM_HASHES && get_be32(bdat + 8) == BLOOM_BITS_PER_ENTRY) {
+        graph->bloom_data = bdat + BDAT_HEADER_SIZE;
+        graph->bloom_size = bdat_len - BDAT_HEADER_SIZE;
+    } else {
+        graph->bloom_index = NULL;
+    }
+    return 0;
+
+fail:
+    commit_graph_close(graph);
+    return -1;
+}
+
+
+void commit_graph_close(CommitGraph *graph) {
+    if (graph->map) munmap((void *)graph->map, graph->size);
+    memset(graph, 0, sizeof(*graph));
+}
+
+
+int commit_graph_find(const CommitGraph *graph, const unsigned char raw_hash[20], uint32_t *pos) {
+    uint32_t lo = raw_hash[0] ? get_be32(graph->fanout + (raw_hash[0] - 1) * 4) : 0;
+    uint32_t hi = get_be32(graph->fanout + raw_hash[0] * 4);
+    if (hi > graph->count) hi = graph->count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int c = memcmp(raw_hash, graph->names + (size_t)mid * 20, 20);
+        if (c == 0) {
+            *pos = mid;
+            return 1;
+        }
+        if (c < 0) hi = mid; else lo = mid + 1;
+    }
+    return 0;
+}
+
+
+const unsigned char *commit_graph_name(const CommitGraph *graph, uint32_t pos) {
+    return graph->names + (size_t)pos * 20;
+}
+
+
+int commit_graph_entry(const CommitGraph *graph, uint32_t pos, CommitGraphEntry *entry,
+                       uint32_t *parents, size_t max) {
+    const unsigned char *rec = graph->data + (size_t)pos * CDAT_SIZE;
+    entry->tree = rec;
+    uint32_t word = get_be32(rec + 28);
+    entry->generation = word >> 2;
+    entry->date = (int64_t)((uint64_t)(word & 3) << 32 | get_be32(rec + 32));
+
+    uint32_t first = get_be32(rec + 20), second = get_be32(rec + 24);
+    size_t count = 0;
+    if (first != NO_PARENT) {
+        if (count < max) parents[count] = first;
+        count++;
+    }
+    if (second != NO_PARENT && !(second & EXTRA_EDGES)) {
+        if (count < max) parents[count] = second;
+        count++;
+    } else if (second != NO_PARENT) {
+        // Octopus: parents 2.. run through EDGE up to the one marked last
+        for (size_t i = second & ~EXTRA_EDGES;; i++) {
+            if (i >= graph->edge_count) goto corrupt;
+            uint32_t edge = get_be32(graph->edges + i * 4);
+            if (count < max) parents[count] = edge & ~LAST_EDGE;
+            count++;
+            if (edge & LAST_EDGE) break;
+        }
+    }
+    for (size_t i = 0; i < count && i < max; i++) {
+        if (parents[i] >= graph->count) goto corrupt;
+    }
+    return (int)count;
+
+corrupt:
+    fprintf(stderr, "error: commit-graph: bad parents for commit %u\n", pos);
+    return -1;
+}
+
+
+int commit_graph_bloom(const CommitGraph *graph, uint32_t pos, BloomFilter *filter) {
+    if (!graph->bloom_index) return 0;
+    uint32_t start = pos ? get_be32(graph->bloom_index + (size_t)(pos - 1) * 4) : 0;
+    uint32_t end = get_be32(graph->bloom_index + (size_t)pos * 4);
+    if (start > end || end > graph->bloom_size) return 0; // corrupt: no help from it
+    filter->data = graph->bloom_data + start;
+    filter->len = end - start;
+    return 1;
+}
+
+
+// The commits a new graph will hold, sorted by name
+typedef struct {
+    Commit **commits;
+    size_t count, cap;
+    RevWalk walk;
+    int changed_paths;
+} GraphBuild;
+
+
+static int push_ref(const char *name, const unsigned char raw_hash[20], void *arg) {
+    (void)name;
+    GraphBuild *build = arg;
+    Commit *c = lookup_commit_reference(raw_hash);
+    if (!c) return -1;
+    return rev_walk_push(&build->walk, c);
+}
+
+
+static int cmp_commit_name(const void *a, const void *b) {
+    return memcmp((*(Commit *const *)a)->raw_hash, (*(Commit *const *)b)->raw_hash, 20);
+}
+
+
+static uint32_t position_of(const GraphBuild *build, const Commit *c) {
+    Commit *const *found = bsearch(&c, build->commits, build->count, sizeof(Commit *), cmp_commit_name);
+    return (uint32_t)(found - build->commits);
+}
+
+
+// Generation numbers: 1 for a root, else one more than the highest parent's.
+// An explicit stack, since histories are far deeper than the C stack.
+static int compute_generations(const GraphBuild *build, const uint32_t *first_parent,
+                               const uint32_t *parent_pos, uint32_t *generation) {
+    uint32_t *stack = malloc((build->count ? build->count : 1) * sizeof(uint32_t));
+    if (!stack) { perror("malloc"); return -1; }
+    for (size_t i = 0; i < build->count; i++) {
+        if (generation[i]) continue;
+        size_t depth = 0;
+        stack[depth++] = (uint32_t)i;
+        while (depth > 0) {
+            uint32_t c = stack[depth - 1];
+            uint32_t max = 0;
+            int ready = 1;
+            for (uint32_t k = first_parent[c]; k < first_parent[c + 1]; k++) {
+                uint32_t p = parent_pos[k];
+                if (!generation[p]) {
+                    // A commit sits on the stack at most once: each is pushed
+                    // only while its generation is unknown, and finishes first
+                    if (ready) stack[depth++] = p;
+                    ready = 0;
+                } else if (generation[p] > max) {
+                    max = generation[p];
+                }
+            }
+            if (!ready) continue;
+            generation[c] = max < GENERATION_MAX ? max + 1 : GENERATION_MAX;
+            depth--;
+        }
+    }
+    free(stack);
+    return 0;
+}
+
+
+// Every commit's filter against its first parent, back to back in graph
+// order; ends[i] is where commit i's stops. Filters the old graph already
+// has are copied instead of diffing again.
+static int compute_filters(const GraphBuild *build, uint32_t *ends, unsigned char **data, size_t *size) {
+    size_t len = 0, cap = 0;
+    *data = NULL;
+    for (size_t i = 0; i < build->count; i++) {
+        const Commit *c = build->commits[i];
+        BloomFilter old;
+        unsigned char *computed = NULL;
+        const unsigned char *filter;
+        size_t filter_len;
+        if (commit_bloom_filter(c, &old)) {
+            filter = old.data;
+            filter_len = old.len;
+        } else {
+            long n = bloom_filter_compute(c->parent_count ? c->parents[0]->tree : NULL, c->tree, &computed);
+            if (n < 0) goto fail;
+            filter = computed;
+            filter_len = (size_t)n;
+        }
+        if (len + filter_len > UINT32_MAX) {
+            fprintf(stderr, "error: commit-graph: changed-path filters too large\n");
+            free(computed);
+            goto fail;
+        }
+        if (len + filter_len > cap) {
+            size_t grown_cap = cap ? cap * 2 : 1 << 16;
+            while (grown_cap < len + filter_len) grown_cap *= 2;
+            unsigned char *grown = realloc(*data, grown_cap);
+            if (!grown) { perror("realloc"); free(computed); goto fail; }
+            *data = grown;
+            cap = grown_cap;
+        }
+        memcpy(*data + len, filter, filter_len);
+        len += filter_len;
+        ends[i] = (uint32_t)len;
+        free(computed);
+    }
+    *size = len;
+    return 0;
+
+fail:
+    free(*data);
+    *data = NULL;
+    return -1;
+}
+
+
+static int write_file(const char *path, const unsigned char *buf, size_t len) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.lock", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0444);
+    if (fd < 0) { perror(tmp_path); return -1; }
+
+    int ok = 1;
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = write(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { ok = 0; break; }
+        done += (size_t)n;
+    }
+    if (close(fd) < 0) ok = 0;
+    if (!ok || rename(tmp_path, path) < 0) {
+        perror("commit-graph");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+static int write_graph(const GraphBuild *build) {
+    size_t n = build->count;
+    uint32_t *first_parent = malloc((n + 1) * sizeof(uint32_t));
+    uint32_t *generation = calloc(n ? n : 1, sizeof(uint32_t));
+    uint32_t *parent_pos = NULL, *bloom_ends = NULL;
+    unsigned char *buf = NULL, *bloom_data = NULL;
+    size_t bloom_size = 0;
+    int ret = -1;
+    if (!first_parent || !generation) { perror("malloc"); goto out; }
+
+    size_t total = 0, edges = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t parents = build->commits[i]->parent_count;
+        total += parents;
+        if (parents > 2) edges += parents - 1;
+    }
+    parent_pos = malloc((total ? total : 1) * sizeof(uint32_t));
+    if (!parent_pos) { perror("malloc"); goto out; }
+    for (size_t i = 0, k = 0; i < n; i++) {
+        first_parent[i] = (uint32_t)k;
+        const Commit *c = build->commits[i];
+        for (uint32_t j = 0; j < c->parent_count; j++) parent_pos[k++] = position_of(build, c->parents[j]);
+        first_parent[i + 1] = (uint32_t)k;
+    }
+    if (compute_generations(build, first_parent, parent_pos, generation) < 0) goto out;
+    if (build->changed_paths) {
+        bloom_ends = malloc((n ? n : 1) * sizeof(uint32_t));
+        if (!bloom_ends) { perror("malloc"); goto out; }
+        TraceSpan span;
+        trace_begin(&span, "bloom");
+        int status = compute_filters(build, bloom_ends, &bloom_data, &bloom_size);
+        trace_end(&span);
+        if (status < 0) goto out;
+    }
+
+    // Chunks in git's order, so the same history gives the same file
+    uint32_t ids[6];
+    size_t offsets[6], sizes[6];
+    int chunks = 0;
+    ids[chunks] = CHUNK_OIDF; sizes[chunks++] = 256 * 4;
+    ids[chunks] = CHUNK_OIDL; sizes[chunks++] = n * 20;
+    ids[chunks] = CHUNK_CDAT; sizes[chunks++] = n * CDAT_SIZE;
+    if (edges) { ids[chunks] = CHUNK_EDGE; sizes[chunks++] = edges * 4; }
+    if (build->changed_paths) {
+        ids[chunks] = CHUNK_BIDX; sizes[chunks++] = n * 4;
+        ids[chunks] = CHUNK_BDAT; sizes[chunks++] = BDAT_HEADER_SIZE + bloom_size;
+    }
+    size_t len = GRAPH_HEADER_SIZE + (size_t)(chunks + 1) * CHUNK_ENTRY_SIZE;
+    for (int i = 0; i < chunks; i++) {
+        offsets[i] = len;
+        len += sizes[i];
+    }
+    len += 20;
+    buf = malloc(len);
+    if (!buf) { perror("malloc"); goto out; }
+
+    unsigned char *p = buf;
+    memcpy(p, "CGPH", 4);
+    p[4] = 1;           // version
+    p[5] = 1;           // SHA-1
+    p[6] = (unsigned char)chunks;
+    p[7] = 0;           // no base graphs
+    p += GRAPH_HEADER_SIZE;
+    for (int i = 0; i < chunks; i++) p = put_be64(put_be32(p, ids[i]), offsets[i]);
+    p = put_be64(put_be32(p, 0), len - 20);
+
+    size_t i = 0;
+    for (int byte = 0; byte < 256; byte++) {
+        while (i < n && build->commits[i]->raw_hash[0] == byte) i++;
+        p = put_be32(p, (uint32_t)i);
+    }
+    for (i = 0; i < n; i++, p += 20) memcpy(p, build->commits[i]->raw_hash, 20);
+
+    unsigned char *edge_out = buf + offsets[2] + sizes[2]; // EDGE, when there is one, follows CDAT
+    uint32_t edge_index = 0;
+    for (i = 0; i < n; i++) {
+        const Commit *c = build->commits[i];
+        const uint32_t *pp = parent_pos + first_parent[i];
+        memcpy(p, c->tree, 20);
+        p += 20;
+        p = put_be32(p, c->parent_count > 0 ? pp[0] : NO_PARENT);
+        if (c->parent_count <= 2) {
+            p = put_be32(p, c->parent_count == 2 ? pp[1] : NO_PARENT);
+        } else {
+            p = put_be32(p, EXTRA_EDGES | edge_index);
+            for (uint32_t j = 1; j < c->parent_count; j++, edge_index++) {
+                edge_out = put_be32(edge_out, pp[j] | (j + 1 == c->parent_count ? LAST_EDGE : 0));
+            }
+        }
+        // 34 bits of date: later than 2514 or before 1970 doesn't fit
+        uint64_t date = c->date < 0 ? 0 : (uint64_t)c->date & 0x3ffffffffull;
+        p = put_be32(p, generation[i] << 2 | (uint32_t)(date >> 32));
+        p = put_be32(p, (uint32_t)date);
+    }
+    if (build->changed_paths) {
+        p = buf + offsets[chunks - 2];
+        for (i = 0; i < n; i++) p = put_be32(p, bloom_ends[i]);
+        p = put_be32(put_be32(put_be32(p, 1), BLOOM_HASHES), BLOOM_BITS_PER_ENTRY);
+        if (bloom_size) memcpy(p, bloom_data, bloom_size);
+    }
+    hash_buffer(buf, len - 20, buf + len - 20);
+
+    if (mkdir(".git/objects/info", 0755) < 0 && errno != EEXIST) {
+        perror(".git/objects/info");
+        goto out;
+    }
+    ret = write_file(COMMIT_GRAPH_FILE, buf, len);
+
+out:
+    free(first_parent);
+    free(generation);
+    free(parent_pos);
+    free(bloom_ends);
+    free(bloom_data);
+    free(buf);
+    return ret;
+}
+
+
+int commit_graph_write(int changed_paths) {
+    GraphBuild build = { .changed_paths = changed_paths || commit_graph_has_filters() };
+    rev_walk_init(&build.walk);
+    int ret = -1;
+
+    TraceSpan span;
+    trace_begin(&span, "walk");
+    int status = for_each_ref(push_ref, &build);
+    Commit *c;
+    while (status == 0 && (status = rev_walk_next(&build.walk, &c)) == 1) {
+        if (build.count == build.cap) {
+            size_t cap = build.cap ? build.cap * 2 : 1024;
+            Commit **grown = realloc(build.commits, cap * sizeof(Commit *));
+            if (!grown) { perror("realloc"); status = -1; break; }
+            build.commits = grown;
+            build.cap = cap;
+        }
+        build.commits[build.count++] = c;
+        status = 0; // go on to the next one
+    }
+    trace_end(&span);
+    if (status != 0) goto out;
+
+    trace_begin(&span, "write");
+    qsort(build.commits, build.count, sizeof(Commit *), cmp_commit_name);
+    ret = write_graph(&build);
+    trace_end(&span);
+
+out:
+    rev_walk_release(&build.walk);
+    free(build.commits);
+    return ret;
+}
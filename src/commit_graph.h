@@ -0,0 +1,65 @@
+#ifndef COMMIT_GRAPH_H
+#define COMMIT_GRAPH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bloom.h"
+
+// git's commit-graph file (version 1, SHA-1), .git/objects/info/commit-graph:
+// every commit reachable from a ref, sorted by name, with its root tree,
+// parents (as positions in the file), committer time and generation number,
+// the length of the longest parent chain down to a root. The file is mmap'd;
+// answering "what are this commit's parents" is a binary search for the
+// commit plus one fixed-size record, with no object inflated. Optionally the
+// file also carries each commit's changed-path Bloom filter (see bloom.h).
+
+#define COMMIT_GRAPH_FILE ".git/objects/info/commit-graph"
+#define GENERATION_MAX 0x3fffffffu     // the 30 bits a record has room for
+
+typedef struct {
+    const unsigned char *map;
+    size_t size;
+    uint32_t count;
+    const unsigned char *fanout;     // OIDF: 256 big-endian cumulative counts
+    const unsigned char *names;      // OIDL: count x 20-byte commit names, sorted
+    const unsigned char *data;       // CDAT: count x (tree, parent 1, parent 2, generation + date)
+    const unsigned char *edges;      // EDGE: parents 2.. of octopus merges, NULL if none
+    size_t edge_count;
+    const unsigned char *bloom_index;  // BIDX: count x end offset into bloom_data, NULL if none
+    const unsigned char *bloom_data;   // BDAT, past its header
+    size_t bloom_size;
+} CommitGraph;
+
+typedef struct {
+    const unsigned char *tree;
+    uint32_t generation;
+    int64_t date;
+} CommitGraphEntry;
+
+// Returns 0, 1 when there is no graph file, or -1 when it is corrupt (reported)
+int commit_graph_open(CommitGraph *graph, const char *path);
+void commit_graph_close(CommitGraph *graph);
+
+// Returns 1 and sets *pos when the graph has the commit
+int commit_graph_find(const CommitGraph *graph, const unsigned char raw_hash[20], uint32_t *pos);
+
+const unsigned char *commit_graph_name(const CommitGraph *graph, uint32_t pos);
+
+// The record at pos; its parents go into parents[0..max) by position.
+// Returns the parent count (which may exceed max), or -1 if corrupt (reported).
+int commit_graph_entry(const CommitGraph *graph, uint32_t pos, CommitGraphEntry *entry,
+                       uint32_t *parents, size_t max);
+
+// The changed-path filter of the commit at pos: returns 1 and sets *filter,
+// or 0 when the graph has no filters
+int commit_graph_bloom(const CommitGraph *graph, uint32_t pos, BloomFilter *filter);
+
+// Walks every commit reachable from HEAD and the refs (through the existing
+// graph where it can) and replaces the graph file with one covering them.
+// With changed_paths, or when the old graph had them, it also stores Bloom
+// filters, reusing the old graph's and computing the rest.
+// Returns 0, or -1 on error (reported).
+int commit_graph_write(int changed_paths);
+
+#endif
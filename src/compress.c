@@ -0,0 +1,181 @@
+#include "compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "trace.h"
+
+// Bits of entropy per byte, from the sample's byte histogram, at and above
+// which deflate is not worth running at all, or past level 1. Random data
+// measures just under 8; deflated streams, JPEG and PNG above 7.9; text
+// and machine code well below 7.
+#define STORE_ENTROPY 7.85
+#define FAST_ENTROPY 7.0
+
+static struct {
+    int level[2];               // by CompressTarget
+    int adaptive;
+} settings;
+
+static pthread_once_t settings_once = PTHREAD_ONCE_INIT;
+
+
+// Reads one level key; a bad value is reported and leaves *level alone
+static int read_level(const char *name, int *level) {
+    long value;
+    int status = config_get_int(name, &value);
+    if (status != 0) return status;
+    if (value < -1 || value > 9) {
+        fprintf(stderr, "error: bad zlib compression level %ld for '%s'\n", value, name);
+        return -1;
+    }
+    *level = (int)value;
+    return 0;
+}
+
+
+static void load_settings(void) {
+    int core = Z_DEFAULT_COMPRESSION;
+    int have_core = read_level("core.compression", &core) == 0;
+
+    settings.level[COMPRESS_LOOSE] = have_core ? core : Z_BEST_SPEED;
+    read_level("core.looseCompression", &settings.level[COMPRESS_LOOSE]);
+    settings.level[COMPRESS_PACK] = core;
+    read_level("pack.compression", &settings.level[COMPRESS_PACK]);
+
+    settings.adaptive = 1;
+    config_get_bool("core.adaptiveCompression", &settings.adaptive);
+}
+
+
+static double sample_entropy(const unsigned char *data, size_t len) {
+    uint32_t counts[256] = { 0 };
+    for (size_t i = 0; i < len; i++) counts[data[i]]++;
+    double bits = 0, n = (double)len;
+    for (int c = 0; c < 256; c++) {
+        if (counts[c]) bits -= counts[c] * log2(counts[c] / n);
+    }
+    return bits / n;
+}
+
+
+int compress_level(CompressTarget target, const void *sample, size_t len) {
+    pthread_once(&settings_once, load_settings);
+    int level = settings.level[target];
+    if (!settings.adaptive || len < COMPRESS_MIN_SAMPLE || level == 0) return level;
+
+    double entropy = sample_entropy(sample, len < COMPRESS_SAMPLE ? len : COMPRESS_SAMPLE);
+    if (entropy >= STORE_ENTROPY) return 0;
+    if (entropy >= FAST_ENTROPY) return Z_BEST_SPEED;
+    return level;
+}
+
+
+int compress_init(z_stream *z, int level) {
+    *z = (z_stream){ 0 };
+    if (deflateInit(z, level) != Z_OK) {
+        fprintf(stderr, "deflateInit failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+// Setting up a deflate stream costs more than compressing a small object,
+// so compress_buffer borrows one from these lists and resets it instead.
+// There is one list per level: deflateParams on a reset stream isn't
+// something every zlib version gets right.
+typedef struct Deflater {
+    z_stream z;
+    struct Deflater *next;
+} Deflater;
+
+#define LEVELS 11                   // -1 through 9
+
+static Deflater *spare_deflaters[LEVELS];  // by level + 1; guarded by `pool_lock`
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static Deflater *get_deflater(int level) {
+    pthread_mutex_lock(&pool_lock);
+    Deflater *d = spare_deflaters[level + 1];
+    if (d) spare_deflaters[level + 1] = d->next;
+    pthread_mutex_unlock(&pool_lock);
+    if (d) {
+        deflateReset(&d->z);
+        return d;
+    }
+    d = calloc(1, sizeof(Deflater));
+    if (!d) {
+        perror("calloc");
+        return NULL;
+    }
+    if (compress_init(&d->z, level) < 0) {
+        free(d);
+        return NULL;
+    }
+    return d;
+}
+
+
+static void put_deflater(Deflater *d, int level) {
+    pthread_mutex_lock(&pool_lock);
+    d->next = spare_deflaters[level + 1];
+    spare_deflaters[level + 1] = d;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+
+int compress_buffer(int level, const unsigned char *data, size_t len, unsigned char **zdata, size_t *zlen) {
+    Deflater *d = get_deflater(level);
+    if (!d) return -1;
+    size_t bound = deflateBound(&d->z, (uLong)len);
+    *zdata = malloc(bound);
+    if (!*zdata) {
+        perror("malloc");
+        put_deflater(d, level);
+        return -1;
+    }
+
+    TraceSpan span;
+    trace_begin(&span, "deflate");
+    int status = Z_OK;
+    d->z.next_in = (unsigned char *)data;
+    d->z.next_out = *zdata;
+    d->z.avail_out = (uInt)bound;
+    for (size_t left = len; status == Z_OK; ) {
+        size_t piece = left < (1u << 30) ? left : (1u << 30); // avail_in is 32 bits
+        d->z.avail_in = (uInt)piece;
+        left -= piece;
+        status = deflate(&d->z, left ? Z_NO_FLUSH : Z_FINISH);
+        left += d->z.avail_in;
+    }
+    *zlen = d->z.total_out;
+    put_deflater(d, level);
+    trace_end(&span);
+    if (status != Z_STREAM_END) {
+        fprintf(stderr, "deflate failed\n");
+        free(*zdata);
+        return -1;
+    }
+    trace_count(TRACE_BYTES_DEFLATED, len);
+    return 0;
+}
+
+
+void compress_release(void) {
+    pthread_mutex_lock(&pool_lock);
+    for (int i = 0; i < LEVELS; i++) {
+        while (spare_deflaters[i]) {
+            Deflater *d = spare_deflaters[i];
+            spare_deflaters[i] = d->next;
+            deflateEnd(&d->z);
+            free(d);
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
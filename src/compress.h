@@ -0,0 +1,42 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <zlib.h>
+
+// Every object this program writes is deflated at a level chosen here.
+// The configured levels follow git's .git/config keys:
+//   core.looseCompression   loose objects; 1 (Z_BEST_SPEED) when unset
+//   pack.compression        pack entries; zlib's default (-1) when unset
+//   core.compression        either of them, when its own key isn't set
+// On top of that, core.adaptiveCompression (true unless set to false)
+// looks at the first bytes of each object: data that is already compressed
+// (images, archives, media) barely shrinks at any level, so it is stored
+// (level 0) or deflated at level 1 instead of spending the configured level
+// on it. The check is a byte histogram of up to COMPRESS_SAMPLE bytes and
+// only runs on objects at least COMPRESS_MIN_SAMPLE long.
+
+#define COMPRESS_SAMPLE (16 << 10)
+#define COMPRESS_MIN_SAMPLE (4 << 10)
+
+typedef enum {
+    COMPRESS_LOOSE,
+    COMPRESS_PACK,
+} CompressTarget;
+
+// The level for an object of the target kind whose data starts with
+// sample[0..len); len may be all of the object or just its first chunk
+int compress_level(CompressTarget target, const void *sample, size_t len);
+
+// deflateInit at `level`. Returns 0, or -1 (reported).
+int compress_init(z_stream *z, int level);
+
+// Deflates data into a malloc'd *zdata in one go, on a stream borrowed from
+// a per-level pool so small objects don't each pay for deflateInit.
+// Returns 0, or -1 (reported).
+int compress_buffer(int level, const unsigned char *data, size_t len, unsigned char **zdata, size_t *zlen);
+
+// Frees the pooled streams; none may be in use
+void compress_release(void);
+
+#endif
@@ -0,0 +1,286 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#define CONFIG_PATH ".git/config"
+
+typedef struct {
+    char *name;                 // normalized: lower-case section and key
+    char *value;
+} ConfigEntry;
+
+// Every assignment in file order, read once
+static struct {
+    ConfigEntry *entries;
+    size_t count, cap;
+} config;
+
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+} Buf;
+
+
+static int buf_add(Buf *b, char c) {
+    if (b->len + 1 >= b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 64;
+        char *grown = realloc(b->data, cap);
+        if (!grown) { perror("realloc"); return -1; }
+        b->data = grown;
+        b->cap = cap;
+    }
+    b->data[b->len++] = c;
+    b->data[b->len] = '\0';
+    return 0;
+}
+
+
+// Empties b, leaving it a valid empty string
+static int buf_reset(Buf *b) {
+    b->len = 0;
+    if (buf_add(b, '\0') < 0) return -1;
+    b->len = 0;
+    return 0;
+}
+
+
+static int add_entry(const char *section, const char *key, const char *value) {
+    if (config.count == config.cap) {
+        size_t cap = config.cap ? config.cap * 2 : 32;
+        ConfigEntry *grown = realloc(config.entries, cap * sizeof(ConfigEntry));
+        if (!grown) { perror("realloc"); return -1; }
+        config.entries = grown;
+        config.cap = cap;
+    }
+    size_t section_len = strlen(section), key_len = strlen(key);
+    char *name = malloc(section_len + key_len + 2);
+    char *copy = strdup(value);
+    if (!name || !copy) { perror("malloc"); free(name); free(copy); return -1; }
+    memcpy(name, section, section_len);
+    name[section_len] = '.';
+    for (size_t i = 0; i <= key_len; i++) name[section_len + 1 + i] = (char)tolower((unsigned char)key[i]);
+    config.entries[config.count++] = (ConfigEntry){ name, copy };
+    return 0;
+}
+
+
+// "[name]" or "[name "subsection"]" with p just past the '['; the section
+// is stored as "name" or "name.subsection"
+static const char *parse_section(const char *p, Buf *section) {
+    if (buf_reset(section) < 0) return NULL;
+    while (isalnum((unsigned char)*p) || *p == '-' || *p == '.') {
+        if (buf_add(section, (char)tolower((unsigned char)*p++)) < 0) return NULL;
+    }
+    if (section->len == 0) return NULL;
+    if (*p == ' ' || *p == '\t') {
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p++ != '"' || buf_add(section, '.') < 0) return NULL;
+        for (; *p != '"'; p++) {
+            if (*p == '\n' || *p == '\0') return NULL;
+            if (*p == '\\' && p[1] != '\n' && p[1] != '\0') p++;
+            if (buf_add(section, *p) < 0) return NULL;
+        }
+        p++;
+    }
+    return *p == ']' ? p + 1 : NULL;
+}
+
+
+// The value after "key =": quotes group, backslash escapes, '#' and ';'
+// start a comment outside quotes, and unquoted trailing blanks are dropped.
+// Returns the start of the next line, or NULL when the value is malformed.
+static const char *parse_value(const char *p, Buf *value) {
+    if (buf_reset(value) < 0) return NULL;
+    while (*p == ' ' || *p == '\t') p++;
+    size_t keep = 0;            // length up to the last byte that isn't unquoted space
+    int quoted = 0;
+    for (;; p++) {
+        char c = *p;
+        if (c == '\0' || c == '\n') {
+            if (quoted) return NULL;
+            break;
+        }
+        if (!quoted && (c == '#' || c == ';')) {
+            while (*p != '\n' && *p != '\0') p++;
+            break;
+        }
+        if (c == '"') {
+            quoted = !quoted;
+            keep = value->len;
+            continue;
+        }
+        if (c == '\\') {
+            c = *++p;
+            if (c == '\n') continue; // line continuation
+            switch (c) {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'b': c = '\b'; break;
+            case '\\': case '"': break;
+            default: return NULL;
+            }
+            if (buf_add(value, c) < 0) return NULL;
+            keep = value->len;
+            continue;
+        }
+        if (buf_add(value, c) < 0) return NULL;
+        if (quoted || (c != ' ' && c != '\t' && c != '\r')) keep = value->len;
+    }
+    value->len = keep;
+    value->data[keep] = '\0';
+    return *p == '\n' ? p + 1 : p;
+}
+
+
+static void parse(const char *text) {
+    Buf section = { 0 }, key = { 0 }, value = { 0 };
+    int line = 1;
+    const char *p = text;
+    while (*p) {
+        const char *start = p;
+        while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+        const char *next = NULL;
+        if (*p == '\n') {
+            next = p + 1;
+        } else if (*p == '#' || *p == ';') {
+            next = strchr(p, '\n');
+            next = next ? next + 1 : p + strlen(p);
+        } else if (*p == '[') {
+            next = parse_section(p + 1, &section);
+            if (next) {
+                while (*next == ' ' || *next == '\t' || *next == '\r') next++;
+                if (*next == '#' || *next == ';') next = strchr(next, '\n');
+                if (!next) next = p + strlen(p);
+                else if (*next == '\n') next++;
+                else if (*next) next = NULL; // more after the ']'
+            }
+        } else if (isalpha((unsigned char)*p) && section.len > 0) {
+            key.len = 0;
+            while (isalnum((unsigned char)*p) || *p == '-') {
+                if (buf_add(&key, *p++) < 0) break;
+            }
+            while (*p == ' ' || *p == '\t') p++;
+            if (*p == '=') {
+                next = parse_value(p + 1, &value);
+                if (next && add_entry(section.data, key.data, value.data) < 0) break;
+            } else if (*p == '\n' || *p == '\0' || *p == '\r' || *p == '#' || *p == ';') {
+                next = strchr(p, '\n');
+                next = next ? next + 1 : p + strlen(p);
+                if (add_entry(section.data, key.data, "true") < 0) break;
+            }
+        }
+
+        if (!next) {
+            fprintf(stderr, "warning: bad config line %d in %s\n", line, CONFIG_PATH);
+            next = strchr(start, '\n');
+            next = next ? next + 1 : start + strlen(start);
+        }
+        for (const char *q = start; q < next; q++) line += *q == '\n';
+        p = next;
+    }
+    free(section.data);
+    free(key.data);
+    free(value.data);
+}
+
+
+static void load_config(void) {
+    FILE *f = fopen(CONFIG_PATH, "r");
+    if (!f) {
+        if (errno != ENOENT) perror(CONFIG_PATH);
+        return;
+    }
+    Buf text = { 0 };
+    char chunk[4096];
+    size_t n;
+    int failed = buf_reset(&text) < 0;
+    while (!failed && (n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        for (size_t i = 0; i < n && !failed; i++) {
+            if (chunk[i] == '\0') chunk[i] = ' '; // a NUL can't end the text early
+            failed = buf_add(&text, chunk[i]) < 0;
+        }
+    }
+    if (ferror(f)) perror(CONFIG_PATH);
+    fclose(f);
+    if (!failed) parse(text.data);
+    free(text.data);
+}
+
+
+// Compares a stored name to one asked for: section and key without regard
+// to case, a subsection exactly
+static int name_matches(const char *stored, const char *name) {
+    const char *first = strchr(name, '.'), *last = strrchr(name, '.');
+    if (!first) return 0;
+    size_t len = strlen(name);
+    if (strlen(stored) != len) return 0;
+    for (size_t i = 0; i < len; i++) {
+        int exact = name + i > first && name + i < last;
+        char a = stored[i], b = exact ? name[i] : (char)tolower((unsigned char)name[i]);
+        if (a != b) return 0;
+    }
+    return 1;
+}
+
+
+const char *config_get(const char *name) {
+    pthread_once(&config_once, load_config);
+    for (size_t i = config.count; i-- > 0; ) {
+        if (name_matches(config.entries[i].name, name)) return config.entries[i].value;
+    }
+    return NULL;
+}
+
+
+int config_get_int(const char *name, long *value) {
+    const char *text = config_get(name);
+    if (!text) return 1;
+    char *end;
+    errno = 0;
+    long v = strtol(text, &end, 10);
+    long unit = 1;
+    switch (tolower((unsigned char)*end)) {
+    case 'k': unit = 1L << 10; end++; break;
+    case 'm': unit = 1L << 20; end++; break;
+    case 'g': unit = 1L << 30; end++; break;
+    }
+    if (end == text || *end != '\0' || errno == ERANGE || v > LONG_MAX / unit || v < LONG_MIN / unit) {
+        fprintf(stderr, "error: bad numeric config value '%s' for '%s'\n", text, name);
+        return -1;
+    }
+    *value = v * unit;
+    return 0;
+}
+
+
+int config_get_bool(const char *name, int *value) {
+    const char *text = config_get(name);
+    if (!text) return 1;
+    static const char *const yes[] = { "true", "yes", "on" }, *const no[] = { "false", "no", "off", "" };
+    for (size_t i = 0; i < sizeof(yes) / sizeof(yes[0]); i++) {
+        if (strcasecmp(text, yes[i]) == 0) { *value = 1; return 0; }
+    }
+    for (size_t i = 0; i < sizeof(no) / sizeof(no[0]); i++) {
+        if (strcasecmp(text, no[i]) == 0) { *value = 0; return 0; }
+    }
+    long v;
+    char *end;
+    errno = 0;
+    v = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE) {
+        fprintf(stderr, "error: bad boolean config value '%s' for '%s'\n", text, name);
+        return -1;
+    }
+    *value = v != 0;
+    return 0;
+}
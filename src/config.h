@@ -0,0 +1,18 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+// Read-only access to .git/config, loaded once on first use. Names are
+// "section.key" or "section.subsection.key"; sections and keys compare
+// case-insensitively, subsections exactly, and the last assignment wins as
+// in git. Values are unquoted and unescaped; a key given with no "=" is
+// stored as "true". Lines that don't parse are reported and skipped.
+
+// The value, or NULL when the key isn't set
+const char *config_get(const char *name);
+
+// Integers take git's k/m/g suffixes. Returns 0 with *value set, 1 when the
+// key isn't set, or -1 when the value isn't a number of that kind (reported).
+int config_get_int(const char *name, long *value);
+int config_get_bool(const char *name, int *value);
+
+#endif
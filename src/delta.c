@@ -0,0 +1,251 @@
+#include "delta.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define BLOCK 16                 // bytes per indexed block and per rolling-hash window
+#define MAX_BUCKET 64            // candidates kept per hash; repetitive bases would go quadratic
+#define MAX_COPY 0x10000         // per copy opcode, as git writes them
+#define MAX_INSERT 127           // per insert opcode
+#define HASH_MUL 0x01000193u     // FNV prime: odd, so the rolling hash stays invertible
+
+typedef struct {
+    uint32_t hash;               // full rolling hash: most bucket neighbours are rejected on it
+    uint32_t offset;
+} Block;
+
+struct DeltaIndex {
+    const unsigned char *base;
+    size_t base_len;
+    unsigned bits;               // log2 of the bucket count
+    uint32_t *bucket_start;      // (1 << bits) + 1 offsets into blocks
+    Block *blocks;               // grouped by bucket
+};
+
+// HASH_MUL^(BLOCK-1), the weight of the byte that leaves the window
+static uint32_t out_weight(void) {
+    uint32_t w = 1;
+    for (int i = 1; i < BLOCK; i++) w *= HASH_MUL;
+    return w;
+}
+
+
+static uint32_t block_hash(const unsigned char *p) {
+    uint32_t h = 0;
+    for (int i = 0; i < BLOCK; i++) h = h * HASH_MUL + p[i];
+    return h;
+}
+
+
+static uint32_t bucket_of(unsigned bits, uint32_t h) {
+    return (h * 0x9e3779b1u) >> (32 - bits);
+}
+
+
+DeltaIndex *delta_index_create(const unsigned char *base, size_t len) {
+    if (len < BLOCK || len > UINT32_MAX) return NULL;
+    size_t blocks = len / BLOCK;
+
+    DeltaIndex *index = calloc(1, sizeof(DeltaIndex));
+    if (!index) return NULL;
+    index->base = base;
+    index->base_len = len;
+    index->bits = 4;
+    while (index->bits < 31 && ((size_t)1 << index->bits) < blocks) index->bits++;
+    size_t buckets = (size_t)1 << index->bits;
+
+    // Counting sort of the block offsets by bucket, capped per bucket
+    uint32_t *hashes = malloc(blocks * sizeof(uint32_t));
+    uint32_t *cursor = NULL;
+    index->bucket_start = calloc(buckets + 1, sizeof(uint32_t));
+    if (!hashes || !index->bucket_start) goto fail;
+    for (size_t b = 0; b < blocks; b++) {
+        hashes[b] = block_hash(base + b * BLOCK);
+        uint32_t *n = &index->bucket_start[bucket_of(index->bits, hashes[b]) + 1];
+        if (*n < MAX_BUCKET) (*n)++;
+    }
+    for (size_t i = 0; i < buckets; i++) index->bucket_start[i + 1] += index->bucket_start[i];
+
+    index->blocks = malloc((index->bucket_start[buckets] + 1) * sizeof(Block));
+    cursor = malloc(buckets * sizeof(uint32_t));
+    if (!index->blocks || !cursor) goto fail;
+    memcpy(cursor, index->bucket_start, buckets * sizeof(uint32_t));
+    for (size_t b = 0; b < blocks; b++) {
+        uint32_t bucket = bucket_of(index->bits, hashes[b]);
+        if (cursor[bucket] < index->bucket_start[bucket + 1]) {
+            index->blocks[cursor[bucket]++] = (Block){ hashes[b], (uint32_t)(b * BLOCK) };
+        }
+    }
+    free(cursor);
+    free(hashes);
+    return index;
+
+fail:
+    free(cursor);
+    free(hashes);
+    delta_index_free(index);
+    return NULL;
+}
+
+
+void delta_index_free(DeltaIndex *index) {
+    if (!index) return;
+    free(index->bucket_start);
+    free(index->blocks);
+    free(index);
+}
+
+
+size_t delta_index_size(const DeltaIndex *index) {
+    size_t buckets = (size_t)1 << index->bits;
+    return sizeof(*index) + (buckets + 1) * sizeof(uint32_t) +
+           (index->bucket_start[buckets] + 1) * sizeof(Block);
+}
+
+
+// Length of the common prefix of a and b, at most `max`
+static size_t match_len(const unsigned char *a, const unsigned char *b, size_t max) {
+    size_t n = 0;
+    while (n + 8 <= max) {
+        uint64_t x, y;
+        memcpy(&x, a + n, 8);
+        memcpy(&y, b + n, 8);
+        if (x != y) return n + (size_t)__builtin_ctzll(x ^ y) / 8; // little-endian
+        n += 8;
+    }
+    while (n < max && a[n] == b[n]) n++;
+    return n;
+}
+
+
+typedef struct {
+    unsigned char *buf;
+    size_t len, cap, limit;
+} DeltaOut;
+
+// Room for `need` more bytes; -1 once the delta would pass its limit
+static int reserve(DeltaOut *out, size_t need) {
+    if (out->limit && out->len + need > out->limit) return -1;
+    if (out->len + need <= out->cap) return 0;
+    size_t cap = out->cap * 2;
+    while (cap < out->len + need) cap *= 2;
+    unsigned char *grown = realloc(out->buf, cap);
+    if (!grown) return -1;
+    out->buf = grown;
+    out->cap = cap;
+    return 0;
+}
+
+
+static int put_varint(DeltaOut *out, size_t v) {
+    if (reserve(out, 10) < 0) return -1;
+    while (v >= 0x80) {
+        out->buf[out->len++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    out->buf[out->len++] = (unsigned char)v;
+    return 0;
+}
+
+
+static int put_insert(DeltaOut *out, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        size_t n = len < MAX_INSERT ? len : MAX_INSERT;
+        if (reserve(out, n + 1) < 0) return -1;
+        out->buf[out->len++] = (unsigned char)n;
+        memcpy(out->buf + out->len, data, n);
+        out->len += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+// Copy opcode: bits 0-3 flag which offset bytes follow, bits 4-6 which size bytes
+static int put_copy(DeltaOut *out, size_t offset, size_t len) {
+    while (len > 0) {
+        size_t n = len < MAX_COPY ? len : MAX_COPY;
+        if (reserve(out, 8) < 0) return -1;
+        size_t op = out->len++;
+        unsigned char bits = 0x80;
+        for (int i = 0; i < 4; i++) {
+            unsigned char b = (unsigned char)(offset >> (8 * i));
+            if (b) { bits |= (unsigned char)(1 << i); out->buf[out->len++] = b; }
+        }
+        for (int i = 0; i < 3; i++) {
+            unsigned char b = (unsigned char)(n >> (8 * i));
+            if (b) { bits |= (unsigned char)(0x10 << i); out->buf[out->len++] = b; }
+        }
+        out->buf[op] = bits;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+unsigned char *delta_create(const DeltaIndex *index, const unsigned char *target, size_t target_len,
+                            size_t max_len, size_t *delta_len) {
+    // Locals, not index->...: stores into the output could alias them
+    const unsigned char *base = index->base;
+    const size_t base_len = index->base_len;
+    const unsigned bits = index->bits;
+    const uint32_t *bucket_start = index->bucket_start;
+    const Block *blocks = index->blocks;
+    DeltaOut out = { NULL, 0, 256, max_len };
+    if (max_len && max_len < out.cap) out.cap = max_len;
+    out.buf = malloc(out.cap);
+    if (!out.buf) return NULL;
+    if (put_varint(&out, base_len) < 0 || put_varint(&out, target_len) < 0) goto fail;
+
+    const uint32_t weight = out_weight();
+    size_t lit_start = 0, i = 0;
+    uint32_t h = target_len >= BLOCK ? block_hash(target) : 0;
+    while (i + BLOCK <= target_len) {
+        size_t best_len = 0, best_off = 0;
+        uint32_t bucket = bucket_of(bits, h);
+        for (uint32_t c = bucket_start[bucket]; c < bucket_start[bucket + 1]; c++) {
+            if (blocks[c].hash != h) continue;
+            size_t pos = blocks[c].offset;
+            size_t max = base_len - pos < target_len - i ? base_len - pos : target_len - i;
+            size_t len = match_len(base + pos, target + i, max);
+            if (len > best_len) {
+                best_len = len;
+                best_off = pos;
+                if (len == max) break; // can't do better than running off an end
+            }
+        }
+
+        if (best_len < BLOCK) {
+            // No usable match here: this byte becomes a literal. Pending
+            // literals count against the limit, so hopeless pairs stop early.
+            if (i + BLOCK < target_len) h = (h - target[i] * weight) * HASH_MUL + target[i + BLOCK];
+            i++;
+            if (out.limit && out.len + (i - lit_start) > out.limit) goto fail;
+            continue;
+        }
+
+        // The match may start before the window did, inside the pending literals
+        while (i > lit_start && best_off > 0 && base[best_off - 1] == target[i - 1]) {
+            i--;
+            best_off--;
+            best_len++;
+        }
+        if (put_insert(&out, target + lit_start, i - lit_start) < 0 ||
+            put_copy(&out, best_off, best_len) < 0) goto fail;
+        i += best_len;
+        lit_start = i;
+        if (i + BLOCK <= target_len) h = block_hash(target + i);
+    }
+    if (put_insert(&out, target + lit_start, target_len - lit_start) < 0) goto fail;
+
+    *delta_len = out.len;
+    return out.buf;
+
+fail:
+    free(out.buf);
+    return NULL;
+}
@@ -0,0 +1,26 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+
+// Delta encoding in git's pack format (the inverse of apply_delta() in
+// pack.h): "<base size><result size>" varints, then copy-from-base and
+// insert-literal opcodes. The base is indexed once, 16-byte block by block,
+// so one base can be tried against many targets; a target is scanned with a
+// rolling hash of the same width and every hit is extended as far as the
+// bytes keep matching, backwards too.
+
+typedef struct DeltaIndex DeltaIndex;
+
+// NULL for bases too small to index (or too big: offsets are 32-bit)
+DeltaIndex *delta_index_create(const unsigned char *base, size_t len);
+void delta_index_free(DeltaIndex *index);
+size_t delta_index_size(const DeltaIndex *index); // bytes held by the index itself
+
+// Encodes target against the indexed base. Returns the malloc'd delta and its
+// length in *delta_len, or NULL once the delta would exceed max_len bytes
+// (0 means no limit) or memory runs out.
+unsigned char *delta_create(const DeltaIndex *index, const unsigned char *target, size_t target_len,
+                            size_t max_len, size_t *delta_len);
+
+#endif
@@ -0,0 +1,146 @@
+#include "diff_tree.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include "hash.h"
+#include "tree.h"
+
+#define MODE_TYPE 0170000
+
+typedef struct {
+    const DiffOptions *opts;
+    tree_change_fn fn;
+    void *arg;
+    char path[PATH_MAX];
+} DiffState;
+
+static int diff_level(DiffState *st, const unsigned char *old_tree, const unsigned char *new_tree,
+                      size_t len, int all);
+
+
+// 2 when path is a pathspec or lies below one, 1 when it is a tree on the
+// way down to one, 0 when neither
+static int match_paths(const DiffOptions *opts, const char *path, size_t len, int is_tree) {
+    if (opts->path_count == 0) return 2;
+    int ret = 0;
+    for (size_t i = 0; i < opts->path_count; i++) {
+        const char *spec = opts->paths[i];
+        size_t spec_len = strlen(spec);
+        int dir_only = 0;
+        while (spec_len > 0 && spec[spec_len - 1] == '/') {
+            spec_len--;
+            dir_only = 1;
+        }
+        if (spec_len == 0) return 2;
+        if (len >= spec_len && memcmp(path, spec, spec_len) == 0) {
+            if (len == spec_len ? !dir_only || is_tree : path[spec_len] == '/') return 2;
+        }
+        if (is_tree && spec_len > len && memcmp(spec, path, len) == 0 && spec[len] == '/') ret = 1;
+    }
+    return ret;
+}
+
+
+// One side's iterator: `has` is 1 while `entry` holds its next entry
+typedef struct {
+    TreeIterator it;
+    TreeEntryView entry;
+    int open, has;
+} Side;
+
+
+static int side_open(Side *side, const unsigned char *raw_hash) {
+    side->open = side->has = 0;
+    if (!raw_hash) return 0;
+    if (tree_iter_open(&side->it, raw_hash) < 0) {
+        char hex[41];
+        hash_to_hex(hex, raw_hash);
+        fprintf(stderr, "error: unable to read tree %s\n", hex);
+        return -1;
+    }
+    side->open = 1;
+    side->has = tree_iter_next(&side->it, &side->entry);
+    return 0;
+}
+
+
+static void side_advance(Side *side) {
+    side->has = tree_iter_next(&side->it, &side->entry);
+}
+
+
+// An entry that differs: changed subtrees are descended into when recursive,
+// anything else goes to the callback
+static int report(DiffState *st, const TreeEntryView *old, const TreeEntryView *new, size_t len, int all) {
+    const TreeEntryView *e = old ? old : new;
+    if (e->mode == 040000 && st->opts->recursive) {
+        st->path[len] = '/';
+        return diff_level(st, old ? old->raw_hash : NULL, new ? new->raw_hash : NULL, len + 1, all);
+    }
+
+    TreeChange change = {
+        .path = st->path,
+        .old_mode = old ? old->mode : 0,
+        .new_mode = new ? new->mode : 0,
+        .old_hash = old ? old->raw_hash : NULL,
+        .new_hash = new ? new->raw_hash : NULL,
+        .status = !old ? 'A' : !new ? 'D' : (old->mode & MODE_TYPE) != (new->mode & MODE_TYPE) ? 'T' : 'M',
+    };
+    return st->fn(&change, st->arg);
+}
+
+
+// Merges the entries of two trees; `all` says the whole level is inside a pathspec
+static int diff_level(DiffState *st, const unsigned char *old_tree, const unsigned char *new_tree,
+                      size_t len, int all) {
+    Side a, b;
+    if (side_open(&a, old_tree) < 0) return -1;
+    if (side_open(&b, new_tree) < 0) {
+        if (a.open) tree_iter_close(&a.it);
+        return -1;
+    }
+
+    int ret = 0;
+    while (ret == 0 && (a.has == 1 || b.has == 1)) {
+        if (a.has < 0 || b.has < 0) {
+            fprintf(stderr, "error: corrupt tree object under '%.*s'\n", (int)len, st->path);
+            ret = -1;
+            break;
+        }
+        int cmp = !a.has ? 1 : !b.has ? -1 :
+                  tree_entry_cmp(a.entry.name, a.entry.name_len, a.entry.mode == 040000,
+                                 b.entry.name, b.entry.name_len, b.entry.mode == 040000);
+        if (cmp == 0 && a.entry.mode == b.entry.mode && memcmp(a.entry.raw_hash, b.entry.raw_hash, 20) == 0) {
+            side_advance(&a); // identical, subtrees included: nothing to look at
+            side_advance(&b);
+            continue;
+        }
+
+        const TreeEntryView *e = cmp <= 0 ? &a.entry : &b.entry;
+        if (len + e->name_len + 2 > sizeof(st->path)) {
+            fprintf(stderr, "error: path too long under '%.*s'\n", (int)len, st->path);
+            ret = -1;
+            break;
+        }
+        memcpy(st->path + len, e->name, e->name_len + 1);
+        int match = all ? 2 : match_paths(st->opts, st->path, len + e->name_len, e->mode == 040000);
+        if (match) ret = report(st, cmp <= 0 ? &a.entry : NULL, cmp >= 0 ? &b.entry : NULL, len + e->name_len, match == 2);
+        if (cmp <= 0) side_advance(&a);
+        if (cmp >= 0) side_advance(&b);
+    }
+
+    if (a.open) tree_iter_close(&a.it);
+    if (b.open) tree_iter_close(&b.it);
+    return ret;
+}
+
+
+int diff_trees(const unsigned char *old_tree, const unsigned char *new_tree, const DiffOptions *opts,
+               tree_change_fn fn, void *arg) {
+    static const DiffOptions everything = { 0 };
+    DiffState st = { .opts = opts ? opts : &everything, .fn = fn, .arg = arg };
+    if (old_tree && new_tree && memcmp(old_tree, new_tree, 20) == 0) return 0;
+    return diff_level(&st, old_tree, new_tree, 0, st.opts->path_count == 0);
+}
@@ -0,0 +1,36 @@
+#ifndef DIFF_TREE_H
+#define DIFF_TREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Differences between two trees, found by walking both in one merge pass
+// over their sorted entries (see TreeIterator). Entries with the same name,
+// mode and hash are skipped without a look inside, so a subtree nobody
+// touched costs one comparison however big it is, and only the trees along
+// changed paths are ever inflated.
+
+typedef struct {
+    const char *path;               // from the root, e.g. "d/e/f"
+    uint32_t old_mode, new_mode;    // 0 on the side where the entry doesn't exist
+    const unsigned char *old_hash;  // NULL where the entry doesn't exist
+    const unsigned char *new_hash;
+    char status;                    // 'A', 'D', 'M', or 'T' when a blob turns into a symlink
+} TreeChange;
+
+// A nonzero return stops the diff and is passed back
+typedef int (*tree_change_fn)(const TreeChange *change, void *arg);
+
+typedef struct {
+    int recursive;                  // report the files in changed subtrees, not the subtrees
+    const char *const *paths;       // only these paths and what's below them; "dir/" only a directory
+    size_t path_count;              // 0: everything
+} DiffOptions;
+
+// Compares old_tree to new_tree; either may be NULL for an empty tree.
+// Returns 0 when done, fn's nonzero return, or -1 when a tree is missing or
+// corrupt (reported).
+int diff_trees(const unsigned char *old_tree, const unsigned char *new_tree, const DiffOptions *opts,
+               tree_change_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,1194 @@
+#include "fast_import.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bulk_checkin.h"
+#include "delta.h"
+#include "hash.h"
+#include "object_store.h"
+#include "refs.h"
+#include "trace.h"
+#include "tree.h"
+
+#define MAX_ACTIVE_BRANCHES 5     // branches whose trees stay in memory between commits
+#define MAX_DELTA_DEPTH 10        // a tree is written whole again after this many deltas
+#define MODE_TREE "40000"
+
+// Buffered stream reader: commands are lines, data is counted bytes. Lines
+// are NUL-terminated in place and stay valid until the next read.
+typedef struct {
+    int fd;
+    char *buf;
+    size_t cap, start, end;      // unread bytes are buf[start..end)
+    char *line;                  // the last line returned
+    int pushed_back;             // hand `line` out again on the next read_line
+    int eof, failed;
+} Input;
+
+// An in-memory tree: the records of one directory plus whichever of its
+// subtrees a change has reached. A tree that was never touched is just its
+// hash until something descends into it.
+typedef struct Dir {
+    Tree tree;                   // in git order, so write_tree_entries finds it sorted
+    struct Dir **subdirs;        // parallel to tree.entries: the loaded subtree, or NULL
+    size_t cap;
+    unsigned char raw_hash[20];  // as last loaded or written
+    int loaded;
+    int dirty;                   // raw_hash no longer matches the records
+    unsigned char *written;      // the payload last written for raw_hash, the next version's delta base
+    size_t written_len;
+    uint32_t depth;              // delta chain length of that object
+} Dir;
+
+typedef struct {
+    char *name;                  // full ref name
+    unsigned char tip[20];
+    unsigned char tree_hash[20]; // the tip's tree
+    int has_tip;
+    Dir *root;                   // NULL while inactive; rebuilt from tree_hash on next use
+    uint64_t last_used;
+} Branch;
+
+typedef struct {
+    unsigned char raw_hash[20];
+    unsigned char tree_hash[20]; // commits made here: their tree, so branching off needs no read
+    uint8_t set;
+    uint8_t type;                // OBJ_NONE for marks imported from a file
+} Mark;
+
+typedef struct {
+    char *ref;
+    unsigned char raw_hash[20];
+} TagRef;
+
+typedef struct {
+    Input in;
+    Mark *marks;
+    size_t mark_cap;
+    Branch **table;              // open-addressed by name
+    size_t table_mask, branch_count;
+    TagRef *tags;
+    size_t tag_count, tag_cap;
+    size_t active;               // branches with a root in memory
+    uint64_t clock;
+    int require_done;
+    size_t counts[5];            // per ObjectType
+} FastImport;
+
+static const unsigned char null_hash[20];
+
+
+// ---- input ----------------------------------------------------------------
+
+// Moves the unread bytes to the front and reads more, keeping one byte
+// spare for a terminator; grows the buffer when a line fills all of it
+static int input_fill(Input *in) {
+    if (in->start > 0) {
+        memmove(in->buf, in->buf + in->start, in->end - in->start);
+        in->end -= in->start;
+        in->start = 0;
+    }
+    if (in->end + 1 >= in->cap) {
+        size_t cap = in->cap ? in->cap * 2 : 1 << 16;
+        char *grown = realloc(in->buf, cap);
+        if (!grown) { perror("realloc"); in->failed = 1; return -1; }
+        in->buf = grown;
+        in->cap = cap;
+    }
+    ssize_t n;
+    do {
+        n = read(in->fd, in->buf + in->end, in->cap - 1 - in->end);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) { perror("read"); in->failed = 1; return -1; }
+    if (n == 0) in->eof = 1;
+    in->end += (size_t)n;
+    return 0;
+}
+
+
+// The next line without its LF, or NULL at the end of the stream
+static char *read_line(Input *in) {
+    if (in->pushed_back) {
+        in->pushed_back = 0;
+        return in->line;
+    }
+    for (;;) {
+        char *nl = memchr(in->buf + in->start, '\n', in->end - in->start);
+        if (nl || (in->eof && in->start < in->end)) {
+            char *stop = nl ? nl : in->buf + in->end;
+            *stop = '\0';
+            in->line = in->buf + in->start;
+            in->start = (size_t)(stop - in->buf) + (nl ? 1 : 0);
+            return in->line;
+        }
+        if (in->eof || input_fill(in) < 0) return NULL;
+    }
+}
+
+
+static int read_exact(Input *in, unsigned char *dst, size_t len) {
+    size_t have = in->end - in->start < len ? in->end - in->start : len;
+    memcpy(dst, in->buf + in->start, have);
+    in->start += have;
+    while (have < len) {
+        ssize_t n = read(in->fd, dst + have, len - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) { perror("read"); return -1; }
+        if (n == 0) { fprintf(stderr, "fatal: stream ends inside a data block\n"); return -1; }
+        have += (size_t)n;
+    }
+    return 0;
+}
+
+
+// "data <count>" and exactly that many bytes, or "data <<<delim>" and the
+// lines up to one holding just the delimiter. *data is malloc'd.
+static int read_data(Input *in, const char *line, unsigned char **data, size_t *len) {
+    if (strncmp(line, "data ", 5) != 0) {
+        fprintf(stderr, "fatal: expected 'data' command, got: %s\n", line);
+        return -1;
+    }
+    const char *arg = line + 5;
+
+    if (strncmp(arg, "<<", 2) == 0) {
+        char *delim = strdup(arg + 2);
+        size_t cap = 256, size = 0;
+        char *buf = malloc(cap);
+        if (!delim || !buf) { perror("malloc"); free(delim); free(buf); return -1; }
+        char *l;
+        while ((l = read_line(in)) && strcmp(l, delim) != 0) {
+            size_t n = strlen(l);
+            if (size + n + 2 > cap) {
+                while (size + n + 2 > cap) cap *= 2;
+                char *grown = realloc(buf, cap);
+                if (!grown) { perror("realloc"); free(delim); free(buf); return -1; }
+                buf = grown;
+            }
+            memcpy(buf + size, l, n);
+            size += n;
+            buf[size++] = '\n';
+        }
+        free(delim);
+        if (!l) { fprintf(stderr, "fatal: unterminated delimited data\n"); free(buf); return -1; }
+        *data = (unsigned char *)buf;
+        *len = size;
+        return 0;
+    }
+
+    char *end;
+    errno = 0;
+    unsigned long long size = strtoull(arg, &end, 10);
+    if (errno || end == arg || *end || size >= SIZE_MAX) {
+        fprintf(stderr, "fatal: invalid data length: %s\n", arg);
+        return -1;
+    }
+    *data = malloc((size_t)size + 1);
+    if (!*data) { perror("malloc"); return -1; }
+    if (read_exact(in, *data, (size_t)size) < 0) { free(*data); return -1; }
+    *len = (size_t)size;
+
+    // An LF after the data is optional
+    if (in->start == in->end && !in->eof) input_fill(in);
+    if (in->start < in->end && in->buf[in->start] == '\n') in->start++;
+    return 0;
+}
+
+
+// A path as the rest of the line, or C-quoted as fast-export writes names
+// with unusual bytes in them. With `first`, an unquoted path ends at a space
+// (the source of C and R). *end is left after the path.
+static int parse_path(const char *s, char *out, size_t size, int first, const char **end) {
+    size_t n = 0;
+    if (*s != '"') {
+        size_t len = first ? strcspn(s, " ") : strlen(s);
+        if (len == 0 || len >= size) goto bad;
+        memcpy(out, s, len);
+        out[len] = '\0';
+        *end = s + len;
+        return 0;
+    }
+
+    const char *p = s + 1;
+    while (*p && *p != '"') {
+        if (n + 1 >= size) goto bad;
+        if (*p != '\\') { out[n++] = *p++; continue; }
+        p++;
+        switch (*p) {
+        case 'a': out[n++] = '\a'; p++; break;
+        case 'b': out[n++] = '\b'; p++; break;
+        case 'f': out[n++] = '\f'; p++; break;
+        case 'n': out[n++] = '\n'; p++; break;
+        case 'r': out[n++] = '\r'; p++; break;
+        case 't': out[n++] = '\t'; p++; break;
+        case 'v': out[n++] = '\v'; p++; break;
+        case '"': case '\\': out[n++] = *p++; break;
+        default:
+            if (p[0] < '0' || p[0] > '3' || p[1] < '0' || p[1] > '7' || p[2] < '0' || p[2] > '7') goto bad;
+            out[n++] = (char)(((p[0] - '0') << 6) | ((p[1] - '0') << 3) | (p[2] - '0'));
+            p += 3;
+        }
+    }
+    if (*p != '"' || n == 0) goto bad;
+    out[n] = '\0';
+    *end = p + 1;
+    return 0;
+
+bad:
+    fprintf(stderr, "fatal: invalid path: %s\n", s);
+    return -1;
+}
+
+
+// ---- in-memory trees ------------------------------------------------------
+
+static int entry_is_tree(const Entry *e) {
+    return strcmp(e->mode, MODE_TREE) == 0;
+}
+
+
+// An empty tree when raw_hash is NULL, else the tree it names, read on first use
+static Dir *dir_new(const unsigned char raw_hash[20]) {
+    Dir *d = calloc(1, sizeof(Dir));
+    if (!d) { perror("calloc"); return NULL; }
+    if (raw_hash) memcpy(d->raw_hash, raw_hash, 20);
+    d->loaded = raw_hash == NULL;
+    d->dirty = raw_hash == NULL;
+    return d;
+}
+
+
+static void dir_free(Dir *d) {
+    if (!d) return;
+    for (size_t i = 0; i < d->tree.count; i++) {
+        free(d->tree.entries[i].file_name);
+        dir_free(d->subdirs[i]);
+    }
+    free(d->tree.entries);
+    free(d->subdirs);
+    free(d->written);
+    free(d);
+}
+
+
+static int dir_reserve(Dir *d, size_t count) {
+    if (count <= d->cap) return 0;
+    size_t cap = d->cap ? d->cap * 2 : 8;
+    while (cap < count) cap *= 2;
+    Entry *entries = realloc(d->tree.entries, cap * sizeof(Entry));
+    if (entries) d->tree.entries = entries;
+    Dir **subdirs = entries ? realloc(d->subdirs, cap * sizeof(Dir *)) : NULL;
+    if (!subdirs) { perror("realloc"); return -1; }
+    d->subdirs = subdirs;
+    d->cap = cap;
+    return 0;
+}
+
+
+static int dir_load(Dir *d) {
+    if (d->loaded) return 0;
+    ObjectType type;
+    unsigned char *data;
+    size_t size;
+    char hex[41];
+    int status = read_object(d->raw_hash, &type, &data, &size);
+    if (status < 0 || type != OBJ_TREE) {
+        if (status == 0) free(data);
+        hash_to_hex(hex, d->raw_hash);
+        fprintf(stderr, "fatal: not a tree: %s\n", hex);
+        return -1;
+    }
+
+    // "<mode> <name>\0<20-byte sha>" records, already in git order
+    const unsigned char *p = data, *end = data + size;
+    while (p < end) {
+        const unsigned char *space = memchr(p, ' ', (size_t)(end - p));
+        const unsigned char *nul = space ? memchr(space, '\0', (size_t)(end - space)) : NULL;
+        if (!nul || space - p > 6 || end - nul < 21 || dir_reserve(d, d->tree.count + 1) < 0) {
+            hash_to_hex(hex, d->raw_hash);
+            fprintf(stderr, "fatal: corrupt tree object %s\n", hex);
+            free(data);
+            return -1;
+        }
+        Entry *e = &d->tree.entries[d->tree.count];
+        memcpy(e->mode, p, (size_t)(space - p));
+        e->mode[space - p] = '\0';
+        e->name_len = (size_t)(nul - space - 1);
+        e->file_name = strndup((const char *)space + 1, e->name_len);
+        if (!e->file_name) { perror("strndup"); free(data); return -1; }
+        memcpy(e->raw_hash, nul + 1, 20);
+        d->subdirs[d->tree.count++] = NULL;
+        p = nul + 21;
+    }
+    free(data);
+    d->loaded = 1;
+    return 0;
+}
+
+
+// Where a record named `name` of the given kind is, or would go; *found says which
+static size_t dir_search(const Dir *d, const char *name, size_t len, int is_tree, int *found) {
+    size_t lo = 0, hi = d->tree.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const Entry *e = &d->tree.entries[mid];
+        int c = tree_entry_cmp(e->file_name, e->name_len, entry_is_tree(e), name, len, is_tree);
+        if (c == 0) { *found = 1; return mid; }
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    *found = 0;
+    return lo;
+}
+
+
+// The record named `name`, whichever kind it is, or -1
+static ssize_t dir_find(const Dir *d, const char *name, size_t len) {
+    int found;
+    size_t pos = dir_search(d, name, len, 0, &found);
+    if (!found) pos = dir_search(d, name, len, 1, &found);
+    return found ? (ssize_t)pos : -1;
+}
+
+
+static void dir_remove(Dir *d, size_t pos) {
+    free(d->tree.entries[pos].file_name);
+    dir_free(d->subdirs[pos]);
+    size_t tail = d->tree.count - pos - 1;
+    memmove(&d->tree.entries[pos], &d->tree.entries[pos + 1], tail * sizeof(Entry));
+    memmove(&d->subdirs[pos], &d->subdirs[pos + 1], tail * sizeof(Dir *));
+    d->tree.count--;
+}
+
+
+// Replaces whatever is called `name` with a new record
+static int dir_put(Dir *d, const char *name, size_t len, const char *mode, const unsigned char raw_hash[20], Dir *sub) {
+    ssize_t old = dir_find(d, name, len);
+    if (old >= 0) dir_remove(d, (size_t)old);
+
+    int found;
+    size_t pos = dir_search(d, name, len, strcmp(mode, MODE_TREE) == 0, &found);
+    char *file_name = strndup(name, len);
+    if (!file_name || dir_reserve(d, d->tree.count + 1) < 0) { free(file_name); return -1; }
+    memmove(&d->tree.entries[pos + 1], &d->tree.entries[pos], (d->tree.count - pos) * sizeof(Entry));
+    memmove(&d->subdirs[pos + 1], &d->subdirs[pos], (d->tree.count - pos) * sizeof(Dir *));
+    Entry *e = &d->tree.entries[pos];
+    strcpy(e->mode, mode);
+    e->file_name = file_name;
+    e->name_len = len;
+    memcpy(e->raw_hash, raw_hash, 20);
+    d->subdirs[pos] = sub;
+    d->tree.count++;
+    d->dirty = 1;
+    return 0;
+}
+
+
+// The subtree at record `pos`, read in if need be
+static Dir *dir_descend(Dir *d, size_t pos) {
+    if (!d->subdirs[pos]) d->subdirs[pos] = dir_new(d->tree.entries[pos].raw_hash);
+    Dir *sub = d->subdirs[pos];
+    return sub && dir_load(sub) == 0 ? sub : NULL;
+}
+
+
+// A new version of a directory mostly repeats the last one, so it goes into
+// the pack as a delta against it. Returns 1 when it has to be written whole.
+static int write_tree_delta(Dir *d, const unsigned char *data, size_t len, const unsigned char raw_hash[20]) {
+    if (!d->written || d->depth >= MAX_DELTA_DEPTH) return 1;
+    DeltaIndex *index = delta_index_create(d->written, d->written_len);
+    size_t delta_len;
+    unsigned char *delta = index ? delta_create(index, data, len, len / 2, &delta_len) : NULL;
+    delta_index_free(index);
+    if (!delta) return 1;
+    int status = bulk_checkin_write_delta(raw_hash, d->raw_hash, delta, delta_len);
+    free(delta);
+    return status;
+}
+
+
+// Serializes every changed directory below and including d, bottom up
+static int dir_write(FastImport *fi, Dir *d) {
+    if (!d->dirty) return 0;
+    for (size_t i = 0; i < d->tree.count; i++) {
+        Dir *sub = d->subdirs[i];
+        if (!sub || !sub->dirty) continue;
+        if (dir_write(fi, sub) < 0) return -1;
+        memcpy(d->tree.entries[i].raw_hash, sub->raw_hash, 20);
+    }
+
+    size_t len;
+    unsigned char raw_hash[20];
+    unsigned char *data = serialize_tree_entries(&d->tree, &len);
+    if (!data) return -1;
+    hash_object("tree", data, len, raw_hash);
+    int status = 0;
+    uint32_t depth = MAX_DELTA_DEPTH; // an existing object's chain is unknown: don't extend it
+    if (!object_exists_quick(raw_hash)) {
+        status = write_tree_delta(d, data, len, raw_hash);
+        depth = status == 0 ? d->depth + 1 : 0;
+        if (status == 1) status = bulk_checkin_write(OBJ_TREE, data, len, raw_hash);
+        fi->counts[OBJ_TREE]++;
+    }
+    if (status < 0) { free(data); return -1; }
+
+    free(d->written);
+    d->written = data;
+    d->written_len = len;
+    d->depth = depth;
+    memcpy(d->raw_hash, raw_hash, 20);
+    d->dirty = 0;
+    return 0;
+}
+
+
+// M: every directory on the way is created, or replaces a file of its name
+static int tree_set(Dir *d, const char *path, const char *mode, const unsigned char raw_hash[20]) {
+    for (;;) {
+        if (dir_load(d) < 0) return -1;
+        const char *slash = strchr(path, '/');
+        size_t len = slash ? (size_t)(slash - path) : strlen(path);
+        if (len == 0 || (len == 1 && path[0] == '.') || (len == 2 && memcmp(path, "..", 2) == 0)) {
+            fprintf(stderr, "fatal: invalid path component in: %s\n", path);
+            return -1;
+        }
+        if (!slash) return dir_put(d, path, len, mode, raw_hash, NULL);
+
+        int found;
+        size_t pos = dir_search(d, path, len, 1, &found);
+        if (!found) {
+            Dir *sub = dir_new(NULL);
+            if (!sub || dir_put(d, path, len, MODE_TREE, null_hash, sub) < 0) { dir_free(sub); return -1; }
+            pos = dir_search(d, path, len, 1, &found);
+        }
+        d->dirty = 1;
+        if (!(d = dir_descend(d, pos))) return -1;
+        path = slash + 1;
+    }
+}
+
+
+// D: returns 1 when the path was there, 0 when not. Directories left empty go too.
+static int tree_delete(Dir *d, const char *path) {
+    if (dir_load(d) < 0) return -1;
+    const char *slash = strchr(path, '/');
+    if (!slash || !slash[1]) {
+        ssize_t pos = dir_find(d, path, slash ? (size_t)(slash - path) : strlen(path));
+        if (pos < 0) return 0;
+        dir_remove(d, (size_t)pos);
+        d->dirty = 1;
+        return 1;
+    }
+
+    int found;
+    size_t pos = dir_search(d, path, (size_t)(slash - path), 1, &found);
+    if (!found) return 0;
+    Dir *sub = dir_descend(d, pos);
+    if (!sub) return -1;
+    int status = tree_delete(sub, slash + 1);
+    if (status <= 0) return status;
+    d->dirty = 1;
+    if (sub->tree.count == 0) dir_remove(d, pos);
+    return 1;
+}
+
+
+// The record at `path` for C and R, with its hash brought up to date
+static int tree_get(FastImport *fi, Dir *d, const char *path, char mode[7], unsigned char raw_hash[20]) {
+    for (;;) {
+        if (dir_load(d) < 0) return -1;
+        const char *slash = strchr(path, '/');
+        size_t len = slash ? (size_t)(slash - path) : strlen(path);
+        int found = 0;
+        size_t pos = 0;
+        if (!slash) {
+            ssize_t at = dir_find(d, path, len);
+            found = at >= 0;
+            pos = found ? (size_t)at : 0;
+        } else {
+            pos = dir_search(d, path, len, 1, &found);
+        }
+        if (!found) {
+            fprintf(stderr, "fatal: path not in branch: %s\n", path);
+            return -1;
+        }
+        if (!slash) {
+            Dir *sub = d->subdirs[pos];
+            if (sub && sub->dirty) {
+                if (dir_write(fi, sub) < 0) return -1;
+                memcpy(d->tree.entries[pos].raw_hash, sub->raw_hash, 20);
+            }
+            strcpy(mode, d->tree.entries[pos].mode);
+            memcpy(raw_hash, d->tree.entries[pos].raw_hash, 20);
+            return 0;
+        }
+        if (!(d = dir_descend(d, pos))) return -1;
+        path = slash + 1;
+    }
+}
+
+
+// ---- marks, branches and object names --------------------------------------
+
+static Mark *mark_slot(FastImport *fi, const char *spec) {
+    char *end;
+    errno = 0;
+    unsigned long long id = spec[0] == ':' ? strtoull(spec + 1, &end, 10) : 0;
+    if (id == 0 || errno || *end || id > (1ull << 32)) {
+        fprintf(stderr, "fatal: invalid mark: %s\n", spec);
+        return NULL;
+    }
+    if (id >= fi->mark_cap) {
+        size_t cap = fi->mark_cap ? fi->mark_cap : 1024;
+        while (cap <= id) cap *= 2;
+        Mark *grown = realloc(fi->marks, cap * sizeof(Mark));
+        if (!grown) { perror("realloc"); return NULL; }
+        memset(grown + fi->mark_cap, 0, (cap - fi->mark_cap) * sizeof(Mark));
+        fi->marks = grown;
+        fi->mark_cap = cap;
+    }
+    return &fi->marks[id];
+}
+
+
+static int set_mark(FastImport *fi, const char *spec, ObjectType type, const unsigned char raw_hash[20],
+                    const unsigned char tree_hash[20]) {
+    Mark *m = mark_slot(fi, spec);
+    if (!m) return -1;
+    memcpy(m->raw_hash, raw_hash, 20);
+    if (tree_hash) memcpy(m->tree_hash, tree_hash, 20);
+    m->set = 1;
+    m->type = (uint8_t)type;
+    return 0;
+}
+
+
+static uint64_t name_hash(const char *name) {
+    uint64_t h = 14695981039346656037ull; // FNV-1a
+    for (; *name; name++) h = (h ^ (unsigned char)*name) * 1099511628211ull;
+    return h;
+}
+
+
+static Branch *branch_lookup(FastImport *fi, const char *name, int create) {
+    if (fi->table) {
+        for (size_t i = name_hash(name) & fi->table_mask; fi->table[i]; i = (i + 1) & fi->table_mask) {
+            if (strcmp(fi->table[i]->name, name) == 0) return fi->table[i];
+        }
+    }
+    if (!create) return NULL;
+
+    // Keep the table at most half full
+    if (!fi->table || (fi->branch_count + 1) * 2 > fi->table_mask + 1) {
+        size_t size = fi->table ? (fi->table_mask + 1) * 2 : 64;
+        Branch **table = calloc(size, sizeof(Branch *));
+        if (!table) { perror("calloc"); return NULL; }
+        for (size_t i = 0; fi->table && i <= fi->table_mask; i++) {
+            if (!fi->table[i]) continue;
+            size_t j = name_hash(fi->table[i]->name) & (size - 1);
+            while (table[j]) j = (j + 1) & (size - 1);
+            table[j] = fi->table[i];
+        }
+        free(fi->table);
+        fi->table = table;
+        fi->table_mask = size - 1;
+    }
+
+    Branch *b = calloc(1, sizeof(Branch));
+    if (b) b->name = strdup(name);
+    if (!b || !b->name) { perror("calloc"); free(b); return NULL; }
+    size_t i = name_hash(name) & fi->table_mask;
+    while (fi->table[i]) i = (i + 1) & fi->table_mask;
+    fi->table[i] = b;
+    fi->branch_count++;
+    return b;
+}
+
+
+static void branch_deactivate(FastImport *fi, Branch *b) {
+    if (!b->root) return;
+    dir_free(b->root);
+    b->root = NULL;
+    fi->active--;
+}
+
+
+// Gives b a tree in memory, dropping the least recently used other one once
+// more than MAX_ACTIVE_BRANCHES have theirs; an inactive branch's tree is
+// clean, so it comes back from its tip's tree hash
+static int branch_activate(FastImport *fi, Branch *b) {
+    b->last_used = ++fi->clock;
+    if (b->root) return 0;
+    if (!(b->root = dir_new(b->has_tip ? b->tree_hash : NULL))) return -1;
+    if (++fi->active <= MAX_ACTIVE_BRANCHES) return 0;
+
+    Branch *lru = NULL;
+    for (size_t i = 0; i <= fi->table_mask; i++) {
+        Branch *o = fi->table[i];
+        if (o && o != b && o->root && (!lru || o->last_used < lru->last_used)) lru = o;
+    }
+    if (lru) branch_deactivate(fi, lru);
+    return 0;
+}
+
+
+// A mark, a branch of this import, a full ref name or a 40-digit object name
+static int resolve_object(FastImport *fi, const char *spec, unsigned char raw_hash[20], ObjectType *type) {
+    if (spec[0] == ':') {
+        Mark *m = mark_slot(fi, spec);
+        if (!m) return -1;
+        if (!m->set) { fprintf(stderr, "fatal: mark %s not declared\n", spec); return -1; }
+        memcpy(raw_hash, m->raw_hash, 20);
+        *type = (ObjectType)m->type;
+    } else {
+        Branch *b = branch_lookup(fi, spec, 0);
+        if (b && b->has_tip) {
+            memcpy(raw_hash, b->tip, 20);
+            *type = OBJ_COMMIT;
+            return 0;
+        }
+        // A ref from before this import, loose or packed, or a full object name
+        int status = strncmp(spec, "refs/", 5) == 0 ? read_ref(spec, raw_hash) : hex_to_hash(raw_hash, spec);
+        if (status != 0) {
+            if (status > 0 || strncmp(spec, "refs/", 5) != 0)
+                fprintf(stderr, "fatal: not a valid object name: %s\n", spec);
+            return -1;
+        }
+        *type = OBJ_NONE;
+    }
+    if (*type != OBJ_NONE) return 0;
+
+    // Named from outside this import: ask the object database
+    unsigned char *data;
+    size_t size;
+    if (read_object(raw_hash, type, &data, &size) < 0) {
+        char name[41];
+        hash_to_hex(name, raw_hash);
+        fprintf(stderr, "fatal: not a valid object name: %s\n", name);
+        return -1;
+    }
+    free(data);
+    return 0;
+}
+
+
+// As resolve_object, for a commit; fills its tree too
+static int resolve_commit(FastImport *fi, const char *spec, unsigned char commit[20], unsigned char tree[20]) {
+    Branch *b = spec[0] == ':' ? NULL : branch_lookup(fi, spec, 0);
+    if (b && b->has_tip) {
+        memcpy(commit, b->tip, 20);
+        memcpy(tree, b->tree_hash, 20);
+        return 0;
+    }
+    if (spec[0] == ':') {
+        Mark *m = mark_slot(fi, spec);
+        if (m && m->set && m->type == OBJ_COMMIT) {
+            memcpy(commit, m->raw_hash, 20);
+            memcpy(tree, m->tree_hash, 20);
+            return 0;
+        }
+    }
+
+    ObjectType type;
+    if (resolve_object(fi, spec, commit, &type) < 0) return -1;
+    unsigned char *data;
+    size_t size;
+    if (type != OBJ_COMMIT || read_object(commit, &type, &data, &size) < 0) {
+        fprintf(stderr, "fatal: not a commit: %s\n", spec);
+        return -1;
+    }
+    // "tree <hex>\n" comes first
+    int ok = size > 45 && memcmp(data, "tree ", 5) == 0 && data[45] == '\n';
+    if (ok) {
+        data[45] = '\0';
+        ok = hex_to_hash(tree, (char *)data + 5) == 0;
+    }
+    free(data);
+    if (!ok) { fprintf(stderr, "fatal: corrupt commit: %s\n", spec); return -1; }
+    return 0;
+}
+
+
+static int write_object(FastImport *fi, ObjectType type, const unsigned char *payload, size_t len,
+                        unsigned char raw_hash[20]) {
+    if (write_loose_object(object_type_name(type), payload, len, raw_hash) < 0) return -1;
+    fi->counts[type]++;
+    return 0;
+}
+
+
+// ---- commands --------------------------------------------------------------
+
+// "mark :<n>" if it is the next line
+static int read_mark(Input *in, char mark[32]) {
+    char *line = read_line(in);
+    mark[0] = '\0';
+    if (line && strncmp(line, "mark ", 5) == 0) {
+        snprintf(mark, 32, "%s", line + 5);
+    } else if (line) {
+        in->pushed_back = 1;
+    }
+    return 0;
+}
+
+
+// "<prefix><value>" as a malloc'd value if it is the next line, else NULL
+static char *read_optional(Input *in, const char *prefix) {
+    char *line = read_line(in);
+    if (!line) return NULL;
+    size_t len = strlen(prefix);
+    if (strncmp(line, prefix, len) != 0) {
+        in->pushed_back = 1;
+        return NULL;
+    }
+    char *value = strdup(line + len);
+    if (!value) perror("strdup");
+    return value;
+}
+
+
+static int parse_blob(FastImport *fi) {
+    char mark[32];
+    read_mark(&fi->in, mark);
+    free(read_optional(&fi->in, "original-oid "));
+
+    char *line = read_line(&fi->in);
+    unsigned char *data;
+    size_t len;
+    if (!line || read_data(&fi->in, line, &data, &len) < 0) return -1;
+    unsigned char raw_hash[20];
+    int status = write_object(fi, OBJ_BLOB, data, len, raw_hash);
+    free(data);
+    if (status == 0 && *mark) status = set_mark(fi, mark, OBJ_BLOB, raw_hash, NULL);
+    return status;
+}
+
+
+static const char *parse_mode(const char *s, size_t len) {
+    static const struct { const char *in, *out; } modes[] = {
+        { "644", "100644" }, { "100644", "100644" }, { "755", "100755" }, { "100755", "100755" },
+        { "120000", "120000" }, { "160000", "160000" }, { "040000", MODE_TREE }, { "40000", MODE_TREE },
+    };
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        if (strlen(modes[i].in) == len && memcmp(modes[i].in, s, len) == 0) return modes[i].out;
+    }
+    return NULL;
+}
+
+
+// "M <mode> <dataref> <path>", where the data can follow inline
+static int file_modify(FastImport *fi, Dir *root, const char *line) {
+    const char *mode_end = strchr(line, ' ');
+    const char *mode = mode_end ? parse_mode(line, (size_t)(mode_end - line)) : NULL;
+    const char *ref = mode_end ? mode_end + 1 : NULL;
+    const char *ref_end = ref ? strchr(ref, ' ') : NULL;
+    if (!mode || !ref_end) {
+        fprintf(stderr, "fatal: invalid file change: M %s\n", line);
+        return -1;
+    }
+
+    char path[PATH_MAX], spec[64];
+    const char *end;
+    if (parse_path(ref_end + 1, path, sizeof(path), 0, &end) < 0) return -1;
+    snprintf(spec, sizeof(spec), "%.*s", (int)(ref_end - ref), ref);
+
+    unsigned char raw_hash[20];
+    if (strcmp(spec, "inline") == 0) {
+        char *data_line = read_line(&fi->in);
+        unsigned char *data;
+        size_t len;
+        if (!data_line || read_data(&fi->in, data_line, &data, &len) < 0) return -1;
+        int status = write_object(fi, OBJ_BLOB, data, len, raw_hash);
+        free(data);
+        if (status < 0) return -1;
+    } else if (spec[0] == ':') {
+        ObjectType type;
+        if (resolve_object(fi, spec, raw_hash, &type) < 0) return -1;
+    } else if (hex_to_hash(raw_hash, spec) < 0) {
+        fprintf(stderr, "fatal: invalid dataref: %s\n", spec);
+        return -1;
+    }
+    return tree_set(root, path, mode, raw_hash);
+}
+
+
+// "C <src> <dst>" and "R <src> <dst>"
+static int file_copy(FastImport *fi, Dir *root, const char *line, int rename) {
+    char src[PATH_MAX], dst[PATH_MAX], mode[7];
+    const char *end;
+    unsigned char raw_hash[20];
+    if (parse_path(line, src, sizeof(src), 1, &end) < 0) return -1;
+    if (*end != ' ' || parse_path(end + 1, dst, sizeof(dst), 0, &end) < 0) {
+        fprintf(stderr, "fatal: missing destination: %c %s\n", rename ? 'R' : 'C', line);
+        return -1;
+    }
+    if (tree_get(fi, root, src, mode, raw_hash) < 0) return -1;
+    if (rename && tree_delete(root, src) < 0) return -1;
+    return tree_set(root, dst, mode, raw_hash);
+}
+
+
+static int parse_commit(FastImport *fi, const char *ref) {
+    Branch *b = branch_lookup(fi, ref, 1);
+    if (!b) return -1;
+
+    int ret = -1;
+    char mark[32];
+    read_mark(&fi->in, mark);
+    free(read_optional(&fi->in, "original-oid "));
+    char *author = read_optional(&fi->in, "author ");
+    char *committer = read_optional(&fi->in, "committer ");
+    char *encoding = read_optional(&fi->in, "encoding ");
+    unsigned char *message = NULL, *content = NULL;
+    size_t message_len = 0;
+    unsigned char (*parents)[20] = NULL;
+    size_t parent_count = 0;
+    char *line;
+    if (!committer) {
+        fprintf(stderr, "fatal: commit to %s has no committer\n", ref);
+        goto out;
+    }
+    if (!(line = read_line(&fi->in)) || read_data(&fi->in, line, &message, &message_len) < 0) goto out;
+
+    // The first parent: "from", else the branch's tip
+    char *from = read_optional(&fi->in, "from ");
+    if (from) {
+        unsigned char commit[20], tree[20];
+        int null = hex_to_hash(commit, from) == 0 && memcmp(commit, null_hash, 20) == 0;
+        int status = null ? 0 : resolve_commit(fi, from, commit, tree);
+        free(from);
+        if (status < 0) goto out;
+        // Unless it is where the branch already is, start over from that tree
+        if (null || !b->has_tip || memcmp(commit, b->tip, 20) != 0) {
+            branch_deactivate(fi, b);
+            b->has_tip = !null;
+            memcpy(b->tip, commit, 20);
+            memcpy(b->tree_hash, tree, 20);
+        }
+    }
+    if (b->has_tip) {
+        if (!(parents = malloc(20))) { perror("malloc"); goto out; }
+        memcpy(parents[parent_count++], b->tip, 20);
+    }
+    char *merge;
+    while ((merge = read_optional(&fi->in, "merge "))) {
+        unsigned char commit[20], tree[20];
+        int status = resolve_commit(fi, merge, commit, tree);
+        free(merge);
+        void *grown = status == 0 ? realloc(parents, (parent_count + 1) * 20) : NULL;
+        if (!grown) goto out;
+        parents = grown;
+        memcpy(parents[parent_count++], commit, 20);
+    }
+
+    if (branch_activate(fi, b) < 0) goto out;
+    while ((line = read_line(&fi->in))) {
+        int status = 0;
+        if (strncmp(line, "M ", 2) == 0) {
+            status = file_modify(fi, b->root, line + 2);
+        } else if (strncmp(line, "D ", 2) == 0) {
+            char path[PATH_MAX];
+            const char *end;
+            status = parse_path(line + 2, path, sizeof(path), 0, &end) < 0 ? -1 : tree_delete(b->root, path);
+        } else if (strncmp(line, "C ", 2) == 0 || strncmp(line, "R ", 2) == 0) {
+            status = file_copy(fi, b->root, line + 2, line[0] == 'R');
+        } else if (strcmp(line, "deleteall") == 0) {
+            dir_free(b->root);
+            status = (b->root = dir_new(NULL)) ? 0 : -1;
+        } else if (strncmp(line, "N ", 2) == 0) {
+            fprintf(stderr, "fatal: notes are not supported\n");
+            status = -1;
+        } else {
+            if (*line) fi->in.pushed_back = 1; // the next command; an empty line just ends this one
+            break;
+        }
+        if (status < 0) goto out;
+    }
+    if (fi->in.failed) goto out;
+
+    TraceSpan span;
+    trace_begin(&span, "write trees");
+    int status = dir_write(fi, b->root);
+    trace_end(&span);
+    if (status < 0) goto out;
+
+    // "tree", "parent"s, "author", "committer", maybe "encoding", a blank line and the message
+    size_t cap = 64 + parent_count * 48 + 2 * (strlen(committer) + 16) + (author ? strlen(author) : 0) +
+                 (encoding ? strlen(encoding) + 16 : 0) + message_len;
+    if (!(content = malloc(cap))) { perror("malloc"); goto out; }
+    char hex[41];
+    hash_to_hex(hex, b->root->raw_hash);
+    char *p = (char *)content;
+    p += sprintf(p, "tree %s\n", hex);
+    for (size_t i = 0; i < parent_count; i++) {
+        hash_to_hex(hex, parents[i]);
+        p += sprintf(p, "parent %s\n", hex);
+    }
+    p += sprintf(p, "author %s\ncommitter %s\n", author ? author : committer, committer);
+    if (encoding) p += sprintf(p, "encoding %s\n", encoding);
+    *p++ = '\n';
+    memcpy(p, message, message_len);
+    p += message_len;
+
+    unsigned char raw_hash[20];
+    if (write_object(fi, OBJ_COMMIT, content, (size_t)(p - (char *)content), raw_hash) < 0) goto out;
+    memcpy(b->tip, raw_hash, 20);
+    memcpy(b->tree_hash, b->root->raw_hash, 20);
+    b->has_tip = 1;
+    if (*mark && set_mark(fi, mark, OBJ_COMMIT, raw_hash, b->tree_hash) < 0) goto out;
+    ret = 0;
+
+out:
+    free(author);
+    free(committer);
+    free(encoding);
+    free(message);
+    free(content);
+    free(parents);
+    return ret;
+}
+
+
+static int parse_reset(FastImport *fi, const char *ref) {
+    Branch *b = branch_lookup(fi, ref, 1);
+    if (!b) return -1;
+    branch_deactivate(fi, b);
+    b->has_tip = 0;
+
+    char *from = read_optional(&fi->in, "from ");
+    if (from) {
+        unsigned char commit[20];
+        int null = hex_to_hash(commit, from) == 0 && memcmp(commit, null_hash, 20) == 0;
+        int status = null ? 0 : resolve_commit(fi, from, b->tip, b->tree_hash);
+        free(from);
+        if (status < 0) return -1;
+        b->has_tip = !null;
+    }
+    char *line = read_line(&fi->in);
+    if (line && *line) fi->in.pushed_back = 1;
+    return 0;
+}
+
+
+static int parse_tag(FastImport *fi, const char *name) {
+    int ret = -1;
+    char mark[32];
+    char *ref = malloc(strlen(name) + 11);
+    if (!ref) { perror("malloc"); return -1; }
+    sprintf(ref, "refs/tags/%s", name);
+    read_mark(&fi->in, mark);
+    char *from = read_optional(&fi->in, "from ");
+    free(read_optional(&fi->in, "original-oid "));
+    char *tagger = read_optional(&fi->in, "tagger ");
+    unsigned char *message = NULL, *content = NULL;
+    size_t message_len = 0;
+    char *line;
+
+    unsigned char object[20];
+    ObjectType type;
+    if (!from) { fprintf(stderr, "fatal: tag %s has no 'from'\n", name); goto out; }
+    if (resolve_object(fi, from, object, &type) < 0) goto out;
+    if (!(line = read_line(&fi->in)) || read_data(&fi->in, line, &message, &message_len) < 0) goto out;
+
+    if (!(content = malloc(128 + strlen(ref) + (tagger ? strlen(tagger) : 0) + message_len))) {
+        perror("malloc");
+        goto out;
+    }
+    char hex[41];
+    hash_to_hex(hex, object);
+    char *p = (char *)content;
+    p += sprintf(p, "object %s\ntype %s\ntag %s\n", hex, object_type_name(type), ref + 10);
+    if (tagger) p += sprintf(p, "tagger %s\n", tagger);
+    *p++ = '\n';
+    memcpy(p, message, message_len);
+    p += message_len;
+
+    if (fi->tag_count == fi->tag_cap) {
+        size_t cap = fi->tag_cap ? fi->tag_cap * 2 : 16;
+        TagRef *grown = realloc(fi->tags, cap * sizeof(TagRef));
+        if (!grown) { perror("realloc"); goto out; }
+        fi->tags = grown;
+        fi->tag_cap = cap;
+    }
+    TagRef *t = &fi->tags[fi->tag_count];
+    if (write_object(fi, OBJ_TAG, content, (size_t)(p - (char *)content), t->raw_hash) < 0) goto out;
+    if (*mark && set_mark(fi, mark, OBJ_TAG, t->raw_hash, NULL) < 0) goto out;
+    t->ref = ref;
+    ref = NULL;
+    fi->tag_count++;
+    ret = 0;
+
+out:
+    free(ref);
+    free(from);
+    free(tagger);
+    free(message);
+    free(content);
+    return ret;
+}
+
+
+static int parse_feature(FastImport *fi, const char *feature) {
+    if (strcmp(feature, "done") == 0) {
+        fi->require_done = 1;
+    } else if (strcmp(feature, "date-format=raw") != 0 && strcmp(feature, "force") != 0) {
+        fprintf(stderr, "fatal: unsupported feature: %s\n", feature);
+        return -1;
+    }
+    return 0;
+}
+
+
+// ---- marks files and refs ---------------------------------------------------
+
+static int import_marks(FastImport *fi, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror(path); return -1; }
+    char line[128];
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *space = strchr(line, ' ');
+        unsigned char raw_hash[20];
+        if (!space || (*space = '\0', hex_to_hash(raw_hash, space + 1) < 0)) {
+            fprintf(stderr, "fatal: corrupt mark line in %s: %s\n", path, line);
+            ret = -1;
+        } else {
+            ret = set_mark(fi, line, OBJ_NONE, raw_hash, NULL);
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+
+static int export_marks(const FastImport *fi, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) { perror(path); return -1; }
+    for (size_t i = 1; i < fi->mark_cap; i++) {
+        if (!fi->marks[i].set) continue;
+        char hex[41];
+        hash_to_hex(hex, fi->marks[i].raw_hash);
+        fprintf(f, ":%zu %s\n", i, hex);
+    }
+    if (fclose(f) != 0) { perror(path); return -1; }
+    return 0;
+}
+
+
+static int write_ref(const char *ref, const unsigned char raw_hash[20]) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), ".git/%s", ref);
+    for (char *p = strchr(path + 5, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) { perror(path); return -1; }
+        *p = '/';
+    }
+    char hex[41];
+    hash_to_hex(hex, raw_hash);
+    FILE *f = fopen(path, "w");
+    if (!f) { perror(path); return -1; }
+    fprintf(f, "%s\n", hex);
+    if (fclose(f) != 0) { perror(path); return -1; }
+    return 0;
+}
+
+
+static int write_refs(const FastImport *fi) {
+    int status = 0;
+    for (size_t i = 0; fi->table && i <= fi->table_mask; i++) {
+        const Branch *b = fi->table[i];
+        if (b && b->has_tip) status |= write_ref(b->name, b->tip);
+    }
+    for (size_t i = 0; i < fi->tag_count; i++) {
+        status |= write_ref(fi->tags[i].ref, fi->tags[i].raw_hash);
+    }
+    return status ? -1 : 0;
+}
+
+
+static int run_stream(FastImport *fi) {
+    char *line;
+    while ((line = read_line(&fi->in))) {
+        int status = 0;
+        if (strcmp(line, "blob") == 0) {
+            status = parse_blob(fi);
+        } else if (strncmp(line, "commit ", 7) == 0) {
+            char *ref = strdup(line + 7);
+            status = ref ? parse_commit(fi, ref) : -1;
+            free(ref);
+        } else if (strncmp(line, "reset ", 6) == 0) {
+            char *ref = strdup(line + 6);
+            status = ref ? parse_reset(fi, ref) : -1;
+            free(ref);
+        } else if (strncmp(line, "tag ", 4) == 0) {
+            char *name = strdup(line + 4);
+            status = name ? parse_tag(fi, name) : -1;
+            free(name);
+        } else if (strncmp(line, "progress ", 9) == 0) {
+            printf("%s\n", line);
+        } else if (strncmp(line, "feature ", 8) == 0) {
+            status = parse_feature(fi, line + 8);
+        } else if (strcmp(line, "done") == 0) {
+            return 0;
+        } else if (strncmp(line, "option git ", 11) == 0) {
+            fprintf(stderr, "fatal: unsupported option: %s\n", line + 11);
+            status = -1;
+        } else if (*line && *line != '#' && strcmp(line, "checkpoint") != 0 && strncmp(line, "option ", 7) != 0) {
+            // Comments, blank lines, checkpoints and other tools' options are skipped
+            fprintf(stderr, "fatal: unsupported command: %s\n", line);
+            status = -1;
+        }
+        if (status < 0) return -1;
+    }
+    if (fi->in.failed) return -1;
+    if (fi->require_done) {
+        fprintf(stderr, "fatal: stream ends early (feature done was set)\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+int fast_import(int fd, const FastImportOptions *opts) {
+    FastImport fi = { .in = { .fd = fd } };
+    int ret = -1;
+    if (opts->import_marks && import_marks(&fi, opts->import_marks) < 0) goto out;
+    if (bulk_checkin_begin() < 0) goto out;
+
+    TraceSpan span;
+    trace_begin(&span, "import");
+    int status = run_stream(&fi);
+    trace_end(&span);
+
+    // What made it in is kept even on error, but no ref points at it
+    if (bulk_checkin_end() < 0 || status < 0) goto out;
+    if (write_refs(&fi) < 0) goto out;
+    if (opts->export_marks && export_marks(&fi, opts->export_marks) < 0) goto out;
+    if (!opts->quiet) {
+        fprintf(stderr, "fast-import: %zu blobs, %zu trees, %zu commits, %zu tags\n", fi.counts[OBJ_BLOB],
+                fi.counts[OBJ_TREE], fi.counts[OBJ_COMMIT], fi.counts[OBJ_TAG]);
+    }
+    ret = 0;
+
+out:
+    for (size_t i = 0; fi.table && i <= fi.table_mask; i++) {
+        if (!fi.table[i]) continue;
+        dir_free(fi.table[i]->root);
+        free(fi.table[i]->name);
+        free(fi.table[i]);
+    }
+    for (size_t i = 0; i < fi.tag_count; i++) free(fi.tags[i].ref);
+    free(fi.table);
+    free(fi.tags);
+    free(fi.marks);
+    free(fi.in.buf);
+    return ret;
+}
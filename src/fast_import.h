@@ -0,0 +1,30 @@
+#ifndef FAST_IMPORT_H
+#define FAST_IMPORT_H
+
+// Bulk object creation from a text stream in git's fast-import format, the
+// part of it that `git fast-export` produces: blob, commit (with M, D, C, R
+// and deleteall file changes, from and merge), reset, tag, progress,
+// checkpoint, feature and done. Every object goes into one pack through a
+// bulk checkin.
+//
+// Trees are never written by the stream itself: each branch keeps its tree
+// in memory as Tree/Entry nodes (see tree.h), a commit's file changes edit
+// that tree in place, and only directories on a changed path are
+// serialized again when the commit is written. Subtrees are read in lazily
+// from the object database (the pack being written included) the first time
+// a change reaches them.
+//
+// Refs are written once the pack is complete, without a fast-forward check
+// (as git's --force does). A checkpoint does not end the pack early.
+
+typedef struct {
+    const char *import_marks;  // ":<mark> <sha>" lines from an earlier run
+    const char *export_marks;  // written the same way when the import succeeds
+    int quiet;                 // no object counts on stderr
+} FastImportOptions;
+
+// Reads the stream from fd to its end (or a "done" command). Returns 0, or -1
+// on error (reported), in which case no refs are updated.
+int fast_import(int fd, const FastImportOptions *opts);
+
+#endif
@@ -0,0 +1,554 @@
+#include "hash.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+
+typedef void (*block_fn)(uint32_t h[5], const unsigned char *data, size_t blocks);
+
+static uint32_t get_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+
+static void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+
+#define ROL(x, n) ((x) << (n) | (x) >> (32 - (n)))
+
+// FIPS 180-4 with a rolling 16-word schedule
+static void sha1_blocks_portable(uint32_t h[5], const unsigned char *data, size_t blocks) {
+    while (blocks--) {
+        uint32_t w[16];
+        for (int i = 0; i < 16; i++) w[i] = get_be32(data + 4 * i);
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+#define SCHEDULE(t) \
+        ((t) < 16 ? w[t] : (w[(t) & 15] = ROL(w[((t) + 13) & 15] ^ w[((t) + 8) & 15] ^ \
+                                              w[((t) + 2) & 15] ^ w[(t) & 15], 1)))
+#define ROUND(t, f, k) do { \
+            uint32_t tmp = ROL(a, 5) + (f) + e + (k) + SCHEDULE(t); \
+            e = d; d = c; c = ROL(b, 30); b = a; a = tmp; \
+        } while (0)
+
+        for (int t = 0; t < 20; t++) ROUND(t, d ^ (b & (c ^ d)), 0x5a827999u);
+        for (int t = 20; t < 40; t++) ROUND(t, b ^ c ^ d, 0x6ed9eba1u);
+        for (int t = 40; t < 60; t++) ROUND(t, (b & c) | (d & (b | c)), 0x8f1bbcdcu);
+        for (int t = 60; t < 80; t++) ROUND(t, b ^ c ^ d, 0xca62c1d6u);
+#undef ROUND
+#undef SCHEDULE
+
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+        data += 64;
+    }
+}
+
+
+#ifdef HAVE_X86
+// SHA-NI: four rounds per sha1rnds4, message schedule in sha1msg1/sha1msg2
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_shani(uint32_t h[5], const unsigned char *data, size_t blocks) {
+    const __m128i bswap = _mm_set_epi64x(0x0001020304050607LL, 0x08090a0b0c0d0e0fLL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0x1b);
+    __m128i e0 = _mm_set_epi32((int)h[4], 0, 0, 0);
+
+    while (blocks--) {
+        __m128i abcd_save = abcd, e0_save = e0;
+        __m128i e1, m0, m1, m2, m3;
+
+        // Rounds 0-3
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), bswap);
+        e0 = _mm_add_epi32(e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        // Rounds 4-7
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), bswap);
+        e1 = _mm_sha1nexte_epu32(e1, m1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+
+        // Rounds 8-11
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), bswap);
+        e0 = _mm_sha1nexte_epu32(e0, m2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        // Rounds 12-15
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), bswap);
+        e1 = _mm_sha1nexte_epu32(e1, m3);
+        e0 = abcd;
+        m0 = _mm_sha1msg2_epu32(m0, m3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        m2 = _mm_sha1msg1_epu32(m2, m3);
+        m1 = _mm_xor_si128(m1, m3);
+
+        // Rounds 16-19
+        e0 = _mm_sha1nexte_epu32(e0, m0);
+        e1 = abcd;
+        m1 = _mm_sha1msg2_epu32(m1, m0);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        m3 = _mm_sha1msg1_epu32(m3, m0);
+        m2 = _mm_xor_si128(m2, m0);
+
+        // Rounds 20-23
+        e1 = _mm_sha1nexte_epu32(e1, m1);
+        e0 = abcd;
+        m2 = _mm_sha1msg2_epu32(m2, m1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+        m3 = _mm_xor_si128(m3, m1);
+
+        // Rounds 24-27
+        e0 = _mm_sha1nexte_epu32(e0, m2);
+        e1 = abcd;
+        m3 = _mm_sha1msg2_epu32(m3, m2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        // Rounds 28-31
+        e1 = _mm_sha1nexte_epu32(e1, m3);
+        e0 = abcd;
+        m0 = _mm_sha1msg2_epu32(m0, m3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+        m2 = _mm_sha1msg1_epu32(m2, m3);
+        m1 = _mm_xor_si128(m1, m3);
+
+        // Rounds 32-35
+        e0 = _mm_sha1nexte_epu32(e0, m0);
+        e1 = abcd;
+        m1 = _mm_sha1msg2_epu32(m1, m0);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+        m3 = _mm_sha1msg1_epu32(m3, m0);
+        m2 = _mm_xor_si128(m2, m0);
+
+        // Rounds 36-39
+        e1 = _mm_sha1nexte_epu32(e1, m1);
+        e0 = abcd;
+        m2 = _mm_sha1msg2_epu32(m2, m1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+        m3 = _mm_xor_si128(m3, m1);
+
+        // Rounds 40-43
+        e0 = _mm_sha1nexte_epu32(e0, m2);
+        e1 = abcd;
+        m3 = _mm_sha1msg2_epu32(m3, m2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        // Rounds 44-47
+        e1 = _mm_sha1nexte_epu32(e1, m3);
+        e0 = abcd;
+        m0 = _mm_sha1msg2_epu32(m0, m3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+        m2 = _mm_sha1msg1_epu32(m2, m3);
+        m1 = _mm_xor_si128(m1, m3);
+
+        // Rounds 48-51
+        e0 = _mm_sha1nexte_epu32(e0, m0);
+        e1 = abcd;
+        m1 = _mm_sha1msg2_epu32(m1, m0);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+        m3 = _mm_sha1msg1_epu32(m3, m0);
+        m2 = _mm_xor_si128(m2, m0);
+
+        // Rounds 52-55
+        e1 = _mm_sha1nexte_epu32(e1, m1);
+        e0 = abcd;
+        m2 = _mm_sha1msg2_epu32(m2, m1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+        m3 = _mm_xor_si128(m3, m1);
+
+        // Rounds 56-59
+        e0 = _mm_sha1nexte_epu32(e0, m2);
+        e1 = abcd;
+        m3 = _mm_sha1msg2_epu32(m3, m2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        // Rounds 60-63
+        e1 = _mm_sha1nexte_epu32(e1, m3);
+        e0 = abcd;
+        m0 = _mm_sha1msg2_epu32(m0, m3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+        m2 = _mm_sha1msg1_epu32(m2, m3);
+        m1 = _mm_xor_si128(m1, m3);
+
+        // Rounds 64-67
+        e0 = _mm_sha1nexte_epu32(e0, m0);
+        e1 = abcd;
+        m1 = _mm_sha1msg2_epu32(m1, m0);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+        m3 = _mm_sha1msg1_epu32(m3, m0);
+        m2 = _mm_xor_si128(m2, m0);
+
+        // Rounds 68-71
+        e1 = _mm_sha1nexte_epu32(e1, m1);
+        e0 = abcd;
+        m2 = _mm_sha1msg2_epu32(m2, m1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+        m3 = _mm_xor_si128(m3, m1);
+
+        // Rounds 72-75
+        e0 = _mm_sha1nexte_epu32(e0, m2);
+        e1 = abcd;
+        m3 = _mm_sha1msg2_epu32(m3, m2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+        // Rounds 76-79
+        e1 = _mm_sha1nexte_epu32(e1, m3);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+        data += 64;
+    }
+
+    _mm_storeu_si128((__m128i *)h, _mm_shuffle_epi32(abcd, 0x1b));
+    h[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+#endif
+
+
+static block_fn sha1_blocks = sha1_blocks_portable;
+static int use_lanes;
+static const char *impl_name = "portable";
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+
+static int cpu_has(const char *feature) {
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (strcmp(feature, "sha-ni") == 0) {
+        unsigned a, b, c, d;
+        return __builtin_cpu_supports("sse4.1") &&
+               __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 29));
+    }
+    if (strcmp(feature, "avx2") == 0) return __builtin_cpu_supports("avx2");
+#endif
+    return strcmp(feature, "portable") == 0;
+}
+
+
+static int set_impl(const char *name) {
+    if (!cpu_has(name)) return -1;
+
+    sha1_blocks = sha1_blocks_portable;
+    use_lanes = 0;
+#ifdef HAVE_X86
+    if (strcmp(name, "sha-ni") == 0) sha1_blocks = sha1_blocks_shani;
+    if (strcmp(name, "avx2") == 0) use_lanes = 1;
+#endif
+    impl_name = strcmp(name, "sha-ni") == 0 ? "sha-ni" : strcmp(name, "avx2") == 0 ? "avx2" : "portable";
+    return 0;
+}
+
+
+// SHA-NI beats 8 AVX2 lanes even on batches, so lanes are only for CPUs without it
+static void pick_impl(void) {
+    if (set_impl("sha-ni") < 0 && set_impl("avx2") < 0) set_impl("portable");
+}
+
+
+int hash_use_impl(const char *name) {
+    pthread_once(&impl_once, pick_impl);
+    return set_impl(name);
+}
+
+
+const char *hash_impl_name(void) {
+    pthread_once(&impl_once, pick_impl);
+    return impl_name;
+}
+
+
+void hash_init(HashCtx *ctx) {
+    pthread_once(&impl_once, pick_impl);
+    ctx->h[0] = 0x67452301u;
+    ctx->h[1] = 0xefcdab89u;
+    ctx->h[2] = 0x98badcfeu;
+    ctx->h[3] = 0x10325476u;
+    ctx->h[4] = 0xc3d2e1f0u;
+    ctx->total = 0;
+    ctx->fill = 0;
+}
+
+
+void hash_update(HashCtx *ctx, const void *data, size_t len) {
+    const unsigned char *p = data;
+    ctx->total += len;
+
+    if (ctx->fill > 0) {
+        size_t take = 64 - ctx->fill < len ? 64 - ctx->fill : len;
+        memcpy(ctx->block + ctx->fill, p, take);
+        ctx->fill += take;
+        p += take;
+        len -= take;
+        if (ctx->fill < 64) return;
+        sha1_blocks(ctx->h, ctx->block, 1);
+        ctx->fill = 0;
+    }
+
+    // Whole blocks straight from the caller's buffer
+    if (len >= 64) {
+        sha1_blocks(ctx->h, p, len / 64);
+        p += len & ~(size_t)63;
+        len &= 63;
+    }
+    memcpy(ctx->block, p, len);
+    ctx->fill = len;
+}
+
+
+void hash_final(HashCtx *ctx, unsigned char raw_hash[20]) {
+    uint64_t bits = ctx->total * 8;
+    ctx->block[ctx->fill++] = 0x80;
+    if (ctx->fill > 56) {
+        memset(ctx->block + ctx->fill, 0, 64 - ctx->fill);
+        sha1_blocks(ctx->h, ctx->block, 1);
+        ctx->fill = 0;
+    }
+    memset(ctx->block + ctx->fill, 0, 56 - ctx->fill);
+    put_be32(ctx->block + 56, (uint32_t)(bits >> 32));
+    put_be32(ctx->block + 60, (uint32_t)bits);
+    sha1_blocks(ctx->h, ctx->block, 1);
+
+    for (int i = 0; i < 5; i++) put_be32(raw_hash + 4 * i, ctx->h[i]);
+}
+
+
+void hash_buffer(const void *data, size_t len, unsigned char raw_hash[20]) {
+    HashCtx ctx;
+    hash_init(&ctx);
+    hash_update(&ctx, data, len);
+    hash_final(&ctx, raw_hash);
+}
+
+
+static size_t object_header(char *header, const char *type, size_t len) {
+    // Hand-rolled "%s %zu" plus the NUL: this runs once per object
+    size_t n = strlen(type);
+    memcpy(header, type, n);
+    header[n++] = ' ';
+    char digits[24];
+    size_t d = 0;
+    do { digits[d++] = (char)('0' + len % 10); len /= 10; } while (len);
+    while (d) header[n++] = digits[--d];
+    header[n++] = '\0';
+    return n;
+}
+
+
+void hash_object(const char *type, const void *data, size_t len, unsigned char raw_hash[20]) {
+    HashCtx ctx;
+    hash_init(&ctx);
+    ctx.fill = ctx.total = object_header((char *)ctx.block, type, len); // header starts the first block
+    hash_update(&ctx, data, len);
+    hash_final(&ctx, raw_hash);
+}
+
+
+#ifdef HAVE_X86
+// Multi-buffer SHA-1: lane i of every vector belongs to message i, so eight
+// independent objects advance one block per call. Each lane walks its own
+// padded "<header><data>" message; lanes that finish pick up the next job.
+
+#define LANES 8
+
+typedef struct {
+    HashJob *job;
+    char header[32];
+    size_t header_len;
+    uint64_t total, padded, pos;   // message length, with padding, and bytes emitted
+} Lane;
+
+
+static void lane_start(Lane *lane, HashJob *job) {
+    lane->job = job;
+    lane->header_len = object_header(lane->header, job->type, job->len);
+    lane->total = lane->header_len + job->len;
+    lane->padded = ((lane->total + 8) / 64 + 1) * 64;
+    lane->pos = 0;
+}
+
+
+static void lane_block(Lane *lane, unsigned char block[64]) {
+    size_t n = 0;
+    while (n < 64 && lane->pos < lane->total) {
+        size_t take;
+        if (lane->pos < lane->header_len) {
+            take = lane->header_len - lane->pos;
+            if (take > 64 - n) take = 64 - n;
+            memcpy(block + n, lane->header + lane->pos, take);
+        } else {
+            take = lane->total - lane->pos;
+            if (take > 64 - n) take = 64 - n;
+            memcpy(block + n, lane->job->data + (lane->pos - lane->header_len), take);
+        }
+        n += take;
+        lane->pos += take;
+    }
+    for (; n < 64; n++, lane->pos++) {
+        if (lane->pos == lane->total) block[n] = 0x80;
+        else if (lane->pos >= lane->padded - 8) block[n] = (unsigned char)((lane->total * 8) >> (8 * (lane->padded - 1 - lane->pos)));
+        else block[n] = 0;
+    }
+}
+
+
+#define VROL(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+
+__attribute__((target("avx2")))
+static void sha1_block_x8(uint32_t state[5][LANES], unsigned char blocks[LANES][64]) {
+    __m256i w[16];
+    for (int t = 0; t < 16; t++) {
+        w[t] = _mm256_set_epi32((int)get_be32(blocks[7] + 4 * t), (int)get_be32(blocks[6] + 4 * t),
+                                (int)get_be32(blocks[5] + 4 * t), (int)get_be32(blocks[4] + 4 * t),
+                                (int)get_be32(blocks[3] + 4 * t), (int)get_be32(blocks[2] + 4 * t),
+                                (int)get_be32(blocks[1] + 4 * t), (int)get_be32(blocks[0] + 4 * t));
+    }
+    __m256i a = _mm256_loadu_si256((const __m256i *)state[0]);
+    __m256i b = _mm256_loadu_si256((const __m256i *)state[1]);
+    __m256i c = _mm256_loadu_si256((const __m256i *)state[2]);
+    __m256i d = _mm256_loadu_si256((const __m256i *)state[3]);
+    __m256i e = _mm256_loadu_si256((const __m256i *)state[4]);
+    __m256i a0 = a, b0 = b, c0 = c, d0 = d, e0 = e;
+
+#define VSCHEDULE(t) \
+    ((t) < 16 ? w[t] : (w[(t) & 15] = VROL(_mm256_xor_si256(_mm256_xor_si256(w[((t) + 13) & 15], w[((t) + 8) & 15]), \
+                                                            _mm256_xor_si256(w[((t) + 2) & 15], w[(t) & 15])), 1)))
+#define VROUND(t, f, k) do { \
+        __m256i tmp = _mm256_add_epi32(_mm256_add_epi32(VROL(a, 5), (f)), \
+                                       _mm256_add_epi32(_mm256_add_epi32(e, _mm256_set1_epi32((int)(k))), VSCHEDULE(t))); \
+        e = d; d = c; c = VROL(b, 30); b = a; a = tmp; \
+    } while (0)
+
+    for (int t = 0; t < 20; t++)
+        VROUND(t, _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d))), 0x5a827999u);
+    for (int t = 20; t < 40; t++)
+        VROUND(t, _mm256_xor_si256(_mm256_xor_si256(b, c), d), 0x6ed9eba1u);
+    for (int t = 40; t < 60; t++)
+        VROUND(t, _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c))), 0x8f1bbcdcu);
+    for (int t = 60; t < 80; t++)
+        VROUND(t, _mm256_xor_si256(_mm256_xor_si256(b, c), d), 0xca62c1d6u);
+#undef VROUND
+#undef VSCHEDULE
+
+    _mm256_storeu_si256((__m256i *)state[0], _mm256_add_epi32(a, a0));
+    _mm256_storeu_si256((__m256i *)state[1], _mm256_add_epi32(b, b0));
+    _mm256_storeu_si256((__m256i *)state[2], _mm256_add_epi32(c, c0));
+    _mm256_storeu_si256((__m256i *)state[3], _mm256_add_epi32(d, d0));
+    _mm256_storeu_si256((__m256i *)state[4], _mm256_add_epi32(e, e0));
+}
+
+
+static const uint32_t sha1_iv[5] = { 0x67452301u, 0xefcdab89u, 0x98badcfeu, 0x10325476u, 0xc3d2e1f0u };
+
+static void hash_objects_x8(HashJob *jobs, size_t count) {
+    Lane lanes[LANES];
+    int busy[LANES];
+    uint32_t state[5][LANES];
+    unsigned char blocks[LANES][64];
+    size_t next = 0, active = 0;
+
+    for (int i = 0; i < LANES; i++) {
+        busy[i] = next < count;
+        if (!busy[i]) continue;
+        lane_start(&lanes[i], &jobs[next++]);
+        for (int j = 0; j < 5; j++) state[j][i] = sha1_iv[j];
+        active++;
+    }
+
+    // Below two busy lanes the vector unit mostly hashes padding; the
+    // stragglers finish one block at a time instead
+    while (active > 2 || (active > 0 && next < count)) {
+        for (int i = 0; i < LANES; i++) {
+            if (busy[i]) lane_block(&lanes[i], blocks[i]);
+        }
+        sha1_block_x8(state, blocks);
+
+        for (int i = 0; i < LANES; i++) {
+            if (!busy[i] || lanes[i].pos < lanes[i].padded) continue;
+            for (int j = 0; j < 5; j++) put_be32(lanes[i].job->raw_hash + 4 * j, state[j][i]);
+            if (next < count) {
+                lane_start(&lanes[i], &jobs[next++]);
+                for (int j = 0; j < 5; j++) state[j][i] = sha1_iv[j];
+            } else {
+                busy[i] = 0;
+                active--;
+            }
+        }
+    }
+
+    for (int i = 0; i < LANES; i++) {
+        if (!busy[i]) continue;
+        uint32_t h[5];
+        for (int j = 0; j < 5; j++) h[j] = state[j][i];
+        while (lanes[i].pos < lanes[i].padded) {
+            lane_block(&lanes[i], blocks[i]);
+            sha1_blocks(h, blocks[i], 1);
+        }
+        for (int j = 0; j < 5; j++) put_be32(lanes[i].job->raw_hash + 4 * j, h[j]);
+    }
+}
+#endif
+
+
+void hash_objects(HashJob *jobs, size_t count) {
+    pthread_once(&impl_once, pick_impl);
+#ifdef HAVE_X86
+    if (use_lanes && count > 1) {
+        hash_objects_x8(jobs, count);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; i++) hash_object(jobs[i].type, jobs[i].data, jobs[i].len, jobs[i].raw_hash);
+}
+
+
+void hash_to_hex(char *hex_buf, const unsigned char *raw_hash) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < 20; i++) {
+        hex_buf[2 * i] = digits[raw_hash[i] >> 4];
+        hex_buf[2 * i + 1] = digits[raw_hash[i] & 15];
+    }
+    hex_buf[40] = '\0';
+}
+
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+
+int hex_to_hash(unsigned char *raw_hash, const char *hex) {
+    for (int i = 0; i < 20; i++) {
+        int hi = hex_digit(hex[2 * i]);
+        int lo = hi < 0 ? -1 : hex_digit(hex[2 * i + 1]);
+        if (lo < 0) return -1;
+        raw_hash[i] = (unsigned char)(hi << 4 | lo);
+    }
+    return hex[40] == '\0' ? 0 : -1;
+}
@@ -0,0 +1,47 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SHA-1 for object names. The block function is picked once per process from
+// what the CPU supports: SHA-NI when present, otherwise portable C. Batches of
+// small objects can additionally run 8 messages side by side in AVX2 lanes;
+// hash-object --stdin-paths names the files it has queued up that way.
+
+typedef struct {
+    uint32_t h[5];
+    uint64_t total;              // bytes fed so far
+    unsigned char block[64];
+    size_t fill;                 // bytes waiting in block
+} HashCtx;
+
+void hash_init(HashCtx *ctx);
+void hash_update(HashCtx *ctx, const void *data, size_t len);
+void hash_final(HashCtx *ctx, unsigned char raw_hash[20]);
+
+void hash_buffer(const void *data, size_t len, unsigned char raw_hash[20]);
+
+// Object name of "<type> <len>\0<data>"
+void hash_object(const char *type, const void *data, size_t len, unsigned char raw_hash[20]);
+
+typedef struct {
+    const char *type;
+    const unsigned char *data;
+    size_t len;
+    unsigned char *raw_hash;     // 20 bytes, filled in
+} HashJob;
+
+// hash_object() for every job; many small objects are hashed several at a time
+void hash_objects(HashJob *jobs, size_t count);
+
+// "sha-ni", "avx2" (multi-buffer batches over portable C) or "portable"
+const char *hash_impl_name(void);
+
+// Override the automatic choice, for benchmarks; -1 if the CPU can't run it
+int hash_use_impl(const char *name);
+
+void hash_to_hex(char *hex_buf, const unsigned char *raw_hash);
+int hex_to_hash(unsigned char *raw_hash, const char *hex); // 0, or -1 if not 40 hex digits
+
+#endif
@@ -0,0 +1,419 @@
+#include "hash_object.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "bulk_checkin.h"
+#include "compress.h"
+#include "hash.h"
+#include "object_store.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+#define RING_SIZE 64                // files a ring holds; a power of two
+#define SPIN_LIMIT 1000             // polls before a waiting stage sleeps
+#define HASH_BATCH 32               // files named in one hash_objects() call
+
+
+// One file on its way through the stages
+typedef struct {
+    char *path;
+    int fd;                         // kept open when the file is streamed, else -1
+    off_t size;
+    unsigned char *buf;             // "blob <size>\0" and the contents, for buffered files
+    size_t header_len;
+    unsigned char raw_hash[20];
+    unsigned char *zdata;           // deflated; NULL when there is nothing to write
+    size_t zlen;
+    int failed;                     // already reported
+} Job;
+
+
+// Bounded single-producer, single-consumer queue. head only moves in the
+// consumer and tail only in the producer, so neither side locks anything to
+// pass a job on. A side that finds the ring empty (or full) polls for a
+// while and then sleeps on `wake`: it counts itself in `sleepers` before its
+// last look at the indices, and the other side looks at `sleepers` after
+// moving its index, so between the two sequentially consistent pairs one
+// of them always sees the other.
+typedef struct {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    _Alignas(64) atomic_int sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    Job *slots[RING_SIZE];
+} Ring;
+
+
+typedef struct Pipeline Pipeline;
+
+typedef struct {
+    Pipeline *pipeline;
+    Ring deflating, writing, done;
+    pthread_t deflater, writer;
+} Lane;
+
+struct Pipeline {
+    FILE *in;
+    int write, bulk;
+    int spin;                       // polls before sleeping; 0 on one CPU
+    Ring hashing;
+    pthread_t reader, hasher;
+    Lane *lanes;
+    int lane_count;
+    atomic_int failed;              // set by the printer; stops the reader
+};
+
+
+static void ring_init(Ring *r) {
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->sleepers, 0);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake, NULL);
+}
+
+
+static void ring_destroy(Ring *r) {
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->wake);
+}
+
+
+static int ring_has_job(Ring *r) {
+    return atomic_load(&r->tail) != atomic_load(&r->head);
+}
+
+
+static int ring_has_room(Ring *r) {
+    return atomic_load(&r->tail) - atomic_load(&r->head) < RING_SIZE;
+}
+
+
+static void ring_wait(Ring *r, int (*ready)(Ring *), int spin) {
+    for (int i = 0; i < spin; i++) {
+        if (ready(r)) return;
+    }
+    pthread_mutex_lock(&r->lock);
+    atomic_fetch_add(&r->sleepers, 1);
+    while (!ready(r)) pthread_cond_wait(&r->wake, &r->lock);
+    atomic_fetch_sub(&r->sleepers, 1);
+    pthread_mutex_unlock(&r->lock);
+}
+
+
+static void ring_notify(Ring *r) {
+    if (atomic_load(&r->sleepers) == 0) return;
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_broadcast(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+}
+
+
+// NULL marks the end of the stream
+static void ring_push(Ring *r, Job *job, int spin) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (tail - atomic_load(&r->head) == RING_SIZE) ring_wait(r, ring_has_room, spin);
+    r->slots[tail % RING_SIZE] = job;
+    atomic_store(&r->tail, tail + 1);
+    ring_notify(r);
+}
+
+
+static Job *ring_pop(Ring *r, int spin) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (atomic_load(&r->tail) == head) ring_wait(r, ring_has_job, spin);
+    Job *job = r->slots[head % RING_SIZE];
+    atomic_store(&r->head, head + 1);
+    ring_notify(r);
+    return job;
+}
+
+
+static void free_job(Job *job) {
+    if (job->fd >= 0) close(job->fd);
+    free(job->path);
+    free(job->buf);
+    free(job->zdata);
+    free(job);
+}
+
+
+// Read stage: small files are read in whole behind their object header,
+// larger ones are left open for the write stage to stream
+static void read_file(Job *job) {
+    TraceSpan span;
+    trace_begin(&span, "open");
+    int fd = open(job->path, O_RDONLY);
+    trace_end(&span);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(job->path);
+        if (fd >= 0) close(fd);
+        job->failed = 1;
+        return;
+    }
+    job->size = st.st_size;
+    if (st.st_size > HASH_OBJECT_BUFFER_MAX) {
+        job->fd = fd;
+        return;
+    }
+
+    char header[32];
+    job->header_len = (size_t)snprintf(header, sizeof(header), "blob %jd", (intmax_t)st.st_size) + 1;
+    job->buf = malloc(job->header_len + (size_t)st.st_size);
+    if (!job->buf) {
+        perror("malloc");
+        close(fd);
+        job->failed = 1;
+        return;
+    }
+    memcpy(job->buf, header, job->header_len);
+
+    trace_begin(&span, "read");
+    size_t got = 0;
+    while (got < (size_t)st.st_size) {
+        ssize_t n = read(fd, job->buf + job->header_len + got, (size_t)st.st_size - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    trace_end(&span);
+    if (got != (size_t)st.st_size) {
+        fprintf(stderr, "%s: file changed size while hashing\n", job->path);
+        job->failed = 1;
+    }
+    close(fd);
+}
+
+
+static void *read_stage(void *arg) {
+    Pipeline *p = arg;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while (!atomic_load(&p->failed) && (len = getline(&line, &cap, p->in)) >= 0) {
+        if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+        Job *job = calloc(1, sizeof(*job));
+        if (!job || !(job->path = strdup(line))) {
+            perror("malloc");
+            free(job);
+            break; // hash_object_paths sees the input wasn't read to its end
+        }
+        job->fd = -1;
+        read_file(job);
+        ring_push(&p->hashing, job, p->spin);
+    }
+    free(line);
+    ring_push(&p->hashing, NULL, p->spin);
+    return NULL;
+}
+
+
+// Hash stage: names every buffered file and deals them out to the lanes.
+// Files that have queued up behind the first are named along with it, as
+// one hash_objects() batch.
+static void *hash_stage(void *arg) {
+    Pipeline *p = arg;
+    Job *batch[HASH_BATCH];
+    HashJob names[HASH_BATCH];
+    size_t n = 0;
+    for (int end = 0; !end;) {
+        size_t count = 0, naming = 0;
+        do {
+            Job *job = ring_pop(&p->hashing, p->spin);
+            if (!job) { end = 1; break; }
+            batch[count++] = job;
+        } while (count < HASH_BATCH && ring_has_job(&p->hashing));
+
+        uint64_t bytes = 0;
+        for (size_t i = 0; i < count; i++) {
+            Job *job = batch[i];
+            if (!job->buf || job->failed) continue;
+            names[naming++] = (HashJob){ "blob", job->buf + job->header_len, (size_t)job->size, job->raw_hash };
+            bytes += (uint64_t)job->size;
+        }
+        TraceSpan span;
+        trace_begin(&span, "sha1");
+        hash_objects(names, naming);
+        trace_end(&span);
+        trace_count(TRACE_BYTES_HASHED, bytes);
+
+        for (size_t i = 0; i < count; i++) ring_push(&p->lanes[n++ % p->lane_count].deflating, batch[i], p->spin);
+    }
+    for (int i = 0; i < p->lane_count; i++) ring_push(&p->lanes[i].deflating, NULL, p->spin);
+    return NULL;
+}
+
+
+// Deflate stage: new objects only, and as the write stage will store them:
+// a loose object deflates its header too, a pack entry just the contents
+static void deflate_job(Pipeline *p, Job *job) {
+    TraceSpan span;
+    trace_begin(&span, "exists");
+    int exists = object_exists_quick(job->raw_hash);
+    trace_end(&span);
+    if (exists) {
+        trace_count(TRACE_OBJECTS_SKIPPED, 1);
+        return;
+    }
+
+    const unsigned char *contents = job->buf + job->header_len;
+    size_t size = (size_t)job->size;
+    int status;
+    if (p->bulk) {
+        status = compress_buffer(compress_level(COMPRESS_PACK, contents, size), contents, size,
+                                 &job->zdata, &job->zlen);
+    } else {
+        status = compress_buffer(compress_level(COMPRESS_LOOSE, contents, size), job->buf,
+                                 job->header_len + size, &job->zdata, &job->zlen);
+    }
+    if (status < 0) job->failed = 1;
+}
+
+
+static void *deflate_stage(void *arg) {
+    Lane *lane = arg;
+    Pipeline *p = lane->pipeline;
+    Job *job;
+    while ((job = ring_pop(&lane->deflating, p->spin)) != NULL) {
+        if (p->write && job->buf && !job->failed) deflate_job(p, job);
+        ring_push(&lane->writing, job, p->spin);
+    }
+    ring_push(&lane->writing, NULL, p->spin);
+    return NULL;
+}
+
+
+// Names a streamed file without storing it
+static int hash_blob_fd(Job *job) {
+    unsigned char *buf = malloc(STREAM_CHUNK);
+    if (!buf) { perror("malloc"); return -1; }
+    char header[32];
+    HashCtx ctx;
+    hash_init(&ctx);
+    hash_update(&ctx, header, (size_t)snprintf(header, sizeof(header), "blob %jd", (intmax_t)job->size) + 1);
+
+    off_t remaining = job->size;
+    while (remaining > 0) {
+        ssize_t n = read(job->fd, buf, remaining < STREAM_CHUNK ? (size_t)remaining : STREAM_CHUNK);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        hash_update(&ctx, buf, (size_t)n);
+        trace_count(TRACE_BYTES_HASHED, (uint64_t)n);
+        remaining -= n;
+    }
+    free(buf);
+    if (remaining) {
+        fprintf(stderr, "%s: file changed size while hashing\n", job->path);
+        return -1;
+    }
+    hash_final(&ctx, job->raw_hash);
+    return 0;
+}
+
+
+// Write stage: lanes write concurrently, each in its own input order
+static void *write_stage(void *arg) {
+    Lane *lane = arg;
+    Pipeline *p = lane->pipeline;
+    Job *job;
+    while ((job = ring_pop(&lane->writing, p->spin)) != NULL) {
+        int status = 0;
+        if (job->failed) {
+            // reported where it happened
+        } else if (job->fd >= 0) {
+            status = p->write ? write_loose_blob_fd(job->fd, job->size, job->raw_hash) : hash_blob_fd(job);
+        } else if (job->zdata && p->bulk) {
+            status = bulk_checkin_write_deflated(OBJ_BLOB, (size_t)job->size, job->zdata, job->zlen, job->raw_hash);
+        } else if (job->zdata) {
+            status = write_loose_deflated(job->raw_hash, job->zdata, job->zlen);
+        }
+        if (status < 0) job->failed = 1;
+        ring_push(&lane->done, job, p->spin);
+    }
+    ring_push(&lane->done, NULL, p->spin);
+    return NULL;
+}
+
+
+static void start_thread(pthread_t *thread, void *(*fn)(void *), void *arg) {
+    if (pthread_create(thread, NULL, fn, arg) != 0) {
+        perror("pthread_create");
+        abort();
+    }
+}
+
+
+int hash_object_paths(FILE *in, const HashObjectOptions *opts) {
+    Pipeline p = {
+        .in = in,
+        .write = opts->write,
+        .bulk = opts->write && bulk_checkin_active(),
+        .spin = default_job_count() > 1 ? SPIN_LIMIT : 0,
+        .lane_count = opts->threads > 0 ? opts->threads : 1,
+    };
+    atomic_init(&p.failed, 0);
+    p.lanes = calloc((size_t)p.lane_count, sizeof(Lane));
+    if (!p.lanes) { perror("calloc"); return -1; }
+
+    ring_init(&p.hashing);
+    for (int i = 0; i < p.lane_count; i++) {
+        Lane *lane = &p.lanes[i];
+        lane->pipeline = &p;
+        ring_init(&lane->deflating);
+        ring_init(&lane->writing);
+        ring_init(&lane->done);
+        start_thread(&lane->deflater, deflate_stage, lane);
+        start_thread(&lane->writer, write_stage, lane);
+    }
+    start_thread(&p.hasher, hash_stage, &p);
+    start_thread(&p.reader, read_stage, &p);
+
+    // Print stage, on this thread: lane n % lane_count has file n
+    int ret = 0;
+    for (size_t n = 0;; n++) {
+        Ring *done = &p.lanes[n % p.lane_count].done;
+        if (!ring_has_job(done)) fflush(stdout); // caught up: don't sit on answers
+        Job *job = ring_pop(done, p.spin);
+        if (!job) break;
+        if (job->failed && ret == 0) {
+            ret = -1;
+            atomic_store(&p.failed, 1);
+        }
+        if (ret == 0) {
+            char hex[41];
+            hash_to_hex(hex, job->raw_hash);
+            printf("%s\n", hex);
+        }
+        free_job(job);
+    }
+
+    pthread_join(p.reader, NULL);
+    pthread_join(p.hasher, NULL);
+    for (int i = 0; i < p.lane_count; i++) {
+        pthread_join(p.lanes[i].deflater, NULL);
+        pthread_join(p.lanes[i].writer, NULL);
+        ring_destroy(&p.lanes[i].deflating);
+        ring_destroy(&p.lanes[i].writing);
+        ring_destroy(&p.lanes[i].done);
+    }
+    ring_destroy(&p.hashing);
+    free(p.lanes);
+
+    if (!feof(in) && ret == 0) {
+        if (ferror(in)) perror("read");
+        ret = -1; // the reader gave up early
+    }
+    if (fflush(stdout) != 0) { perror("write"); ret = -1; }
+    return ret;
+}
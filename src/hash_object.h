@@ -0,0 +1,36 @@
+#ifndef HASH_OBJECT_H
+#define HASH_OBJECT_H
+
+#include <stdio.h>
+
+// hash-object for many files in one process: paths come in one per line and
+// each file becomes a blob, its name printed on stdout in input order.
+//
+// Every file passes through a pipeline of stages, each on its own thread:
+// read (open and slurp the file), SHA-1, deflate, write (temp file and
+// rename, or an append to the bulk pack) and print. The deflate and write
+// stages are the expensive ones, so they come in `threads` lanes that file
+// n goes down lane n % threads; the hasher deals files out to the lanes in
+// order and the printer collects them in the same order, so no stage ever
+// has to sort. Stages hand files on through bounded single-producer,
+// single-consumer rings: a full ring holds its producer back, which keeps
+// the number of files in memory bounded, and neither end takes a lock
+// unless it has to sleep.
+//
+// Files larger than HASH_OBJECT_BUFFER_MAX aren't read in whole: the write
+// stage streams them as write_loose_blob_fd() does.
+
+#define HASH_OBJECT_BUFFER_MAX (1 << 20)
+
+typedef struct {
+    int write;          // store the blobs, not just name them
+    int threads;        // deflate/write lanes
+} HashObjectOptions;
+
+// Reads paths from `in` to its end. stdout is flushed whenever the printer
+// has caught up with the input, so a caller feeding paths over a pipe gets
+// each answer without closing it. Returns 0, or -1 on error (reported), in
+// which case nothing is printed for the failed file or any after it.
+int hash_object_paths(FILE *in, const HashObjectOptions *opts);
+
+#endif
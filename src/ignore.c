@@ -0,0 +1,440 @@
+#include "ignore.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define EXCLUDE_FILE ".git/info/exclude"
+
+#define PATTERN_NEGATIVE    (1u << 0)   // "!": re-includes
+#define PATTERN_MUST_BE_DIR (1u << 1)   // trailing "/"
+#define PATTERN_NO_DIR      (1u << 2)   // no slash: matched against the last component
+#define PATTERN_LITERAL     (1u << 3)   // no wildcards at all
+#define PATTERN_ENDS_WITH   (1u << 4)   // "*" and then a literal
+
+// wildmatch results
+#define WM_MATCH 0
+#define WM_NOMATCH 1
+#define WM_ABORT_ALL (-1)
+#define WM_ABORT_TO_STARSTAR (-2)
+
+typedef struct {
+    const char *text;          // NUL-terminated, without "!", trailing "/" or leading "/"
+    uint32_t len;
+    uint32_t literal_len;      // bytes before the first wildcard
+    uint32_t flags;
+} Pattern;
+
+struct PatternList {
+    char *buf;                 // the file; patterns are cut out of it in place
+    Pattern *patterns;         // file order: the highest index that matches wins
+    uint32_t count;
+    uint32_t *literals;        // open addressing by text: pattern index + 1, 0 when free
+    size_t literal_cap;
+    uint32_t *suffixes;        // PATTERN_ENDS_WITH ones, highest index first
+    uint32_t suffix_count;
+    uint32_t *globs;           // everything else, highest index first
+    uint32_t glob_count;
+};
+
+
+static int is_glob_special(unsigned char c) {
+    return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+
+// A "[:name:]" class inside a bracket expression
+static int class_matches(const unsigned char *name, size_t len, unsigned char c, int *known) {
+    static const struct { const char *name; int (*test)(int); } classes[] = {
+        { "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank }, { "cntrl", iscntrl },
+        { "digit", isdigit }, { "graph", isgraph }, { "lower", islower }, { "print", isprint },
+        { "punct", ispunct }, { "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit },
+    };
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+        if (strlen(classes[i].name) == len && memcmp(classes[i].name, name, len) == 0) {
+            *known = 1;
+            return classes[i].test(c) != 0;
+        }
+    }
+    *known = 0;
+    return 0;
+}
+
+
+// git's wildmatch.c, case-sensitive. With `pathname`, '*', '?' and brackets
+// never match '/', and "**" between slashes matches any number of directories.
+static int dowild(const unsigned char *p, const unsigned char *text, int pathname) {
+    const unsigned char *pattern = p;
+    unsigned char p_ch;
+    for (; (p_ch = *p) != '\0'; text++, p++) {
+        unsigned char t_ch = *text;
+        int match_slash;
+        if (t_ch == '\0' && p_ch != '*') return WM_ABORT_ALL;
+        switch (p_ch) {
+        case '\\':
+            p_ch = *++p; // the next character, literally
+            // fall through
+        default:
+            if (t_ch != p_ch) return WM_NOMATCH;
+            continue;
+        case '?':
+            if (pathname && t_ch == '/') return WM_NOMATCH;
+            continue;
+        case '*':
+            if (*++p == '*') {
+                const unsigned char *prev_p = p - 2;
+                while (*++p == '*') {}
+                if ((prev_p < pattern || *prev_p == '/') &&
+                    (*p == '\0' || *p == '/' || (p[0] == '\\' && p[1] == '/'))) {
+                    // "**/" may also match no directory at all
+                    if (p[0] == '/' && dowild(p + 1, text, pathname) == WM_MATCH) return WM_MATCH;
+                    match_slash = 1;
+                } else {
+                    match_slash = !pathname;
+                }
+            } else {
+                match_slash = !pathname;
+            }
+            if (*p == '\0') {
+                // Trailing "**" matches everything, trailing "*" the rest of a component
+                if (!match_slash && strchr((const char *)text, '/')) return WM_NOMATCH;
+                return WM_MATCH;
+            }
+            if (!match_slash && *p == '/') {
+                // "*/" consumes the rest of this component
+                const char *slash = strchr((const char *)text, '/');
+                if (!slash) return WM_NOMATCH;
+                text = (const unsigned char *)slash;
+                break;
+            }
+            for (;;) {
+                if (t_ch == '\0') break;
+                if (!is_glob_special(*p)) {
+                    // Skip ahead to where the literal after the star could start
+                    p_ch = *p;
+                    while ((t_ch = *text) != '\0' && (match_slash || t_ch != '/')) {
+                        if (t_ch == p_ch) break;
+                        text++;
+                    }
+                    if (t_ch != p_ch) return WM_NOMATCH;
+                }
+                int matched = dowild(p, text, pathname);
+                if (matched != WM_NOMATCH) {
+                    if (!match_slash || matched != WM_ABORT_TO_STARSTAR) return matched;
+                } else if (!match_slash && t_ch == '/') {
+                    return WM_ABORT_TO_STARSTAR;
+                }
+                t_ch = *++text;
+            }
+            return WM_ABORT_ALL;
+        case '[': {
+            p_ch = *++p;
+            if (p_ch == '^') p_ch = '!';
+            int negated = p_ch == '!';
+            if (negated) p_ch = *++p;
+            unsigned char prev_ch = 0;
+            int matched = 0;
+            do {
+                if (!p_ch) return WM_ABORT_ALL;
+                if (p_ch == '\\') {
+                    p_ch = *++p;
+                    if (!p_ch) return WM_ABORT_ALL;
+                    if (t_ch == p_ch) matched = 1;
+                } else if (p_ch == '-' && prev_ch && p[1] && p[1] != ']') {
+                    p_ch = *++p;
+                    if (p_ch == '\\') {
+                        p_ch = *++p;
+                        if (!p_ch) return WM_ABORT_ALL;
+                    }
+                    if (t_ch <= p_ch && t_ch >= prev_ch) matched = 1;
+                    p_ch = 0; // a range can't start another one
+                } else if (p_ch == '[' && p[1] == ':') {
+                    const unsigned char *s = p += 2;
+                    while ((p_ch = *p) && p_ch != ']') p++;
+                    if (!p_ch) return WM_ABORT_ALL;
+                    if (p - s < 1 || p[-1] != ':') {
+                        // No ":]": an ordinary '['
+                        p = s - 2;
+                        p_ch = '[';
+                        if (t_ch == p_ch) matched = 1;
+                        continue;
+                    }
+                    int known;
+                    if (class_matches(s, (size_t)(p - s - 1), t_ch, &known)) matched = 1;
+                    if (!known) return WM_ABORT_ALL;
+                    p_ch = 0;
+                } else if (t_ch == p_ch) {
+                    matched = 1;
+                }
+            } while (prev_ch = p_ch, (p_ch = *++p) != ']');
+            if (matched == negated || (pathname && t_ch == '/')) return WM_NOMATCH;
+            continue;
+        }
+        }
+    }
+    return *text ? WM_NOMATCH : WM_MATCH;
+}
+
+
+static int wildmatch(const char *pattern, const char *text, int pathname) {
+    return dowild((const unsigned char *)pattern, (const unsigned char *)text, pathname) == WM_MATCH;
+}
+
+
+static uint32_t hash_text(const char *s, size_t len) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+
+// Spaces at the end of a line don't count unless escaped with a backslash
+static void trim_trailing_spaces(char *s) {
+    char *last_space = NULL;
+    for (char *p = s; *p; p++) {
+        if (*p == ' ') {
+            if (!last_space) last_space = p;
+            continue;
+        }
+        if (*p == '\\' && !*++p) return;
+        last_space = NULL;
+    }
+    if (last_space) *last_space = '\0';
+}
+
+
+static void add_pattern(PatternList *list, char *line) {
+    uint32_t flags = 0;
+    if (*line == '!') {
+        flags |= PATTERN_NEGATIVE;
+        line++;
+    }
+    size_t len = strlen(line);
+    if (len > 0 && line[len - 1] == '/') {
+        line[--len] = '\0';
+        flags |= PATTERN_MUST_BE_DIR;
+    }
+    if (!memchr(line, '/', len)) {
+        flags |= PATTERN_NO_DIR;
+    } else if (*line == '/') {
+        line++; // anchored to the directory, which a path pattern is anyway
+        len--;
+    }
+    if (len == 0) return; // matches nothing
+
+    size_t literal = strcspn(line, "*?[\\");
+    if (literal >= len) flags |= PATTERN_LITERAL;
+    else if (line[0] == '*' && strcspn(line + 1, "*?[\\") == len - 1) flags |= PATTERN_ENDS_WITH;
+    list->patterns[list->count++] = (Pattern){ line, (uint32_t)len, (uint32_t)(literal < len ? literal : len), flags };
+}
+
+
+// Splits the file into patterns and sorts them into the buckets. buf has
+// room for two more bytes after size.
+static PatternList *compile(char *buf, size_t size) {
+    PatternList *list = calloc(1, sizeof(PatternList));
+    if (!list) { perror("calloc"); free(buf); return NULL; }
+    list->buf = buf;
+
+    char *p = buf, *end = buf + size;
+    if (size >= 3 && memcmp(buf, "\xef\xbb\xbf", 3) == 0) p += 3; // byte order mark
+    if (end == p || end[-1] != '\n') *end++ = '\n';
+    *end = '\0';
+    size_t lines = 0;
+    for (char *q = p; q < end; q++) lines += *q == '\n';
+    list->patterns = malloc((lines ? lines : 1) * sizeof(Pattern));
+    if (!list->patterns) goto fail;
+
+    while (p < end) {
+        char *nl = memchr(p, '\n', (size_t)(end - p));
+        *nl = '\0';
+        if (nl > p && *p != '#') {
+            if (nl[-1] == '\r') nl[-1] = '\0';
+            trim_trailing_spaces(p);
+            add_pattern(list, p);
+        }
+        p = nl + 1;
+    }
+
+    size_t literals = 0;
+    for (uint32_t i = 0; i < list->count; i++) {
+        uint32_t flags = list->patterns[i].flags;
+        if (flags & PATTERN_LITERAL) literals++;
+        else if ((flags & PATTERN_NO_DIR) && (flags & PATTERN_ENDS_WITH)) list->suffix_count++;
+        else list->glob_count++;
+    }
+    list->literal_cap = 16;
+    while (list->literal_cap < literals * 2) list->literal_cap *= 2;
+    list->literals = calloc(list->literal_cap, sizeof(uint32_t));
+    list->suffixes = malloc((list->suffix_count + 1) * sizeof(uint32_t));
+    list->globs = malloc((list->glob_count + 1) * sizeof(uint32_t));
+    if (!list->literals || !list->suffixes || !list->globs) goto fail;
+
+    uint32_t suffixes = 0, globs = 0;
+    for (uint32_t i = list->count; i-- > 0; ) {
+        const Pattern *pat = &list->patterns[i];
+        if (pat->flags & PATTERN_LITERAL) {
+            size_t s = hash_text(pat->text, pat->len) & (list->literal_cap - 1);
+            while (list->literals[s]) s = (s + 1) & (list->literal_cap - 1);
+            list->literals[s] = i + 1;
+        } else if ((pat->flags & PATTERN_NO_DIR) && (pat->flags & PATTERN_ENDS_WITH)) {
+            list->suffixes[suffixes++] = i;
+        } else {
+            list->globs[globs++] = i;
+        }
+    }
+    return list;
+
+fail:
+    perror("malloc");
+    free(list->patterns);
+    free(list->literals);
+    free(list->suffixes);
+    free(list->globs);
+    free(list->buf);
+    free(list);
+    return NULL;
+}
+
+
+static void free_list(PatternList *list) {
+    if (!list) return;
+    free(list->patterns);
+    free(list->literals);
+    free(list->suffixes);
+    free(list->globs);
+    free(list->buf);
+    free(list);
+}
+
+
+// NULL when the file is missing or has no patterns
+static PatternList *load(int dir_fd, const char *path) {
+    int fd = openat(dir_fd, path, O_RDONLY | O_NOFOLLOW); // like git, no symlinked ignore files
+    if (fd < 0) {
+        if (errno != ENOENT && errno != ENOTDIR && errno != ELOOP) perror(path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    char *buf = malloc(size + 2);
+    if (!buf) { perror("malloc"); close(fd); return NULL; }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, buf + done, size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) { perror(path); break; }
+        if (n == 0) break;
+        done += (size_t)n;
+    }
+    close(fd);
+
+    PatternList *list = compile(buf, done);
+    if (list && list->count == 0) {
+        free_list(list);
+        return NULL;
+    }
+    return list;
+}
+
+
+void ignore_init_exclude(IgnoreDir *exclude) {
+    exclude->parent = NULL;
+    exclude->patterns = load(AT_FDCWD, EXCLUDE_FILE);
+    exclude->base_len = 0;
+}
+
+
+void ignore_dir_enter(IgnoreDir *dir, const IgnoreDir *parent, int dir_fd, size_t base_len) {
+    dir->parent = parent;
+    dir->patterns = load(dir_fd, ".gitignore");
+    dir->base_len = base_len;
+}
+
+
+void ignore_dir_leave(IgnoreDir *dir) {
+    free_list(dir->patterns);
+    dir->patterns = NULL;
+}
+
+
+static int applies(const Pattern *pat, int is_dir) {
+    return is_dir || !(pat->flags & PATTERN_MUST_BE_DIR);
+}
+
+
+// The highest index above best of a literal pattern equal to key, among
+// basename patterns or among path ones
+static long match_literal(const PatternList *list, const char *key, size_t len, uint32_t no_dir, int is_dir, long best) {
+    size_t s = hash_text(key, len) & (list->literal_cap - 1);
+    for (; list->literals[s]; s = (s + 1) & (list->literal_cap - 1)) {
+        long i = (long)list->literals[s] - 1;
+        const Pattern *pat = &list->patterns[i];
+        if (i > best && (pat->flags & PATTERN_NO_DIR) == no_dir && pat->len == len &&
+            memcmp(pat->text, key, len) == 0 && applies(pat, is_dir)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+
+// -1 when no pattern matches name (relative to the list's directory),
+// else 1 when the last one to match excludes it and 0 when it re-includes it
+static int match_list(const PatternList *list, const char *name, size_t name_len,
+                      const char *base, size_t base_len, int is_dir) {
+    long best = -1;
+    if (list->literal_cap) {
+        best = match_literal(list, base, base_len, PATTERN_NO_DIR, is_dir, best);
+        best = match_literal(list, name, name_len, 0, is_dir, best);
+    }
+    for (uint32_t k = 0; k < list->suffix_count && (long)list->suffixes[k] > best; k++) {
+        const Pattern *pat = &list->patterns[list->suffixes[k]];
+        size_t tail = pat->len - 1;
+        if (applies(pat, is_dir) && tail <= base_len && memcmp(pat->text + 1, base + base_len - tail, tail) == 0) {
+            best = list->suffixes[k];
+            break;
+        }
+    }
+    for (uint32_t k = 0; k < list->glob_count && (long)list->globs[k] > best; k++) {
+        const Pattern *pat = &list->patterns[list->globs[k]];
+        if (!applies(pat, is_dir)) continue;
+        int hit;
+        if (pat->flags & PATTERN_NO_DIR) {
+            hit = base_len >= pat->literal_len && memcmp(pat->text, base, pat->literal_len) == 0 &&
+                  wildmatch(pat->text, base, 0);
+        } else {
+            hit = name_len >= pat->literal_len && memcmp(pat->text, name, pat->literal_len) == 0 &&
+                  wildmatch(pat->text + pat->literal_len, name + pat->literal_len, 1);
+        }
+        if (hit) {
+            best = list->globs[k];
+            break;
+        }
+    }
+    if (best < 0) return -1;
+    return !(list->patterns[best].flags & PATTERN_NEGATIVE);
+}
+
+
+int ignore_excluded(const IgnoreDir *dir, const char *path, size_t len, int is_dir) {
+    size_t base_start = len;
+    while (base_start > 0 && path[base_start - 1] != '/') base_start--;
+    for (; dir; dir = dir->parent) {
+        if (!dir->patterns) continue;
+        int status = match_list(dir->patterns, path + dir->base_len, len - dir->base_len,
+                                path + base_start, len - base_start, is_dir);
+        if (status >= 0) return status;
+    }
+    return 0;
+}
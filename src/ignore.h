@@ -0,0 +1,41 @@
+#ifndef IGNORE_H
+#define IGNORE_H
+
+#include <stddef.h>
+
+// .gitignore and .git/info/exclude, with git's rules: a pattern without a
+// slash matches a name at any depth below its file's directory, one with a
+// slash matches the path relative to that directory, "dir/" only matches
+// directories, "!" re-includes, and the last matching line wins. A deeper
+// .gitignore takes precedence over the ones above it, and info/exclude
+// comes last. Directories that match are never opened, so nothing below
+// them can be re-included (as in git).
+//
+// Each file's patterns are compiled once when it's loaded: exact names and
+// paths go into a hash table, "*.ext" style patterns into a suffix list,
+// and only what's left is run through wildmatch, after a check of its
+// literal prefix.
+
+typedef struct PatternList PatternList;
+
+// One directory's patterns, chained to the frames of the directories above
+// it; the chain ends in the info/exclude frame
+typedef struct IgnoreDir {
+    const struct IgnoreDir *parent;
+    PatternList *patterns;          // NULL when the directory has none
+    size_t base_len;                // length of "<dir>/" relative to the work tree root; 0 at the top
+} IgnoreDir;
+
+// Sets up the bottom frame from .git/info/exclude
+void ignore_init_exclude(IgnoreDir *exclude);
+
+// Loads the .gitignore of the directory open as dir_fd. A file that can't be
+// read is reported and treated as empty.
+void ignore_dir_enter(IgnoreDir *dir, const IgnoreDir *parent, int dir_fd, size_t base_len);
+void ignore_dir_leave(IgnoreDir *dir);
+
+// Whether path (relative to the work tree root, len bytes, inside the
+// directory of `dir`) is ignored
+int ignore_excluded(const IgnoreDir *dir, const char *path, size_t len, int is_dir);
+
+#endif
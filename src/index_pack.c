@@ -0,0 +1,755 @@
+#include "index_pack.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "hash.h"
+#include "object_store.h"
+#include "pack.h"
+#include "pack_write.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+#define SKIM_BUF_SIZE (64 * 1024)
+#define INPUT_BUF_SIZE (256 * 1024)
+#define ENTRY_HEADER_MAX 32      // type/size varint, then an OFS distance or a REF name
+#define ZLIB_CHUNK (1u << 30)    // avail_in/avail_out are 32-bit
+#define ROOT_BATCH 16            // whole objects a worker claims at a time
+
+typedef struct {
+    uint64_t offset;             // entry header
+    uint64_t data_offset;        // zlib stream
+    size_t size;                 // inflated size: the object's, or for a delta the delta's
+    uint32_t crc;                // of the entry as stored
+    uint32_t base;               // OFS_DELTA: index of the base object
+    uint8_t type;                // as stored
+    uint8_t real_type;           // the object's own type, OBJ_NONE until resolved
+    unsigned char raw_hash[20];
+} Object;
+
+typedef struct {
+    const unsigned char *base_name;  // points into the pack
+    uint32_t obj;
+} RefDelta;
+
+// Where the sequential pass gets its bytes: a mapped pack, all of it in
+// `data` from the start, or a stream pulled in a chunk at a time, each chunk
+// copied to the pack file being built as soon as it arrives
+typedef struct {
+    pack_read_fn read;           // NULL for a mapped pack
+    void *ctx;
+    int out_fd;
+    const unsigned char *data;
+    unsigned char *buf;          // streams: what data points at
+    size_t start, end;           // unparsed bytes are data[start..end)
+    uint64_t offset;             // pack offset of data[start]
+    uint32_t crc;                // of the bytes consumed since the caller zeroed it
+    HashCtx *sum;                // streams: the checksum of every byte consumed
+    int eof;                     // read() has said there is no more
+    int failed;                  // reading or teeing failed (reported)
+} PackInput;
+
+typedef struct {
+    const unsigned char *map;
+    size_t map_size;
+    uint64_t end;                // start of the trailing checksum
+    Object *objects;             // in pack order, so sorted by offset
+    uint32_t count;
+    uint32_t *ofs_first;         // count + 1 entries: OFS children of i are
+    uint32_t *ofs_children;      // ofs_children[ofs_first[i] .. ofs_first[i + 1])
+    RefDelta *ref_deltas;        // sorted by base name
+    uint32_t ref_count;
+    atomic_size_t next_root;
+    size_t budget;               // bytes of bases each worker may hold
+} IndexPack;
+
+typedef struct {
+    uint32_t obj;
+    unsigned char *data;         // NULL until built, or after eviction
+    size_t size;
+    uint32_t next_ofs, end_ofs;  // children still to resolve
+    uint32_t next_ref, end_ref;
+} Frame;
+
+typedef struct {
+    IndexPack *ip;
+    z_stream zs;
+    Frame *stack;                // the path from a root down to the current base
+    size_t depth, cap;
+    size_t used;                 // bytes held by the stack
+    uint32_t resolved;
+    int failed;
+} Worker;
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    unsigned char raw_hash[20];
+} ChecksumTask;
+
+
+static uint32_t get_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+
+static int write_all(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("write pack");
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+
+// Pulls the next chunk of a stream in behind the unparsed bytes and copies it
+// to the pack file; returns the bytes added, 0 at the end of the input (a
+// mapped pack has no more) or -1
+static ssize_t input_fill(PackInput *in) {
+    if (in->failed) return -1;
+    if (!in->read || in->eof) return 0;
+    memmove(in->buf, in->buf + in->start, in->end - in->start);
+    in->end -= in->start;
+    in->start = 0;
+
+    ssize_t n = in->read(in->ctx, in->buf + in->end, INPUT_BUF_SIZE - in->end);
+    if (n > 0 && write_all(in->out_fd, in->buf + in->end, (size_t)n) < 0) n = -1;
+    if (n < 0) {
+        in->failed = 1;
+        return -1;
+    }
+    in->eof = n == 0;
+    in->end += (size_t)n;
+    return n;
+}
+
+
+// Unparsed bytes available after trying to make it at least n (fewer only
+// at the end of the input)
+static size_t input_need(PackInput *in, size_t n) {
+    while (in->end - in->start < n && input_fill(in) > 0) {}
+    return in->end - in->start;
+}
+
+
+static void input_consume(PackInput *in, size_t n) {
+    const unsigned char *p = in->data + in->start;
+    in->crc = (uint32_t)crc32_z(in->crc, p, n);
+    if (in->sum) hash_update(in->sum, p, n);
+    in->start += n;
+    in->offset += n;
+}
+
+
+// Inflates the zlib stream at the front of the input, which has to come out
+// at exactly `size` bytes, through `scratch` and into `hash` when given
+static int inflate_input(PackInput *in, z_stream *zs, size_t size, unsigned char *scratch, HashCtx *hash) {
+    if (inflateReset(zs) != Z_OK) return -1;
+    size_t produced = 0;
+    for (;;) {
+        if (in->start == in->end && input_fill(in) <= 0) return -1; // ran out of pack
+        size_t avail = in->end - in->start;
+        zs->next_in = (Bytef *)in->data + in->start;
+        zs->avail_in = (uInt)(avail < ZLIB_CHUNK ? avail : ZLIB_CHUNK);
+        zs->next_out = scratch;
+        zs->avail_out = SKIM_BUF_SIZE;
+        int status = inflate(zs, Z_NO_FLUSH);
+        size_t got = SKIM_BUF_SIZE - zs->avail_out;
+        if (hash) hash_update(hash, scratch, got);
+        produced += got;
+        input_consume(in, (size_t)(zs->next_in - (in->data + in->start)));
+        if (produced > size) return -1;
+        if (status == Z_STREAM_END) break;
+        if (status != Z_OK && status != Z_BUF_ERROR) return -1;
+    }
+    return produced == size ? 0 : -1;
+}
+
+
+// Inflates an entry of the mapped pack into a new buffer (with a NUL after
+// the last byte) for delta resolution
+static unsigned char *inflate_object(Worker *w, const Object *o) {
+    const IndexPack *ip = w->ip;
+    z_stream *zs = &w->zs;
+    unsigned char *out = malloc(o->size + 1);
+    if (!out) { perror("malloc"); return NULL; }
+    if (inflateReset(zs) != Z_OK) goto corrupt;
+
+    uint64_t in_left = ip->end - o->data_offset;
+    zs->next_in = (Bytef *)ip->map + o->data_offset;
+    zs->avail_in = (uInt)(in_left < ZLIB_CHUNK ? in_left : ZLIB_CHUNK);
+    in_left -= zs->avail_in;
+    size_t produced = 0;
+    for (;;) {
+        size_t room = o->size + 1 - produced;
+        zs->next_out = out + produced;
+        zs->avail_out = (uInt)(room < ZLIB_CHUNK ? room : ZLIB_CHUNK);
+        uInt before = zs->avail_out;
+        int status = inflate(zs, Z_NO_FLUSH);
+        produced += before - zs->avail_out;
+        if (produced > o->size) goto corrupt;
+        if (status == Z_STREAM_END) break;
+        if (status != Z_OK && status != Z_BUF_ERROR) goto corrupt;
+
+        if (zs->avail_in == 0 && in_left > 0) {
+            zs->avail_in = (uInt)(in_left < ZLIB_CHUNK ? in_left : ZLIB_CHUNK);
+            in_left -= zs->avail_in;
+        } else if (status == Z_BUF_ERROR) {
+            goto corrupt; // ran out of pack
+        }
+    }
+    if (produced != o->size) goto corrupt;
+    out[o->size] = '\0';
+    return out;
+
+corrupt:
+    fprintf(stderr, "index-pack: corrupt entry at offset %llu\n", (unsigned long long)o->offset);
+    free(out);
+    return NULL;
+}
+
+
+// Index of the object starting at `offset` among the first n, or -1
+static int64_t find_offset(const Object *objects, uint32_t n, uint64_t offset) {
+    uint32_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (objects[mid].offset < offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < n && objects[lo].offset == offset ? (int64_t)lo : -1;
+}
+
+
+// "PACK", version 2 or 3 and the object count
+static int parse_header(IndexPack *ip, PackInput *in, const char *name) {
+    if (input_need(in, 12) < 12) {
+        if (!in->failed) fprintf(stderr, "%s: too short to be a pack\n", name);
+        return -1;
+    }
+    const unsigned char *p = in->data + in->start;
+    uint32_t version = get_be32(p + 4);
+    if (memcmp(p, "PACK", 4) != 0 || (version != 2 && version != 3)) {
+        fprintf(stderr, "%s: not a version 2 or 3 pack\n", name);
+        return -1;
+    }
+    ip->count = get_be32(p + 8);
+    input_consume(in, 12);
+    return 0;
+}
+
+
+// Entry header (type and size, little-endian base-128), the base reference
+// of a delta, then the zlib stream
+static int parse_entry(IndexPack *ip, PackInput *in, uint32_t i) {
+    Object *o = &ip->objects[i];
+    o->offset = in->offset;
+    size_t avail = input_need(in, ENTRY_HEADER_MAX);
+    const unsigned char *p = in->data + in->start;
+    size_t pos = 0;
+
+    if (pos >= avail) return -1;
+    unsigned char c = p[pos++];
+    o->type = (c >> 4) & 7;
+    uint64_t size = c & 15;
+    int shift = 4;
+    while (c & 0x80) {
+        if (pos >= avail || shift > 57) return -1;
+        c = p[pos++];
+        size |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    }
+    if (size > SIZE_MAX - 1) return -1;
+    o->size = (size_t)size;
+
+    if (o->type == OBJ_OFS_DELTA) {
+        // Big-endian base-128 with an implicit +1 per continuation byte
+        if (pos >= avail) return -1;
+        c = p[pos++];
+        uint64_t dist = c & 0x7f;
+        while (c & 0x80) {
+            if (pos >= avail || dist > (UINT64_MAX >> 8)) return -1;
+            c = p[pos++];
+            dist = ((dist + 1) << 7) | (c & 0x7f);
+        }
+        if (dist == 0 || dist > o->offset) return -1;
+        int64_t base = find_offset(ip->objects, i, o->offset - dist);
+        if (base < 0) return -1;
+        o->base = (uint32_t)base;
+    } else if (o->type == OBJ_REF_DELTA) {
+        if (avail - pos < 20) return -1;
+        pos += 20;
+        ip->ref_count++;
+    } else if (o->type < OBJ_COMMIT || o->type > OBJ_TAG) {
+        return -1;
+    }
+    input_consume(in, pos);
+    o->data_offset = in->offset;
+    return 0;
+}
+
+
+// The one sequential pass: every entry has to be inflated to find the next.
+// The object table grows as entries turn up rather than trusting the count
+// in the header. Stops in front of the trailing checksum.
+static int parse_pack(IndexPack *ip, PackInput *in) {
+    z_stream zs = {0};
+    unsigned char *scratch = malloc(SKIM_BUF_SIZE);
+    if (!scratch) { perror("malloc"); return -1; }
+    if (inflateInit(&zs) != Z_OK) { fprintf(stderr, "inflateInit failed\n"); free(scratch); return -1; }
+
+    int ret = -1;
+    size_t cap = 0;
+    for (uint32_t i = 0; i < ip->count; i++) {
+        if (i == cap) {
+            size_t grown_cap = cap ? cap * 2 : 1024;
+            if (grown_cap > (size_t)ip->count + 1) grown_cap = (size_t)ip->count + 1;
+            Object *grown = realloc(ip->objects, grown_cap * sizeof(Object));
+            if (!grown) { perror("realloc"); goto out; }
+            memset(grown + cap, 0, (grown_cap - cap) * sizeof(Object));
+            ip->objects = grown;
+            cap = grown_cap;
+        }
+        Object *o = &ip->objects[i];
+        in->crc = 0;
+        if (parse_entry(ip, in, i) < 0) goto corrupt;
+
+        int whole = o->type != OBJ_OFS_DELTA && o->type != OBJ_REF_DELTA;
+        HashCtx hash;
+        if (whole) {
+            char header[64];
+            int header_len = snprintf(header, sizeof(header), "%s %zu", object_type_name(o->type), o->size) + 1;
+            hash_init(&hash);
+            hash_update(&hash, header, (size_t)header_len);
+        }
+        if (inflate_input(in, &zs, o->size, scratch, whole ? &hash : NULL) < 0) goto corrupt;
+        o->crc = in->crc;
+        if (whole) {
+            hash_final(&hash, o->raw_hash);
+            trace_count(TRACE_BYTES_HASHED, o->size);
+            o->real_type = o->type;
+        }
+        continue;
+
+    corrupt:
+        if (!in->failed) {
+            fprintf(stderr, "index-pack: corrupt entry at offset %llu\n", (unsigned long long)o->offset);
+        }
+        goto out;
+    }
+
+    // Nothing but the checksum may follow the last entry
+    size_t left = input_need(in, 21);
+    if (in->failed) goto out;
+    if (left != 20) {
+        fprintf(stderr, "index-pack: %s after the last object\n", left < 20 ? "pack truncated" : "garbage");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    inflateEnd(&zs);
+    free(scratch);
+    return ret;
+}
+
+
+static int cmp_ref_delta(const void *a, const void *b) {
+    return memcmp(((const RefDelta *)a)->base_name, ((const RefDelta *)b)->base_name, 20);
+}
+
+
+// OFS children grouped by base index (a counting sort), REF deltas by base name
+static int build_trees(IndexPack *ip) {
+    uint32_t *cursor = NULL;
+    ip->ofs_first = calloc((size_t)ip->count + 1, sizeof(uint32_t));
+    ip->ref_deltas = malloc(((size_t)ip->ref_count + 1) * sizeof(RefDelta));
+    if (!ip->ofs_first || !ip->ref_deltas) goto fail;
+
+    uint32_t refs = 0;
+    for (uint32_t i = 0; i < ip->count; i++) {
+        const Object *o = &ip->objects[i];
+        if (o->type == OBJ_OFS_DELTA) ip->ofs_first[o->base + 1]++;
+        else if (o->type == OBJ_REF_DELTA) ip->ref_deltas[refs++] = (RefDelta){ ip->map + o->data_offset - 20, i };
+    }
+    for (uint32_t i = 0; i < ip->count; i++) ip->ofs_first[i + 1] += ip->ofs_first[i];
+    qsort(ip->ref_deltas, refs, sizeof(RefDelta), cmp_ref_delta);
+
+    ip->ofs_children = malloc(((size_t)ip->ofs_first[ip->count] + 1) * sizeof(uint32_t));
+    cursor = malloc(((size_t)ip->count + 1) * sizeof(uint32_t));
+    if (!ip->ofs_children || !cursor) goto fail;
+    memcpy(cursor, ip->ofs_first, (size_t)ip->count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < ip->count; i++) {
+        const Object *o = &ip->objects[i];
+        if (o->type == OBJ_OFS_DELTA) ip->ofs_children[cursor[o->base]++] = i;
+    }
+    free(cursor);
+    return 0;
+
+fail:
+    perror("malloc");
+    free(cursor);
+    return -1;
+}
+
+
+// [*first, *last) of the REF deltas waiting for raw_hash
+static void ref_range(const IndexPack *ip, const unsigned char raw_hash[20], uint32_t *first, uint32_t *last) {
+    uint32_t lo = 0, hi = ip->ref_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (memcmp(ip->ref_deltas[mid].base_name, raw_hash, 20) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    *first = lo;
+    while (hi < ip->ref_count && memcmp(ip->ref_deltas[hi].base_name, raw_hash, 20) == 0) hi++;
+    *last = hi;
+}
+
+
+// Frees the oldest bases, never the current one, until the worker is back
+// under its budget; they get rebuilt if a later child needs them
+static void prune(Worker *w) {
+    for (size_t k = 0; w->used > w->ip->budget && k + 1 < w->depth; k++) {
+        Frame *f = &w->stack[k];
+        if (!f->data) continue;
+        w->used -= f->size;
+        free(f->data);
+        f->data = NULL;
+    }
+}
+
+
+// Pushes obj as the new current base if anything deltas against it; returns
+// 1 if pushed, 0 if not (data is freed) or -1
+static int push_frame(Worker *w, uint32_t obj, unsigned char *data, size_t size) {
+    const IndexPack *ip = w->ip;
+    Frame f = { obj, data, size, ip->ofs_first[obj], ip->ofs_first[obj + 1], 0, 0 };
+    ref_range(ip, ip->objects[obj].raw_hash, &f.next_ref, &f.end_ref);
+    if (f.next_ofs == f.end_ofs && f.next_ref == f.end_ref) {
+        free(data);
+        return 0;
+    }
+
+    if (w->depth == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 64;
+        Frame *grown = realloc(w->stack, cap * sizeof(Frame));
+        if (!grown) { perror("realloc"); free(data); return -1; }
+        w->stack = grown;
+        w->cap = cap;
+    }
+    w->stack[w->depth++] = f;
+    w->used += data ? size : 0;
+    prune(w);
+    return 1;
+}
+
+
+static void pop_frame(Worker *w) {
+    Frame *f = &w->stack[--w->depth];
+    if (f->data) {
+        w->used -= f->size;
+        free(f->data);
+    }
+}
+
+
+// Makes sure the current base is in memory: a root is inflated from the
+// pack, an evicted delta is replayed from the nearest ancestor still held
+static int load_base(Worker *w) {
+    size_t top = w->depth - 1;
+    if (w->stack[top].data) return 0;
+
+    size_t j = top;
+    while (j > 0 && !w->stack[j - 1].data) j--;
+    for (; j <= top; j++) {
+        Frame *f = &w->stack[j];
+        const Object *o = &w->ip->objects[f->obj];
+        unsigned char *raw = inflate_object(w, o);
+        if (!raw) return -1;
+        if (j == 0) {
+            f->data = raw;
+            f->size = o->size;
+        } else {
+            const Frame *parent = &w->stack[j - 1];
+            int status = apply_delta(parent->data, parent->size, raw, o->size, &f->data, &f->size);
+            free(raw);
+            if (status < 0) {
+                fprintf(stderr, "index-pack: bad delta at offset %llu\n", (unsigned long long)o->offset);
+                return -1;
+            }
+        }
+        w->used += f->size;
+    }
+    prune(w);
+    return 0;
+}
+
+
+// Depth-first over the delta tree below a whole object
+static int resolve_tree(Worker *w, uint32_t root) {
+    IndexPack *ip = w->ip;
+    if (push_frame(w, root, NULL, 0) < 0) return -1;
+
+    while (w->depth > 0) {
+        Frame *f = &w->stack[w->depth - 1];
+        uint32_t child;
+        if (f->next_ofs < f->end_ofs) child = ip->ofs_children[f->next_ofs++];
+        else if (f->next_ref < f->end_ref) child = ip->ref_deltas[f->next_ref++].obj;
+        else { pop_frame(w); continue; }
+
+        if (load_base(w) < 0) return -1;
+        Object *c = &ip->objects[child];
+        unsigned char *delta = inflate_object(w, c);
+        if (!delta) return -1;
+        unsigned char *data;
+        size_t size;
+        int status = apply_delta(f->data, f->size, delta, c->size, &data, &size);
+        free(delta);
+        if (status < 0) {
+            fprintf(stderr, "index-pack: bad delta at offset %llu\n", (unsigned long long)c->offset);
+            return -1;
+        }
+
+        c->real_type = ip->objects[f->obj].real_type;
+        hash_object(object_type_name(c->real_type), data, size, c->raw_hash);
+        trace_count(TRACE_BYTES_HASHED, size);
+        w->resolved++;
+        if (push_frame(w, child, data, size) < 0) return -1;
+    }
+    return 0;
+}
+
+
+static void resolve_task(void *arg) {
+    Worker *w = arg;
+    IndexPack *ip = w->ip;
+    TraceSpan span;
+    trace_begin(&span, "resolve deltas");
+    if (inflateInit(&w->zs) != Z_OK) {
+        fprintf(stderr, "inflateInit failed\n");
+        w->failed = 1;
+        trace_end(&span);
+        return;
+    }
+
+    while (!w->failed) {
+        size_t first = atomic_fetch_add_explicit(&ip->next_root, ROOT_BATCH, memory_order_relaxed);
+        if (first >= ip->count) break;
+        size_t last = first + ROOT_BATCH < ip->count ? first + ROOT_BATCH : ip->count;
+        for (size_t i = first; i < last; i++) {
+            uint8_t type = ip->objects[i].type;
+            if (type == OBJ_OFS_DELTA || type == OBJ_REF_DELTA) continue;
+            if (resolve_tree(w, (uint32_t)i) < 0) { w->failed = 1; break; }
+        }
+    }
+
+    while (w->depth > 0) pop_frame(w);
+    free(w->stack);
+    inflateEnd(&w->zs);
+    trace_end(&span);
+}
+
+
+static void checksum_task(void *arg) {
+    ChecksumTask *t = arg;
+    TraceSpan span;
+    trace_begin(&span, "checksum");
+    hash_buffer(t->data, t->len, t->raw_hash);
+    trace_end(&span);
+}
+
+
+// Everything after the sequential pass, once the whole pack is mapped:
+// delta resolution on the pool, then the .idx
+static int resolve_and_write(IndexPack *ip, ThreadPool *pool, int threads, size_t max_cache,
+                             const char *name, const char *idx_path) {
+    PackIndexEntry *entries = NULL;
+    int ret = -1;
+    Worker *workers = calloc((size_t)threads, sizeof(Worker));
+    if (!workers) { perror("calloc"); return -1; }
+    if (build_trees(ip) < 0) goto out;
+
+    ip->budget = max_cache / (size_t)threads;
+    TraceSpan span;
+    trace_begin(&span, "resolve");
+    for (int i = 0; i < threads; i++) {
+        workers[i].ip = ip;
+        thread_pool_submit(pool, resolve_task, &workers[i]);
+    }
+    thread_pool_wait(pool);
+    trace_end(&span);
+
+    uint64_t resolved = 0, deltas = 0;
+    for (int i = 0; i < threads; i++) {
+        if (workers[i].failed) goto out;
+        resolved += workers[i].resolved;
+    }
+    for (uint32_t i = 0; i < ip->count; i++) {
+        deltas += ip->objects[i].type == OBJ_OFS_DELTA || ip->objects[i].type == OBJ_REF_DELTA;
+    }
+    if (resolved != deltas) {
+        fprintf(stderr, "%s: %llu of %llu deltas have no base in the pack\n", name,
+                (unsigned long long)(deltas - resolved), (unsigned long long)deltas);
+        goto out;
+    }
+
+    entries = malloc(((size_t)ip->count + 1) * sizeof(PackIndexEntry));
+    if (!entries) { perror("malloc"); goto out; }
+    for (uint32_t i = 0; i < ip->count; i++) {
+        PackIndexEntry *e = &entries[i];
+        memcpy(e->raw_hash, ip->objects[i].raw_hash, 20);
+        e->crc = ip->objects[i].crc;
+        e->offset = ip->objects[i].offset;
+    }
+    trace_begin(&span, "write index");
+    int status = pack_write_index(idx_path, entries, ip->count, ip->map + ip->end);
+    trace_end(&span);
+    if (status == 0) ret = 0;
+
+out:
+    free(entries);
+    free(workers);
+    return ret;
+}
+
+
+static void index_pack_release(IndexPack *ip) {
+    free(ip->objects);
+    free(ip->ofs_first);
+    free(ip->ofs_children);
+    free(ip->ref_deltas);
+    if (ip->map) munmap((void *)ip->map, ip->map_size);
+}
+
+
+int index_pack(const char *pack_path, const char *idx_path, const IndexPackOptions *opts,
+               unsigned char pack_hash[20]) {
+    IndexPack ip = { 0 };
+    ThreadPool *pool = NULL;
+    char idx_buf[PATH_MAX];
+    int threads = opts->threads > 0 ? opts->threads : 1;
+    int ret = -1;
+
+    if (!idx_path) {
+        size_t len = strlen(pack_path);
+        if (len < 5 || strcmp(pack_path + len - 5, ".pack") != 0 || len >= sizeof(idx_buf)) {
+            fprintf(stderr, "%s: pack name does not end in .pack; give the index a name with -o\n", pack_path);
+            return -1;
+        }
+        memcpy(idx_buf, pack_path, len - 5);
+        strcpy(idx_buf + len - 5, ".idx");
+        idx_path = idx_buf;
+    }
+
+    int fd = open(pack_path, O_RDONLY);
+    if (fd < 0) { perror(pack_path); return -1; }
+    struct stat st;
+    if (fstat(fd, &st) < 0) { perror(pack_path); close(fd); return -1; }
+    if (st.st_size < 12 + 20) {
+        fprintf(stderr, "%s: too short to be a pack\n", pack_path);
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping stays valid
+    if (map == MAP_FAILED) { perror("mmap"); return -1; }
+    ip.map = map;
+    ip.map_size = (size_t)st.st_size;
+    ip.end = ip.map_size - 20;
+
+    PackInput in = { .data = ip.map, .end = ip.map_size };
+    if (parse_header(&ip, &in, pack_path) < 0) goto out;
+    pool = thread_pool_create(threads);
+    if (!pool) goto out;
+
+    // The trailer covers every byte before it: checked alongside the parse
+    ChecksumTask sum = { ip.map, ip.end, { 0 } };
+    thread_pool_submit(pool, checksum_task, &sum);
+    TraceSpan span;
+    trace_begin(&span, "parse");
+    int status = parse_pack(&ip, &in);
+    trace_end(&span);
+    thread_pool_wait(pool);
+    if (status < 0) goto out;
+    if (memcmp(sum.raw_hash, ip.map + ip.end, 20) != 0) {
+        fprintf(stderr, "%s: pack checksum mismatch\n", pack_path);
+        goto out;
+    }
+
+    if (resolve_and_write(&ip, pool, threads, opts->max_cache, pack_path, idx_path) < 0) goto out;
+    memcpy(pack_hash, ip.map + ip.end, 20);
+    ret = 0;
+
+out:
+    if (pool) thread_pool_destroy(pool);
+    index_pack_release(&ip);
+    return ret;
+}
+
+
+int index_pack_stream(pack_read_fn read, void *ctx, int pack_fd, const char *idx_path,
+                      const IndexPackOptions *opts, unsigned char pack_hash[20]) {
+    IndexPack ip = { 0 };
+    ThreadPool *pool = NULL;
+    int threads = opts->threads > 0 ? opts->threads : 1;
+    int ret = -1;
+
+    HashCtx sum;
+    hash_init(&sum);
+    PackInput in = { .read = read, .ctx = ctx, .out_fd = pack_fd, .sum = &sum };
+    in.buf = malloc(INPUT_BUF_SIZE);
+    if (!in.buf) { perror("malloc"); return -1; }
+    in.data = in.buf;
+
+    // Parsing keeps pace with the sender: each chunk is inflated and hashed
+    // as soon as it is read, while the next one is still on its way
+    TraceSpan span;
+    trace_begin(&span, "parse");
+    int status = parse_header(&ip, &in, "index-pack");
+    if (status == 0) status = parse_pack(&ip, &in);
+    trace_end(&span);
+    if (status < 0) goto out;
+
+    unsigned char computed[20];
+    hash_final(&sum, computed);
+    memcpy(pack_hash, in.data + in.start, 20);
+    if (memcmp(computed, pack_hash, 20) != 0) {
+        fprintf(stderr, "index-pack: pack checksum mismatch\n");
+        goto out;
+    }
+
+    // Resolution reads bases back out of the finished file
+    ip.end = in.offset;
+    ip.map_size = (size_t)in.offset + 20;
+    void *map = mmap(NULL, ip.map_size, PROT_READ, MAP_PRIVATE, pack_fd, 0);
+    if (map == MAP_FAILED) { perror("mmap"); goto out; }
+    ip.map = map;
+
+    pool = thread_pool_create(threads);
+    if (!pool) goto out;
+    if (resolve_and_write(&ip, pool, threads, opts->max_cache, "index-pack", idx_path) < 0) goto out;
+    ret = 0;
+
+out:
+    if (pool) thread_pool_destroy(pool);
+    free(in.buf);
+    index_pack_release(&ip);
+    return ret;
+}
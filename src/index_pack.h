@@ -0,0 +1,37 @@
+#ifndef INDEX_PACK_H
+#define INDEX_PACK_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Builds the .idx for a .pack received from elsewhere. One sequential pass
+// finds where every entry ends (only inflating tells), records its CRC and
+// names every whole object. The deltas then form trees hanging off those
+// objects, by base offset (OFS_DELTA) or base name (REF_DELTA); the trees are
+// independent, so worker threads take roots off a shared counter and walk
+// them depth first, keeping reconstructed bases only up to a memory budget
+// and rebuilding evicted ones from the nearest ancestor still held.
+
+typedef struct {
+    int threads;
+    size_t max_cache;      // bytes of reconstructed bases held at once, split across threads
+} IndexPackOptions;
+
+// Writes idx_path (pack_path with .pack replaced by .idx when NULL) and
+// returns the pack's checksum in pack_hash; 0, or -1 on error (reported)
+int index_pack(const char *pack_path, const char *idx_path, const IndexPackOptions *opts,
+               unsigned char pack_hash[20]);
+
+// Fills buf with up to len more bytes of a pack: returns how many, 0 at the
+// end of the pack, or -1 on error (reported)
+typedef ssize_t (*pack_read_fn)(void *ctx, unsigned char *buf, size_t len);
+
+// The same for a pack that is still arriving, e.g. from a fetch: every chunk
+// read is appended to pack_fd (a new, empty file opened for reading and
+// writing) and parsed straight away, so the transfer and the sequential pass
+// overlap and the pack is never held in memory. Deltas are resolved from the
+// finished file.
+int index_pack_stream(pack_read_fn read, void *ctx, int pack_fd, const char *idx_path,
+                      const IndexPackOptions *opts, unsigned char pack_hash[20]);
+
+#endif
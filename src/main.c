@@ -1,333 +1,954 @@
+#define _GNU_SOURCE // memrchr
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <zlib.h>
-#include <openssl/sha.h>
 #include <dirent.h>
 #include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "arena.h"
+#include "bulk_checkin.h"
+#include "checkout.h"
+#include "clone.h"
+#include "commit.h"
+#include "commit_graph.h"
+#include "diff_tree.h"
+#include "fast_import.h"
+#include "hash_object.h"
+#include "ignore.h"
+#include "object_store.h"
+#include "index_pack.h"
+#include "multi_pack_index.h"
+#include "object_cache.h"
+#include "refs.h"
+#include "repack.h"
+#include "stat_cache.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "tree.h"
 
 
-typedef struct {
-    char mode[7];               // e.g. "100644" is a file
-    char *file_name;            // allocated dynamically
-    unsigned char raw_hash[20];
-} Entry; 
+unsigned char *hash_blob_object(char *file_name, char* flag);
 
 
-typedef struct {
-    Entry *entries;
-    size_t count;
-} Tree;
+#define MODE_BLOB "100644"
+#define MODE_TREE "40000"
+
+// Decide whether a directory entry becomes a blob or a subtree; NULL means skip it.
+// Fills *st, which the stat cache needs for every entry anyway; stat relative to the
+// open directory so the kernel doesn't re-walk the whole path for every file.
+static const char *entry_mode(DIR *dir, const struct dirent *dent, struct stat *st) {
+    if (dent->d_type != DT_REG && dent->d_type != DT_DIR && dent->d_type != DT_UNKNOWN)
+        return NULL; // symlinks, devices, etc.
+
+    TraceSpan span;
+    trace_begin(&span, "lstat");
+    int status = fstatat(dirfd(dir), dent->d_name, st, AT_SYMLINK_NOFOLLOW);
+    trace_end(&span);
+    if (status == -1) { perror("lstat"); return NULL; }
+    if (S_ISREG(st->st_mode)) return MODE_BLOB;
+    if (S_ISDIR(st->st_mode)) return MODE_TREE;
+    return NULL;
+}
+
+
+static struct dirent *traced_readdir(DIR *dir) {
+    TraceSpan span;
+    trace_begin(&span, "readdir");
+    struct dirent *dent = readdir(dir);
+    trace_end(&span);
+    return dent;
+}
+
+
+static int skip_dir_entry(const char *name) {
+    return strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, ".git") == 0;
+}
+
+
+// Length of "<dir>/" as ignore rules see it, relative to the work tree root
+static size_t ignore_base_len(const char *key) {
+    return *key ? strlen(key) + 1 : 0;
+}
+
+
+// write-tree's stat cache: what the previous run saw, and what this run records
+static StatCache prev_cache, next_cache;
+static atomic_size_t cache_misses; // files rehashed + trees rebuilt this run
+
+// Cache keys are relative to the work tree root: "./a/b" -> "a/b", "." -> ""
+static const char *cache_key(const char *path) {
+    if (strcmp(path, ".") == 0) return "";
+    return strncmp(path, "./", 2) == 0 ? path + 2 : path;
+}
 
-unsigned char *hash_blob_object(char *file_name, char* flag);
-void hash_to_hex(char* hex_buf, const unsigned char *raw_hash);
 
+// Fills raw_hash from the cache and returns 1 when lstat says the file is untouched
+static int cached_blob_hash(const char *path, const struct stat *st, unsigned char raw_hash[20]) {
+    const char *key = cache_key(path);
+    const StatCacheEntry *e = stat_cache_lookup(&prev_cache, key);
+    if (!e || !stat_cache_blob_clean(&prev_cache, e, st)) return 0;
 
-// Sort tree entries by filename (required for Git-canonical tree hash)
-static int cmp_entry_by_name(const void *a, const void *b) {
-    const Entry *ea = (const Entry *)a, *eb = (const Entry *)b;
-    return strcmp(ea->file_name, eb->file_name);
+    memcpy(raw_hash, e->sha, 20);
+    stat_cache_add(&next_cache, key, st, 0, raw_hash);
+    return 1;
 }
 
-void create_tree_object(const char *dirpath, Tree *tree, unsigned char tree_hash[20]) {
+
+// Hash and write a dirty file, recording it for the next run
+static int hash_blob_uncached(const char *path, const struct stat *st, unsigned char raw_hash[20]) {
+    unsigned char *hash = hash_blob_object((char *)path, "");
+    if (!hash) return -1;
+    memcpy(raw_hash, hash, 20);
+    free(hash);
+    atomic_fetch_add(&cache_misses, 1);
+    stat_cache_add(&next_cache, cache_key(path), st, 0, raw_hash);
+    return 0;
+}
+
+
+// Reuse the cached tree hash when the directory still has the same entries with the
+// same hashes; only trees with a changed descendant get serialized (into out) and written.
+static int finish_tree(const char *dirpath, Tree *tree, TreeBuffer *out, unsigned char tree_hash[20]) {
+    TraceSpan span;
+    trace_begin(&span, "finish-tree");
+    const char *key = cache_key(dirpath);
+    const StatCacheEntry *cached = stat_cache_lookup(&prev_cache, key);
+
+    int unchanged = cached && S_ISDIR(cached->st_mode) && cached->entry_count == tree->count;
+    for (size_t i = 0; unchanged && i < tree->count; i++) {
+        const Entry *e = &tree->entries[i];
+        char child_key[PATH_MAX];
+        snprintf(child_key, sizeof(child_key), "%s%s%s", key, *key ? "/" : "", e->file_name);
+        const StatCacheEntry *child = stat_cache_lookup(&prev_cache, child_key);
+        unchanged = child && memcmp(child->sha, e->raw_hash, 20) == 0 &&
+                    (S_ISDIR(child->st_mode) != 0) == (strcmp(e->mode, MODE_TREE) == 0);
+    }
+
+    int status = 0;
+    if (unchanged) {
+        memcpy(tree_hash, cached->sha, 20);
+    } else {
+        status = write_tree_entries(tree, out, tree_hash);
+        atomic_fetch_add(&cache_misses, 1);
+    }
+    if (status == 0) stat_cache_add(&next_cache, key, NULL, (uint32_t)tree->count, tree_hash);
+    trace_end(&span);
+    return status;
+}
+
+
+// Appends an entry named `name`, its array and name in `arena`; NULL when out of memory
+static Entry *add_tree_entry(Tree *tree, size_t *cap, Arena *arena, const char *mode, const char *name) {
+    if (tree->count == *cap) {
+        size_t grown_cap = *cap ? *cap * 2 : 16;
+        Entry *grown = arena_grow(arena, tree->entries, *cap * sizeof(Entry), grown_cap * sizeof(Entry));
+        if (!grown) return NULL;
+        tree->entries = grown;
+        *cap = grown_cap;
+    }
+    Entry *entry = &tree->entries[tree->count];
+    entry->name_len = strlen(name);
+    entry->file_name = arena_strndup(arena, name, entry->name_len);
+    if (!entry->file_name) return NULL;
+    strcpy(entry->mode, mode);
+    tree->count++;
+    return entry;
+}
+
+
+// One serial write-tree's memory: every directory's entries and names come
+// from the arena and are handed back once its tree is written, and every
+// tree is serialized into the same buffer
+typedef struct {
+    Arena arena;
+    TreeBuffer out;
+} TreeScratch;
+
+
+// Ignored entries are left out, and ignored directories never opened. Like
+// git, a directory with nothing left in it gets no entry. Returns the number
+// of entries in the tree, or -1 on error (reported).
+static long create_tree_object(const char *dirpath, const IgnoreDir *parent_ignore, TreeScratch *scratch,
+                               unsigned char tree_hash[20]) {
     DIR *dir = opendir(dirpath);
-    if (!dir) { perror("opendir"); return; }
+    if (!dir) { perror("opendir"); return -1; }
+    IgnoreDir ignore;
+    ignore_dir_enter(&ignore, parent_ignore, dirfd(dir), ignore_base_len(cache_key(dirpath)));
 
+    Tree tree = { NULL, 0 };
+    size_t cap = 0;
+    long ret = 0;
     struct dirent *dent;
-    while ((dent = readdir(dir)) != NULL) {
-        if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0 || strcmp(dent->d_name, ".git") == 0)
+    while ((dent = traced_readdir(dir)) != NULL) {
+        if (skip_dir_entry(dent->d_name))
             continue;
 
         char subpath[PATH_MAX];
         snprintf(subpath, sizeof(subpath), "%s/%s", dirpath, dent->d_name);
 
-        char *file_name = malloc(strlen(dent->d_name) + 1);
-        strcpy(file_name, dent->d_name);
-
         // Decide mode and raw_hash based on entry type
-        char mode[7];
+        struct stat st;
+        const char *mode = entry_mode(dir, dent, &st);
+        if (!mode) continue;
+        const char *key = cache_key(subpath);
+        if (ignore_excluded(&ignore, key, strlen(key), S_ISDIR(st.st_mode))) continue;
         unsigned char raw_hash[20];
 
-        if (dent->d_type == DT_REG) { // regular file
-            strcpy(mode, "100644");
-            unsigned char *hash = hash_blob_object(subpath, ""); // assuming this both hashes and writes as needed
-            memcpy(raw_hash, hash, 20);
-            free(hash);
-        } else if (dent->d_type == DT_DIR) { // directory
-            strcpy(mode, "40000");
-            Tree new_tree = (Tree){ NULL, 0 };
-            unsigned char new_tree_hash[20];
-            create_tree_object(subpath, &new_tree, new_tree_hash);
-            memcpy(raw_hash, new_tree_hash, 20);
-        } else if (dent->d_type == DT_UNKNOWN) {
-            // Some filesystems don't fill d_type; fall back to lstat
-            struct stat st;
-            if (lstat(subpath, &st) == -1) { perror("lstat"); free(file_name); continue; }
-            if (S_ISREG(st.st_mode)) {
-                strcpy(mode, "100644");
-                unsigned char *hash = hash_blob_object(subpath, "");
-                memcpy(raw_hash, hash, 20);
-                free(hash);
-            } else if (S_ISDIR(st.st_mode)) {
-                strcpy(mode, "40000");
-                Tree new_tree = (Tree){ NULL, 0 };
-                unsigned char new_tree_hash[20];
-                create_tree_object(subpath, &new_tree, new_tree_hash);
-                memcpy(raw_hash, new_tree_hash, 20);
-            } else {
-                free(file_name);
-                continue; // skip other types (symlinks, devices, etc.)
-            }
-        } else {
-            free(file_name);
-            continue; // skip non-regular/non-directory types
+        if (strcmp(mode, MODE_BLOB) == 0) { // regular file
+            if (!cached_blob_hash(subpath, &st, raw_hash) &&
+                hash_blob_uncached(subpath, &st, raw_hash) < 0) { ret = -1; break; }
+        } else { // directory: everything it allocates is ours again once it's written
+            ArenaMark mark = arena_mark(&scratch->arena);
+            long count = create_tree_object(subpath, &ignore, scratch, raw_hash);
+            arena_rewind(&scratch->arena, mark);
+            if (count < 0) { ret = -1; break; }
+            if (count == 0) continue;
         }
 
-        // Store the Entry
-        tree->entries = realloc(tree->entries, sizeof(Entry) * (tree->count + 1));
-        Entry *entry = &tree->entries[tree->count++];
-        strcpy(entry->mode, mode);
-        entry->file_name = file_name;
+        Entry *entry = add_tree_entry(&tree, &cap, &scratch->arena, mode, dent->d_name);
+        if (!entry) { ret = -1; break; }
         memcpy(entry->raw_hash, raw_hash, 20);
     }
 
+    ignore_dir_leave(&ignore);
     closedir(dir);
 
-    // Canonicalize order: sort entries by filename before hashing/writing
-    if (tree->count > 1) {
-        qsort(tree->entries, tree->count, sizeof(Entry), cmp_entry_by_name);
-    }
-
-    // Compute tree payload size
-    size_t tree_size = 0;
-    for (int i = 0; i < tree->count; i++) {
-        Entry *e = &tree->entries[i];
-        tree_size += strlen(e->mode) + 1;    // "<mode><space>"
-        tree_size += strlen(e->file_name) + 1; // "<name><NUL>"
-        tree_size += 20;                       // 20-byte raw SHA
-    }
-
-    // "tree <size>\0" header + payload
-    char header[64];
-    int header_len = sprintf(header, "tree %zu", tree_size) + 1; // +1 for '\0'
-    size_t buf_size = header_len + tree_size;
-
-    unsigned char *tree_data = malloc(buf_size);
-    memcpy(tree_data, header, header_len);
-
-    // Serialize entries
-    unsigned char *p = tree_data + header_len;
-    for (int i = 0; i < tree->count; i++) {
-        Entry *e = &tree->entries[i];
-        p += sprintf((char *)p, "%s %s", e->mode, e->file_name) + 1; // includes the trailing NUL
-        memcpy(p, e->raw_hash, 20);
-        p += 20;
-    }
-
-    // Hash the uncompressed tree object
-    unsigned char sha[20];
-    SHA1(tree_data, buf_size, sha);
-    memcpy(tree_hash, sha, 20);
-
-    // Compress to zlib format (use compressBound to avoid overflow)
-    uLongf cap = compressBound(buf_size);
-    unsigned char *zbuf = malloc(cap);
-    z_stream s = (z_stream){0};
-    if (deflateInit(&s, Z_DEFAULT_COMPRESSION) != Z_OK) {
-        fprintf(stderr, "deflateInit failed\n");
-        free(tree_data);
-        free(zbuf);
-        return;
-    }
-
-    s.next_in  = tree_data; s.avail_in  = (uInt)buf_size;
-    s.next_out = zbuf;      s.avail_out = cap;
-
-    int st = deflate(&s, Z_FINISH);
-    if (st != Z_STREAM_END) {
-        fprintf(stderr, "deflate error: %d (in=%zu, out cap=%lu, out=%lu)\n",
-                st, (size_t)buf_size, (unsigned long)cap, (unsigned long)s.total_out);
-        deflateEnd(&s);
-        free(tree_data);
-        free(zbuf);
-        return;
-    }
-    size_t zlen = s.total_out;
-    deflateEnd(&s);
-
-    // Write to .git/objects/xx/yyyy...
-    char hex[41];
-    hash_to_hex(hex, sha);
-
-    char directory[64], path[128];
-    snprintf(directory,  sizeof(directory), ".git/objects/%.2s", hex);
-    mkdir(directory, 0755);
-    snprintf(path, sizeof(path), ".git/objects/%.2s/%.38s", hex, hex + 2);
+    if (ret == 0 && finish_tree(dirpath, &tree, &scratch->out, tree_hash) < 0) ret = -1;
+    return ret < 0 ? -1 : (long)tree.count;
+}
 
-    FILE *fp = fopen(path, "wb");
-    if (!fp) { perror("fopen"); free(tree_data); free(zbuf); return; }
-    fwrite(zbuf, 1, zlen, fp);
-    fclose(fp);
 
-    free(tree_data);
-    free(zbuf);
-}
+// Parallel write-tree: every directory scan and every blob is a task on the pool.
+// A directory node counts its outstanding children; whichever task finishes the
+// last child serializes that tree (through write_tree_entries, same as the serial
+// path) and reports the hash to its own parent. A node's entries, names, paths
+// and tasks, and its child nodes, come from its arena, released when it finishes:
+// by then every child is done with them.
+typedef struct TreeNode {
+    struct TreeNode *parent;
+    Entry *slot;               // where our hash goes in the parent's entries
+    const char *path;
+    Tree tree;
+    Arena arena;
+    IgnoreDir ignore;          // our .gitignore; children's rules chain to it
+    atomic_size_t pending;     // unhashed children, +1 while the directory is still being scanned
+} TreeNode;
+
+// A serialization buffer not in use by any worker
+typedef struct SpareBuffer {
+    TreeBuffer buf;
+    struct SpareBuffer *next;
+} SpareBuffer;
 
+typedef struct {
+    ThreadPool *pool;
+    atomic_int failed;
+    const IgnoreDir *ignore;   // what the top directory's rules chain to
+    TreeNode root;
+    unsigned char root_hash[20];
+    SpareBuffer *spare;        // guarded by `lock`
+    pthread_mutex_t lock;
+} TreeBuild;
 
-int decompress_data(unsigned char *buffer, const unsigned char *compressed_data, size_t compressed_size) {
-    z_stream stream = {0};
-    stream.next_in = (unsigned char *)compressed_data;
-    stream.avail_in = compressed_size;
+typedef struct {
+    TreeNode *parent;
+    Entry *slot;
+    char *path;
+    struct stat st;
+} TreeTask;
 
-    stream.next_out = buffer;
-    stream.avail_out = 16384;
+static TreeBuild *tree_build; // one build per process
 
-    if (inflateInit(&stream) != Z_OK) return -1;
+static void tree_node_child_done(TreeNode *node);
 
-    int status = inflate(&stream, Z_FINISH);
-    if (status != Z_STREAM_END) {
-        fprintf(stderr, "inflate error: %d\n", status);
-        inflateEnd(&stream);
-        return -1;
+static void finish_tree_node(TreeNode *node) {
+    // Subtrees that turned out empty (mode cleared below) get no entry
+    size_t kept = 0;
+    for (size_t i = 0; i < node->tree.count; i++) {
+        if (node->tree.entries[i].mode[0]) node->tree.entries[kept++] = node->tree.entries[i];
+    }
+    node->tree.count = kept;
+
+    pthread_mutex_lock(&tree_build->lock);
+    SpareBuffer *spare = tree_build->spare;
+    if (spare) tree_build->spare = spare->next;
+    pthread_mutex_unlock(&tree_build->lock);
+    if (!spare && !(spare = calloc(1, sizeof(SpareBuffer)))) { perror("calloc"); abort(); }
+
+    unsigned char hash[20];
+    if (finish_tree(node->path, &node->tree, &spare->buf, hash) < 0) atomic_store(&tree_build->failed, 1);
+
+    pthread_mutex_lock(&tree_build->lock);
+    spare->next = tree_build->spare;
+    tree_build->spare = spare;
+    pthread_mutex_unlock(&tree_build->lock);
+
+    TreeNode *parent = node->parent;
+    if (parent) {
+        memcpy(node->slot->raw_hash, hash, 20);
+        if (node->tree.count == 0) node->slot->mode[0] = '\0';
+    } else {
+        memcpy(tree_build->root_hash, hash, 20);
     }
+    ignore_dir_leave(&node->ignore);
+    arena_release(&node->arena); // the node itself is in its parent's
 
-    inflateEnd(&stream);
-    return stream.total_out;  // return decompressed length
+    if (parent) tree_node_child_done(parent);
 }
 
+static void tree_node_child_done(TreeNode *node) {
+    if (atomic_fetch_sub(&node->pending, 1) == 1) finish_tree_node(node);
+}
 
-long get_file_size(FILE *fp) {
-    fseek(fp, 0, SEEK_END);
-    long file_size = ftell(fp);
-    rewind(fp);
-    return file_size;
-} 
+static void hash_blob_task(void *arg) {
+    TreeTask *task = (TreeTask *)arg; // in the parent's arena: done with it before reporting
+    if (hash_blob_uncached(task->path, &task->st, task->slot->raw_hash) < 0) {
+        atomic_store(&tree_build->failed, 1);
+        memset(task->slot->raw_hash, 0, 20);
+    }
+    tree_node_child_done(task->parent);
+}
 
+static void init_tree_node(TreeNode *node, TreeNode *parent, Entry *slot, const char *path) {
+    *node = (TreeNode){ .parent = parent, .slot = slot, .path = path };
+    atomic_init(&node->pending, 1);
+}
 
+static void scan_dir_task(void *arg) {
+    TreeNode *node = (TreeNode *)arg;
+    Arena *arena = &node->arena;
+
+    // Collect every entry first so the array stops moving before children write into it
+    struct stat *stats = NULL;
+    size_t cap = 0, stats_cap = 0;
+    DIR *dir = opendir(node->path);
+    if (!dir) {
+        perror("opendir");
+        atomic_store(&tree_build->failed, 1);
+    } else {
+        ignore_dir_enter(&node->ignore, node->parent ? &node->parent->ignore : tree_build->ignore, dirfd(dir),
+                         ignore_base_len(cache_key(node->path)));
+        struct dirent *dent;
+        while ((dent = traced_readdir(dir)) != NULL) {
+            if (skip_dir_entry(dent->d_name))
+                continue;
+
+            char subpath[PATH_MAX];
+            snprintf(subpath, sizeof(subpath), "%s/%s", node->path, dent->d_name);
+            struct stat st;
+            const char *mode = entry_mode(dir, dent, &st);
+            if (!mode) continue;
+            const char *key = cache_key(subpath);
+            if (ignore_excluded(&node->ignore, key, strlen(key), S_ISDIR(st.st_mode))) continue;
+
+            if (node->tree.count == stats_cap) {
+                stats_cap = stats_cap ? stats_cap * 2 : 16;
+                stats = realloc(stats, sizeof(struct stat) * stats_cap);
+                if (!stats) { perror("realloc"); abort(); }
+            }
+            stats[node->tree.count] = st;
+            if (!add_tree_entry(&node->tree, &cap, arena, mode, dent->d_name)) abort();
+        }
+        closedir(dir);
+    }
 
-void build_path(char* full_path, size_t buf_size, const char *object_hash) {
-    snprintf(full_path, buf_size, ".git/objects/%.2s/%.38s", object_hash, object_hash + 2);
-}
+    atomic_fetch_add(&node->pending, node->tree.count);
+    size_t path_len = strlen(node->path);
+    for (size_t i = 0; i < node->tree.count; i++) {
+        Entry *entry = &node->tree.entries[i];
+        char *subpath = arena_alloc(arena, path_len + 1 + entry->name_len + 1);
+        if (!subpath) abort();
+        memcpy(subpath, node->path, path_len);
+        subpath[path_len] = '/';
+        memcpy(subpath + path_len + 1, entry->file_name, entry->name_len + 1);
+
+        if (strcmp(entry->mode, MODE_TREE) == 0) {
+            TreeNode *child = arena_alloc(arena, sizeof(TreeNode));
+            if (!child) abort();
+            init_tree_node(child, node, entry, subpath);
+            thread_pool_submit(tree_build->pool, scan_dir_task, child);
+        } else if (cached_blob_hash(subpath, &stats[i], entry->raw_hash)) {
+            // Clean file: no task needed
+            tree_node_child_done(node);
+        } else {
+            TreeTask *task = arena_alloc(arena, sizeof(TreeTask));
+            if (!task) abort();
+            *task = (TreeTask){ node, entry, subpath, stats[i] };
+            thread_pool_submit(tree_build->pool, hash_blob_task, task);
+        }
+    }
+    free(stats);
 
+    // Drop the scan's own reference; finishes the node right away if it had no children
+    tree_node_child_done(node);
+}
 
-void hash_to_hex(char* hex_buf, const unsigned char *raw_hash) {
-    for (int i = 0; i < 20; i++) {
-        sprintf(hex_buf + (i * 2), "%02x", raw_hash[i]);
+// Returns 0 on success; tree_hash is byte-identical to create_tree_object's
+static int create_tree_object_parallel(const char *dirpath, const IgnoreDir *ignore, int jobs,
+                                       unsigned char tree_hash[20]) {
+    TreeBuild build = { .ignore = ignore, .lock = PTHREAD_MUTEX_INITIALIZER };
+    build.pool = thread_pool_create(jobs);
+    if (!build.pool) return -1;
+    tree_build = &build;
+
+    init_tree_node(&build.root, NULL, NULL, dirpath);
+    thread_pool_submit(build.pool, scan_dir_task, &build.root);
+    thread_pool_destroy(build.pool);
+    tree_build = NULL;
+
+    while (build.spare) {
+        SpareBuffer *spare = build.spare;
+        build.spare = spare->next;
+        free(spare->buf.data);
+        free(spare);
     }
-    hex_buf[40] = '\0';
+    memcpy(tree_hash, build.root_hash, 20);
+    return atomic_load(&build.failed) ? -1 : 0;
 }
 
 
+// Hash (and write) a file as a blob object; returns a malloc'd raw hash or NULL
 unsigned char *hash_blob_object(char *file_name, char* flag) {
-    FILE *fp = NULL, *new_fp = NULL;
-    unsigned char *blob = NULL, *compressed = NULL, *hash = NULL;
-    size_t total_size = 0;
-    uLongf comp_cap = 0;
-    size_t zlen = 0;
+    TraceSpan span;
+    trace_begin(&span, "open");
+    int fd = open(file_name, O_RDONLY);
+    trace_end(&span);
+    if (fd < 0) { perror("open"); return NULL; }
 
-    // 1) Open input
-    fp = fopen(file_name, "rb");
-    if (!fp) { perror("fopen"); goto cleanup; }
+    struct stat st;
+    if (fstat(fd, &st) < 0) { perror("fstat"); close(fd); return NULL; }
 
-    long file_length = get_file_size(fp);
-    if (file_length < 0) { fprintf(stderr, "get_file_size failed\n"); goto cleanup; }
+    unsigned char raw_hash[20];
+    int status = write_loose_blob_fd(fd, st.st_size, raw_hash);
+    close(fd);
+    if (status < 0) return NULL;
 
-    // 2) Build "blob <len>\0" header + content
-    char header[64];
-    size_t header_length = (size_t)snprintf(header, sizeof(header), "blob %ld", file_length);
-    if (header_length + 1 > sizeof(header)) { fprintf(stderr, "header overflow\n"); goto cleanup; }
+    if (flag && strcmp(flag, "w") == 0) {
+        char hex_hash[41];
+        hash_to_hex(hex_hash, raw_hash);
+        printf("%s\n", hex_hash);
+    }
 
-    total_size = header_length + 1 + (size_t)file_length;
-    blob = (unsigned char *)malloc(total_size);
-    if (!blob) { perror("malloc"); goto cleanup; }
+    // Success: duplicate hash for caller ownership
+    unsigned char *hash = (unsigned char *)malloc(20);
+    if (!hash) { perror("malloc"); return NULL; }
+    memcpy(hash, raw_hash, 20);
+    return hash;
+}
 
-    memcpy(blob, header, header_length);
-    blob[header_length] = '\0';
 
-    if (fread(blob + header_length + 1, 1, (size_t)file_length, fp) != (size_t)file_length) {
-        perror("fread");
-        goto cleanup;
+
+// hash-object --stdin: all of stdin is one blob
+static int hash_stdin_object(int write) {
+    unsigned char *data = NULL;
+    size_t len = 0, cap = 0;
+    for (;;) {
+        if (len == cap) {
+            cap = cap ? cap * 2 : STREAM_CHUNK;
+            unsigned char *grown = realloc(data, cap);
+            if (!grown) { perror("realloc"); free(data); return -1; }
+            data = grown;
+        }
+        ssize_t n = read(STDIN_FILENO, data + len, cap - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) { perror("read"); free(data); return -1; }
+        if (n == 0) break;
+        len += (size_t)n;
     }
 
-    // 3) SHA1 of uncompressed object
     unsigned char raw_hash[20];
-    SHA1(blob, total_size, raw_hash);
+    int status = 0;
+    if (write) status = write_loose_object("blob", data, len, raw_hash);
+    else hash_object("blob", data, len, raw_hash);
+    free(data);
+    if (status < 0) return -1;
+
     char hex_hash[41];
     hash_to_hex(hex_hash, raw_hash);
+    printf("%s\n", hex_hash);
+    return 0;
+}
+
+
+// Line-at-a-time reader over a raw fd. Owning the buffer tells us when the next
+// read() could block, which is exactly when pending output must be flushed so a
+// client driving us over a pipe sees its answer.
+typedef struct {
+    int fd;
+    char buf[1 << 16];
+    size_t start, end;
+} LineReader;
+
+static char *next_line(LineReader *lr) {
+    for (;;) {
+        char *nl = memchr(lr->buf + lr->start, '\n', lr->end - lr->start);
+        if (nl || (lr->start == 0 && lr->end == sizeof(lr->buf) - 1)) {
+            char *line = lr->buf + lr->start;
+            char *stop = nl ? nl : lr->buf + lr->end;
+            lr->start = (size_t)(stop - lr->buf) + (nl ? 1 : 0);
+            *stop = '\0';
+            return line;
+        }
 
-    // 4) Compress (use compressBound to avoid overflow)
-    z_stream stream = (z_stream){0};
-    if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK) {
-        fprintf(stderr, "deflateInit failed\n");
-        goto cleanup;
+        // Keep the partial line, then refill; -1 leaves room for the terminator
+        memmove(lr->buf, lr->buf + lr->start, lr->end - lr->start);
+        lr->end -= lr->start;
+        lr->start = 0;
+        fflush(stdout);
+        ssize_t n;
+        do {
+            n = read(lr->fd, lr->buf + lr->end, sizeof(lr->buf) - 1 - lr->end);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            if (lr->end == 0) return NULL;
+            lr->buf[lr->end] = '\0'; // last line without a newline
+            lr->start = lr->end = 0;
+            return lr->buf;
+        }
+        lr->end += (size_t)n;
     }
+}
 
-    comp_cap = compressBound(total_size);
-    compressed = (unsigned char *)malloc(comp_cap);
-    if (!compressed) { perror("malloc"); deflateEnd(&stream); goto cleanup; }
 
-    stream.next_in  = blob;
-    stream.avail_in = (uInt)total_size;
-    stream.next_out = compressed;
-    stream.avail_out = comp_cap;
+// cat-file --batch / --batch-check: object names on stdin, "<sha> <type> <size>"
+// (plus the contents and a newline for --batch) on a fully buffered stdout. One
+// ObjectReader, and so one inflate stream and one set of buffers, serves every object.
+static int cat_file_batch(int with_contents) {
+    static char out_buf[1 << 16];
+    setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
 
-    int status = deflate(&stream, Z_FINISH);
-    if (status != Z_STREAM_END) {
-        fprintf(stderr, "Compression overflow.\n");
-        deflateEnd(&stream);
-        goto cleanup;  // don't touch/free 'compressed' again below if we bail here
+    static LineReader input;
+    input.fd = STDIN_FILENO;
+
+    ObjectReader reader;
+    object_reader_init(&reader);
+
+    char *line;
+    while ((line = next_line(&input)) != NULL) {
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\r') line[--len] = '\0';
+
+        unsigned char raw_hash[20];
+        ObjectType type;
+        size_t size;
+        const unsigned char *data = NULL;
+        int status = -1;
+        if (hex_to_hash(raw_hash, line) == 0) {
+            status = with_contents ? object_reader_read(&reader, raw_hash, &type, &data, &size)
+                                   : object_reader_header(&reader, raw_hash, &type, &size);
+        }
+        if (status < 0) {
+            printf("%s missing\n", line);
+            continue;
+        }
+
+        char hex_hash[41];
+        hash_to_hex(hex_hash, raw_hash);
+        printf("%s %s %zu\n", hex_hash, object_type_name(type), size);
+        if (with_contents) {
+            fwrite(data, 1, size, stdout);
+            putchar('\n');
+        }
     }
-    zlen = (size_t)stream.total_out;
-    deflateEnd(&stream);
 
-    // 5) Write .git/objects/xx/yyyy...
-    char dir_path[256];
-    snprintf(dir_path, sizeof(dir_path), ".git/objects/%.2s", hex_hash);
-    // mkdir may already exist; that's fine
-    (void)mkdir(dir_path, 0755);
+    object_reader_release(&reader);
+    if (fflush(stdout) != 0) { perror("write"); return 1; }
+    return 0;
+}
+
+
 
-    char write_path[256];
-    snprintf(write_path, sizeof(write_path), ".git/objects/%.2s/%.38s", hex_hash, hex_hash + 2);
+// ls-tree output for one tree, entries in stored order. With `recursive`,
+// subtrees are descended into in place (one open iterator per level) and
+// only their contents are listed, under "<dir>/" prefixed paths.
+static int ls_tree_walk(const unsigned char raw_hash[20], char *path, size_t path_len,
+                        int recursive, int name_only) {
+    TreeIterator it;
+    if (tree_iter_open(&it, raw_hash) < 0) return -1;
 
-    new_fp = fopen(write_path, "wb");
-    if (!new_fp) { perror("fopen"); goto cleanup; }
+    int ret = 0;
+    TreeEntryView entry;
+    int status;
+    while ((status = tree_iter_next(&it, &entry)) == 1) {
+        if (path_len + entry.name_len + 2 > PATH_MAX) {
+            fprintf(stderr, "fatal: path too long under %.*s\n", (int)path_len, path);
+            ret = -1;
+            break;
+        }
+        memcpy(path + path_len, entry.name, entry.name_len + 1);
+
+        if (recursive && entry.mode == 040000) {
+            path[path_len + entry.name_len] = '/';
+            if (ls_tree_walk(entry.raw_hash, path, path_len + entry.name_len + 1, recursive, name_only) < 0) {
+                ret = -1;
+                break;
+            }
+            continue;
+        }
 
-    if (fwrite(compressed, 1, zlen, new_fp) != zlen) {
-        perror("fwrite");
-        goto cleanup;
+        if (name_only) {
+            puts(path);
+        } else {
+            const char *type = entry.mode == 040000 ? "tree" : entry.mode == 0160000 ? "commit" : "blob";
+            char hex_hash[41];
+            hash_to_hex(hex_hash, entry.raw_hash);
+            printf("%06o %s %s\t%s\n", entry.mode, type, hex_hash, path);
+        }
+    }
+    if (status < 0) {
+        char hex_hash[41];
+        hash_to_hex(hex_hash, raw_hash);
+        fprintf(stderr, "fatal: corrupt tree object %s\n", hex_hash);
+        ret = -1;
     }
 
-    if (flag && strcmp(flag, "w") == 0) {
-        printf("%s\n", hex_hash);
+    tree_iter_close(&it);
+    return ret;
+}
+
+
+
+// "<n>[k|m|g]" into bytes; 0, or -1 if it isn't one
+static int parse_size(const char *arg, size_t *size) {
+    char *end;
+    unsigned long long n = strtoull(arg, &end, 10);
+    int shift = *end == 'k' ? 10 : *end == 'm' ? 20 : *end == 'g' ? 30 : 0;
+    if (shift) end++;
+    if (*end || end == arg) return -1;
+    *size = (size_t)(n << shift);
+    return 0;
+}
+
+
+
+// "<n>" into a count for --max-count/-n; 0, or -1 if it isn't one
+static int parse_count(const char *arg, long *count) {
+    char *end;
+    *count = strtol(arg, &end, 10);
+    return *end || end == arg || *count < 0 ? -1 : 0;
+}
+
+
+// "Thu Oct 5 03:00:00 2023 -0700" from "<time> <tz>", in the author's own zone
+static void format_date(char *buf, size_t len, const char *stamp, const char *end) {
+    static const char *const days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+    static const char *const months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                          "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    char *tz;
+    long long t = strtoll(stamp, &tz, 10);
+    while (tz < end && *tz == ' ') tz++;
+    long zone = 0;
+    if (end - tz >= 5 && (*tz == '+' || *tz == '-')) {
+        zone = ((tz[1] - '0') * 10 + (tz[2] - '0')) * 3600L + ((tz[3] - '0') * 10 + (tz[4] - '0')) * 60L;
+        if (*tz == '-') zone = -zone;
+    } else {
+        tz = "+0000";
     }
+    time_t local = (time_t)(t + zone);
+    struct tm tm;
+    gmtime_r(&local, &tm);
+    snprintf(buf, len, "%s %s %d %02d:%02d:%02d %d %.5s", days[tm.tm_wday], months[tm.tm_mon], tm.tm_mday,
+             tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_year + 1900, tz);
+}
 
-    // 6) Success: duplicate hash for caller ownership
-    hash = (unsigned char *)malloc(20);
-    if (!hash) { perror("malloc"); goto cleanup; }
-    memcpy(hash, raw_hash, 20);
 
-cleanup:
-    if (fp) fclose(fp);
-    if (new_fp) fclose(new_fp);
-    if (blob) free(blob);
-    if (compressed) free(compressed);
-    return hash; // may be NULL if something failed
+// One commit as git log prints it by default, or as "<abbrev> <subject>".
+// Abbreviations are the first 7 digits; unlike git's they aren't lengthened
+// when another object shares them.
+static int print_log_entry(ObjectReader *reader, const Commit *c, int oneline, int first) {
+    ObjectType type;
+    const unsigned char *data;
+    size_t size;
+    char hex[41];
+    hash_to_hex(hex, c->raw_hash);
+    if (object_reader_read(reader, c->raw_hash, &type, &data, &size) < 0 || type != OBJ_COMMIT) {
+        fprintf(stderr, "error: unable to read commit %s\n", hex);
+        return -1;
+    }
+    const char *p = (const char *)data, *end = p + size;
+
+    // Headers up to the blank line; only the author's is shown
+    const char *author = NULL, *author_end = NULL;
+    while (p < end && *p != '\n') {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) eol = end;
+        if (eol - p > 7 && memcmp(p, "author ", 7) == 0) {
+            author = p + 7;
+            author_end = eol;
+        }
+        p = eol < end ? eol + 1 : end;
+    }
+    if (p < end) p++;
+
+    // The message without blank lines around it
+    while (p < end && *p == '\n') p++;
+    while (end > p && (end[-1] == '\n' || end[-1] == ' ' || end[-1] == '\t')) end--;
+
+    if (oneline) {
+        printf("%.7s ", hex);
+        for (int line = 0; p < end && *p != '\n'; line++) { // the first paragraph, on one line
+            const char *eol = memchr(p, '\n', (size_t)(end - p));
+            if (!eol) eol = end;
+            printf("%s%.*s", line ? " " : "", (int)(eol - p), p);
+            p = eol < end ? eol + 1 : end;
+        }
+        putchar('\n');
+        return 0;
+    }
+
+    printf("%scommit %s\n", first ? "" : "\n", hex);
+    if (c->parent_count > 1) {
+        printf("Merge:");
+        for (uint32_t i = 0; i < c->parent_count; i++) {
+            hash_to_hex(hex, c->parents[i]->raw_hash);
+            printf(" %.7s", hex);
+        }
+        putchar('\n');
+    }
+    if (author) {
+        const char *gt = memrchr(author, '>', (size_t)(author_end - author));
+        if (!gt) gt = author_end - 1;
+        char date[64];
+        format_date(date, sizeof(date), gt + 1, author_end);
+        printf("Author: %.*s\nDate:   %s\n", (int)(gt + 1 - author), author, date);
+    }
+    putchar('\n');
+    while (p < end) {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) eol = end;
+        printf("    %.*s\n", (int)(eol - p), p);
+        p = eol < end ? eol + 1 : end;
+    }
+    return 0;
 }
 
 
+// diff-tree output: git's raw lines, or names, or statuses and names. A
+// single commit's id goes above its changes, printed with the first one.
+typedef struct {
+    int name_only, name_status;
+    const char *header;
+} DiffPrint;
 
-int main(int argc, char *argv[]) {
-    // Disable output buffering
-    setbuf(stdout, NULL);
-    setbuf(stderr, NULL);
 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: ./your_program.sh <command> [<args>]\n");
+static int print_change(const TreeChange *change, void *arg) {
+    DiffPrint *print = arg;
+    if (print->header) {
+        puts(print->header);
+        print->header = NULL;
+    }
+    if (print->name_only) {
+        puts(change->path);
+    } else if (print->name_status) {
+        printf("%c\t%s\n", change->status, change->path);
+    } else {
+        static const unsigned char missing[20]; // all zeros on the side without the entry
+        char old_hex[41], new_hex[41];
+        hash_to_hex(old_hex, change->old_hash ? change->old_hash : missing);
+        hash_to_hex(new_hex, change->new_hash ? change->new_hash : missing);
+        printf(":%06o %06o %s %s %c\t%s\n", change->old_mode, change->new_mode, old_hex, new_hex,
+               change->status, change->path);
+    }
+    return 0;
+}
+
+
+// diff-tree <tree-ish> <tree-ish> compares two trees; diff-tree <commit>
+// compares a commit to its first parent, or with --root a root commit to the
+// empty tree. Merges show nothing, as git's without -c.
+static int diff_tree(int argc, char *argv[]) {
+    DiffOptions opts = { 0 };
+    DiffPrint print = { 0 };
+    int root = 0, named = 0, bad = 0, ret = 1;
+    const char *names[2];
+    for (int i = 2; i < argc && !bad; i++) {
+        if (strcmp(argv[i], "-r") == 0) opts.recursive = 1;
+        else if (strcmp(argv[i], "--root") == 0) root = 1;
+        else if (strcmp(argv[i], "--name-only") == 0) print.name_only = 1;
+        else if (strcmp(argv[i], "--name-status") == 0) print.name_status = 1;
+        else if (strcmp(argv[i], "--") == 0) {
+            opts.paths = (const char *const *)argv + i + 1;
+            opts.path_count = (size_t)(argc - i - 1);
+            break;
+        } else if (argv[i][0] != '-' && named < 2) names[named++] = argv[i];
+        else bad = 1;
+    }
+    if (bad || !named) {
+        fprintf(stderr, "usage: diff-tree [-r] [--root] [--name-only | --name-status] <tree-ish> [<tree-ish>] [-- <path>...]\n");
         return 1;
     }
-    
+
+    unsigned char trees[2][20];
+    const unsigned char *old_tree = trees[0];
+    char header[41];
+    if (named == 2) {
+        for (int i = 0; i < 2; i++) {
+            unsigned char raw_hash[20];
+            if (resolve_name(names[i], raw_hash) < 0 || peel_to_tree(raw_hash, trees[i]) < 0) goto out;
+        }
+    } else {
+        unsigned char raw_hash[20];
+        Commit *c;
+        if (resolve_name(names[0], raw_hash) < 0 || !(c = lookup_commit_reference(raw_hash))) goto out;
+        if (c->parent_count > 1 || (c->parent_count == 0 && !root)) {
+            ret = 0;
+            goto out;
+        }
+        if (c->parent_count == 0) {
+            old_tree = NULL;
+        } else {
+            if (parse_commit(c->parents[0]) < 0) goto out;
+            memcpy(trees[0], c->parents[0]->tree, 20);
+        }
+        memcpy(trees[1], c->tree, 20);
+        hash_to_hex(header, c->raw_hash);
+        print.header = header;
+    }
+
+    if (diff_trees(old_tree, trees[1], &opts, print_change, &print) == 0) ret = 0;
+    if (fflush(stdout) != 0) { perror("write"); ret = 1; }
+
+out:
+    commits_release();
+    return ret;
+}
+
+
+// rev-list and log: everything reachable from the commits named (HEAD when
+// log is given none), newest committer date first. Commits in the
+// commit-graph are walked without inflating them; log reads each one it
+// prints. Paths after "--" limit the walk to the commits that change them.
+static int walk_history(int argc, char *argv[], int is_log) {
+    long max_count = -1;
+    int count_only = 0, oneline = 0, named = 0, bad = 0, ret = 1;
+    RevWalk walk;
+    rev_walk_init(&walk);
+    for (int i = 2; i < argc && !bad; i++) {
+        unsigned char raw_hash[20];
+        Commit *c;
+        if (!is_log && strcmp(argv[i], "--count") == 0) {
+            count_only = 1;
+        } else if (is_log && strcmp(argv[i], "--oneline") == 0) {
+            oneline = 1;
+        } else if (strncmp(argv[i], "--max-count=", 12) == 0) {
+            bad = parse_count(argv[i] + 12, &max_count) < 0;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            bad = parse_count(argv[++i], &max_count) < 0;
+        } else if (strcmp(argv[i], "--") == 0) {
+            if (rev_walk_set_paths(&walk, (const char *const *)argv + i + 1, (size_t)(argc - i - 1)) < 0) goto out;
+            break;
+        } else if (argv[i][0] != '-') {
+            if (resolve_name(argv[i], raw_hash) < 0 || !(c = lookup_commit_reference(raw_hash)) ||
+                rev_walk_push(&walk, c) < 0) goto out;
+            named++;
+        } else {
+            bad = 1;
+        }
+    }
+    if (!bad && !named && is_log) {
+        unsigned char raw_hash[20];
+        Commit *c;
+        if (read_ref("HEAD", raw_hash) != 0) {
+            fprintf(stderr, "fatal: your current branch does not have any commits yet\n");
+            goto out;
+        }
+        if (!(c = lookup_commit_reference(raw_hash)) || rev_walk_push(&walk, c) < 0) goto out;
+        named++;
+    }
+    if (bad || !named) {
+        fprintf(stderr, is_log ? "usage: log [--oneline] [--max-count=<n>] [<commit>...] [-- <path>...]\n"
+                               : "usage: rev-list [--count] [--max-count=<n>] <commit>... [-- <path>...]\n");
+        goto out;
+    }
+
+    static char out_buf[1 << 16];
+    setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+    ObjectReader reader;
+    object_reader_init(&reader);
+    TraceSpan span;
+    trace_begin(&span, "walk");
+    long shown = 0;
+    Commit *c;
+    int status = 0;
+    while ((max_count < 0 || shown < max_count) && (status = rev_walk_next(&walk, &c)) == 1) {
+        if (is_log) {
+            if (print_log_entry(&reader, c, oneline, shown == 0) < 0) { status = -1; break; }
+        } else if (!count_only) {
+            char hex[41];
+            hash_to_hex(hex, c->raw_hash);
+            puts(hex);
+        }
+        shown++;
+    }
+    trace_end(&span);
+    object_reader_release(&reader);
+    if (count_only && status >= 0) printf("%ld\n", shown);
+    if (fflush(stdout) != 0) { perror("write"); status = -1; }
+    if (status >= 0) ret = 0;
+
+out:
+    rev_walk_release(&walk);
+    commits_release();
+    return ret;
+}
+
+
+// merge-base [--all] <a> <b> prints the best common ancestor(s);
+// --is-ancestor answers in the exit status only
+static int merge_base(int argc, char *argv[]) {
+    int all = 0, is_ancestor = 0, ret = 1;
+    const char *names[2];
+    int named = 0, bad = 0;
+    for (int i = 2; i < argc && !bad; i++) {
+        if (strcmp(argv[i], "--all") == 0) all = 1;
+        else if (strcmp(argv[i], "--is-ancestor") == 0) is_ancestor = 1;
+        else if (argv[i][0] != '-' && named < 2) names[named++] = argv[i];
+        else bad = 1;
+    }
+    if (bad || named != 2 || (all && is_ancestor)) {
+        fprintf(stderr, "usage: merge-base [--all] <commit> <commit>\n"
+                        "       merge-base --is-ancestor <commit> <commit>\n");
+        return 1;
+    }
+
+    Commit *commits[2];
+    for (int i = 0; i < 2; i++) {
+        unsigned char raw_hash[20];
+        if (resolve_name(names[i], raw_hash) < 0 || !(commits[i] = lookup_commit_reference(raw_hash))) goto out;
+    }
+
+    if (is_ancestor) {
+        int status = commit_is_ancestor(commits[0], commits[1]);
+        ret = status == 1 ? 0 : 1;
+        goto out;
+    }
+
+    Commit **bases;
+    size_t count;
+    if (merge_bases(commits[0], commits[1], &bases, &count) < 0) goto out;
+    for (size_t i = 0; i < count && (all || i == 0); i++) {
+        char hex[41];
+        hash_to_hex(hex, bases[i]->raw_hash);
+        printf("%s\n", hex);
+    }
+    free(bases);
+    ret = count > 0 ? 0 : 1; // no common history: no output, as git
+
+out:
+    commits_release();
+    return ret;
+}
+
+
+static int run_command(int argc, char *argv[]) {
     const char *command = argv[1];
     
     if (strcmp(command, "init") == 0) {
@@ -353,149 +974,353 @@ int main(int argc, char *argv[]) {
         
         printf("Initialized git directory\n");
     } else if ((strcmp(command, "cat-file") == 0)){
-        const char *arg_two = argv[3]; // The object hash
-        char path[256];
-        build_path(path, sizeof(path), arg_two);
+        // Example use: /path/to/your_program.sh cat-file (-p | -t | -s) <object_sha>
+        //              /path/to/your_program.sh cat-file --batch[-check] < object_names
+        if (argc == 3 && strcmp(argv[2], "--batch") == 0) return cat_file_batch(1);
+        if (argc == 3 && strcmp(argv[2], "--batch-check") == 0) return cat_file_batch(0);
 
-        FILE *fp = fopen(path, "rb");
-        if (!fp) {
-            perror("fopen");
+        unsigned char raw_hash[20];
+        if (argc != 4 || (strcmp(argv[2], "-p") != 0 && strcmp(argv[2], "-t") != 0 && strcmp(argv[2], "-s") != 0) ||
+            hex_to_hash(raw_hash, argv[3]) < 0) {
+            fprintf(stderr, "usage: cat-file (-p | -t | -s) <object> | cat-file (--batch | --batch-check)\n");
             return 1;
         }
 
-        // Get file size
-        long compressed_size = get_file_size(fp);
-
-        // Read compressed data into buffer
-        unsigned char *compressed_data = malloc(compressed_size);
-        fread(compressed_data, 1, compressed_size, fp);
-        fclose(fp);
-
-        // Prepare zlib stream
-        z_stream stream = {0};
-        inflateInit(&stream);
-        stream.next_in = compressed_data;
-        stream.avail_in = compressed_size;
-
-        unsigned char buffer[16384]; // 16KB temp buffer
-        int status;
-
-        do {
-            stream.next_out = buffer;
-            stream.avail_out = sizeof(buffer);
-
-            status = inflate(&stream, Z_NO_FLUSH);
-            if (status == Z_STREAM_ERROR || status == Z_DATA_ERROR || status == Z_MEM_ERROR) {
-                fprintf(stderr, "zlib inflate error: %d\n", status);
-                inflateEnd(&stream);
-                free(compressed_data);
+        // -t and -s only need the object header, never the inflated body
+        if (argv[2][1] != 'p') {
+            ObjectReader reader;
+            object_reader_init(&reader);
+            ObjectType type;
+            size_t size;
+            int status = object_reader_header(&reader, raw_hash, &type, &size);
+            object_reader_release(&reader);
+            if (status < 0) {
+                fprintf(stderr, "fatal: Not a valid object name %s\n", argv[3]);
                 return 1;
             }
+            if (argv[2][1] == 't') puts(object_type_name(type));
+            else printf("%zu\n", size);
+            return 0;
+        }
 
-            fwrite(buffer + 8, 1, sizeof(buffer) - stream.avail_out - 8, stdout);
-        } while (status != Z_STREAM_END);
+        // Loose or packed, the object database hands back the inflated payload
+        ObjectView view;
+        CachedObject *obj = read_object_cached(raw_hash, &view);
+        if (!obj) {
+            fprintf(stderr, "fatal: Not a valid object name %s\n", argv[3]);
+            return 1;
+        }
 
-        inflateEnd(&stream);
-        free(compressed_data);
+        fwrite(view.data, 1, view.size, stdout);
+        object_cache_release(obj);
 
     } else if ((strcmp(command, "hash-object") == 0)){
-        // Open file
-        // ./your_program.sh hash-object -w test.txt
-
-        unsigned char *hash = hash_blob_object(argv[3], "w");
-        free(hash);
-        
-    } else if ((strcmp(command, "ls-tree") == 0)){
-        // Example use: /path/to/your_program.sh ls-tree --name-only <tree_sha>
-        const char *tree_sha = argv[3];
-        char hex_hash[41]; 
-        // hash_to_hex(hex_hash, tree_sha);
-        strncpy(hex_hash, tree_sha, 40);
-        hex_hash[40] = '\0';
-        
-        char path[256];
-        build_path(path, sizeof(path), hex_hash);
-        
-        FILE *fp = fopen(path, "rb");
-        if (!fp) {
-            perror("fopen");
+        // ./your_program.sh hash-object -w [--bulk] test.txt
+        // ./your_program.sh hash-object [-w [--bulk]] --stdin-paths < list   (names in input order)
+        // ./your_program.sh hash-object [-w [--bulk]] --stdin < contents
+        int write = 0, bulk = 0, stdin_paths = 0, from_stdin = 0;
+        int arg = 2;
+        for (; arg < argc; arg++) {
+            if (strcmp(argv[arg], "-w") == 0) write = 1;
+            else if (strcmp(argv[arg], "--bulk") == 0) bulk = 1;
+            else if (strcmp(argv[arg], "--stdin-paths") == 0) stdin_paths = 1;
+            else if (strcmp(argv[arg], "--stdin") == 0) from_stdin = 1;
+            else break;
+        }
+        if (stdin_paths + from_stdin + (arg < argc) != 1 || arg < argc - 1) {
+            fprintf(stderr, "usage: hash-object -w [--bulk] <file>\n"
+                            "       hash-object [-w [--bulk]] (--stdin-paths | --stdin)\n");
             return 1;
         }
 
-        long file_size = get_file_size(fp);
-        unsigned char *compressed_data = malloc(file_size);
-        fread(compressed_data, 1, file_size, fp);
-        fclose(fp);
+        if (bulk && bulk_checkin_begin() < 0) return 1;
+        int status;
+        if (stdin_paths) {
+            HashObjectOptions opts = { .write = write, .threads = default_job_count() };
+            static char out_buf[1 << 16];
+            setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+            status = hash_object_paths(stdin, &opts);
+        } else if (from_stdin) {
+            status = hash_stdin_object(write);
+        } else {
+            // A single file is always written, as it was before -w meant anything
+            unsigned char *hash = hash_blob_object(argv[arg], "w");
+            status = hash ? 0 : -1;
+            free(hash);
+        }
+        if (bulk_checkin_end() < 0 || status < 0) return 1;
 
-        unsigned char data[16384]; // 16KB buffer
-        int decompressed_size = decompress_data(data, compressed_data, file_size);
-        if (decompressed_size < 0) {
-            fprintf(stderr, "Failed to decompress data.\n");
-            free(compressed_data);
+    } else if ((strcmp(command, "ls-tree") == 0)){
+        // Example use: /path/to/your_program.sh ls-tree [-r] [--name-only] <tree_sha>
+        int recursive = 0, name_only = 0;
+        int arg = 2;
+        for (; arg < argc - 1; arg++) {
+            if (strcmp(argv[arg], "-r") == 0) recursive = 1;
+            else if (strcmp(argv[arg], "--name-only") == 0) name_only = 1;
+            else break;
+        }
+        unsigned char raw_tree_hash[20];
+        if (arg != argc - 1 || hex_to_hash(raw_tree_hash, argv[arg]) < 0) {
+            fprintf(stderr, "usage: ls-tree [-r] [--name-only] <tree_sha>\n");
+            return 1;
+        }
+        if (!object_exists(raw_tree_hash)) {
+            fprintf(stderr, "fatal: Not a valid object name %s\n", argv[arg]);
             return 1;
         }
 
+        // Listings can run to millions of lines; don't pay a write() for each
+        static char out_buf[1 << 16];
+        setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+        static char path[PATH_MAX];
+        int status = ls_tree_walk(raw_tree_hash, path, 0, recursive, name_only);
+        if (fflush(stdout) != 0) { perror("write"); return 1; }
+        if (status < 0) return 1;
 
-        Tree tree = { NULL, 0 };
-        unsigned char *null_position = memchr(data, '\0', sizeof(data) - 1);
-
-        if (null_position) {
-            size_t offset = null_position - data + 1;
-            while (offset < decompressed_size) {
-                // 1. Parse mode 
-                char mode[7];
-                size_t mode_len = 0;
-                while (data[offset] != ' ') mode[mode_len++] = data[offset++];
-                mode[mode_len] = '\0';
-                offset++; //skip the space
-
-                // 2. Parse filename
-                size_t name_len = 0;
-                while (data[offset + name_len] != '\0') name_len++;
-                char *file_name = malloc(name_len + 1);
-                memcpy(file_name, &data[offset], name_len);
-                file_name[name_len] = '\0';
-                offset += name_len + 1; // skip file name & null terminator
-
-                // 3. Parse raw SHA1
-                unsigned char raw_hash[20];
-                memcpy(raw_hash, &data[offset], 20);
-                offset += 20; // skip the saved raw_hash
-
-                // 4. Store the Entry
-                tree.entries = realloc(tree.entries, sizeof(Entry) * (tree.count + 1));
-                Entry *entry = &tree.entries[tree.count++]; 
-                strcpy(entry->mode, mode);
-                entry->file_name = file_name;
-                memcpy(entry->raw_hash, raw_hash, 20);
-            }
-        } 
 
-        for (int i = 0; i < tree.count; i++) {
-            Entry *entry = &tree.entries[i];
-            printf("%s\n", entry->file_name);
-            free(entry->file_name);
+    } else if ((strcmp(command, "write-tree") == 0)){
+        // Example use: /path/to/your_program.sh write-tree [--jobs=<n>] [--bulk]
+        int jobs = default_job_count();
+        int bulk = 0;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--bulk") == 0) {
+                bulk = 1;
+            } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+                jobs = atoi(argv[i] + 7);
+            } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+                jobs = atoi(argv[++i]);
+            } else {
+                fprintf(stderr, "usage: write-tree [--jobs=<n>] [--bulk]\n");
+                return 1;
+            }
         }
 
-        free(compressed_data);
-        free(tree.entries); 
+        stat_cache_init(&prev_cache);
+        stat_cache_init(&next_cache);
+        stat_cache_load(&prev_cache, STAT_CACHE_FILE);
 
+        // Bulk mode: every new blob and tree goes into one pack
+        if (bulk && bulk_checkin_begin() < 0) return 1;
 
-    } else if ((strcmp(command, "write-tree") == 0)){
-        // Example use: /path/to/your_program.sh write-tree
-        Tree tree = { NULL, 0 };
+        IgnoreDir exclude;
+        ignore_init_exclude(&exclude);
         unsigned char tree_hash[20];
-        create_tree_object(".", &tree, tree_hash); 
+        int status = 0;
+        if (jobs <= 1) {
+            TreeScratch scratch = { 0 };
+            status = create_tree_object(".", &exclude, &scratch, tree_hash) < 0 ? -1 : 0;
+            arena_release(&scratch.arena);
+            free(scratch.out.data);
+        } else {
+            status = create_tree_object_parallel(".", &exclude, jobs, tree_hash);
+        }
+        ignore_dir_leave(&exclude);
+        if (status < 0) {
+            fprintf(stderr, "write-tree failed\n");
+            bulk_checkin_end();
+            return 1;
+        }
+
+        // The cache must not point at objects whose pack never made it to disk
+        if (bulk_checkin_end() < 0) return 1;
+
+        // Best effort: a missing cache only costs the next run a full rehash.
+        // A run that reused every entry would write back the same cache, so skip it.
+        if (atomic_load(&cache_misses) > 0 || next_cache.count != prev_cache.count) {
+            stat_cache_write(&next_cache, STAT_CACHE_FILE);
+        }
+        stat_cache_free(&prev_cache);
+        stat_cache_free(&next_cache);
         for (int i = 0; i < 20; i++) {
             printf("%02x", tree_hash[i]);
         }
         printf("\n");
 
+    } else if ((strcmp(command, "repack") == 0)) {
+        // Example use: /path/to/your_program.sh repack [-d] [-q] [--window=<n>] [--depth=<n>] [--threads=<n>]
+        RepackOptions opts = { .window = 10, .depth = 50, .threads = default_job_count() };
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "-d") == 0) {
+                opts.remove_redundant = 1;
+            } else if (strcmp(argv[i], "-q") == 0) {
+                opts.quiet = 1;
+            } else if (strncmp(argv[i], "--window=", 9) == 0) {
+                opts.window = atoi(argv[i] + 9);
+            } else if (strncmp(argv[i], "--depth=", 8) == 0) {
+                opts.depth = atoi(argv[i] + 8);
+            } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+                opts.threads = atoi(argv[i] + 10);
+            } else {
+                fprintf(stderr, "usage: repack [-d] [-q] [--window=<n>] [--depth=<n>] [--threads=<n>]\n");
+                return 1;
+            }
+        }
+        if (opts.window < 0 || opts.depth < 0 || opts.depth > 4095) {
+            fprintf(stderr, "repack: --window must be >= 0 and --depth between 0 and 4095\n");
+            return 1;
+        }
+        if (repack(&opts) < 0) return 1;
+
+    } else if ((strcmp(command, "index-pack") == 0)) {
+        // Example use: /path/to/your_program.sh index-pack [-o <idx-file>] [--threads=<n>] [--max-cache=<n>[k|m|g]] <pack-file>
+        IndexPackOptions opts = { .threads = default_job_count(), .max_cache = 96u << 20 };
+        const char *pack_path = NULL, *idx_path = NULL;
+        int bad = 0;
+        for (int i = 2; i < argc && !bad; i++) {
+            if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+                idx_path = argv[++i];
+            } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+                opts.threads = atoi(argv[i] + 10);
+            } else if (strncmp(argv[i], "--max-cache=", 12) == 0) {
+                if (parse_size(argv[i] + 12, &opts.max_cache) < 0) bad = 1;
+            } else if (argv[i][0] != '-' && !pack_path) {
+                pack_path = argv[i];
+            } else {
+                bad = 1;
+            }
+        }
+        if (bad || !pack_path) {
+            fprintf(stderr, "usage: index-pack [-o <idx-file>] [--threads=<n>] [--max-cache=<n>[k|m|g]] <pack-file>\n");
+            return 1;
+        }
+
+        unsigned char pack_hash[20];
+        if (index_pack(pack_path, idx_path, &opts, pack_hash) < 0) return 1;
+        char hex_hash[41];
+        hash_to_hex(hex_hash, pack_hash);
+        printf("%s\n", hex_hash);
+
+    } else if ((strcmp(command, "clone") == 0)) {
+        // Example use: /path/to/your_program.sh clone [-q] [-n] [--threads=<n>] [--max-cache=<n>[k|m|g]]
+        //                  [--upload-pack=<command>] <repository> [<directory>]
+        CloneOptions opts = { .threads = default_job_count(), .max_cache = 96u << 20 };
+        const char *source = NULL, *dir = NULL;
+        int bad = 0;
+        for (int i = 2; i < argc && !bad; i++) {
+            if (strcmp(argv[i], "-q") == 0) {
+                opts.quiet = 1;
+            } else if (strcmp(argv[i], "-n") == 0) {
+                opts.no_checkout = 1;
+            } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+                opts.threads = atoi(argv[i] + 10);
+            } else if (strncmp(argv[i], "--max-cache=", 12) == 0) {
+                if (parse_size(argv[i] + 12, &opts.max_cache) < 0) bad = 1;
+            } else if (strncmp(argv[i], "--upload-pack=", 14) == 0) {
+                opts.upload_pack = argv[i] + 14;
+            } else if (argv[i][0] != '-' && !source) {
+                source = argv[i];
+            } else if (argv[i][0] != '-' && !dir) {
+                dir = argv[i];
+            } else {
+                bad = 1;
+            }
+        }
+        if (bad || !source) {
+            fprintf(stderr, "usage: clone [-q] [-n] [--threads=<n>] [--max-cache=<n>[k|m|g]] "
+                            "[--upload-pack=<command>] <repository> [<directory>]\n");
+            return 1;
+        }
+        if (clone_repository(source, dir, &opts) < 0) return 1;
+
+    } else if ((strcmp(command, "read-tree") == 0)) {
+        // Example use: /path/to/your_program.sh read-tree -u [--jobs=<n>] <tree-ish>
+        int jobs = default_job_count();
+        int update = 0;
+        const char *name = NULL;
+        int bad = 0;
+        for (int i = 2; i < argc && !bad; i++) {
+            if (strcmp(argv[i], "-u") == 0) {
+                update = 1;
+            } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+                jobs = atoi(argv[i] + 7);
+            } else if (argv[i][0] != '-' && !name) {
+                name = argv[i];
+            } else {
+                bad = 1;
+            }
+        }
+        // There is no index to read into: the work tree is all we update
+        unsigned char raw_hash[20], tree_hash[20];
+        if (bad || !update || !name) {
+            fprintf(stderr, "usage: read-tree -u [--jobs=<n>] <tree-ish>\n");
+            return 1;
+        }
+        if (resolve_name(name, raw_hash) < 0 || peel_to_tree(raw_hash, tree_hash) < 0) return 1;
+
+        StatCache cache;
+        stat_cache_init(&cache);
+        int status = checkout_tree(tree_hash, jobs, &cache);
+        // Best effort, as for write-tree: without it the next write-tree rehashes
+        if (status == 0) stat_cache_write(&cache, STAT_CACHE_FILE);
+        stat_cache_free(&cache);
+        if (status < 0) return 1;
+
+    } else if ((strcmp(command, "fast-import") == 0)) {
+        // Example use: /path/to/your_program.sh fast-import [--quiet] [--import-marks=<file>] [--export-marks=<file>] < stream
+        FastImportOptions opts = { 0 };
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--quiet") == 0) {
+                opts.quiet = 1;
+            } else if (strncmp(argv[i], "--import-marks=", 15) == 0) {
+                opts.import_marks = argv[i] + 15;
+            } else if (strncmp(argv[i], "--export-marks=", 15) == 0) {
+                opts.export_marks = argv[i] + 15;
+            } else {
+                fprintf(stderr, "usage: fast-import [--quiet] [--import-marks=<file>] [--export-marks=<file>]\n");
+                return 1;
+            }
+        }
+        if (fast_import(STDIN_FILENO, &opts) < 0) return 1;
+
+    } else if ((strcmp(command, "rev-list") == 0)) {
+        // Example use: /path/to/your_program.sh rev-list [--count] [--max-count=<n>] <commit>... [-- <path>...]
+        return walk_history(argc, argv, 0);
+
+    } else if ((strcmp(command, "log") == 0)) {
+        // Example use: /path/to/your_program.sh log [--oneline] [--max-count=<n>] [<commit>...] [-- <path>...]
+        return walk_history(argc, argv, 1);
+
+    } else if ((strcmp(command, "diff-tree") == 0)) {
+        // Example use: /path/to/your_program.sh diff-tree -r <commit> [<commit>] [-- <path>...]
+        return diff_tree(argc, argv);
+
+    } else if ((strcmp(command, "merge-base") == 0)) {
+        // Example use: /path/to/your_program.sh merge-base [--all | --is-ancestor] <commit> <commit>
+        return merge_base(argc, argv);
+
+    } else if ((strcmp(command, "commit-graph") == 0)) {
+        // Example use: /path/to/your_program.sh commit-graph write [--changed-paths]
+        int changed_paths = argc == 4 && strcmp(argv[3], "--changed-paths") == 0;
+        if (argc != 3 + changed_paths || strcmp(argv[2], "write") != 0) {
+            fprintf(stderr, "usage: commit-graph write [--changed-paths]\n");
+            return 1;
+        }
+        int status = commit_graph_write(changed_paths);
+        commits_release();
+        if (status < 0) return 1;
+
+    } else if ((strcmp(command, "multi-pack-index") == 0)) {
+        // Example use: /path/to/your_program.sh multi-pack-index write
+        if (argc != 3 || strcmp(argv[2], "write") != 0) {
+            fprintf(stderr, "usage: multi-pack-index write\n");
+            return 1;
+        }
+        if (multi_pack_index_write() < 0) return 1;
+
     } else if ((strcmp(command, "commit-tree") == 0)) {
-        // $ ./your_program.sh commit-tree <tree_sha> -p <commit_sha> -m <message>
-        char *tree_sha = argv[2];
-        char *parent_sha = argv[4];
-        char *message = argv[6];
+        // $ ./your_program.sh commit-tree <tree_sha> [-p <commit_sha>] -m <message>
+        char *tree_sha = argc > 2 ? argv[2] : NULL;
+        char *parent_sha = NULL;
+        char *message = NULL;
+        for (int i = 3; i + 1 < argc; i += 2) {
+            if (strcmp(argv[i], "-p") == 0) parent_sha = argv[i + 1];
+            else if (strcmp(argv[i], "-m") == 0) message = argv[i + 1];
+        }
+        if (!tree_sha || !message) {
+            fprintf(stderr, "usage: commit-tree <tree_sha> [-p <commit_sha>] -m <message>\n");
+            return 1;
+        }
 
         char *tree_label = "tree ";
         char *parent_label = "parent ";
@@ -513,88 +1338,33 @@ int main(int argc, char *argv[]) {
         snprintf(time_str, sizeof(time_str), "%ld %+03d%02d", (long)now, hours, minutes);
 
         size_t content_len= strlen(tree_label) + strlen(tree_sha) + 1;  // + 1 for newline character
-        content_len += strlen(parent_label) + strlen(parent_sha) + 1; // + 1 for newline character
+        if (parent_sha) content_len += strlen(parent_label) + strlen(parent_sha) + 1; // + 1 for newline character
         content_len += strlen(author) + strlen(time_str) + 1;         // + 1 for newline character
         content_len += strlen(committer) + strlen(time_str) + 1;      // + 1 for newline character
         content_len += 1;                                             // + 1 for newline character
         content_len += strlen(message) + 1;                           // + 1 for newline character
 
-        char header[64] = "commit ";
-        snprintf(header + strlen(header), sizeof(header) - strlen(header), "%zu", content_len); 
-        size_t header_len = strlen(header);
-
-        size_t blob_len = header_len + 1 + content_len;
-        unsigned char *blob = malloc(blob_len);
+        unsigned char *content = malloc(content_len + 1); // +1 for sprintf's trailing NUL
+        if (!content) { perror("malloc"); return 1; }
 
-        // Copy header + null separator
-        memcpy(blob, header, header_len);
-        blob[header_len] = '\0'; // Required null between header and content
-
-        unsigned char *p = blob + header_len + 1;
+        unsigned char *p = content;
         p += sprintf((char *)p, "%s%s\n", tree_label, tree_sha);
-        p += sprintf((char *)p, "%s%s\n", parent_label, parent_sha);
+        if (parent_sha) p += sprintf((char *)p, "%s%s\n", parent_label, parent_sha);
         p += sprintf((char *)p, "%s%s\n", author, time_str);
         p += sprintf((char *)p, "%s%s\n", committer, time_str);
         *p++ = '\n'; // blank line
         p += sprintf((char *)p, "%s\n", message);
 
-        // Hash the uncompressed commit object
+        // Hash the uncompressed commit object; written only if it's new
         unsigned char raw_hash[20];
-        SHA1(blob, blob_len, raw_hash);
+        int status = write_loose_object("commit", content, content_len, raw_hash);
+        free(content);
+        if (status < 0) return 1;
+
         char hex_hash[41];
         hash_to_hex(hex_hash, raw_hash);
-
-        // Compress to zlib format (use compressBound to avoid overflow)
-        uLongf cap = compressBound(blob_len);
-        unsigned char *zbuf = malloc(cap);
-        z_stream s = (z_stream){0};
-        if (deflateInit(&s, Z_DEFAULT_COMPRESSION) != Z_OK) {
-            fprintf(stderr, "deflateInit failed\n");
-            free(blob);
-            free(zbuf);
-            return;
-        }
-
-        s.next_in  = blob;      s.avail_in  = (uInt)blob_len;
-        s.next_out = zbuf;      s.avail_out = cap;
-
-        int st = deflate(&s, Z_FINISH);
-        size_t zlen = s.total_out;
-        deflateEnd(&s);
-
-        char dir_path[256];
-        snprintf(dir_path, sizeof(dir_path), ".git/objects/%.2s", hex_hash);
-        // mkdir may already exist; that's fine
-        (void)mkdir(dir_path, 0755);
-
-        char write_path[256];
-        snprintf(write_path, sizeof(write_path), ".git/objects/%.2s/%.38s", hex_hash, hex_hash + 2);
-
         printf("%s\n", hex_hash);
 
-        FILE *fp = fopen(write_path, "wb");
-        if (!fp) {
-            perror("fopen");
-            free(blob);
-            free(zbuf);
-            return;
-        }
-
-        if (fwrite(zbuf, 1, zlen, fp) != zlen) {
-            fprintf(stderr, "fwrite failed\n");
-            fclose(fp);
-            free(blob);
-            free(zbuf);
-            return;
-        }
-
-        fclose(fp);
-
-        // Cleanup
-        free(blob);
-        free(zbuf);
-
-     
     } else {
         fprintf(stderr, "Unknown command %s\n", command);
         return 1;
@@ -602,3 +1372,23 @@ int main(int argc, char *argv[]) {
     
     return 0;
 }
+
+
+int main(int argc, char *argv[]) {
+    // Disable output buffering
+    setbuf(stdout, NULL);
+    setbuf(stderr, NULL);
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: ./your_program.sh <command> [<args>]\n");
+        return 1;
+    }
+
+    // One span per command, so every phase below nests under it
+    trace_init();
+    TraceSpan span;
+    trace_begin(&span, argv[1]);
+    int status = run_command(argc, argv);
+    trace_end(&span);
+    return status;
+}
@@ -0,0 +1,449 @@
+#include "multi_pack_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+#include "pack.h"
+#include "trace.h"
+
+#define PACK_DIR ".git/objects/pack"
+#define MIDX_HEADER_SIZE 12         // "MIDX", version, hash version, chunk count, base files, pack count
+#define CHUNK_ENTRY_SIZE 12         // chunk id + 64-bit offset
+#define OOFF_SIZE 8                 // pack id + offset
+#define LARGE_OFFSET 0x80000000u    // the offset is an index into LOFF instead
+
+#define CHUNK_PNAM 0x504e414du      // "PNAM"
+#define CHUNK_OIDF 0x4f494446u      // "OIDF"
+#define CHUNK_OIDL 0x4f49444cu      // "OIDL"
+#define CHUNK_OOFF 0x4f4f4646u      // "OOFF"
+#define CHUNK_LOFF 0x4c4f4646u      // "LOFF"
+#define CHUNK_OBLM 0x4f424c4du      // "OBLM": ours, the existence filter
+
+// The filter: 10 bits per object in 512-bit blocks, 7 of them set per object
+// within its block. Object names are uniformly random already, so the block
+// comes from name bytes 4-7 and the bits from 9-bit slices of bytes 8-15.
+#define OBLM_HEADER_SIZE 8          // version, hashes per object
+#define FILTER_BLOCK 64
+#define FILTER_BITS_PER_OBJECT 10
+#define FILTER_HASHES 7
+
+
+static uint32_t get_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+
+static uint64_t get_be64(const unsigned char *p) {
+    return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+
+static unsigned char *put_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+    return p + 4;
+}
+
+
+static unsigned char *put_be64(unsigned char *p, uint64_t v) {
+    return put_be32(put_be32(p, (uint32_t)(v >> 32)), (uint32_t)v);
+}
+
+
+static size_t filter_block(uint32_t blocks, const unsigned char *name) {
+    return (size_t)(((uint64_t)get_be32(name + 4) * blocks) >> 32) * FILTER_BLOCK;
+}
+
+
+static void filter_add(unsigned char *filter, uint32_t blocks, const unsigned char *name) {
+    unsigned char *block = filter + filter_block(blocks, name);
+    uint64_t bits = get_be64(name + 8);
+    for (int i = 0; i < FILTER_HASHES; i++, bits >>= 9) block[(bits & 511) / 8] |= 1u << (bits & 7);
+}
+
+
+static int filter_contains(const unsigned char *filter, uint32_t blocks, const unsigned char *name) {
+    const unsigned char *block = filter + filter_block(blocks, name);
+    uint64_t bits = get_be64(name + 8);
+    for (int i = 0; i < FILTER_HASHES; i++, bits >>= 9) {
+        if (!(block[(bits & 511) / 8] & 1u << (bits & 7))) return 0;
+    }
+    return 1;
+}
+
+
+int multi_pack_index_open(MultiPackIndex *midx, const char *path) {
+    memset(midx, 0, sizeof(*midx));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) return 1;
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) { perror(path); close(fd); return -1; }
+    if (st.st_size < MIDX_HEADER_SIZE + CHUNK_ENTRY_SIZE + 20) {
+        close(fd);
+        fprintf(stderr, "error: %s is too short\n", path);
+        return -1;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping stays valid
+    if (map == MAP_FAILED) { perror("mmap"); return -1; }
+    midx->map = map;
+    midx->size = (size_t)st.st_size;
+
+    const unsigned char *p = midx->map;
+    int chunks = p[6];
+    if (memcmp(p, "MIDX", 4) != 0 || p[4] != 1 || p[5] != 1 || p[7] != 0 ||
+        MIDX_HEADER_SIZE + (size_t)(chunks + 1) * CHUNK_ENTRY_SIZE + 20 > midx->size) {
+        fprintf(stderr, "error: %s is not a version 1 SHA-1 multi-pack-index\n", path);
+        goto fail;
+    }
+    midx->pack_count = get_be32(p + 8);
+
+    // Chunks lie back to back, each up to the next one's offset
+    const unsigned char *pnam = NULL, *oblm = NULL;
+    size_t pnam_len = 0, oidl_len = 0, ooff_len = 0, oblm_len = 0;
+    for (int i = 0; i < chunks; i++) {
+        const unsigned char *e = p + MIDX_HEADER_SIZE + (size_t)i * CHUNK_ENTRY_SIZE;
+        uint64_t start = get_be64(e + 4), end = get_be64(e + CHUNK_ENTRY_SIZE + 4);
+        if (start > end || end > midx->size - 20) {
+            fprintf(stderr, "error: %s: bad chunk offsets\n", path);
+            goto fail;
+        }
+        const unsigned char *data = p + start;
+        size_t len = (size_t)(end - start);
+        switch (get_be32(e)) {
+        case CHUNK_PNAM: pnam = data; pnam_len = len; break;
+        case CHUNK_OIDF: if (len == 256 * 4) midx->fanout = data; break;
+        case CHUNK_OIDL: midx->names = data; oidl_len = len; break;
+        case CHUNK_OOFF: midx->offsets = data; ooff_len = len; break;
+        case CHUNK_LOFF: midx->large_offsets = data; midx->large_count = len / 8; break;
+        case CHUNK_OBLM: oblm = data; oblm_len = len; break;
+        default: break; // RIDX and friends: we manage without
+        }
+    }
+    if (!pnam || !midx->fanout || !midx->names || !midx->offsets) {
+        fprintf(stderr, "error: %s lacks a required chunk\n", path);
+        goto fail;
+    }
+    midx->count = get_be32(midx->fanout + 255 * 4);
+    if (oidl_len != (size_t)midx->count * 20 || ooff_len != (size_t)midx->count * OOFF_SIZE) {
+        fprintf(stderr, "error: %s: chunk sizes don't match %u objects\n", path, midx->count);
+        goto fail;
+    }
+
+    midx->pack_names = malloc((midx->pack_count ? midx->pack_count : 1) * sizeof(char *));
+    if (!midx->pack_names) { perror("malloc"); goto fail; }
+    const unsigned char *name = pnam, *pnam_end = pnam + pnam_len;
+    for (uint32_t i = 0; i < midx->pack_count; i++) {
+        const unsigned char *nul = name < pnam_end ? memchr(name, '\0', (size_t)(pnam_end - name)) : NULL;
+        if (!nul || nul == name) {
+            fprintf(stderr, "error: %s: bad pack names\n", path);
+            goto fail;
+        }
+        midx->pack_names[i] = (const char *)name;
+        name = nul + 1;
+    }
+
+    // A filter made with other settings than ours is as good as none
+    if (oblm && oblm_len > OBLM_HEADER_SIZE && (oblm_len - OBLM_HEADER_SIZE) % FILTER_BLOCK == 0 &&
+        get_be32(oblm) == 1 && get_be32(oblm + 4) == FILTER_HASHES) {
+        midx->filter = oblm + OBLM_HEADER_SIZE;
+        midx->filter_blocks = (uint32_t)((oblm_len - OBLM_HEADER_SIZE) / FILTER_BLOCK);
+    }
+    return 0;
+
+fail:
+    multi_pack_index_close(midx);
+    return -1;
+}
+
+
+void multi_pack_index_close(MultiPackIndex *midx) {
+    if (midx->map) munmap((void *)midx->map, midx->size);
+    free(midx->pack_names);
+    memset(midx, 0, sizeof(*midx));
+}
+
+
+int multi_pack_index_find(const MultiPackIndex *midx, const unsigned char raw_hash[20],
+                          uint32_t *pack, uint64_t *offset) {
+    if (midx->filter && !filter_contains(midx->filter, midx->filter_blocks, raw_hash)) return 0;
+
+    uint32_t lo = raw_hash[0] ? get_be32(midx->fanout + (raw_hash[0] - 1) * 4) : 0;
+    uint32_t hi = get_be32(midx->fanout + raw_hash[0] * 4);
+    if (hi > midx->count) hi = midx->count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int c = memcmp(raw_hash, midx->names + (size_t)mid * 20, 20);
+        if (c < 0) { hi = mid; continue; }
+        if (c > 0) { lo = mid + 1; continue; }
+
+        const unsigned char *e = midx->offsets + (size_t)mid * OOFF_SIZE;
+        uint32_t off = get_be32(e + 4);
+        *pack = get_be32(e);
+        if (*pack >= midx->pack_count) return 0;
+        if (!(off & LARGE_OFFSET)) {
+            *offset = off;
+            return 1;
+        }
+        if ((off & ~LARGE_OFFSET) >= midx->large_count) return 0;
+        *offset = get_be64(midx->large_offsets + (size_t)(off & ~LARGE_OFFSET) * 8);
+        return 1;
+    }
+    return 0;
+}
+
+
+typedef struct {
+    const unsigned char *name;
+    uint32_t pack;
+    uint32_t rank;              // of the pack: 0 for the newest
+    uint64_t offset;
+} MidxEntry;
+
+typedef struct {
+    char *name;                 // "pack-xxxx.idx"
+    time_t mtime;
+    Pack pack;
+} MidxPack;
+
+
+static int cmp_pack_name(const void *a, const void *b) {
+    return strcmp(((const MidxPack *)a)->name, ((const MidxPack *)b)->name);
+}
+
+
+static const MidxPack *rank_packs;
+
+static int cmp_pack_age(const void *a, const void *b) {
+    const MidxPack *pa = &rank_packs[*(const uint32_t *)a], *pb = &rank_packs[*(const uint32_t *)b];
+    if (pa->mtime != pb->mtime) return pa->mtime > pb->mtime ? -1 : 1;
+    return strcmp(pa->name, pb->name);
+}
+
+
+// By name, and an object in several packs with its newest copy first
+static int cmp_entry(const void *a, const void *b) {
+    const MidxEntry *ea = a, *eb = b;
+    int c = memcmp(ea->name, eb->name, 20);
+    if (c != 0) return c;
+    return (ea->rank > eb->rank) - (ea->rank < eb->rank);
+}
+
+
+static int write_file(const char *path, const unsigned char *buf, size_t len) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.lock", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0444);
+    if (fd < 0) { perror(tmp_path); return -1; }
+
+    int ok = 1;
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = write(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { ok = 0; break; }
+        done += (size_t)n;
+    }
+    if (close(fd) < 0) ok = 0;
+    if (!ok || rename(tmp_path, path) < 0) {
+        perror("multi-pack-index");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+// Every pack in the pack directory, sorted by name as PNAM wants them
+static MidxPack *open_packs(uint32_t *count) {
+    *count = 0;
+    DIR *dir = opendir(PACK_DIR);
+    if (!dir) { perror(PACK_DIR); return NULL; }
+
+    MidxPack *packs = NULL;
+    size_t cap = 0;
+    int failed = 0;
+    struct dirent *dent;
+    while (!failed && (dent = readdir(dir)) != NULL) {
+        size_t len = strlen(dent->d_name);
+        if (len < 4 || strcmp(dent->d_name + len - 4, ".idx") != 0) continue;
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 8;
+            MidxPack *grown = realloc(packs, cap * sizeof(MidxPack));
+            if (!grown) { perror("realloc"); failed = 1; break; }
+            packs = grown;
+        }
+        MidxPack *mp = &packs[*count];
+        char idx_path[PATH_MAX];
+        snprintf(idx_path, sizeof(idx_path), PACK_DIR "/%s", dent->d_name);
+        if (pack_open(&mp->pack, idx_path) < 0) continue; // reported
+        struct stat st;
+        mp->mtime = stat(mp->pack.pack_path, &st) == 0 ? st.st_mtime : 0;
+        mp->name = strdup(dent->d_name);
+        if (!mp->name) { perror("strdup"); pack_close(&mp->pack); failed = 1; break; }
+        (*count)++;
+    }
+    closedir(dir);
+
+    if (failed) {
+        for (uint32_t i = 0; i < *count; i++) {
+            pack_close(&packs[i].pack);
+            free(packs[i].name);
+        }
+        free(packs);
+        return NULL;
+    }
+    if (*count > 1) qsort(packs, *count, sizeof(MidxPack), cmp_pack_name);
+    return packs;
+}
+
+
+static int write_midx(const MidxPack *packs, uint32_t pack_count, const MidxEntry *entries, size_t n) {
+    size_t large = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (entries[i].offset >= LARGE_OFFSET) large++;
+    }
+    size_t pnam_len = 0;
+    for (uint32_t i = 0; i < pack_count; i++) pnam_len += strlen(packs[i].name) + 1;
+    pnam_len = (pnam_len + 3) & ~(size_t)3;
+    uint32_t blocks = (uint32_t)((n * FILTER_BITS_PER_OBJECT + FILTER_BLOCK * 8 - 1) / (FILTER_BLOCK * 8));
+    if (blocks == 0) blocks = 1;
+
+    // Chunks in git's order, then the filter
+    uint32_t ids[6];
+    size_t offsets[6], sizes[6];
+    int chunks = 0;
+    ids[chunks] = CHUNK_PNAM; sizes[chunks++] = pnam_len;
+    ids[chunks] = CHUNK_OIDF; sizes[chunks++] = 256 * 4;
+    ids[chunks] = CHUNK_OIDL; sizes[chunks++] = n * 20;
+    ids[chunks] = CHUNK_OOFF; sizes[chunks++] = n * OOFF_SIZE;
+    if (large) { ids[chunks] = CHUNK_LOFF; sizes[chunks++] = large * 8; }
+    ids[chunks] = CHUNK_OBLM; sizes[chunks++] = OBLM_HEADER_SIZE + (size_t)blocks * FILTER_BLOCK;
+    size_t len = MIDX_HEADER_SIZE + (size_t)(chunks + 1) * CHUNK_ENTRY_SIZE;
+    for (int i = 0; i < chunks; i++) {
+        offsets[i] = len;
+        len += sizes[i];
+    }
+    len += 20;
+    unsigned char *buf = calloc(1, len);
+    if (!buf) { perror("calloc"); return -1; }
+
+    unsigned char *p = buf;
+    memcpy(p, "MIDX", 4);
+    p[4] = 1;           // version
+    p[5] = 1;           // SHA-1
+    p[6] = (unsigned char)chunks;
+    p[7] = 0;           // no base files
+    p = put_be32(p + 8, pack_count);
+    for (int i = 0; i < chunks; i++) p = put_be64(put_be32(p, ids[i]), offsets[i]);
+    p = put_be64(put_be32(p, 0), len - 20);
+
+    for (uint32_t i = 0; i < pack_count; i++) {
+        size_t name_len = strlen(packs[i].name) + 1;
+        memcpy(p, packs[i].name, name_len);
+        p += name_len;
+    }
+    p = buf + offsets[1];
+
+    size_t i = 0;
+    for (int byte = 0; byte < 256; byte++) {
+        while (i < n && entries[i].name[0] == byte) i++;
+        p = put_be32(p, (uint32_t)i);
+    }
+    for (i = 0; i < n; i++, p += 20) memcpy(p, entries[i].name, 20);
+
+    unsigned char *loff = large ? buf + offsets[4] : NULL;
+    uint32_t large_index = 0;
+    for (i = 0; i < n; i++) {
+        p = put_be32(p, entries[i].pack);
+        if (entries[i].offset < LARGE_OFFSET) {
+            p = put_be32(p, (uint32_t)entries[i].offset);
+        } else {
+            p = put_be32(p, LARGE_OFFSET | large_index++);
+            loff = put_be64(loff, entries[i].offset);
+        }
+    }
+
+    p = put_be32(put_be32(buf + offsets[chunks - 1], 1), FILTER_HASHES);
+    for (i = 0; i < n; i++) filter_add(p, blocks, entries[i].name);
+    hash_buffer(buf, len - 20, buf + len - 20);
+
+    int ret = write_file(MULTI_PACK_INDEX_FILE, buf, len);
+    free(buf);
+    return ret;
+}
+
+
+int multi_pack_index_write(void) {
+    uint32_t pack_count;
+    MidxPack *packs = open_packs(&pack_count);
+    if (!packs) return -1;
+    uint32_t *order = NULL, *rank = NULL;
+    MidxEntry *entries = NULL;
+    int ret = -1;
+    if (pack_count == 0) {
+        fprintf(stderr, "error: no packs to index\n");
+        goto out;
+    }
+
+    TraceSpan span;
+    trace_begin(&span, "merge");
+    order = malloc(pack_count * sizeof(uint32_t));
+    rank = malloc(pack_count * sizeof(uint32_t));
+    size_t total = 0;
+    for (uint32_t i = 0; i < pack_count; i++) total += packs[i].pack.count;
+    entries = malloc((total ? total : 1) * sizeof(MidxEntry));
+    if (!order || !rank || !entries) { perror("malloc"); trace_end(&span); goto out; }
+
+    for (uint32_t i = 0; i < pack_count; i++) order[i] = i;
+    rank_packs = packs;
+    qsort(order, pack_count, sizeof(uint32_t), cmp_pack_age);
+    for (uint32_t i = 0; i < pack_count; i++) rank[order[i]] = i;
+
+    size_t n = 0;
+    for (uint32_t i = 0; i < pack_count; i++) {
+        const Pack *pack = &packs[i].pack;
+        for (uint32_t j = 0; j < pack->count; j++) {
+            uint64_t offset = pack_offset(pack, j);
+            if (offset == UINT64_MAX) continue;
+            entries[n++] = (MidxEntry){ pack_name(pack, j), i, rank[i], offset };
+        }
+    }
+    qsort(entries, n, sizeof(MidxEntry), cmp_entry);
+    size_t unique = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (unique && memcmp(entries[unique - 1].name, entries[i].name, 20) == 0) continue;
+        entries[unique++] = entries[i];
+    }
+    trace_end(&span);
+
+    trace_begin(&span, "write");
+    ret = write_midx(packs, pack_count, entries, unique);
+    trace_end(&span);
+
+out:
+    for (uint32_t i = 0; i < pack_count; i++) {
+        pack_close(&packs[i].pack);
+        free(packs[i].name);
+    }
+    free(packs);
+    free(order);
+    free(rank);
+    free(entries);
+    return ret;
+}
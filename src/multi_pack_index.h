@@ -0,0 +1,50 @@
+#ifndef MULTI_PACK_INDEX_H
+#define MULTI_PACK_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// git's multi-pack-index (version 1, SHA-1), .git/objects/pack/multi-pack-index:
+// the names of every object in a set of packs, merged into one sorted table
+// with the pack and offset each is read from, so a lookup is one binary
+// search however many packs there are. An object in several packs is listed
+// once, for the most recently written of them.
+//
+// The file also carries an OBLM chunk, which git skips as it does any chunk
+// it doesn't know: a blocked Bloom filter over the same names. Asking it
+// whether an object exists touches one 64-byte block, and a "no" (wrong for
+// about one missing object in a hundred) settles the lookup without the
+// binary search, which is the common case when a write checks whether the
+// object it is about to store is new.
+
+#define MULTI_PACK_INDEX_FILE ".git/objects/pack/multi-pack-index"
+
+typedef struct {
+    const unsigned char *map;
+    size_t size;
+    uint32_t pack_count;
+    const char **pack_names;          // PNAM: "pack-xxxx.idx", sorted; points into the map
+    uint32_t count;
+    const unsigned char *fanout;      // OIDF: 256 big-endian cumulative counts
+    const unsigned char *names;       // OIDL: count x 20-byte object names, sorted
+    const unsigned char *offsets;     // OOFF: count x (pack id, offset or LOFF index)
+    const unsigned char *large_offsets;  // LOFF, NULL if none
+    size_t large_count;
+    const unsigned char *filter;      // OBLM blocks, NULL if none
+    uint32_t filter_blocks;
+} MultiPackIndex;
+
+// Returns 0, 1 when there is no such file, or -1 when it is corrupt (reported)
+int multi_pack_index_open(MultiPackIndex *midx, const char *path);
+void multi_pack_index_close(MultiPackIndex *midx);
+
+// Returns 1 and sets *pack (an index into pack_names) and *offset when the
+// object is in one of the packs
+int multi_pack_index_find(const MultiPackIndex *midx, const unsigned char raw_hash[20],
+                          uint32_t *pack, uint64_t *offset);
+
+// Replaces the file with one covering every pack in .git/objects/pack.
+// Returns 0, or -1 on error (reported).
+int multi_pack_index_write(void);
+
+#endif
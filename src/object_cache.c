@@ -0,0 +1,218 @@
+#include "object_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "trace.h"
+
+#define DEFAULT_LIMIT (96u << 20)   // git's core.deltaBaseCacheLimit default
+#define MIN_BUCKETS 1024
+
+struct CachedObject {
+    const void *pack;
+    uint64_t offset;
+    unsigned char name[20];
+    ObjectType type;
+    unsigned char *data;
+    size_t size;
+    unsigned refs;                  // guarded by cache.lock, like everything below
+    int cached;                     // still in the table (and on the LRU list)
+    CachedObject *chain;            // next in the bucket
+    CachedObject *newer, *older;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    CachedObject **buckets;
+    size_t bucket_count;            // a power of two, or 0 until the first put
+    size_t count;
+    size_t bytes, limit;
+    CachedObject *newest, *oldest;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_once_t limit_once = PTHREAD_ONCE_INIT;
+
+
+static void load_limit(void) {
+    long value;
+    cache.limit = DEFAULT_LIMIT;
+    if (config_get_int("core.deltaBaseCacheLimit", &value) == 0 && value >= 0) cache.limit = (size_t)value;
+}
+
+
+static size_t key_hash(const void *pack, uint64_t offset, const unsigned char *name) {
+    uint64_t h;
+    if (pack) {
+        h = ((uint64_t)(uintptr_t)pack ^ offset) * 0x9e3779b97f4a7c15u;
+        return (size_t)(h >> 32 ^ h);
+    }
+    memcpy(&h, name, sizeof(h)); // object names are already uniformly distributed
+    return (size_t)h;
+}
+
+
+static int key_equal(const CachedObject *obj, const void *pack, uint64_t offset, const unsigned char *name) {
+    if (obj->pack != pack) return 0;
+    return pack ? obj->offset == offset : memcmp(obj->name, name, 20) == 0;
+}
+
+
+static CachedObject **find_slot(const void *pack, uint64_t offset, const unsigned char *name) {
+    CachedObject **slot = &cache.buckets[key_hash(pack, offset, name) & (cache.bucket_count - 1)];
+    while (*slot && !key_equal(*slot, pack, offset, name)) slot = &(*slot)->chain;
+    return slot;
+}
+
+
+static void lru_unlink(CachedObject *obj) {
+    if (obj->newer) obj->newer->older = obj->older; else cache.newest = obj->older;
+    if (obj->older) obj->older->newer = obj->newer; else cache.oldest = obj->newer;
+    obj->newer = obj->older = NULL;
+}
+
+
+static void lru_push(CachedObject *obj) {
+    obj->older = cache.newest;
+    obj->newer = NULL;
+    if (cache.newest) cache.newest->newer = obj; else cache.oldest = obj;
+    cache.newest = obj;
+}
+
+
+static void free_object(CachedObject *obj) {
+    free(obj->data);
+    free(obj);
+}
+
+
+// Drops the entry from the table; its payload lives on while referenced
+static void evict(CachedObject *obj) {
+    *find_slot(obj->pack, obj->offset, obj->name) = obj->chain;
+    lru_unlink(obj);
+    obj->cached = 0;
+    cache.count--;
+    cache.bytes -= obj->size;
+    if (obj->refs == 0) free_object(obj);
+}
+
+
+static int grow_table(void) {
+    size_t n = cache.bucket_count ? cache.bucket_count * 2 : MIN_BUCKETS;
+    CachedObject **buckets = calloc(n, sizeof(*buckets));
+    if (!buckets) return -1; // a crowded table still works
+
+    for (size_t i = 0; i < cache.bucket_count; i++) {
+        for (CachedObject *obj = cache.buckets[i], *next; obj; obj = next) {
+            next = obj->chain;
+            size_t b = key_hash(obj->pack, obj->offset, obj->name) & (n - 1);
+            obj->chain = buckets[b];
+            buckets[b] = obj;
+        }
+    }
+    free(cache.buckets);
+    cache.buckets = buckets;
+    cache.bucket_count = n;
+    return 0;
+}
+
+
+static void fill_view(const CachedObject *obj, ObjectView *view) {
+    view->type = obj->type;
+    view->data = obj->data;
+    view->size = obj->size;
+}
+
+
+CachedObject *object_cache_get(const void *pack, uint64_t offset, const unsigned char *name, ObjectView *view) {
+    CachedObject *obj = NULL;
+    pthread_mutex_lock(&cache.lock);
+    if (cache.count) obj = *find_slot(pack, offset, name);
+    if (obj) {
+        obj->refs++;
+        lru_unlink(obj);
+        lru_push(obj);
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    if (obj) {
+        trace_count(TRACE_CACHE_HITS, 1);
+        fill_view(obj, view);
+    }
+    return obj;
+}
+
+
+CachedObject *object_cache_put(const void *pack, uint64_t offset, const unsigned char *name,
+                               ObjectType type, unsigned char *data, size_t size, int keep, ObjectView *view) {
+    pthread_once(&limit_once, load_limit);
+    trace_count(TRACE_CACHE_MISSES, 1);
+    CachedObject *obj = calloc(1, sizeof(*obj));
+    if (!obj) {
+        perror("calloc");
+        free(data);
+        return NULL;
+    }
+    obj->pack = pack;
+    obj->offset = offset;
+    if (name) memcpy(obj->name, name, 20);
+    obj->type = type;
+    obj->data = data;
+    obj->size = size;
+    obj->refs = 1;
+    if (!keep || size > cache.limit / 4) {
+        fill_view(obj, view);
+        return obj;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    if (cache.count >= cache.bucket_count) grow_table();
+    CachedObject **slot = cache.bucket_count ? find_slot(pack, offset, name) : NULL;
+    if (slot && *slot) {
+        // Another thread read the same object meanwhile: share its copy
+        free_object(obj);
+        obj = *slot;
+        obj->refs++;
+    } else if (slot) {
+        *slot = obj;
+        obj->cached = 1;
+        lru_push(obj);
+        cache.count++;
+        cache.bytes += size;
+        while (cache.bytes > cache.limit && cache.oldest != obj) evict(cache.oldest);
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    fill_view(obj, view);
+    return obj;
+}
+
+
+void object_cache_release(CachedObject *obj) {
+    if (!obj) return;
+    pthread_mutex_lock(&cache.lock);
+    int last = --obj->refs == 0 && !obj->cached;
+    pthread_mutex_unlock(&cache.lock);
+    if (last) free_object(obj);
+}
+
+
+unsigned char *object_cache_detach(CachedObject *obj) {
+    pthread_mutex_lock(&cache.lock);
+    int sole = obj->refs == 1 && !obj->cached;
+    pthread_mutex_unlock(&cache.lock);
+
+    unsigned char *data;
+    if (sole) {
+        data = obj->data;
+        free(obj);
+        return data;
+    }
+    data = malloc(obj->size + 1);
+    if (!data) perror("malloc");
+    else memcpy(data, obj->data, obj->size + 1);
+    object_cache_release(obj);
+    return data;
+}
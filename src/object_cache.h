@@ -0,0 +1,40 @@
+#ifndef OBJECT_CACHE_H
+#define OBJECT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "object_store.h"
+
+// Inflated objects recently read, shared by every reader in the process.
+// Tree walks come back to the same trees (a path-limited log compares each
+// commit's tree with its parent's, which is compared again one commit
+// later), and the object a packed delta chain resolves to is the base the
+// next version of it needs. Packed objects are keyed by pack and offset,
+// loose ones by name. Least recently used entries go once the cache holds
+// more than core.deltaBaseCacheLimit bytes (96 MiB unless set, as in git);
+// an object over a quarter of that is never kept.
+//
+// Lookups hand out references: the payload stays valid until the reference
+// is released, even if the entry is evicted meanwhile. All functions are
+// thread safe.
+
+// A packed entry (pack and offset) or, with pack NULL, a loose object (name)
+CachedObject *object_cache_get(const void *pack, uint64_t offset, const unsigned char *name, ObjectView *view);
+
+// Hands `data` (malloc'd, with a NUL after the last byte) to the cache and
+// returns a reference to it. With keep 0 it isn't remembered: the reference
+// just frees the payload when released, so callers can treat cached and
+// uncached objects alike. Returns NULL when out of memory (reported; data
+// is freed).
+CachedObject *object_cache_put(const void *pack, uint64_t offset, const unsigned char *name,
+                               ObjectType type, unsigned char *data, size_t size, int keep, ObjectView *view);
+
+void object_cache_release(CachedObject *obj); // NULL is fine
+
+// Releases the reference and returns its payload as a malloc'd buffer of
+// the caller's own: the payload itself when nothing else can see it, else a
+// copy. Returns NULL when out of memory (reported).
+unsigned char *object_cache_detach(CachedObject *obj);
+
+#endif
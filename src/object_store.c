@@ -0,0 +1,1009 @@
+#include "object_store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "bulk_checkin.h"
+#include "compress.h"
+#include "multi_pack_index.h"
+#include "object_cache.h"
+#include "pack.h"
+#include "trace.h"
+
+
+// Write the whole buffer, retrying on short writes and EINTR
+static int write_all(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+
+// Fill buf with exactly len bytes unless the input ends first; returns bytes read or -1
+static ssize_t read_full(int fd, unsigned char *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        got += (size_t)n;
+    }
+    return (ssize_t)got;
+}
+
+
+static const char *const type_names[] = {
+    [OBJ_COMMIT] = "commit", [OBJ_TREE] = "tree", [OBJ_BLOB] = "blob", [OBJ_TAG] = "tag",
+};
+
+
+const char *object_type_name(ObjectType type) {
+    if (type >= OBJ_COMMIT && type <= OBJ_TAG) return type_names[type];
+    return "unknown";
+}
+
+
+ObjectType object_type_from_name(const char *name, size_t len) {
+    for (int t = OBJ_COMMIT; t <= OBJ_TAG; t++) {
+        if (strlen(type_names[t]) == len && memcmp(type_names[t], name, len) == 0) return (ObjectType)t;
+    }
+    return OBJ_NONE;
+}
+
+
+void build_path(char* full_path, size_t buf_size, const char *object_hash) {
+    snprintf(full_path, buf_size, ".git/objects/%.2s/%.38s", object_hash, object_hash + 2);
+}
+
+
+// Which loose objects exist, one sorted list of names (less their first
+// byte) per fan-out directory, read the first time a lookup lands there
+// (see object_exists_quick).
+// A process starts without it: until LOOSE_CACHE_AFTER lookups have gone
+// to disk, one more access() is cheaper than listing a directory.
+#define LOOSE_CACHE_AFTER 32
+
+typedef struct {
+    pthread_mutex_t lock;
+    int loaded;
+    unsigned char (*names)[19];
+    size_t count, cap;
+} LooseDir;
+
+static LooseDir loose_dirs[256];
+static atomic_uint loose_lookups;
+static pthread_once_t loose_dirs_once = PTHREAD_ONCE_INIT;
+
+
+static void init_loose_dirs(void) {
+    for (int i = 0; i < 256; i++) pthread_mutex_init(&loose_dirs[i].lock, NULL);
+}
+
+
+static int cmp_loose_name(const void *a, const void *b) {
+    return memcmp(a, b, 19);
+}
+
+
+static int loose_dir_add(LooseDir *d, const unsigned char name[19]) {
+    if (d->count == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 64;
+        unsigned char (*grown)[19] = realloc(d->names, cap * sizeof(*grown));
+        if (!grown) return -1;
+        d->names = grown;
+        d->cap = cap;
+    }
+    memcpy(d->names[d->count++], name, 19);
+    return 0;
+}
+
+
+// Left unloaded (and so asked on disk) when the listing can't be read in full
+static void loose_dir_load(LooseDir *d, int fanout) {
+    char dir_path[32];
+    snprintf(dir_path, sizeof(dir_path), ".git/objects/%02x", fanout);
+    TraceSpan span;
+    trace_begin(&span, "loose-list");
+    DIR *dir = opendir(dir_path);
+    int ok = dir || errno == ENOENT;
+    struct dirent *dent;
+    while (ok && dir && (dent = readdir(dir)) != NULL) {
+        char hex[41];
+        unsigned char raw_hash[20];
+        if (strlen(dent->d_name) != 38) continue;
+        snprintf(hex, sizeof(hex), "%02x%s", fanout, dent->d_name);
+        if (hex_to_hash(raw_hash, hex) < 0) continue;
+        ok = loose_dir_add(d, raw_hash + 1) == 0;
+    }
+    if (dir) closedir(dir);
+    trace_end(&span);
+
+    if (!ok) {
+        free(d->names);
+        d->names = NULL;
+        d->count = d->cap = 0;
+        return;
+    }
+    qsort(d->names, d->count, sizeof(*d->names), cmp_loose_name);
+    d->loaded = 1;
+}
+
+
+// 1 or 0 from the cache, -1 when the answer has to come from disk
+static int loose_cache_lookup(const unsigned char raw_hash[20]) {
+    if (atomic_fetch_add_explicit(&loose_lookups, 1, memory_order_relaxed) < LOOSE_CACHE_AFTER) return -1;
+    pthread_once(&loose_dirs_once, init_loose_dirs);
+    LooseDir *d = &loose_dirs[raw_hash[0]];
+    pthread_mutex_lock(&d->lock);
+    if (!d->loaded) loose_dir_load(d, raw_hash[0]);
+    int found = -1;
+    if (d->loaded) found = bsearch(raw_hash + 1, d->names, d->count, sizeof(*d->names), cmp_loose_name) != NULL;
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+
+// An object this process just wrote, for directories already listed
+static void loose_cache_insert(const unsigned char raw_hash[20]) {
+    pthread_once(&loose_dirs_once, init_loose_dirs);
+    LooseDir *d = &loose_dirs[raw_hash[0]];
+    pthread_mutex_lock(&d->lock);
+    if (d->loaded && !bsearch(raw_hash + 1, d->names, d->count, sizeof(*d->names), cmp_loose_name)) {
+        if (loose_dir_add(d, raw_hash + 1) == 0) {
+            size_t i = d->count - 1;
+            for (; i > 0 && memcmp(d->names[i - 1], raw_hash + 1, 19) > 0; i--) memcpy(d->names[i], d->names[i - 1], 19);
+            memcpy(d->names[i], raw_hash + 1, 19);
+        } else {
+            d->loaded = 0; // relisted on the next lookup
+            free(d->names);
+            d->names = NULL;
+            d->count = d->cap = 0;
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+}
+
+
+int loose_object_exists(const unsigned char raw_hash[20]) {
+    char hex[41], path[64];
+    hash_to_hex(hex, raw_hash);
+    build_path(path, sizeof(path), hex);
+    return access(path, F_OK) == 0;
+}
+
+
+// Every pack under .git/objects/pack, mapped once per process on first use,
+// and the multi-pack-index over them when there is one. Packs it covers are
+// only searched through it; ones written since are searched one by one.
+static Pack *packs;
+static size_t pack_count;
+static MultiPackIndex midx;
+static const Pack **midx_packs;  // by midx pack id
+static unsigned char *in_midx;   // by index into packs
+static pthread_once_t packs_once = PTHREAD_ONCE_INIT;
+
+// A multi-pack-index naming a pack that is gone (or that failed to open) is
+// out of date, and is then not used at all
+static void load_multi_pack_index(void) {
+    if (multi_pack_index_open(&midx, MULTI_PACK_INDEX_FILE) != 0) return;
+    midx_packs = calloc(midx.pack_count ? midx.pack_count : 1, sizeof(*midx_packs));
+    in_midx = calloc(pack_count ? pack_count : 1, 1);
+    if (!midx_packs || !in_midx) goto stale;
+
+    for (uint32_t i = 0; i < midx.pack_count; i++) {
+        for (size_t j = 0; j < pack_count && !midx_packs[i]; j++) {
+            const char *base = strrchr(packs[j].pack_path, '/') + 1;
+            size_t len = strlen(base) - 5; // "pack-xxxx" of "pack-xxxx.pack"
+            if (strncmp(base, midx.pack_names[i], len) == 0 && strcmp(midx.pack_names[i] + len, ".idx") == 0) {
+                midx_packs[i] = &packs[j];
+                in_midx[j] = 1;
+            }
+        }
+        if (!midx_packs[i]) goto stale;
+    }
+    return;
+
+stale:
+    free(midx_packs);
+    free(in_midx);
+    midx_packs = NULL;
+    in_midx = NULL;
+    multi_pack_index_close(&midx);
+}
+
+static void load_packs(void) {
+    DIR *dir = opendir(".git/objects/pack");
+    if (!dir) return;
+
+    size_t cap = 0;
+    struct dirent *dent;
+    while ((dent = readdir(dir)) != NULL) {
+        size_t len = strlen(dent->d_name);
+        if (len < 4 || strcmp(dent->d_name + len - 4, ".idx") != 0) continue;
+
+        if (pack_count == cap) {
+            cap = cap ? cap * 2 : 4;
+            Pack *grown = realloc(packs, sizeof(Pack) * cap);
+            if (!grown) break;
+            packs = grown;
+        }
+        char idx_path[PATH_MAX];
+        snprintf(idx_path, sizeof(idx_path), ".git/objects/pack/%s", dent->d_name);
+        if (pack_open(&packs[pack_count], idx_path) == 0) pack_count++;
+    }
+    closedir(dir);
+    load_multi_pack_index();
+}
+
+
+static const Pack *find_packed(const unsigned char raw_hash[20], uint64_t *offset) {
+    pthread_once(&packs_once, load_packs);
+    if (midx_packs) {
+        uint32_t id;
+        if (multi_pack_index_find(&midx, raw_hash, &id, offset)) return midx_packs[id];
+    }
+    for (size_t i = 0; i < pack_count; i++) {
+        if (in_midx && in_midx[i]) continue;
+        if (pack_find(&packs[i], raw_hash, offset)) return &packs[i];
+    }
+    return NULL;
+}
+
+
+// Packs first: with a multi-pack-index that is a memory lookup either way,
+// while a loose object costs a system call to look for
+int object_exists(const unsigned char raw_hash[20]) {
+    uint64_t offset;
+    return find_packed(raw_hash, &offset) != NULL || loose_object_exists(raw_hash) ||
+           bulk_checkin_contains(raw_hash);
+}
+
+
+// A listing only ever settles "no": one that names the object may be older
+// than a repack that deleted it, so that is still checked on disk
+int object_exists_quick(const unsigned char raw_hash[20]) {
+    uint64_t offset;
+    if (find_packed(raw_hash, &offset) || bulk_checkin_contains(raw_hash)) return 1;
+    return loose_cache_lookup(raw_hash) != 0 && loose_object_exists(raw_hash);
+}
+
+
+int for_each_loose_object(each_object_fn fn, void *arg) {
+    for (int b = 0; b < 256; b++) {
+        char dir_path[32];
+        snprintf(dir_path, sizeof(dir_path), ".git/objects/%02x", b);
+        DIR *dir = opendir(dir_path);
+        if (!dir) continue;
+
+        int ret = 0;
+        struct dirent *dent;
+        while (ret == 0 && (dent = readdir(dir)) != NULL) {
+            // Anything that isn't 38 hex digits is a temp file or stray
+            char hex[41];
+            unsigned char raw_hash[20];
+            if (strlen(dent->d_name) != 38) continue;
+            snprintf(hex, sizeof(hex), "%02x%s", b, dent->d_name);
+            if (hex_to_hash(raw_hash, hex) < 0) continue;
+            ret = fn(raw_hash, arg);
+        }
+        closedir(dir);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+
+int for_each_packed_object(each_object_fn fn, void *arg) {
+    pthread_once(&packs_once, load_packs);
+    for (size_t p = 0; p < pack_count; p++) {
+        for (uint32_t i = 0; i < packs[p].count; i++) {
+            int ret = fn(pack_name(&packs[p], i), arg);
+            if (ret) return ret;
+        }
+    }
+    return 0;
+}
+
+
+void object_reader_init(ObjectReader *r) {
+    memset(r, 0, sizeof(*r));
+}
+
+
+void object_reader_release(ObjectReader *r) {
+    object_cache_release(r->held);
+    if (r->z_ready) inflateEnd(&r->stream);
+    free(r->in_buf);
+    free(r->out_buf);
+    memset(r, 0, sizeof(*r));
+}
+
+
+static int grow_buffer(unsigned char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) return 0;
+    size_t new_cap = *cap ? *cap : 4096;
+    while (new_cap < need) new_cap *= 2;
+    unsigned char *grown = realloc(*buf, new_cap);
+    if (!grown) { perror("realloc"); return -1; }
+    *buf = grown;
+    *cap = new_cap;
+    return 0;
+}
+
+
+// A loose object's "<type> <size>\0" header sits in the first few compressed bytes
+#define LOOSE_HEADER_PREFIX 4096
+
+// Loose files at least this big are inflated straight out of a mapping
+// rather than copied into the reader's input buffer first
+#define LOOSE_MMAP_MIN (256 * 1024)
+
+// Inflate a loose object into r->out_buf (or just its header). The header
+// tells us how much room the body needs; the stream and buffers are reused.
+static int reader_read_loose(ObjectReader *r, const char *path, ObjectType *type, size_t *size,
+                             int header_only) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    int ret = -1;
+    void *map = NULL;
+    const unsigned char *in;
+    struct stat st;
+    if (fstat(fd, &st) < 0) { perror("fstat"); goto done; }
+
+    size_t in_len = (size_t)st.st_size;
+    if (header_only && in_len > LOOSE_HEADER_PREFIX) in_len = LOOSE_HEADER_PREFIX;
+    if (in_len >= LOOSE_MMAP_MIN) {
+        map = mmap(NULL, in_len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) { map = NULL; perror("mmap"); goto done; }
+        in = map;
+    } else {
+        if (grow_buffer(&r->in_buf, &r->in_cap, in_len ? in_len : 1) < 0) goto done;
+        if (read_full(fd, r->in_buf, in_len) != (ssize_t)in_len) { perror("read"); goto done; }
+        in = r->in_buf;
+    }
+
+    if (!r->z_ready) {
+        if (inflateInit(&r->stream) != Z_OK) goto done;
+        r->z_ready = 1;
+    } else if (inflateReset(&r->stream) != Z_OK) {
+        goto done;
+    }
+    z_stream *stream = &r->stream;
+    size_t in_left = in_len;
+    stream->next_in = (unsigned char *)in;
+    stream->avail_in = (uInt)(in_left < (1u << 30) ? in_left : (1u << 30));
+    in_left -= stream->avail_in;
+
+    // "<type> <size>\0" fits in 32 bytes for any real object
+    unsigned char header[32];
+    stream->next_out = header;
+    stream->avail_out = sizeof(header);
+    int status = inflate(stream, Z_NO_FLUSH);
+    unsigned char *nul = memchr(header, '\0', sizeof(header) - stream->avail_out);
+    unsigned char *space = memchr(header, ' ', sizeof(header) - stream->avail_out);
+    if ((status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) ||
+        !nul || !space || space > nul) goto corrupt;
+
+    *type = object_type_from_name((char *)header, (size_t)(space - header));
+    char *end;
+    unsigned long long declared = strtoull((char *)space + 1, &end, 10);
+    if (*type == OBJ_NONE || end != (char *)nul) goto corrupt;
+    *size = (size_t)declared;
+    if (header_only) { ret = 0; goto done; }
+
+    if (grow_buffer(&r->out_buf, &r->out_cap, declared + 1) < 0) goto done;
+
+    // Whatever followed the header in the first inflate goes first
+    size_t already = (size_t)(header + sizeof(header) - stream->avail_out - (nul + 1));
+    if (already > declared) goto corrupt;
+    memcpy(r->out_buf, nul + 1, already);
+
+    if (declared - already + 1 > UINT_MAX) {
+        fprintf(stderr, "%s: object too large to read into memory\n", path);
+        goto done;
+    }
+    stream->next_out = r->out_buf + already;
+    stream->avail_out = (uInt)(declared - already + 1); // +1 catches oversized data
+    while (status == Z_OK) {
+        if (stream->avail_in == 0 && in_left > 0) {
+            stream->avail_in = (uInt)(in_left < (1u << 30) ? in_left : (1u << 30));
+            in_left -= stream->avail_in;
+        }
+        status = inflate(stream, Z_NO_FLUSH);
+    }
+    if (status != Z_STREAM_END || stream->total_out - (nul + 1 - header) != declared) goto corrupt;
+
+    r->out_buf[declared] = '\0';
+    ret = 0;
+    goto done;
+
+corrupt:
+    fprintf(stderr, "corrupt loose object %s\n", path);
+done:
+    if (map) munmap(map, in_len);
+    close(fd);
+    return ret;
+}
+
+
+int object_reader_read(ObjectReader *r, const unsigned char raw_hash[20], ObjectType *type,
+                       const unsigned char **data, size_t *size) {
+    object_cache_release(r->held);
+    r->held = NULL;
+
+    uint64_t offset;
+    const Pack *pack = find_packed(raw_hash, &offset);
+    if (pack) {
+        ObjectView view;
+        r->held = pack_read_cached(pack, offset, &view);
+        if (!r->held) return -1;
+        *type = view.type;
+        *data = view.data;
+        *size = view.size;
+        return 0;
+    }
+
+    char hex[41], path[64];
+    hash_to_hex(hex, raw_hash);
+    build_path(path, sizeof(path), hex);
+    if (reader_read_loose(r, path, type, size, 0) < 0) return -1;
+    *data = r->out_buf;
+    return 0;
+}
+
+
+int object_reader_header(ObjectReader *r, const unsigned char raw_hash[20], ObjectType *type, size_t *size) {
+    uint64_t offset;
+    const Pack *pack = find_packed(raw_hash, &offset);
+    if (pack) return pack_object_header(pack, offset, type, size);
+
+    char hex[41], path[64];
+    hash_to_hex(hex, raw_hash);
+    build_path(path, sizeof(path), hex);
+    return reader_read_loose(r, path, type, size, 1);
+}
+
+
+CachedObject *read_object_cached(const unsigned char raw_hash[20], ObjectView *view) {
+    CachedObject *obj = object_cache_get(NULL, 0, raw_hash, view);
+    if (obj) return obj;
+
+    uint64_t offset;
+    const Pack *pack = find_packed(raw_hash, &offset);
+    if (pack) return pack_read_cached(pack, offset, view);
+
+    char hex[41], path[64];
+    hash_to_hex(hex, raw_hash);
+    build_path(path, sizeof(path), hex);
+    ObjectReader r;
+    object_reader_init(&r);
+    ObjectType type;
+    size_t size;
+    int status = reader_read_loose(&r, path, &type, &size, 0);
+    unsigned char *data = r.out_buf; // hand the buffer over instead of copying
+    r.out_buf = NULL;
+    object_reader_release(&r);
+    if (status == 0) {
+        int keep = type == OBJ_TREE;
+        if (keep) {
+            unsigned char *trimmed = realloc(data, size + 1); // the reader rounds its buffer up
+            if (trimmed) data = trimmed;
+        }
+        return object_cache_put(NULL, 0, raw_hash, type, data, size, keep, view);
+    }
+    free(data);
+
+    if (bulk_checkin_active() && bulk_checkin_read(raw_hash, &type, &data, &size) == 0)
+        return object_cache_put(NULL, 0, raw_hash, type, data, size, 0, view);
+    return NULL;
+}
+
+
+int read_object(const unsigned char raw_hash[20], ObjectType *type,
+                unsigned char **data, size_t *size) {
+    ObjectView view;
+    CachedObject *obj = read_object_cached(raw_hash, &view);
+    if (!obj) return -1;
+    *data = object_cache_detach(obj);
+    if (!*data) return -1;
+    *type = view.type;
+    *size = view.size;
+    return 0;
+}
+
+
+void object_stream_close(ObjectStream *s) {
+    if (s->fd >= 0) close(s->fd);
+    if (s->z_ready) inflateEnd(&s->z);
+    free(s->in_buf);
+    object_cache_release(s->whole);
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+}
+
+
+// Feed the next piece of compressed input once zlib has consumed the last one
+static int stream_refill(ObjectStream *s) {
+    if (s->z.avail_in > 0) return 0;
+    if (s->fd >= 0) {
+        ssize_t n = read_full(s->fd, s->in_buf, STREAM_CHUNK);
+        if (n < 0) { perror("read"); return -1; }
+        s->z.next_in = s->in_buf;
+        s->z.avail_in = (uInt)n;
+    } else if (s->zavail > 0) {
+        size_t piece = s->zavail < (1u << 30) ? s->zavail : (1u << 30);
+        s->z.next_in = (unsigned char *)s->zdata;
+        s->z.avail_in = (uInt)piece;
+        s->zdata += piece;
+        s->zavail -= piece;
+    }
+    return 0;
+}
+
+
+static int stream_open_loose(ObjectStream *s, const char *path) {
+    s->fd = open(path, O_RDONLY);
+    if (s->fd < 0) return -1;
+
+    s->in_buf = malloc(STREAM_CHUNK);
+    if (!s->in_buf) { perror("malloc"); return -1; }
+    if (inflateInit(&s->z) != Z_OK) return -1;
+    s->z_ready = 1;
+
+    // "<type> <size>\0" fits in 32 bytes for any real object; whatever else
+    // comes out of that first inflate is the start of the payload
+    s->z.next_out = s->head;
+    s->z.avail_out = sizeof(s->head);
+    int status = Z_OK;
+    while (s->z.avail_out > 0 && status == Z_OK) {
+        if (stream_refill(s) < 0) return -1;
+        if (s->z.avail_in == 0) break;
+        status = inflate(&s->z, Z_NO_FLUSH);
+    }
+    size_t got = sizeof(s->head) - s->z.avail_out;
+    unsigned char *nul = memchr(s->head, '\0', got);
+    unsigned char *space = memchr(s->head, ' ', got);
+    if ((status != Z_OK && status != Z_STREAM_END) || !nul || !space || space > nul) goto corrupt;
+
+    s->type = object_type_from_name((char *)s->head, (size_t)(space - s->head));
+    char *end;
+    unsigned long long declared = strtoull((char *)space + 1, &end, 10);
+    if (s->type == OBJ_NONE || end != (char *)nul) goto corrupt;
+
+    s->size = s->remaining = (size_t)declared;
+    s->head_pos = (size_t)(nul + 1 - s->head);
+    s->head_len = got;
+    if (s->head_len - s->head_pos > s->size) goto corrupt;
+    return 0;
+
+corrupt:
+    fprintf(stderr, "corrupt loose object %s\n", path);
+    return -1;
+}
+
+
+int object_stream_open(ObjectStream *s, const unsigned char raw_hash[20]) {
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+
+    uint64_t offset;
+    const Pack *pack = find_packed(raw_hash, &offset);
+    if (!pack) {
+        char hex[41], path[64];
+        hash_to_hex(hex, raw_hash);
+        build_path(path, sizeof(path), hex);
+        if (stream_open_loose(s, path) == 0) return 0;
+        object_stream_close(s);
+        return -1;
+    }
+
+    int status = pack_entry_data(pack, offset, &s->type, &s->size, &s->zdata, &s->zavail);
+    if (status < 0) return -1;
+    if (status == 1) {
+        // A delta only exists relative to its base, so there is nothing to stream
+        ObjectView view;
+        s->whole = pack_read_cached(pack, offset, &view);
+        if (!s->whole) return -1;
+        s->whole_data = view.data;
+        s->type = view.type; // the entry header gave the delta's type and size
+        s->size = s->remaining = view.size;
+        return 0;
+    }
+
+    if (inflateInit(&s->z) != Z_OK) return -1;
+    s->z_ready = 1;
+    s->remaining = s->size;
+    return 0;
+}
+
+
+ssize_t object_stream_read(ObjectStream *s, unsigned char *buf, size_t len) {
+    if (len > s->remaining) len = s->remaining;
+    if (len == 0) return 0;
+
+    if (s->whole) {
+        memcpy(buf, s->whole_data + (s->size - s->remaining), len);
+        s->remaining -= len;
+        return (ssize_t)len;
+    }
+
+    size_t done = 0;
+    if (s->head_pos < s->head_len) {
+        done = s->head_len - s->head_pos;
+        if (done > len) done = len;
+        memcpy(buf, s->head + s->head_pos, done);
+        s->head_pos += done;
+    }
+
+    s->z.next_out = buf + done;
+    s->z.avail_out = (uInt)(len - done < UINT_MAX ? len - done : UINT_MAX);
+    while (s->z.avail_out > 0) {
+        if (stream_refill(s) < 0) return -1;
+        if (s->z.avail_in == 0) break; // truncated
+        int status = inflate(&s->z, Z_NO_FLUSH);
+        if (status == Z_STREAM_END) break;
+        if (status != Z_OK) break;
+    }
+    done = (size_t)(s->z.next_out - buf);
+    if (done == 0) {
+        fprintf(stderr, "object data ends %zu bytes early\n", s->remaining);
+        return -1;
+    }
+    s->remaining -= done;
+    return (ssize_t)done;
+}
+
+
+// One bit per .git/objects/xx directory we know exists, so each process
+// mkdirs a fan-out directory at most once
+static atomic_uint fanout_known[256 / 32];
+
+static int ensure_fanout_dir(unsigned char first_byte) {
+    atomic_uint *word = &fanout_known[first_byte / 32];
+    unsigned bit = 1u << (first_byte % 32);
+    if (atomic_load(word) & bit) return 0;
+
+    char dir_path[32];
+    snprintf(dir_path, sizeof(dir_path), ".git/objects/%02x", first_byte);
+    TraceSpan span;
+    trace_begin(&span, "mkdir");
+    int status = mkdir(dir_path, 0755);
+    trace_end(&span);
+    if (status < 0 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+    atomic_fetch_or(word, bit);
+    return 0;
+}
+
+
+// Closes a complete temp file and renames it to the object's path; the temp
+// file is gone either way
+static int install_temp_object(int fd, const char *tmp_path, const unsigned char raw_hash[20]) {
+    TraceSpan span;
+    trace_begin(&span, "close");
+    fchmod(fd, 0444);
+    int closed = close(fd);
+    trace_end(&span);
+    if (closed < 0) { perror("close"); unlink(tmp_path); return -1; }
+
+    char hex[41], path[64];
+    hash_to_hex(hex, raw_hash);
+    build_path(path, sizeof(path), hex);
+
+    // rename() atomically replaces an identical object a concurrent writer got in first
+    if (ensure_fanout_dir(raw_hash[0]) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    trace_begin(&span, "rename");
+    int status = rename(tmp_path, path);
+    trace_end(&span);
+    if (status < 0) {
+        perror("rename");
+        unlink(tmp_path);
+        return -1;
+    }
+    trace_count(TRACE_OBJECTS_WRITTEN, 1);
+    loose_cache_insert(raw_hash);
+    return 0;
+}
+
+
+// In-progress loose object: deflated into a temp file, renamed once complete
+typedef struct {
+    int fd;
+    char tmp_path[64];
+    z_stream stream;
+    int z_ready;
+    HashCtx hash;
+    int hashing;              // 0 when the caller already knows the hash
+    unsigned char *zbuf;
+} LooseWriter;
+
+
+static void writer_abort(LooseWriter *w) {
+    if (w->fd >= 0) {
+        close(w->fd);
+        unlink(w->tmp_path);
+    }
+    if (w->z_ready) deflateEnd(&w->stream);
+    free(w->zbuf);
+    w->fd = -1;
+    w->z_ready = 0;
+    w->zbuf = NULL;
+}
+
+
+// Push bytes through deflate, draining compressed output into the temp file.
+// Input is fed in STREAM_CHUNK pieces so avail_in never overflows a uInt.
+static int writer_deflate(LooseWriter *w, const unsigned char *in, size_t len, int flush) {
+    trace_count(TRACE_BYTES_DEFLATED, len);
+    do {
+        size_t piece = len < STREAM_CHUNK ? len : STREAM_CHUNK;
+        int piece_flush = (piece == len) ? flush : Z_NO_FLUSH;
+        w->stream.next_in  = (unsigned char *)in;
+        w->stream.avail_in = (uInt)piece;
+
+        int status;
+        do {
+            TraceSpan span;
+            w->stream.next_out  = w->zbuf;
+            w->stream.avail_out = STREAM_CHUNK;
+            trace_begin(&span, "deflate");
+            status = deflate(&w->stream, piece_flush);
+            trace_end(&span);
+            if (status == Z_STREAM_ERROR) return -1;
+
+            trace_begin(&span, "write");
+            int written = write_all(w->fd, w->zbuf, STREAM_CHUNK - w->stream.avail_out);
+            trace_end(&span);
+            if (written < 0) return -1;
+        } while (w->stream.avail_out == 0 || (piece_flush == Z_FINISH && status != Z_STREAM_END));
+
+        in += piece;
+        len -= piece;
+    } while (len > 0);
+
+    return 0;
+}
+
+
+static int writer_begin(LooseWriter *w, const char *header, size_t header_len, int want_hash, int level) {
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+    strcpy(w->tmp_path, ".git/objects/tmp_obj_XXXXXX");
+
+    w->zbuf = malloc(STREAM_CHUNK);
+    if (!w->zbuf) { perror("malloc"); return -1; }
+    if (want_hash) {
+        w->hashing = 1;
+        hash_init(&w->hash);
+        hash_update(&w->hash, header, header_len);
+    }
+
+    TraceSpan span;
+    trace_begin(&span, "mkstemp");
+    w->fd = mkstemp(w->tmp_path);
+    trace_end(&span);
+    if (w->fd < 0) { perror("mkstemp"); writer_abort(w); return -1; }
+
+    if (compress_init(&w->stream, level) < 0) {
+        writer_abort(w);
+        return -1;
+    }
+    w->z_ready = 1;
+
+    if (writer_deflate(w, (const unsigned char *)header, header_len, Z_NO_FLUSH) < 0) {
+        perror("deflate/write");
+        writer_abort(w);
+        return -1;
+    }
+    return 0;
+}
+
+
+static int writer_update(LooseWriter *w, const unsigned char *data, size_t len) {
+    if (w->hashing) {
+        TraceSpan span;
+        trace_begin(&span, "sha1");
+        hash_update(&w->hash, data, len);
+        trace_end(&span);
+        trace_count(TRACE_BYTES_HASHED, len);
+    }
+    if (writer_deflate(w, data, len, Z_NO_FLUSH) < 0) {
+        perror("deflate/write");
+        writer_abort(w);
+        return -1;
+    }
+    return 0;
+}
+
+
+// Flush the zlib trailer and rename the temp file into place. With a hashing
+// writer raw_hash is filled in; otherwise it must already hold the object id.
+static int writer_finish(LooseWriter *w, unsigned char raw_hash[20]) {
+    if (writer_deflate(w, NULL, 0, Z_FINISH) < 0) {
+        perror("deflate/write");
+        writer_abort(w);
+        return -1;
+    }
+    if (w->hashing) hash_final(&w->hash, raw_hash);
+
+    int fd = w->fd;
+    w->fd = -1;
+    int status = install_temp_object(fd, w->tmp_path, raw_hash);
+    writer_abort(w); // releases zlib/hash state; the temp file is gone
+    return status;
+}
+
+
+int write_loose_object(const char *type, const unsigned char *payload, size_t len,
+                       unsigned char raw_hash[20]) {
+    TraceSpan span;
+    trace_begin(&span, "sha1");
+    hash_object(type, payload, len, raw_hash);
+    trace_end(&span);
+    trace_count(TRACE_BYTES_HASHED, len);
+
+    trace_begin(&span, "exists");
+    int exists = object_exists_quick(raw_hash);
+    trace_end(&span);
+    if (exists) {
+        trace_count(TRACE_OBJECTS_SKIPPED, 1);
+        return 0;
+    }
+    if (bulk_checkin_active()) return bulk_checkin_write(object_type_from_name(type, strlen(type)), payload, len, raw_hash);
+
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "%s %zu", type, len) + 1; // +1 for '\0'
+
+    LooseWriter w;
+    if (writer_begin(&w, header, header_len, 0, compress_level(COMPRESS_LOOSE, payload, len)) < 0) return -1;
+    if (writer_update(&w, payload, len) < 0) return -1;
+    return writer_finish(&w, raw_hash);
+}
+
+
+int write_loose_deflated(const unsigned char raw_hash[20], const unsigned char *zdata, size_t zlen) {
+    char tmp_path[64];
+    strcpy(tmp_path, ".git/objects/tmp_obj_XXXXXX");
+    TraceSpan span;
+    trace_begin(&span, "mkstemp");
+    int fd = mkstemp(tmp_path);
+    trace_end(&span);
+    if (fd < 0) { perror("mkstemp"); return -1; }
+
+    trace_begin(&span, "write");
+    int written = write_all(fd, zdata, zlen);
+    trace_end(&span);
+    if (written < 0) {
+        perror("write");
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    return install_temp_object(fd, tmp_path, raw_hash);
+}
+
+
+static ssize_t traced_read(int fd, unsigned char *buf, size_t len) {
+    TraceSpan span;
+    trace_begin(&span, "read");
+    ssize_t n = read_full(fd, buf, len);
+    trace_end(&span);
+    return n;
+}
+
+
+int write_loose_blob_fd(int fd, off_t size, unsigned char raw_hash[20]) {
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "blob %jd", (intmax_t)size) + 1; // +1 for '\0'
+
+    unsigned char *in_buf = malloc(STREAM_CHUNK);
+    if (!in_buf) { perror("malloc"); return -1; }
+    int ret = -1;
+
+    // Small blob: one read, then it is just an in-memory object
+    if (size <= STREAM_CHUNK) {
+        ssize_t n = traced_read(fd, in_buf, (size_t)size);
+        if (n < 0) { perror("read"); goto out; }
+        if (n != size) { fprintf(stderr, "file changed size while hashing\n"); goto out; }
+        ret = write_loose_object("blob", in_buf, (size_t)size, raw_hash);
+        goto out;
+    }
+
+    // Large seekable blob: hash-only first pass, then deflate only if it's new
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if (start >= 0) {
+        unsigned char first_pass[20];
+        HashCtx ctx;
+        hash_init(&ctx);
+        hash_update(&ctx, header, header_len);
+        off_t remaining = size;
+        while (remaining > 0) {
+            size_t want = remaining < STREAM_CHUNK ? (size_t)remaining : STREAM_CHUNK;
+            ssize_t n = traced_read(fd, in_buf, want);
+            if (n < 0) { perror("read"); goto out; }
+            if ((size_t)n != want) {
+                fprintf(stderr, "file changed size while hashing\n");
+                goto out;
+            }
+            TraceSpan span;
+            trace_begin(&span, "sha1");
+            hash_update(&ctx, in_buf, want);
+            trace_end(&span);
+            trace_count(TRACE_BYTES_HASHED, want);
+            remaining -= n;
+        }
+        hash_final(&ctx, first_pass);
+
+        TraceSpan span;
+        trace_begin(&span, "exists");
+        int exists = object_exists_quick(first_pass);
+        trace_end(&span);
+        if (exists) {
+            trace_count(TRACE_OBJECTS_SKIPPED, 1);
+            memcpy(raw_hash, first_pass, 20);
+            ret = 0;
+            goto out;
+        }
+        if (lseek(fd, start, SEEK_SET) < 0) { perror("lseek"); goto out; }
+    }
+
+    if (bulk_checkin_active()) {
+        ret = bulk_checkin_write_fd(fd, size, raw_hash);
+        goto out;
+    }
+
+    // Streaming pass: SHA-1 and deflate together, constant memory. The
+    // writer is set up after the first chunk, which picks the level.
+    LooseWriter w;
+    int started = 0;
+    off_t remaining = size;
+    while (remaining > 0) {
+        size_t want = remaining < STREAM_CHUNK ? (size_t)remaining : STREAM_CHUNK;
+        ssize_t n = traced_read(fd, in_buf, want);
+        if (n < 0 || (size_t)n != want) {
+            if (n < 0) perror("read"); else fprintf(stderr, "file changed size while hashing\n");
+            if (started) writer_abort(&w);
+            goto out;
+        }
+        if (!started && writer_begin(&w, header, header_len, 1, compress_level(COMPRESS_LOOSE, in_buf, want)) < 0) goto out;
+        started = 1;
+        if (writer_update(&w, in_buf, want) < 0) goto out;
+        remaining -= n;
+    }
+
+    // Named after the bytes actually deflated, even if the file changed since the first pass
+    if (writer_finish(&w, raw_hash) < 0) goto out;
+    ret = 0;
+
+out:
+    free(in_buf);
+    return ret;
+}
@@ -0,0 +1,139 @@
+#ifndef OBJECT_STORE_H
+#define OBJECT_STORE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "hash.h"
+
+#define STREAM_CHUNK (64 * 1024) // bytes per read/deflate step when streaming objects
+
+// Object type codes as stored in pack entry headers
+typedef enum {
+    OBJ_NONE = 0,
+    OBJ_COMMIT = 1,
+    OBJ_TREE = 2,
+    OBJ_BLOB = 3,
+    OBJ_TAG = 4,
+    OBJ_OFS_DELTA = 6,
+    OBJ_REF_DELTA = 7,
+} ObjectType;
+
+// An object in memory, as handed out by the object cache (object_cache.h).
+// The payload is NUL-terminated like read_object()'s.
+typedef struct CachedObject CachedObject;
+
+typedef struct {
+    ObjectType type;
+    const unsigned char *data;
+    size_t size;
+} ObjectView;
+
+const char *object_type_name(ObjectType type);
+ObjectType object_type_from_name(const char *name, size_t len);
+
+void build_path(char *full_path, size_t buf_size, const char *object_hash);
+
+int loose_object_exists(const unsigned char raw_hash[20]);
+int object_exists(const unsigned char raw_hash[20]); // loose or in any pack
+
+// object_exists() for a writer deciding whether an object is new. Past its
+// first few lookups a process lists each .git/objects/xx directory once and
+// takes "not listed" as "missing" without a system call; objects it writes
+// itself are added to the listing. A loose object another process wrote
+// after the listing then reads as missing and is written again, which is
+// harmless. "Listed" is still checked on disk, and readers never use the
+// listing at all.
+int object_exists_quick(const unsigned char raw_hash[20]);
+
+// Enumerate the object database: every .git/objects/xx/yyyy... file, or every
+// entry of every pack. An object stored in several places is reported once per
+// copy. A nonzero return from fn stops the walk and is passed back.
+typedef int (*each_object_fn)(const unsigned char raw_hash[20], void *arg);
+int for_each_loose_object(each_object_fn fn, void *arg);
+int for_each_packed_object(each_object_fn fn, void *arg);
+
+// Object database lookup: the packs first (through the multi-pack-index when
+// there is one), then loose objects, then the pack of an open bulk checkin.
+// Like git, a packed object is found without a system call.
+// *data is malloc'd with a NUL after the last byte. Returns 0, or -1 when the
+// object is missing (silently) or corrupt (reported).
+int read_object(const unsigned char raw_hash[20], ObjectType *type,
+                unsigned char **data, size_t *size);
+
+// The same lookup without a copy for the caller: returns a reference whose
+// payload (*view) stays valid until object_cache_release(). Trees and packed
+// delta bases are kept in the object cache, so walking the same trees again
+// or reading the next object of a delta chain is served from memory.
+// Returns NULL when the object is missing (silently) or corrupt (reported).
+CachedObject *read_object_cached(const unsigned char raw_hash[20], ObjectView *view);
+
+// Reusable read state for callers that fetch many objects in a row: one inflate
+// stream and the I/O buffers survive from object to object. Big loose objects
+// are inflated straight from an mmap of their file; packed ones are read
+// through the object cache, so a delta's base is usually already inflated.
+typedef struct {
+    z_stream stream;
+    int z_ready;
+    unsigned char *in_buf;
+    size_t in_cap;
+    unsigned char *out_buf;
+    size_t out_cap;
+    CachedObject *held;           // the last packed object returned
+} ObjectReader;
+
+void object_reader_init(ObjectReader *r);
+void object_reader_release(ObjectReader *r);
+
+// *data points into the reader and stays valid until the next call
+int object_reader_read(ObjectReader *r, const unsigned char raw_hash[20], ObjectType *type,
+                       const unsigned char **data, size_t *size);
+
+// Incremental read of one object's payload with constant memory. Loose objects
+// and whole pack entries are inflated chunk by chunk as the caller reads; a
+// packed delta has to be materialized first and is then served from memory.
+typedef struct {
+    ObjectType type;
+    size_t size;                  // payload size from the header
+    size_t remaining;             // payload bytes not yet returned
+    int fd;                       // loose: compressed input comes from here
+    unsigned char *in_buf;
+    const unsigned char *zdata;   // packed: zlib data inside the mapping
+    size_t zavail;
+    CachedObject *whole;          // packed delta: the materialized object
+    const unsigned char *whole_data;
+    z_stream z;
+    int z_ready;
+    unsigned char head[32];       // payload bytes inflated along with the header
+    size_t head_pos, head_len;
+} ObjectStream;
+
+int object_stream_open(ObjectStream *s, const unsigned char raw_hash[20]); // 0, or -1 if missing/corrupt
+ssize_t object_stream_read(ObjectStream *s, unsigned char *buf, size_t len); // 0 at the end, -1 on error
+void object_stream_close(ObjectStream *s);
+
+// Type and size only: loose objects inflate just their header, packed ones
+// read the entry header (and the first bytes of a delta)
+int object_reader_header(ObjectReader *r, const unsigned char raw_hash[20], ObjectType *type, size_t *size);
+
+// Loose object writers. Both hash "<type> <len>\0<payload>" first and return
+// without deflating or touching the disk when the object is already present.
+// New objects are deflated into a temp file and renamed into
+// .git/objects/xx/yyyy..., so readers and concurrent writers never see a torn
+// object; while a bulk checkin is open they go into its pack instead (see
+// bulk_checkin.h). Return 0 on success and -1 on error (already reported).
+int write_loose_object(const char *type, const unsigned char *payload, size_t len,
+                       unsigned char raw_hash[20]);
+
+// The last step of write_loose_object on its own, for callers that hashed
+// and deflated (header included) elsewhere and already know the object is
+// new. Always a loose file, bulk checkin or not.
+int write_loose_deflated(const unsigned char raw_hash[20], const unsigned char *zdata, size_t zlen);
+
+// Streams `size` bytes of blob content from fd with constant memory. Seekable
+// inputs larger than one chunk are hashed in a first pass so existing objects
+// are never deflated.
+int write_loose_blob_fd(int fd, off_t size, unsigned char raw_hash[20]);
+
+#endif
@@ -0,0 +1,488 @@
+#include "pack.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define IDX_HEADER_SIZE (8 + 256 * 4) // magic + version + fanout
+#define MAX_DELTA_DEPTH 10000         // git's own default tops out at 4095
+
+
+static uint32_t get_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+
+static uint64_t get_be64(const unsigned char *p) {
+    return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+
+static const unsigned char *map_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { perror(path); return NULL; }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) { close(fd); return NULL; }
+
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping stays valid
+    if (map == MAP_FAILED) { perror("mmap"); return NULL; }
+
+    *size = (size_t)st.st_size;
+    return map;
+}
+
+
+int pack_open(Pack *pack, const char *idx_path) {
+    memset(pack, 0, sizeof(*pack));
+
+    pack->idx_map = map_file(idx_path, &pack->idx_size);
+    if (!pack->idx_map) return -1;
+
+    const unsigned char *idx = pack->idx_map;
+    if (pack->idx_size < IDX_HEADER_SIZE + 40 ||
+        memcmp(idx, "\377tOc", 4) != 0 || get_be32(idx + 4) != 2) {
+        fprintf(stderr, "%s: not a version 2 pack index\n", idx_path);
+        goto fail;
+    }
+
+    pack->fanout = idx + 8;
+    pack->count = get_be32(pack->fanout + 255 * 4);
+
+    size_t tables = IDX_HEADER_SIZE + (size_t)pack->count * (20 + 4 + 4);
+    if (tables + 40 > pack->idx_size || (pack->idx_size - tables - 40) % 8 != 0) {
+        fprintf(stderr, "%s: truncated pack index\n", idx_path);
+        goto fail;
+    }
+    pack->names = idx + IDX_HEADER_SIZE;
+    pack->crcs = pack->names + (size_t)pack->count * 20;
+    pack->offsets = pack->crcs + (size_t)pack->count * 4;
+    pack->large_offsets = pack->offsets + (size_t)pack->count * 4;
+    pack->large_count = (pack->idx_size - tables - 40) / 8;
+
+    // pack-xxxx.idx -> pack-xxxx.pack
+    size_t len = strlen(idx_path);
+    if (len < 4 || strcmp(idx_path + len - 4, ".idx") != 0) goto fail;
+    pack->pack_path = malloc(len + 2);
+    if (!pack->pack_path) goto fail;
+    memcpy(pack->pack_path, idx_path, len - 4);
+    strcpy(pack->pack_path + len - 4, ".pack");
+
+    pack->pack_map = map_file(pack->pack_path, &pack->pack_size);
+    if (!pack->pack_map) goto fail;
+    if (pack->pack_size < 12 + 20 || memcmp(pack->pack_map, "PACK", 4) != 0 ||
+        (get_be32(pack->pack_map + 4) != 2 && get_be32(pack->pack_map + 4) != 3) ||
+        get_be32(pack->pack_map + 8) != pack->count) {
+        fprintf(stderr, "%s: pack does not match its index\n", pack->pack_path);
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    pack_close(pack);
+    return -1;
+}
+
+
+void pack_close(Pack *pack) {
+    if (pack->idx_map) munmap((void *)pack->idx_map, pack->idx_size);
+    if (pack->pack_map) munmap((void *)pack->pack_map, pack->pack_size);
+    free(pack->pack_path);
+    memset(pack, 0, sizeof(*pack));
+}
+
+
+const unsigned char *pack_name(const Pack *pack, uint32_t i) {
+    return pack->names + (size_t)i * 20;
+}
+
+
+uint64_t pack_offset(const Pack *pack, uint32_t i) {
+    uint32_t off = get_be32(pack->offsets + (size_t)i * 4);
+    if (!(off & 0x80000000u)) return off;
+
+    size_t large = off & 0x7fffffffu;
+    if (large >= pack->large_count) return UINT64_MAX;
+    return get_be64(pack->large_offsets + large * 8);
+}
+
+
+int pack_find(const Pack *pack, const unsigned char raw_hash[20], uint64_t *offset) {
+    // The fanout narrows the search to names sharing the first byte
+    uint32_t lo = raw_hash[0] ? get_be32(pack->fanout + (raw_hash[0] - 1) * 4) : 0;
+    uint32_t hi = get_be32(pack->fanout + raw_hash[0] * 4);
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int c = memcmp(raw_hash, pack_name(pack, mid), 20);
+        if (c == 0) {
+            *offset = pack_offset(pack, mid);
+            return *offset != UINT64_MAX;
+        }
+        if (c < 0) hi = mid; else lo = mid + 1;
+    }
+    return 0;
+}
+
+
+// Entry header: type in bits 4-6 of the first byte, size as a little-endian
+// base-128 varint starting with the low 4 bits. Returns header length or 0.
+static size_t parse_entry_header(const Pack *pack, uint64_t offset, ObjectType *type, size_t *size) {
+    const unsigned char *p = pack->pack_map + offset;
+    const unsigned char *end = pack->pack_map + pack->pack_size - 20; // trailing checksum
+    if (offset >= pack->pack_size - 20) return 0;
+
+    unsigned char c = *p++;
+    *type = (ObjectType)((c >> 4) & 7);
+    uint64_t sz = c & 15;
+    int shift = 4;
+    while (c & 0x80) {
+        if (p >= end || shift > 57) return 0;
+        c = *p++;
+        sz |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    }
+    *size = (size_t)sz;
+    return (size_t)(p - (pack->pack_map + offset));
+}
+
+
+// Inflate exactly `size` bytes of zlib data starting at `offset`
+static unsigned char *inflate_entry(const Pack *pack, uint64_t offset, size_t size) {
+    unsigned char *out = malloc(size + 1);
+    if (!out) { perror("malloc"); return NULL; }
+
+    z_stream stream = {0};
+    if (inflateInit(&stream) != Z_OK) { free(out); return NULL; }
+
+    const unsigned char *in = pack->pack_map + offset;
+    size_t in_left = pack->pack_size - offset;
+    stream.next_out = out;
+    stream.avail_out = (uInt)(size < UINT_MAX ? size + 1 : UINT_MAX); // +1 catches oversized data
+
+    int status;
+    do {
+        if (stream.avail_in == 0 && in_left > 0) {
+            size_t piece = in_left < (1u << 30) ? in_left : (1u << 30);
+            stream.next_in = (unsigned char *)in;
+            stream.avail_in = (uInt)piece;
+            in += piece;
+            in_left -= piece;
+        }
+        if (stream.avail_out == 0 && stream.total_out < size) {
+            size_t room = size + 1 - stream.total_out;
+            stream.avail_out = (uInt)(room < UINT_MAX ? room : UINT_MAX);
+        }
+        status = inflate(&stream, Z_NO_FLUSH);
+    } while (status == Z_OK);
+
+    size_t total = stream.total_out;
+    inflateEnd(&stream);
+    if (status != Z_STREAM_END || total != size) {
+        fprintf(stderr, "%s: corrupt entry at offset %llu\n", pack->pack_path, (unsigned long long)offset);
+        free(out);
+        return NULL;
+    }
+    out[size] = '\0';
+    return out;
+}
+
+
+static size_t delta_varint(const unsigned char **p, const unsigned char *end) {
+    size_t v = 0;
+    int shift = 0;
+    unsigned char c;
+    do {
+        if (*p >= end || shift > 63) return SIZE_MAX;
+        c = *(*p)++;
+        v |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return v;
+}
+
+
+int apply_delta(const unsigned char *base, size_t base_size,
+                const unsigned char *delta, size_t delta_size,
+                unsigned char **out, size_t *out_size) {
+    const unsigned char *p = delta, *end = delta + delta_size;
+    size_t src_size = delta_varint(&p, end);
+    size_t dst_size = delta_varint(&p, end);
+    if (src_size != base_size || dst_size == SIZE_MAX) {
+        fprintf(stderr, "delta does not apply to its base\n");
+        return -1;
+    }
+
+    unsigned char *dst = malloc(dst_size + 1);
+    if (!dst) { perror("malloc"); return -1; }
+    unsigned char *q = dst, *q_end = dst + dst_size;
+
+    while (p < end) {
+        unsigned char op = *p++;
+        if (op & 0x80) {
+            // Copy from base: bits 0-3 select offset bytes, bits 4-6 size bytes
+            size_t off = 0, len = 0;
+            for (int i = 0; i < 4; i++) {
+                if (op & (1 << i)) { if (p >= end) goto corrupt; off |= (size_t)*p++ << (8 * i); }
+            }
+            for (int i = 0; i < 3; i++) {
+                if (op & (0x10 << i)) { if (p >= end) goto corrupt; len |= (size_t)*p++ << (8 * i); }
+            }
+            if (len == 0) len = 0x10000;
+            if (off + len > base_size || len > (size_t)(q_end - q)) goto corrupt;
+            memcpy(q, base + off, len);
+            q += len;
+        } else if (op) {
+            // Insert the next `op` literal bytes
+            if (op > end - p || op > q_end - q) goto corrupt;
+            memcpy(q, p, op);
+            p += op;
+            q += op;
+        } else {
+            goto corrupt; // opcode 0 is reserved
+        }
+    }
+    if (q != q_end) goto corrupt;
+
+    *q = '\0';
+    *out = dst;
+    *out_size = dst_size;
+    return 0;
+
+corrupt:
+    fprintf(stderr, "corrupt delta\n");
+    free(dst);
+    return -1;
+}
+
+
+int pack_entry_data(const Pack *pack, uint64_t offset, ObjectType *type, size_t *size,
+                    const unsigned char **zdata, size_t *zavail) {
+    size_t header_len = parse_entry_header(pack, offset, type, size);
+    if (!header_len) return -1;
+    if (*type == OBJ_OFS_DELTA || *type == OBJ_REF_DELTA) return 1;
+    if (*type < OBJ_COMMIT || *type > OBJ_TAG) return -1;
+
+    *zdata = pack->pack_map + offset + header_len;
+    *zavail = pack->pack_size - 20 - (offset + header_len);
+    return 0;
+}
+
+
+// Inflate just the first `want` bytes of the zlib stream at `offset`; returns bytes produced
+static size_t inflate_prefix(const Pack *pack, uint64_t offset, unsigned char *out, size_t want) {
+    z_stream stream = {0};
+    if (inflateInit(&stream) != Z_OK) return 0;
+
+    size_t in_left = pack->pack_size - offset;
+    stream.next_in = (unsigned char *)pack->pack_map + offset;
+    stream.avail_in = (uInt)(in_left < 4096 ? in_left : 4096);
+    stream.next_out = out;
+    stream.avail_out = (uInt)want;
+    inflate(&stream, Z_SYNC_FLUSH);
+
+    size_t got = stream.total_out;
+    inflateEnd(&stream);
+    return got;
+}
+
+
+// Offset just past an OFS_DELTA's base distance, or 0 if malformed; *base gets the base entry
+static uint64_t parse_ofs_base(const Pack *pack, uint64_t cur, size_t header_len, uint64_t *base) {
+    const unsigned char *p = pack->pack_map + cur + header_len;
+    const unsigned char *end = pack->pack_map + pack->pack_size - 20;
+
+    // Base distance: big-endian base-128 with an implicit +1 per continuation byte
+    if (p >= end) return 0;
+    unsigned char c = *p++;
+    uint64_t dist = c & 0x7f;
+    while (c & 0x80) {
+        if (p >= end || dist > (UINT64_MAX >> 8)) return 0;
+        c = *p++;
+        dist = ((dist + 1) << 7) | (c & 0x7f);
+    }
+    if (dist == 0 || dist > cur) return 0;
+    *base = cur - dist;
+    return (uint64_t)(p - pack->pack_map);
+}
+
+
+int pack_object_header(const Pack *pack, uint64_t offset, ObjectType *type, size_t *size) {
+    ObjectType t;
+    size_t sz;
+    size_t header_len = parse_entry_header(pack, offset, &t, &sz);
+    if (!header_len) return -1;
+    if (t != OBJ_OFS_DELTA && t != OBJ_REF_DELTA) {
+        *type = t;
+        *size = sz;
+        return 0;
+    }
+
+    // A delta opens with "<base size><result size>" varints; the result size is ours
+    uint64_t data_offset, cur = offset;
+    const unsigned char *base_name = NULL;
+    if (t == OBJ_OFS_DELTA) {
+        data_offset = parse_ofs_base(pack, offset, header_len, &cur);
+        if (!data_offset) return -1;
+    } else {
+        if (offset + header_len + 20 > pack->pack_size - 20) return -1;
+        base_name = pack->pack_map + offset + header_len;
+        data_offset = offset + header_len + 20;
+    }
+    unsigned char prefix[20];
+    size_t got = inflate_prefix(pack, data_offset, prefix, sizeof(prefix));
+    const unsigned char *p = prefix;
+    if (delta_varint(&p, prefix + got) == SIZE_MAX) return -1;
+    *size = delta_varint(&p, prefix + got);
+    if (*size == SIZE_MAX) return -1;
+
+    // The type is the base's: walk the chain without inflating anything
+    for (int depth = 0; depth < MAX_DELTA_DEPTH; depth++) {
+        if (base_name) {
+            uint64_t found;
+            if (!pack_find(pack, base_name, &found)) {
+                size_t base_size;
+                ObjectReader r;
+                object_reader_init(&r);
+                int status = object_reader_header(&r, base_name, type, &base_size);
+                object_reader_release(&r);
+                return status;
+            }
+            cur = found;
+            base_name = NULL;
+        }
+
+        header_len = parse_entry_header(pack, cur, &t, &sz);
+        if (!header_len) return -1;
+        if (t == OBJ_OFS_DELTA) {
+            if (!parse_ofs_base(pack, cur, header_len, &cur)) return -1;
+        } else if (t == OBJ_REF_DELTA) {
+            if (cur + header_len + 20 > pack->pack_size - 20) return -1;
+            base_name = pack->pack_map + cur + header_len;
+        } else {
+            *type = t;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+typedef struct {
+    uint64_t entry;       // where the delta's own entry starts
+    uint64_t data_offset; // zlib stream of the delta itself
+    size_t size;          // inflated delta size
+} DeltaLink;
+
+
+// What a read keeps: trees, which walks come back to, and every object a
+// delta was applied to or produced, which is what the next delta against
+// them needs. A blob stored whole is read once and handed over.
+static int worth_keeping(ObjectType type, size_t depth) {
+    return type == OBJ_TREE || depth > 0;
+}
+
+
+CachedObject *pack_read_cached(const Pack *pack, uint64_t offset, ObjectView *view) {
+    DeltaLink *chain = NULL;
+    size_t depth = 0, cap = 0;
+    CachedObject *base = NULL;
+    ObjectView base_view;
+
+    // Walk from the requested entry down to a full (non-delta) base, or to
+    // the first link whose result is still cached
+    uint64_t cur = offset;
+    for (;;) {
+        base = object_cache_get(pack, cur, NULL, &base_view);
+        if (base) break;
+
+        ObjectType t;
+        size_t sz;
+        size_t header_len = parse_entry_header(pack, cur, &t, &sz);
+        if (!header_len) goto corrupt;
+        const unsigned char *p = pack->pack_map + cur + header_len;
+        const unsigned char *end = pack->pack_map + pack->pack_size - 20;
+
+        if (t == OBJ_COMMIT || t == OBJ_TREE || t == OBJ_BLOB || t == OBJ_TAG) {
+            unsigned char *data = inflate_entry(pack, cur + header_len, sz);
+            if (!data) goto out;
+            base = object_cache_put(pack, cur, NULL, t, data, sz, worth_keeping(t, depth), &base_view);
+            if (!base) goto out;
+            break;
+        }
+        if (t != OBJ_OFS_DELTA && t != OBJ_REF_DELTA) goto corrupt;
+        if (depth >= MAX_DELTA_DEPTH) goto corrupt;
+
+        if (depth == cap) {
+            cap = cap ? cap * 2 : 16;
+            DeltaLink *grown = realloc(chain, sizeof(DeltaLink) * cap);
+            if (!grown) { perror("realloc"); goto out; }
+            chain = grown;
+        }
+
+        if (t == OBJ_OFS_DELTA) {
+            uint64_t base_offset;
+            uint64_t data_offset = parse_ofs_base(pack, cur, header_len, &base_offset);
+            if (!data_offset) goto corrupt;
+            chain[depth++] = (DeltaLink){ cur, data_offset, sz };
+            cur = base_offset;
+        } else {
+            if (end - p < 20) goto corrupt;
+            const unsigned char *base_name = p;
+            chain[depth++] = (DeltaLink){ cur, (uint64_t)(p + 20 - pack->pack_map), sz };
+
+            uint64_t base_offset;
+            if (pack_find(pack, base_name, &base_offset)) {
+                cur = base_offset;
+                continue;
+            }
+            // Base lives elsewhere in the object database
+            base = read_object_cached(base_name, &base_view);
+            if (!base) {
+                char hex[41];
+                hash_to_hex(hex, base_name);
+                fprintf(stderr, "%s: missing delta base %s\n", pack->pack_path, hex);
+                goto out;
+            }
+            break;
+        }
+    }
+
+    // Apply the deltas from the innermost outwards, caching each result
+    while (depth > 0) {
+        DeltaLink link = chain[--depth];
+        unsigned char *delta = inflate_entry(pack, link.data_offset, link.size);
+        if (!delta) goto fail;
+
+        unsigned char *result;
+        size_t result_size;
+        int status = apply_delta(base_view.data, base_view.size, delta, link.size, &result, &result_size);
+        free(delta);
+        if (status < 0) goto fail;
+        object_cache_release(base);
+        base = object_cache_put(pack, link.entry, NULL, base_view.type, result, result_size, 1, &base_view);
+        if (!base) goto out;
+    }
+
+    *view = base_view;
+    free(chain);
+    return base;
+
+corrupt:
+    fprintf(stderr, "%s: corrupt entry near offset %llu\n", pack->pack_path, (unsigned long long)cur);
+    goto out;
+fail:
+    object_cache_release(base);
+    base = NULL;
+out:
+    free(chain);
+    return base;
+}
@@ -0,0 +1,61 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "object_cache.h"
+#include "object_store.h"
+
+// Read-only access to a .pack and its .idx (version 2). Both files are
+// mmap'd; a lookup touches the 256-entry fanout table, about log2(n) object
+// names and the entry itself, so it never reads a whole file.
+
+typedef struct {
+    char *pack_path;
+    const unsigned char *idx_map;
+    size_t idx_size;
+    const unsigned char *pack_map;
+    size_t pack_size;
+
+    uint32_t count;
+    const unsigned char *fanout;      // 256 big-endian cumulative counts
+    const unsigned char *names;       // count x 20-byte object names, sorted
+    const unsigned char *crcs;        // count x 4 bytes
+    const unsigned char *offsets;     // count x 4 bytes, MSB set -> large offset index
+    const unsigned char *large_offsets;
+    size_t large_count;
+} Pack;
+
+// Maps pack-xxxx.idx and the matching pack-xxxx.pack; returns 0 or -1
+int pack_open(Pack *pack, const char *idx_path);
+void pack_close(Pack *pack);
+
+// Returns 1 and sets *offset when the pack holds the object
+int pack_find(const Pack *pack, const unsigned char raw_hash[20], uint64_t *offset);
+
+// Inflates the object at `offset`, resolving OFS_DELTA/REF_DELTA chains,
+// through the object cache: a chain is only followed down to the first link
+// whose result is cached, and what it resolves is cached for the next read.
+// Returns a reference to the object (see object_cache.h), or NULL (reported).
+CachedObject *pack_read_cached(const Pack *pack, uint64_t offset, ObjectView *view);
+
+// Type and size without inflating the object: a delta's size comes from the
+// first bytes of its delta data, its type from the base at the end of the chain
+int pack_object_header(const Pack *pack, uint64_t offset, ObjectType *type, size_t *size);
+
+// Where a non-delta entry's zlib data starts, so callers can inflate it
+// incrementally. Returns 0, 1 for a delta (use pack_read_cached) or -1.
+int pack_entry_data(const Pack *pack, uint64_t offset, ObjectType *type, size_t *size,
+                    const unsigned char **zdata, size_t *zavail);
+
+// Object name of entry i in index order
+const unsigned char *pack_name(const Pack *pack, uint32_t i);
+uint64_t pack_offset(const Pack *pack, uint32_t i);
+
+// Applies a git delta to base; result is malloc'd with a trailing NUL
+int apply_delta(const unsigned char *base, size_t base_size,
+                const unsigned char *delta, size_t delta_size,
+                unsigned char **out, size_t *out_size);
+
+#endif
@@ -0,0 +1,188 @@
+#include "pack_write.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <zlib.h>
+
+#include "trace.h"
+
+#define OUT_BUF_SIZE (256 * 1024)
+
+
+static void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+
+static int write_all(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+
+int pack_writer_init(PackWriter *w, int fd) {
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    hash_init(&w->hash);
+    w->buf = malloc(OUT_BUF_SIZE);
+    if (!w->buf) { perror("malloc"); return -1; }
+    return 0;
+}
+
+
+int pack_writer_flush(PackWriter *w) {
+    if (w->len == 0) return 0;
+    TraceSpan span;
+    trace_begin(&span, "write");
+    int status = write_all(w->fd, w->buf, w->len);
+    trace_end(&span);
+    if (status < 0) { perror("write pack"); return -1; }
+    w->len = 0;
+    return 0;
+}
+
+
+int pack_writer_write(PackWriter *w, const void *data, size_t len) {
+    const unsigned char *p = data;
+    w->crc = (uint32_t)crc32(w->crc, p, (uInt)len);
+    hash_update(&w->hash, p, len);
+    w->offset += len;
+    while (len > 0) {
+        size_t room = OUT_BUF_SIZE - w->len;
+        size_t take = len < room ? len : room;
+        memcpy(w->buf + w->len, p, take);
+        w->len += take;
+        p += take;
+        len -= take;
+        if (w->len == OUT_BUF_SIZE && pack_writer_flush(w) < 0) return -1;
+    }
+    return 0;
+}
+
+
+void pack_writer_release(PackWriter *w) {
+    free(w->buf);
+    w->buf = NULL;
+    w->len = 0;
+}
+
+
+// Type in bits 4-6 of the first byte, size as a little-endian base-128 varint
+// starting with the low 4 bits
+size_t pack_encode_entry_header(unsigned char *out, ObjectType type, uint64_t size) {
+    unsigned char c = (unsigned char)(type << 4 | (size & 15));
+    size_t n = 0;
+    size >>= 4;
+    while (size) {
+        out[n++] = c | 0x80;
+        c = size & 0x7f;
+        size >>= 7;
+    }
+    out[n++] = c;
+    return n;
+}
+
+
+// Big-endian base-128 with an implicit +1 per continuation byte, so every
+// distance has exactly one encoding
+size_t pack_encode_ofs_distance(unsigned char *out, uint64_t distance) {
+    unsigned char tmp[10];
+    size_t pos = sizeof(tmp) - 1;
+    tmp[pos] = distance & 0x7f;
+    while (distance >>= 7) tmp[--pos] = 0x80 | (--distance & 0x7f);
+    size_t n = sizeof(tmp) - pos;
+    memcpy(out, tmp + pos, n);
+    return n;
+}
+
+
+static int cmp_entry_hash(const void *a, const void *b) {
+    return memcmp(((const PackIndexEntry *)a)->raw_hash, ((const PackIndexEntry *)b)->raw_hash, 20);
+}
+
+
+// .idx version 2: fanout, names, CRCs, 31-bit offsets (MSB set -> index into
+// the 64-bit table), 64-bit offsets, pack checksum, index checksum
+int pack_write_index(const char *path, PackIndexEntry *entries, size_t count,
+                     const unsigned char pack_hash[20]) {
+    qsort(entries, count, sizeof(PackIndexEntry), cmp_entry_hash);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0444);
+    if (fd < 0) { perror(path); return -1; }
+    PackWriter w;
+    if (pack_writer_init(&w, fd) < 0) goto fail;
+
+    unsigned char word[8];
+    if (pack_writer_write(&w, "\377tOc\0\0\0\2", 8) < 0) goto fail;
+    size_t n = 0;
+    for (int b = 0; b < 256; b++) {
+        while (n < count && entries[n].raw_hash[0] == b) n++;
+        put_be32(word, (uint32_t)n);
+        if (pack_writer_write(&w, word, 4) < 0) goto fail;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (pack_writer_write(&w, entries[i].raw_hash, 20) < 0) goto fail;
+    }
+    for (size_t i = 0; i < count; i++) {
+        put_be32(word, entries[i].crc);
+        if (pack_writer_write(&w, word, 4) < 0) goto fail;
+    }
+    uint32_t large = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t off = entries[i].offset;
+        put_be32(word, off < 0x80000000u ? (uint32_t)off : 0x80000000u | large++);
+        if (pack_writer_write(&w, word, 4) < 0) goto fail;
+    }
+    for (size_t i = 0; i < count; i++) {
+        uint64_t off = entries[i].offset;
+        if (off < 0x80000000u) continue;
+        put_be32(word, (uint32_t)(off >> 32));
+        put_be32(word + 4, (uint32_t)off);
+        if (pack_writer_write(&w, word, 8) < 0) goto fail;
+    }
+    if (pack_writer_write(&w, pack_hash, 20) < 0) goto fail;
+
+    unsigned char idx_hash[20];
+    hash_final(&w.hash, idx_hash);
+    if (pack_writer_write(&w, idx_hash, 20) < 0 || pack_writer_flush(&w) < 0) goto fail;
+    pack_writer_release(&w);
+    if (close(fd) < 0) { perror(path); unlink(path); return -1; }
+    return 0;
+
+fail:
+    pack_writer_release(&w);
+    close(fd);
+    unlink(path);
+    return -1;
+}
+
+
+int pack_install(const char *tmp_pack, const char *tmp_idx, const unsigned char pack_hash[20]) {
+    char hex[41], pack_path[PATH_MAX], idx_path[PATH_MAX];
+    hash_to_hex(hex, pack_hash);
+    snprintf(pack_path, sizeof(pack_path), ".git/objects/pack/pack-%s.pack", hex);
+    snprintf(idx_path, sizeof(idx_path), ".git/objects/pack/pack-%s.idx", hex);
+    if (rename(tmp_pack, pack_path) < 0 || rename(tmp_idx, idx_path) < 0) {
+        perror("rename pack");
+        unlink(tmp_pack);
+        unlink(tmp_idx);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef PACK_WRITE_H
+#define PACK_WRITE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hash.h"
+#include "object_store.h"
+
+// Writing side of the pack format, shared by bulk checkin and repack: a
+// buffered output stream that keeps a running SHA-1 and per-entry CRC, the
+// entry header encodings, the .idx v2 writer and the final rename. Functions
+// returning int return 0 on success and -1 on error (already reported).
+
+typedef struct {
+    int fd;
+    unsigned char *buf;
+    size_t len;           // buffered bytes not yet written
+    uint64_t offset;      // bytes written so far, buffered ones included
+    uint32_t crc;         // CRC-32 of everything since the caller last zeroed it
+    HashCtx hash;         // SHA-1 of everything written
+} PackWriter;
+
+int pack_writer_init(PackWriter *w, int fd);
+int pack_writer_write(PackWriter *w, const void *data, size_t len);
+int pack_writer_flush(PackWriter *w);
+void pack_writer_release(PackWriter *w); // frees the buffer; the fd is the caller's
+
+// Type and size header of an entry; `out` needs room for 16 bytes
+size_t pack_encode_entry_header(unsigned char *out, ObjectType type, uint64_t size);
+
+// OFS_DELTA base distance; `out` needs room for 10 bytes
+size_t pack_encode_ofs_distance(unsigned char *out, uint64_t distance);
+
+typedef struct {
+    unsigned char raw_hash[20];
+    uint32_t crc;         // CRC-32 of the entry's bytes in the pack
+    uint64_t offset;
+} PackIndexEntry;
+
+// Sorts `entries` by object name and writes a version 2 .idx for them to a
+// new file at `path`
+int pack_write_index(const char *path, PackIndexEntry *entries, size_t count,
+                     const unsigned char pack_hash[20]);
+
+// Renames a finished pack and its index to .git/objects/pack/pack-<hash>.*.
+// Readers find packs through their .idx, so the .pack goes first.
+int pack_install(const char *tmp_pack, const char *tmp_idx, const unsigned char pack_hash[20]);
+
+#endif
@@ -0,0 +1,228 @@
+#define _GNU_SOURCE // strchrnul
+#include "refs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+
+#define MAX_SYMREF_DEPTH 5
+
+// .git/packed-refs, read once: "<hex> <name>" lines, "^<hex>" peeled lines
+static char *packed;
+static int packed_loaded;
+
+typedef struct {
+    char **names;
+    size_t count, cap;
+} NameList;
+
+
+// The whole file, NUL-terminated; NULL when it doesn't exist (errno ENOENT
+// or friends) or can't be read (reported)
+static char *read_text(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    size_t len = 0, cap = 256;
+    char *buf = malloc(cap);
+    while (buf) {
+        if (len + 1 == cap) {
+            char *grown = realloc(buf, cap *= 2);
+            if (!grown) { free(buf); buf = NULL; break; }
+            buf = grown;
+        }
+        ssize_t n = read(fd, buf + len, cap - 1 - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            if (errno != EISDIR) perror(path); // a directory is just not a ref
+            free(buf);
+            buf = NULL;
+            break;
+        }
+        if (n == 0) {
+            buf[len] = '\0';
+            break;
+        }
+        len += (size_t)n;
+    }
+    close(fd);
+    return buf;
+}
+
+
+static const char *packed_refs(void) {
+    if (!packed_loaded) {
+        packed = read_text(".git/packed-refs");
+        packed_loaded = 1;
+    }
+    return packed;
+}
+
+
+// Returns 0 with the packed value of name, or 1 when it isn't packed
+static int find_packed(const char *name, unsigned char raw_hash[20]) {
+    const char *p = packed_refs();
+    size_t len = strlen(name);
+    while (p && *p) {
+        const char *eol = strchrnul(p, '\n');
+        if (eol - p == 41 + (ptrdiff_t)len && p[40] == ' ' && memcmp(p + 41, name, len) == 0) {
+            char hex[41];
+            memcpy(hex, p, 40);
+            hex[40] = '\0';
+            return hex_to_hash(raw_hash, hex) == 0 ? 0 : 1;
+        }
+        p = *eol ? eol + 1 : eol;
+    }
+    return 1;
+}
+
+
+static int valid_name(const char *name) {
+    return *name && name[0] != '/' && !strstr(name, "..") && strlen(name) < PATH_MAX - 8;
+}
+
+
+int read_ref(const char *name, unsigned char raw_hash[20]) {
+    char target[PATH_MAX];
+    for (int depth = 0; depth < MAX_SYMREF_DEPTH; depth++) {
+        if (!valid_name(name)) return 1;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), ".git/%s", name);
+        char *text = read_text(path);
+        if (!text) return find_packed(name, raw_hash);
+
+        text[strcspn(text, "\n")] = '\0';
+        if (strncmp(text, "ref: ", 5) == 0) {
+            snprintf(target, sizeof(target), "%s", text + 5);
+            free(text);
+            name = target;
+            continue;
+        }
+        int status = hex_to_hash(raw_hash, text);
+        free(text);
+        if (status < 0) {
+            fprintf(stderr, "error: broken ref %s\n", name);
+            return -1;
+        }
+        return 0;
+    }
+    fprintf(stderr, "error: symref loop at %s\n", name);
+    return -1;
+}
+
+
+int resolve_name(const char *name, unsigned char raw_hash[20]) {
+    if (strlen(name) == 40 && hex_to_hash(raw_hash, name) == 0) return 0;
+
+    static const char *const rules[] = { "%s", "refs/%s", "refs/tags/%s", "refs/heads/%s",
+                                         "refs/remotes/%s", "refs/remotes/%s/HEAD" };
+    for (size_t i = 0; i < sizeof(rules) / sizeof(rules[0]); i++) {
+        char full[PATH_MAX];
+        snprintf(full, sizeof(full), rules[i], name);
+        int status = read_ref(full, raw_hash);
+        if (status <= 0) return status;
+    }
+    fprintf(stderr, "fatal: ambiguous argument '%s': unknown revision\n", name);
+    return -1;
+}
+
+
+static int add_name(NameList *list, const char *name) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 64;
+        char **grown = realloc(list->names, cap * sizeof(char *));
+        if (!grown) { perror("realloc"); return -1; }
+        list->names = grown;
+        list->cap = cap;
+    }
+    list->names[list->count] = strdup(name);
+    if (!list->names[list->count]) { perror("strdup"); return -1; }
+    list->count++;
+    return 0;
+}
+
+
+// Every file below .git/<dir>, by its name relative to .git
+static int collect_loose(char *dir, size_t len, NameList *list) {
+    char path[PATH_MAX + 8];
+    snprintf(path, sizeof(path), ".git/%s", dir);
+    DIR *d = opendir(path);
+    if (!d) {
+        if (errno == ENOENT) return 0;
+        perror(path);
+        return -1;
+    }
+
+    int ret = 0;
+    struct dirent *dent;
+    while (ret == 0 && (dent = readdir(d)) != NULL) {
+        if (dent->d_name[0] == '.') continue;
+        size_t name_len = strlen(dent->d_name);
+        if (len + 1 + name_len + 1 > PATH_MAX) continue;
+        dir[len] = '/';
+        memcpy(dir + len + 1, dent->d_name, name_len + 1);
+
+        int is_dir = dent->d_type == DT_DIR;
+        struct stat st;
+        if (dent->d_type == DT_UNKNOWN && fstatat(dirfd(d), dent->d_name, &st, 0) == 0)
+            is_dir = S_ISDIR(st.st_mode);
+        ret = is_dir ? collect_loose(dir, len + 1 + name_len, list) : add_name(list, dir);
+        dir[len] = '\0';
+    }
+    closedir(d);
+    return ret;
+}
+
+
+static int cmp_name(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+
+int for_each_ref(each_ref_fn fn, void *arg) {
+    unsigned char raw_hash[20];
+    int ret = read_ref("HEAD", raw_hash);
+    if (ret < 0) return -1;
+    if (ret == 0 && (ret = fn("HEAD", raw_hash, arg)) != 0) return ret;
+
+    NameList loose = { 0 };
+    char dir[PATH_MAX] = "refs";
+    ret = collect_loose(dir, 4, &loose);
+    qsort(loose.names, loose.count, sizeof(char *), cmp_name);
+
+    for (size_t i = 0; ret == 0 && i < loose.count; i++) {
+        int status = read_ref(loose.names[i], raw_hash);
+        if (status < 0) ret = -1;
+        else if (status == 0) ret = fn(loose.names[i], raw_hash, arg);
+    }
+
+    // Packed refs that no loose file overrides
+    const char *p = packed_refs();
+    while (ret == 0 && p && *p) {
+        const char *eol = strchrnul(p, '\n');
+        if (eol - p > 41 && p[40] == ' ') {
+            char name[PATH_MAX], hex[41];
+            snprintf(name, sizeof(name), "%.*s", (int)(eol - p - 41), p + 41);
+            memcpy(hex, p, 40);
+            hex[40] = '\0';
+            const char *key = name;
+            if (!bsearch(&key, loose.names, loose.count, sizeof(char *), cmp_name) &&
+                hex_to_hash(raw_hash, hex) == 0) {
+                ret = fn(name, raw_hash, arg);
+            }
+        }
+        p = *eol ? eol + 1 : eol;
+    }
+
+    for (size_t i = 0; i < loose.count; i++) free(loose.names[i]);
+    free(loose.names);
+    return ret;
+}
@@ -0,0 +1,24 @@
+#ifndef REFS_H
+#define REFS_H
+
+// Read-only access to refs: .git/HEAD, loose files under .git/refs and the
+// .git/packed-refs written by clone. A loose ref shadows a packed one of the
+// same name, and "ref: <name>" symrefs are followed.
+
+// Looks up one full name ("HEAD", "refs/heads/main"). Returns 0, 1 when
+// there is no such ref, or -1 when it is broken (reported).
+int read_ref(const char *name, unsigned char raw_hash[20]);
+
+// Names as git's rev-parse takes them: 40 hex digits, or a ref tried as
+// <name>, refs/<name>, refs/tags/<name>, refs/heads/<name>,
+// refs/remotes/<name> and refs/remotes/<name>/HEAD, in that order.
+// Returns 0, or -1 when nothing matches (reported).
+int resolve_name(const char *name, unsigned char raw_hash[20]);
+
+// Calls fn for HEAD and then every ref, in no particular order. A nonzero
+// return from fn stops the walk and is passed back; -1 is also returned
+// when the refs can't be read (reported).
+typedef int (*each_ref_fn)(const char *name, const unsigned char raw_hash[20], void *arg);
+int for_each_ref(each_ref_fn fn, void *arg);
+
+#endif
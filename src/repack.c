@@ -0,0 +1,574 @@
+#include "repack.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "compress.h"
+#include "delta.h"
+#include "multi_pack_index.h"
+#include "object_store.h"
+#include "pack_write.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "tree.h"
+
+#define PACK_DIR ".git/objects/pack"
+#define MIN_DELTA_SIZE 50                // smaller objects are always stored whole, as in git
+#define WRITE_BATCH_BYTES (32u << 20)    // raw bytes deflated in parallel between sequential writes
+#define WRITE_BATCH_COUNT 4096
+
+typedef struct {
+    unsigned char raw_hash[20];
+    uint8_t type;            // ObjectType
+    uint8_t loose;           // has a loose copy, removed by -d
+    uint8_t named;           // name_hash is set
+    uint8_t scheduled;       // has a place in the write order
+    uint32_t depth;          // delta chain length, 0 when stored whole
+    uint32_t name_hash;
+    int64_t base;            // entry index of the delta base, or -1
+    size_t size;
+    unsigned char *zdata;    // deflated delta, or the whole object if the search deflated it
+    size_t zlen;
+    size_t delta_len;        // inflated delta size, which is what the entry header records
+    uint64_t offset;         // in the new pack
+} PackedObject;
+
+typedef struct {
+    PackedObject *entries;
+    size_t count, cap;
+} PackedObjectList;
+
+
+static int add_entry(PackedObjectList *list, const unsigned char raw_hash[20], int loose) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 1024;
+        PackedObject *grown = realloc(list->entries, cap * sizeof(PackedObject));
+        if (!grown) { perror("realloc"); return -1; }
+        list->entries = grown;
+        list->cap = cap;
+    }
+    PackedObject *e = &list->entries[list->count++];
+    memset(e, 0, sizeof(*e));
+    memcpy(e->raw_hash, raw_hash, 20);
+    e->loose = (uint8_t)loose;
+    e->base = -1;
+    return 0;
+}
+
+
+static int collect_loose(const unsigned char raw_hash[20], void *arg) {
+    return add_entry(arg, raw_hash, 1);
+}
+
+
+static int collect_packed(const unsigned char raw_hash[20], void *arg) {
+    return add_entry(arg, raw_hash, 0);
+}
+
+
+static int cmp_hash(const void *a, const void *b) {
+    return memcmp(((const PackedObject *)a)->raw_hash, ((const PackedObject *)b)->raw_hash, 20);
+}
+
+
+// Every object once, sorted by name, with its type and size
+static int collect(PackedObjectList *list) {
+    if (for_each_loose_object(collect_loose, list) < 0 || for_each_packed_object(collect_packed, list) < 0) {
+        return -1;
+    }
+    qsort(list->entries, list->count, sizeof(PackedObject), cmp_hash);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        if (kept > 0 && memcmp(list->entries[kept - 1].raw_hash, list->entries[i].raw_hash, 20) == 0) {
+            list->entries[kept - 1].loose |= list->entries[i].loose;
+            continue;
+        }
+        list->entries[kept++] = list->entries[i];
+    }
+    list->count = kept;
+
+    ObjectReader r;
+    object_reader_init(&r);
+    int ret = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        PackedObject *e = &list->entries[i];
+        ObjectType type;
+        if (object_reader_header(&r, e->raw_hash, &type, &e->size) < 0) {
+            char hex[41];
+            hash_to_hex(hex, e->raw_hash);
+            fprintf(stderr, "fatal: unable to read object %s\n", hex);
+            ret = -1;
+            break;
+        }
+        e->type = (uint8_t)type;
+    }
+    object_reader_release(&r);
+    return ret;
+}
+
+
+// git's pack name hash: the last characters weigh most, so "a/Makefile" and
+// "b/Makefile" (or "foo.c" and "bar.c") land close together
+static uint32_t name_hash(const char *name) {
+    uint32_t hash = 0;
+    for (; *name; name++) {
+        unsigned char c = (unsigned char)*name;
+        if (isspace(c)) continue;
+        hash = (hash >> 2) + ((uint32_t)c << 24);
+    }
+    return hash;
+}
+
+
+static PackedObject *find_entry(PackedObjectList *list, const unsigned char raw_hash[20]) {
+    size_t lo = 0, hi = list->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = memcmp(list->entries[mid].raw_hash, raw_hash, 20);
+        if (c == 0) return &list->entries[mid];
+        if (c < 0) lo = mid + 1; else hi = mid;
+    }
+    return NULL;
+}
+
+
+// Name every object after the first tree entry that points at it
+static int assign_names(PackedObjectList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        if (list->entries[i].type != OBJ_TREE) continue;
+        TreeIterator it;
+        if (tree_iter_open(&it, list->entries[i].raw_hash) < 0) return -1;
+        TreeEntryView entry;
+        int status;
+        while ((status = tree_iter_next(&it, &entry)) == 1) {
+            PackedObject *child = find_entry(list, entry.raw_hash);
+            if (!child || child->named) continue;
+            child->name_hash = name_hash(entry.name);
+            child->named = 1;
+        }
+        tree_iter_close(&it);
+        if (status < 0) return -1;
+    }
+    return 0;
+}
+
+
+static int cmp_delta_order(const void *a, const void *b) {
+    const PackedObject *x = a, *y = b;
+    if (x->type != y->type) return x->type < y->type ? -1 : 1;
+    if (x->name_hash != y->name_hash) return x->name_hash < y->name_hash ? -1 : 1;
+    if (x->size != y->size) return x->size > y->size ? -1 : 1; // deleting is cheaper than inserting
+    return memcmp(x->raw_hash, y->raw_hash, 20);
+}
+
+
+typedef struct {
+    PackedObject *entries;
+    size_t lo, hi;           // this thread's run of the sorted list
+    const RepackOptions *opts;
+    int failed;
+} SearchTask;
+
+typedef struct {
+    size_t idx;
+    unsigned char *data;
+    DeltaIndex *index;
+} Slot;
+
+
+static int deflate_buffer(const unsigned char *data, size_t len, unsigned char **zdata, size_t *zlen) {
+    return compress_buffer(compress_level(COMPRESS_PACK, data, len), data, len, zdata, zlen);
+}
+
+
+// Sliding window over [lo, hi): each object is diffed against the previous
+// `window` ones and keeps the smallest delta that beats half its size
+static void search_task(void *arg) {
+    SearchTask *t = arg;
+    TraceSpan span;
+    trace_begin(&span, "delta search");
+
+    int window = t->opts->window;
+    Slot *slots = calloc((size_t)window, sizeof(Slot));
+    if (!slots) { perror("calloc"); t->failed = 1; trace_end(&span); return; }
+
+    size_t next = 0;
+    for (size_t i = t->lo; i < t->hi; i++) {
+        PackedObject *e = &t->entries[i];
+        if (e->size < MIN_DELTA_SIZE) continue;
+
+        ObjectType type;
+        unsigned char *data;
+        size_t size;
+        if (read_object(e->raw_hash, &type, &data, &size) < 0) { t->failed = 1; break; }
+
+        unsigned char *best = NULL;
+        size_t best_len = 0;
+        int best_slot = -1;
+        // Newest first: the likeliest base, and a good delta early makes
+        // every later attempt give up sooner
+        for (int k = 1; k <= window; k++) {
+            int s = (int)((next + (size_t)window - (size_t)k) % (size_t)window);
+            if (!slots[s].index) continue;
+            const PackedObject *b = &t->entries[slots[s].idx];
+            if (b->type != e->type || b->depth >= (uint32_t)t->opts->depth) continue;
+
+            size_t max_len = best ? best_len - 1 : size / 2 - 20;
+            if (size > b->size && size - b->size >= max_len) continue; // the growth alone is too big
+
+            size_t len;
+            unsigned char *delta = delta_create(slots[s].index, data, size, max_len, &len);
+            if (!delta) continue;
+            free(best);
+            best = delta;
+            best_len = len;
+            best_slot = s;
+        }
+        if (best) {
+            int failed = deflate_buffer(best, best_len, &e->zdata, &e->zlen) < 0;
+            free(best);
+
+            // A delta of many short copies can deflate worse than the object
+            // itself; only weak deltas are worth the extra compression to check
+            if (!failed && best_len > size / 16) {
+                unsigned char *whole;
+                size_t whole_len;
+                failed = deflate_buffer(data, size, &whole, &whole_len) < 0;
+                if (!failed && whole_len <= e->zlen) {
+                    free(e->zdata);
+                    e->zdata = whole;
+                    e->zlen = whole_len;
+                    best_slot = -1;
+                } else if (!failed) {
+                    free(whole);
+                }
+            }
+            if (failed) {
+                free(data);
+                t->failed = 1;
+                break;
+            }
+            if (best_slot >= 0) {
+                e->base = (int64_t)slots[best_slot].idx;
+                e->depth = t->entries[e->base].depth + 1;
+                e->delta_len = best_len;
+            }
+        }
+
+        // The oldest candidate makes room for this one
+        Slot *slot = &slots[next];
+        delta_index_free(slot->index);
+        free(slot->data);
+        slot->idx = i;
+        slot->data = data;
+        slot->index = delta_index_create(data, size);
+        next = (next + 1) % (size_t)window;
+    }
+
+    for (int s = 0; s < window; s++) {
+        delta_index_free(slots[s].index);
+        free(slots[s].data);
+    }
+    free(slots);
+    trace_end(&span);
+}
+
+
+static int find_deltas(PackedObject *entries, size_t count, const RepackOptions *opts, ThreadPool *pool) {
+    if (opts->window <= 0 || count == 0) return 0;
+
+    size_t threads = opts->threads > 0 ? (size_t)opts->threads : 1;
+    size_t per = (count + threads - 1) / threads;
+    SearchTask *tasks = calloc(threads, sizeof(SearchTask));
+    if (!tasks) { perror("calloc"); return -1; }
+
+    // Runs end where the name hash changes, so no group of lookalikes is split
+    size_t lo = 0, n = 0;
+    while (lo < count && n < threads) {
+        size_t hi = n == threads - 1 || count - lo <= per ? count : lo + per;
+        size_t limit = hi + per / 2 < count ? hi + per / 2 : count;
+        while (hi < limit && entries[hi].type == entries[hi - 1].type &&
+               entries[hi].name_hash == entries[hi - 1].name_hash) hi++;
+        tasks[n] = (SearchTask){ entries, lo, hi, opts, 0 };
+        thread_pool_submit(pool, search_task, &tasks[n++]);
+        lo = hi;
+    }
+    thread_pool_wait(pool);
+
+    int ret = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (tasks[i].failed) ret = -1;
+    }
+    free(tasks);
+    return ret;
+}
+
+
+// Bases have to precede their deltas; otherwise keep the search order
+static size_t *write_order(PackedObject *entries, size_t count, int depth) {
+    size_t *seq = malloc(count * sizeof(size_t));
+    size_t *chain = malloc(((size_t)depth + 2) * sizeof(size_t));
+    if (!seq || !chain) { perror("malloc"); free(seq); free(chain); return NULL; }
+
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t len = 0;
+        for (int64_t j = (int64_t)i; j >= 0 && !entries[j].scheduled; j = entries[j].base) {
+            chain[len++] = (size_t)j;
+        }
+        while (len > 0) {
+            size_t j = chain[--len];
+            entries[j].scheduled = 1;
+            seq[n++] = j;
+        }
+    }
+    free(chain);
+    return seq;
+}
+
+
+typedef struct {
+    PackedObject *entry;
+    unsigned char *zdata;
+    size_t zlen;
+    int failed;
+} WholeJob;
+
+
+static void deflate_task(void *arg) {
+    WholeJob *job = arg;
+    ObjectType type;
+    unsigned char *data;
+    size_t size;
+    if (read_object(job->entry->raw_hash, &type, &data, &size) < 0) { job->failed = 1; return; }
+    if (deflate_buffer(data, size, &job->zdata, &job->zlen) < 0) job->failed = 1;
+    free(data);
+}
+
+
+static int write_entry(PackWriter *w, PackedObject *entries, PackedObject *e, const unsigned char *zdata, size_t zlen,
+                       PackIndexEntry *idx) {
+    unsigned char header[32];
+    size_t header_len;
+    e->offset = w->offset;
+    w->crc = 0;
+    if (e->base >= 0) {
+        header_len = pack_encode_entry_header(header, OBJ_OFS_DELTA, e->delta_len);
+        header_len += pack_encode_ofs_distance(header + header_len, e->offset - entries[e->base].offset);
+    } else {
+        header_len = pack_encode_entry_header(header, (ObjectType)e->type, e->size);
+    }
+    if (pack_writer_write(w, header, header_len) < 0 || pack_writer_write(w, zdata, zlen) < 0) return -1;
+
+    memcpy(idx->raw_hash, e->raw_hash, 20);
+    idx->crc = w->crc;
+    idx->offset = e->offset;
+    return 0;
+}
+
+
+static void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+
+// Streams the entries into `fd` in write order. Deltas were deflated during
+// the search; other objects are deflated a batch at a time on the pool.
+static int write_pack(int fd, PackedObject *entries, size_t count, const size_t *seq, ThreadPool *pool,
+                      PackIndexEntry *idx, unsigned char pack_hash[20]) {
+    PackWriter w;
+    if (pack_writer_init(&w, fd) < 0) return -1;
+    WholeJob *jobs = malloc(WRITE_BATCH_COUNT * sizeof(WholeJob));
+    if (!jobs) { perror("malloc"); pack_writer_release(&w); return -1; }
+
+    unsigned char header[12] = { 'P', 'A', 'C', 'K', 0, 0, 0, 2 };
+    put_be32(header + 8, (uint32_t)count);
+    int ret = pack_writer_write(&w, header, sizeof(header));
+
+    for (size_t start = 0; ret == 0 && start < count; ) {
+        // Batch up to a byte or count budget, then deflate its whole objects at once
+        size_t end = start, njobs = 0, bytes = 0;
+        while (end < count && njobs < WRITE_BATCH_COUNT && (end == start || bytes < WRITE_BATCH_BYTES)) {
+            PackedObject *e = &entries[seq[end++]];
+            if (e->zdata) continue;
+            jobs[njobs] = (WholeJob){ e, NULL, 0, 0 };
+            thread_pool_submit(pool, deflate_task, &jobs[njobs++]);
+            bytes += e->size;
+        }
+        thread_pool_wait(pool);
+
+        size_t j = 0;
+        for (size_t k = start; k < end; k++) {
+            PackedObject *e = &entries[seq[k]];
+            if (ret < 0) break;
+            if (e->zdata) {
+                ret = write_entry(&w, entries, e, e->zdata, e->zlen, &idx[k]);
+                free(e->zdata);
+                e->zdata = NULL;
+            } else {
+                WholeJob *job = &jobs[j++];
+                ret = job->failed ? -1 : write_entry(&w, entries, e, job->zdata, job->zlen, &idx[k]);
+            }
+        }
+        for (size_t k = 0; k < njobs; k++) free(jobs[k].zdata);
+        start = end;
+    }
+
+    if (ret == 0) {
+        hash_final(&w.hash, pack_hash);
+        ret = pack_writer_write(&w, pack_hash, 20) < 0 || pack_writer_flush(&w) < 0 ? -1 : 0;
+    }
+    pack_writer_release(&w);
+    free(jobs);
+    return ret;
+}
+
+
+// Paths of the packs present before this run, by their .idx
+static char **list_packs(size_t *count) {
+    *count = 0;
+    DIR *dir = opendir(PACK_DIR);
+    if (!dir) return NULL;
+    char **paths = NULL;
+    size_t cap = 0;
+    struct dirent *dent;
+    while ((dent = readdir(dir)) != NULL) {
+        size_t len = strlen(dent->d_name);
+        if (len < 4 || strcmp(dent->d_name + len - 4, ".idx") != 0) continue;
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 8;
+            char **grown = realloc(paths, cap * sizeof(char *));
+            if (!grown) break;
+            paths = grown;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), PACK_DIR "/%s", dent->d_name);
+        if ((paths[*count] = strdup(path)) != NULL) (*count)++;
+    }
+    closedir(dir);
+    return paths;
+}
+
+
+// -d: everything below is now in the new pack. An .idx goes before its .pack
+// so no reader finds an index whose pack has vanished.
+static void remove_redundant(const PackedObject *entries, size_t count, char **old_packs, size_t old_count,
+                             const unsigned char pack_hash[20]) {
+    TraceSpan span;
+    trace_begin(&span, "prune");
+
+    char hex[41], keep[PATH_MAX];
+    hash_to_hex(hex, pack_hash);
+    snprintf(keep, sizeof(keep), PACK_DIR "/pack-%s.idx", hex);
+    // The multi-pack-index goes first too: it would name the packs removed here
+    if (unlink(MULTI_PACK_INDEX_FILE) < 0 && errno != ENOENT) perror(MULTI_PACK_INDEX_FILE);
+    for (size_t i = 0; i < old_count; i++) {
+        if (strcmp(old_packs[i], keep) == 0) continue; // the same objects produced the same pack
+        char pack_path[PATH_MAX];
+        snprintf(pack_path, sizeof(pack_path), "%.*s.pack", (int)(strlen(old_packs[i]) - 4), old_packs[i]);
+        if (unlink(old_packs[i]) < 0) perror(old_packs[i]);
+        if (unlink(pack_path) < 0 && errno != ENOENT) perror(pack_path);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (!entries[i].loose) continue;
+        char path[64];
+        hash_to_hex(hex, entries[i].raw_hash);
+        build_path(path, sizeof(path), hex);
+        if (unlink(path) < 0 && errno != ENOENT) perror(path);
+    }
+    for (int b = 0; b < 256; b++) {
+        char dir_path[32];
+        snprintf(dir_path, sizeof(dir_path), ".git/objects/%02x", b);
+        rmdir(dir_path); // only succeeds once empty
+    }
+    trace_end(&span);
+}
+
+
+int repack(const RepackOptions *opts) {
+    PackedObjectList list = { 0 };
+    ThreadPool *pool = NULL;
+    size_t *seq = NULL;
+    PackIndexEntry *idx = NULL;
+    size_t old_count = 0;
+    char **old_packs = list_packs(&old_count);
+    char tmp_path[64] = "", idx_tmp[PATH_MAX];
+    int fd = -1, ret = -1;
+
+    TraceSpan span;
+    trace_begin(&span, "collect");
+    int status = collect(&list);
+    trace_end(&span);
+    if (status < 0) goto out;
+    if (list.count == 0) { ret = 0; goto out; }
+
+    trace_begin(&span, "names");
+    status = assign_names(&list);
+    trace_end(&span);
+    if (status < 0) goto out;
+    qsort(list.entries, list.count, sizeof(PackedObject), cmp_delta_order);
+
+    pool = thread_pool_create(opts->threads > 0 ? opts->threads : 1);
+    if (!pool) goto out;
+    trace_begin(&span, "find deltas");
+    status = find_deltas(list.entries, list.count, opts, pool);
+    trace_end(&span);
+    if (status < 0) goto out;
+
+    seq = write_order(list.entries, list.count, opts->depth);
+    idx = malloc(list.count * sizeof(PackIndexEntry));
+    if (!seq || !idx) { perror("malloc"); goto out; }
+
+    if (mkdir(PACK_DIR, 0755) < 0 && errno != EEXIST) { perror("mkdir " PACK_DIR); goto out; }
+    strcpy(tmp_path, PACK_DIR "/tmp_pack_XXXXXX");
+    fd = mkstemp(tmp_path);
+    if (fd < 0) { perror("mkstemp"); tmp_path[0] = '\0'; goto out; }
+
+    unsigned char pack_hash[20];
+    trace_begin(&span, "write pack");
+    status = write_pack(fd, list.entries, list.count, seq, pool, idx, pack_hash);
+    trace_end(&span);
+    if (status < 0) goto out;
+    fchmod(fd, 0444);
+    status = close(fd);
+    fd = -1;
+    if (status < 0) { perror("close pack"); goto out; }
+
+    snprintf(idx_tmp, sizeof(idx_tmp), "%s.idx", tmp_path);
+    if (pack_write_index(idx_tmp, idx, list.count, pack_hash) < 0) goto out;
+    status = pack_install(tmp_path, idx_tmp, pack_hash);
+    tmp_path[0] = '\0';
+    if (status < 0) goto out;
+
+    size_t deltas = 0;
+    for (size_t i = 0; i < list.count; i++) deltas += list.entries[i].base >= 0;
+    if (!opts->quiet) fprintf(stderr, "Total %zu (delta %zu)\n", list.count, deltas);
+
+    if (opts->remove_redundant) remove_redundant(list.entries, list.count, old_packs, old_count, pack_hash);
+    ret = 0;
+
+out:
+    if (fd >= 0) close(fd);
+    if (tmp_path[0]) unlink(tmp_path);
+    if (pool) thread_pool_destroy(pool);
+    for (size_t i = 0; i < list.count; i++) free(list.entries[i].zdata);
+    free(list.entries);
+    free(seq);
+    free(idx);
+    for (size_t i = 0; i < old_count; i++) free(old_packs[i]);
+    free(old_packs);
+    return ret;
+}
@@ -0,0 +1,22 @@
+#ifndef REPACK_H
+#define REPACK_H
+
+// Gathers every object in the database, loose and packed, into one new pack.
+// Candidates are sorted by type, a hash of the name they appear under in some
+// tree and size (largest first), so likely delta pairs end up side by side.
+// Each object is then tried against the `window` objects before it and stored
+// as the smallest OFS_DELTA found, or whole. The sorted list is cut into one
+// contiguous run per thread for that search, and whole objects are deflated
+// in parallel batches while the pack is written.
+
+typedef struct {
+    int window;            // delta candidates tried per object; 0 stores everything whole
+    int depth;             // longest delta chain allowed
+    int threads;
+    int remove_redundant;  // -d: delete the loose objects and old packs afterwards
+    int quiet;             // -q: no "Total" line on stderr
+} RepackOptions;
+
+int repack(const RepackOptions *opts); // 0, or -1 on error (reported)
+
+#endif
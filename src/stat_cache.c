@@ -0,0 +1,272 @@
+#include "stat_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "trace.h"
+
+// On-disk layout (native byte order; the cache never leaves this machine):
+//   "STC1" | u32 version | u64 count
+//   count x { DiskRecord, path bytes, NUL, zero padding to 8 bytes }
+//   20-byte SHA-1 of everything above
+
+#define STAT_CACHE_MAGIC "STC1"
+#define STAT_CACHE_VERSION 1
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t count;
+} DiskHeader;
+
+typedef struct {
+    uint32_t path_len;
+    uint32_t st_mode;
+    uint32_t entry_count;
+    uint32_t reserved;
+    uint64_t size;
+    int64_t mtime_sec, mtime_nsec;
+    int64_t ctime_sec, ctime_nsec;
+    uint64_t ino, dev;
+    unsigned char sha[20];
+    unsigned char pad[4];
+} DiskRecord;
+
+
+static size_t record_size(size_t path_len) {
+    return (sizeof(DiskRecord) + path_len + 1 + 7) & ~(size_t)7;
+}
+
+
+static int cmp_by_path(const void *a, const void *b) {
+    return strcmp(((const StatCacheEntry *)a)->path, ((const StatCacheEntry *)b)->path);
+}
+
+
+void stat_cache_init(StatCache *cache) {
+    memset(cache, 0, sizeof(*cache));
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+
+void stat_cache_free(StatCache *cache) {
+    if (!cache->data) {
+        for (size_t i = 0; i < cache->count; i++) free(cache->entries[i].path);
+    }
+    free(cache->entries);
+    free(cache->data);
+    pthread_mutex_destroy(&cache->lock);
+    memset(cache, 0, sizeof(*cache));
+}
+
+
+static void load_file(StatCache *cache, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return; // first run
+
+    struct stat st;
+    char *data = NULL;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(DiskHeader) + 20) goto bad;
+
+    size_t len = (size_t)st.st_size;
+    data = malloc(len);
+    if (!data) goto bad;
+    for (size_t got = 0; got < len; ) {
+        ssize_t n = read(fd, data + got, len - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) goto bad;
+        got += (size_t)n;
+    }
+
+    unsigned char sum[20];
+    hash_buffer(data, len - 20, sum);
+    if (memcmp(sum, data + len - 20, 20) != 0) goto bad;
+
+    DiskHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, STAT_CACHE_MAGIC, 4) != 0 || header.version != STAT_CACHE_VERSION) goto bad;
+    if (header.count > (len - sizeof(DiskHeader)) / sizeof(DiskRecord)) goto bad;
+
+    StatCacheEntry *entries = malloc(sizeof(StatCacheEntry) * (header.count ? header.count : 1));
+    if (!entries) goto bad;
+
+    size_t offset = sizeof(DiskHeader);
+    for (uint64_t i = 0; i < header.count; i++) {
+        DiskRecord rec;
+        if (offset + sizeof(rec) > len - 20) { free(entries); goto bad; }
+        memcpy(&rec, data + offset, sizeof(rec));
+        size_t size = record_size(rec.path_len);
+        if (offset + size > len - 20 || data[offset + sizeof(rec) + rec.path_len] != '\0') {
+            free(entries);
+            goto bad;
+        }
+
+        StatCacheEntry *e = &entries[i];
+        e->path = data + offset + sizeof(rec); // paths stay in the loaded buffer
+        e->st_mode = rec.st_mode;
+        e->entry_count = rec.entry_count;
+        e->size = rec.size;
+        e->mtime_sec = rec.mtime_sec;  e->mtime_nsec = rec.mtime_nsec;
+        e->ctime_sec = rec.ctime_sec;  e->ctime_nsec = rec.ctime_nsec;
+        e->ino = rec.ino;
+        e->dev = rec.dev;
+        memcpy(e->sha, rec.sha, 20);
+        offset += size;
+    }
+
+    close(fd);
+    cache->entries = entries;
+    cache->count = cache->cap = header.count;
+    cache->data = data;
+    cache->stamp = st.st_mtim;
+    return;
+
+bad:
+    fprintf(stderr, "warning: ignoring unreadable %s\n", path);
+    free(data);
+    close(fd);
+}
+
+
+void stat_cache_load(StatCache *cache, const char *path) {
+    TraceSpan span;
+    trace_begin(&span, "stat-cache load");
+    load_file(cache, path);
+    trace_end(&span);
+}
+
+
+const StatCacheEntry *stat_cache_lookup(const StatCache *cache, const char *path) {
+    size_t lo = 0, hi = cache->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = strcmp(path, cache->entries[mid].path);
+        if (c == 0) return &cache->entries[mid];
+        if (c < 0) hi = mid; else lo = mid + 1;
+    }
+    return NULL;
+}
+
+
+int stat_cache_blob_clean(const StatCache *cache, const StatCacheEntry *e, const struct stat *st) {
+    if ((e->st_mode & S_IFMT) != (st->st_mode & S_IFMT)) return 0;
+    if (e->size != (uint64_t)st->st_size) return 0;
+    if (e->mtime_sec != st->st_mtim.tv_sec || e->mtime_nsec != st->st_mtim.tv_nsec) return 0;
+    if (e->ctime_sec != st->st_ctim.tv_sec || e->ctime_nsec != st->st_ctim.tv_nsec) return 0;
+    if (e->ino != (uint64_t)st->st_ino || e->dev != (uint64_t)st->st_dev) return 0;
+
+    // Racy entry: the file may have changed again within the same timestamp tick
+    // right after it was hashed, so only trust entries older than the cache file.
+    if (e->mtime_sec > cache->stamp.tv_sec ||
+        (e->mtime_sec == cache->stamp.tv_sec && e->mtime_nsec >= cache->stamp.tv_nsec)) return 0;
+
+    return 1;
+}
+
+
+void stat_cache_add(StatCache *cache, const char *path, const struct stat *st,
+                    uint32_t entry_count, const unsigned char sha[20]) {
+    StatCacheEntry e = { 0 };
+    e.path = strdup(path);
+    if (!e.path) { perror("strdup"); return; }
+    e.entry_count = entry_count;
+    if (st) {
+        e.st_mode = st->st_mode;
+        e.size = st->st_size;
+        e.mtime_sec = st->st_mtim.tv_sec;  e.mtime_nsec = st->st_mtim.tv_nsec;
+        e.ctime_sec = st->st_ctim.tv_sec;  e.ctime_nsec = st->st_ctim.tv_nsec;
+        e.ino = st->st_ino;
+        e.dev = st->st_dev;
+    } else {
+        e.st_mode = S_IFDIR;
+    }
+    memcpy(e.sha, sha, 20);
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->count == cache->cap) {
+        size_t new_cap = cache->cap ? cache->cap * 2 : 256;
+        StatCacheEntry *grown = realloc(cache->entries, sizeof(StatCacheEntry) * new_cap);
+        if (!grown) {
+            pthread_mutex_unlock(&cache->lock);
+            perror("realloc");
+            free(e.path);
+            return;
+        }
+        cache->entries = grown;
+        cache->cap = new_cap;
+    }
+    cache->entries[cache->count++] = e;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+static int write_file(StatCache *cache, const char *path) {
+    qsort(cache->entries, cache->count, sizeof(StatCacheEntry), cmp_by_path);
+
+    size_t len = sizeof(DiskHeader) + 20;
+    for (size_t i = 0; i < cache->count; i++) len += record_size(strlen(cache->entries[i].path));
+
+    char *buf = calloc(1, len);
+    if (!buf) { perror("calloc"); return -1; }
+
+    DiskHeader header = { .version = STAT_CACHE_VERSION, .count = cache->count };
+    memcpy(header.magic, STAT_CACHE_MAGIC, 4);
+    memcpy(buf, &header, sizeof(header));
+
+    size_t offset = sizeof(DiskHeader);
+    for (size_t i = 0; i < cache->count; i++) {
+        const StatCacheEntry *e = &cache->entries[i];
+        DiskRecord rec = { 0 };
+        rec.path_len = (uint32_t)strlen(e->path);
+        rec.st_mode = e->st_mode;
+        rec.entry_count = e->entry_count;
+        rec.size = e->size;
+        rec.mtime_sec = e->mtime_sec;  rec.mtime_nsec = e->mtime_nsec;
+        rec.ctime_sec = e->ctime_sec;  rec.ctime_nsec = e->ctime_nsec;
+        rec.ino = e->ino;
+        rec.dev = e->dev;
+        memcpy(rec.sha, e->sha, 20);
+
+        memcpy(buf + offset, &rec, sizeof(rec));
+        memcpy(buf + offset + sizeof(rec), e->path, rec.path_len);
+        offset += record_size(rec.path_len);
+    }
+    hash_buffer(buf, len - 20, (unsigned char *)buf + len - 20);
+
+    // Write next to the real file and rename, so readers never see half a cache
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.lock", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { perror("open"); free(buf); return -1; }
+
+    int ok = 1;
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = write(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { ok = 0; break; }
+        done += (size_t)n;
+    }
+    if (close(fd) < 0) ok = 0;
+    free(buf);
+
+    if (!ok || rename(tmp_path, path) < 0) {
+        perror("stat-cache");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+int stat_cache_write(StatCache *cache, const char *path) {
+    TraceSpan span;
+    trace_begin(&span, "stat-cache write");
+    int status = write_file(cache, path);
+    trace_end(&span);
+    return status;
+}
@@ -0,0 +1,55 @@
+#ifndef STAT_CACHE_H
+#define STAT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Persistent lstat cache for write-tree, stored in .git/stat-cache.
+//
+// Blob records remember the lstat data a file had when it was hashed, so an
+// unchanged file can reuse its hash without being read. Tree records remember
+// how many entries the directory had and its tree hash; when every child comes
+// out with the hash it had last time the tree is reused without being rebuilt.
+
+#define STAT_CACHE_FILE ".git/stat-cache"
+
+typedef struct {
+    char *path;               // relative to the work tree root; "" is the root tree
+    uint32_t st_mode;
+    uint32_t entry_count;     // trees only
+    uint64_t size;
+    int64_t mtime_sec, mtime_nsec;
+    int64_t ctime_sec, ctime_nsec;
+    uint64_t ino, dev;
+    unsigned char sha[20];
+} StatCacheEntry;
+
+typedef struct {
+    StatCacheEntry *entries;  // sorted by path once loaded or written
+    size_t count;
+    size_t cap;
+    char *data;               // backing buffer for paths of a loaded cache
+    struct timespec stamp;    // mtime of the cache file; entries this new are racy
+    pthread_mutex_t lock;     // guards stat_cache_add
+} StatCache;
+
+void stat_cache_init(StatCache *cache);
+void stat_cache_free(StatCache *cache);
+
+// A missing, stale-format or corrupt cache just loads as empty
+void stat_cache_load(StatCache *cache, const char *path);
+int stat_cache_write(StatCache *cache, const char *path);
+
+const StatCacheEntry *stat_cache_lookup(const StatCache *cache, const char *path);
+
+// Nonzero when st still describes the file the cached blob hash was computed from
+int stat_cache_blob_clean(const StatCache *cache, const StatCacheEntry *e, const struct stat *st);
+
+// Thread-safe; st may be NULL for trees
+void stat_cache_add(StatCache *cache, const char *path, const struct stat *st,
+                    uint32_t entry_count, const unsigned char sha[20]);
+
+#endif
@@ -0,0 +1,245 @@
+#include "thread_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+
+typedef struct {
+    task_fn fn;
+    void *arg;
+} Task;
+
+
+// Growable ring buffer; the owner uses the bottom, thieves take from the top
+typedef struct {
+    pthread_mutex_t lock;
+    Task *tasks;
+    size_t cap;
+    size_t top;    // index of the oldest task
+    size_t count;
+} Deque;
+
+
+typedef struct {
+    ThreadPool *pool;
+    int id;
+    pthread_t thread;
+} Worker;
+
+
+struct ThreadPool {
+    int nthreads;
+    Worker *workers;
+    Deque *deques;
+
+    atomic_size_t queued;      // tasks sitting in some deque (updated under that deque's lock)
+    atomic_size_t unfinished;  // queued + running
+    atomic_int idle;           // workers asleep (or about to sleep) on work_cond
+    atomic_uint next_deque;    // round robin target for submissions from outside the pool
+    int shutdown;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;  // signalled when new work shows up
+    pthread_cond_t done_cond;  // signalled when unfinished drops to 0
+};
+
+
+static _Thread_local Worker *current_worker = NULL;
+
+
+static void deque_push_bottom(ThreadPool *pool, Deque *d, Task t) {
+    pthread_mutex_lock(&d->lock);
+    if (d->count == d->cap) {
+        size_t new_cap = d->cap ? d->cap * 2 : 64;
+        Task *grown = malloc(sizeof(Task) * new_cap);
+        if (!grown) { perror("malloc"); abort(); }
+        for (size_t i = 0; i < d->count; i++) grown[i] = d->tasks[(d->top + i) % d->cap];
+        free(d->tasks);
+        d->tasks = grown;
+        d->cap = new_cap;
+        d->top = 0;
+    }
+    d->tasks[(d->top + d->count) % d->cap] = t;
+    d->count++;
+    atomic_fetch_add(&pool->queued, 1);
+    pthread_mutex_unlock(&d->lock);
+}
+
+
+static int deque_pop_bottom(ThreadPool *pool, Deque *d, Task *out) {
+    int found = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->count > 0) {
+        d->count--;
+        *out = d->tasks[(d->top + d->count) % d->cap];
+        atomic_fetch_sub(&pool->queued, 1);
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+
+static int deque_steal_top(ThreadPool *pool, Deque *d, Task *out) {
+    int found = 0;
+    // Don't queue up behind the owner; just try somebody else
+    if (pthread_mutex_trylock(&d->lock) != 0) return 0;
+    if (d->count > 0) {
+        *out = d->tasks[d->top];
+        d->top = (d->top + 1) % d->cap;
+        d->count--;
+        atomic_fetch_sub(&pool->queued, 1);
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+
+static int find_task(Worker *w, Task *out) {
+    ThreadPool *pool = w->pool;
+    if (deque_pop_bottom(pool, &pool->deques[w->id], out)) return 1;
+
+    // Steal, starting with our neighbour so thieves spread out
+    for (int i = 1; i < pool->nthreads; i++) {
+        int victim = (w->id + i) % pool->nthreads;
+        if (deque_steal_top(pool, &pool->deques[victim], out)) return 1;
+    }
+    return 0;
+}
+
+
+static void *worker_main(void *arg) {
+    Worker *w = (Worker *)arg;
+    ThreadPool *pool = w->pool;
+    current_worker = w;
+
+    for (;;) {
+        Task t;
+        if (find_task(w, &t)) {
+            t.fn(t.arg);
+            if (atomic_fetch_sub(&pool->unfinished, 1) == 1) {
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_broadcast(&pool->done_cond);
+                pthread_mutex_unlock(&pool->lock);
+            }
+            continue;
+        }
+
+        // Nothing to pop or steal: sleep until a submit bumps `queued`.
+        // `idle` is raised before re-checking `queued`, and submitters bump `queued`
+        // before checking `idle`, so one side always sees the other.
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->idle, 1);
+        while (atomic_load(&pool->queued) == 0 && !pool->shutdown) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        atomic_fetch_sub(&pool->idle, 1);
+        int stop = pool->shutdown && atomic_load(&pool->queued) == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) break;
+    }
+
+    return NULL;
+}
+
+
+ThreadPool *thread_pool_create(int nthreads) {
+    if (nthreads < 1) nthreads = 1;
+
+    ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+    if (!pool) { perror("calloc"); return NULL; }
+    pool->nthreads = nthreads;
+    pool->workers = calloc(nthreads, sizeof(Worker));
+    pool->deques = calloc(nthreads, sizeof(Deque));
+    if (!pool->workers || !pool->deques) {
+        perror("calloc");
+        free(pool->workers);
+        free(pool->deques);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0) {
+            perror("pthread_create");
+            abort();
+        }
+    }
+
+    return pool;
+}
+
+
+void thread_pool_submit(ThreadPool *pool, task_fn fn, void *arg) {
+    atomic_fetch_add(&pool->unfinished, 1);
+
+    // Workers keep their own subtasks local; outside callers spread them round robin
+    int target;
+    if (current_worker && current_worker->pool == pool) {
+        target = current_worker->id;
+    } else {
+        target = (int)(atomic_fetch_add(&pool->next_deque, 1) % (unsigned)pool->nthreads);
+    }
+    deque_push_bottom(pool, &pool->deques[target], (Task){ fn, arg });
+
+    if (atomic_load(&pool->idle) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work_cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+
+void thread_pool_wait(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->unfinished) != 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+void thread_pool_destroy(ThreadPool *pool) {
+    if (!pool) return;
+    thread_pool_wait(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->workers);
+    free(pool->deques);
+    free(pool);
+}
+
+
+int default_job_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
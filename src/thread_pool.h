@@ -0,0 +1,24 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+
+// Work-stealing thread pool.
+//
+// Every worker owns a deque: it pushes and pops its own tasks at the bottom
+// (LIFO, cache friendly for recursive work) while idle workers steal from the
+// top of other workers' deques (FIFO, so they take the biggest pieces of work).
+// Tasks may submit further tasks from inside a worker.
+
+typedef void (*task_fn)(void *arg);
+
+typedef struct ThreadPool ThreadPool;
+
+ThreadPool *thread_pool_create(int nthreads);
+void thread_pool_submit(ThreadPool *pool, task_fn fn, void *arg);
+void thread_pool_wait(ThreadPool *pool);    // blocks until every submitted task has finished
+void thread_pool_destroy(ThreadPool *pool); // waits, then joins the workers
+
+int default_job_count(void); // number of online CPUs, at least 1
+
+#endif
@@ -0,0 +1,189 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define MAX_NODES 256
+
+// One node per distinct call path; node 0 is the root every thread starts at
+typedef struct {
+    const char *name;
+    int parent;
+    atomic_uint_fast64_t calls, total_ns;
+} TraceNode;
+
+// Chrome "complete" event, kept only in JSON mode
+typedef struct {
+    const char *name;
+    int tid;
+    uint64_t start_ns, dur_ns;
+} TraceEvent;
+
+int trace_enabled;
+atomic_uint_fast64_t trace_counters[TRACE_COUNTER_COUNT];
+
+static const char *const counter_names[TRACE_COUNTER_COUNT] = {
+    [TRACE_BYTES_HASHED] = "bytes hashed",
+    [TRACE_BYTES_DEFLATED] = "bytes deflated",
+    [TRACE_OBJECTS_WRITTEN] = "objects written",
+    [TRACE_OBJECTS_SKIPPED] = "objects skipped",
+    [TRACE_CACHE_HITS] = "object cache hits",
+    [TRACE_CACHE_MISSES] = "object cache misses",
+};
+
+static TraceNode nodes[MAX_NODES];
+static atomic_int node_count = 1;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local int current_node;
+static _Thread_local int thread_id = -1;
+static atomic_int thread_count;
+
+static char *out_path;             // NULL: stderr
+static int json_mode;
+static TraceEvent *events;
+static size_t event_count, event_cap;
+static uint64_t epoch_ns;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+
+// Child of `parent` called `name`, created on first use; -1 once the table is full
+static int find_node(int parent, const char *name) {
+    int count = atomic_load_explicit(&node_count, memory_order_acquire);
+    for (int i = 1; i < count; i++) {
+        if (nodes[i].parent == parent && (nodes[i].name == name || strcmp(nodes[i].name, name) == 0)) return i;
+    }
+
+    pthread_mutex_lock(&lock);
+    int found = -1;
+    int now = atomic_load_explicit(&node_count, memory_order_relaxed);
+    for (int i = count; i < now && found < 0; i++) {
+        if (nodes[i].parent == parent && strcmp(nodes[i].name, name) == 0) found = i;
+    }
+    if (found < 0 && now < MAX_NODES) {
+        nodes[now].name = name;
+        nodes[now].parent = parent;
+        found = now;
+        atomic_store_explicit(&node_count, now + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+
+void trace_span_begin(TraceSpan *span, const char *name) {
+    span->parent = current_node;
+    span->node = find_node(current_node, name);
+    if (span->node >= 0) current_node = span->node;
+    span->start_ns = now_ns();
+}
+
+
+void trace_span_end(TraceSpan *span) {
+    uint64_t dur = now_ns() - span->start_ns;
+    current_node = span->parent;
+    if (span->node < 0) return;
+
+    TraceNode *node = &nodes[span->node];
+    atomic_fetch_add_explicit(&node->calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&node->total_ns, dur, memory_order_relaxed);
+    if (!json_mode) return;
+
+    if (thread_id < 0) thread_id = atomic_fetch_add(&thread_count, 1);
+    pthread_mutex_lock(&lock);
+    if (event_count == event_cap) {
+        size_t cap = event_cap ? event_cap * 2 : 4096;
+        TraceEvent *grown = realloc(events, cap * sizeof(TraceEvent));
+        if (!grown) { pthread_mutex_unlock(&lock); return; }
+        events = grown;
+        event_cap = cap;
+    }
+    events[event_count++] = (TraceEvent){ node->name, thread_id, span->start_ns - epoch_ns, dur };
+    pthread_mutex_unlock(&lock);
+}
+
+
+static void print_node(FILE *out, int index, int depth) {
+    int count = atomic_load(&node_count);
+    uint64_t total = atomic_load(&nodes[index].total_ns), children = 0;
+    for (int i = 1; i < count; i++) {
+        if (nodes[i].parent == index) children += atomic_load(&nodes[i].total_ns);
+    }
+    // Children on worker threads can add up to more than their parent's wall time
+    uint64_t self = total > children ? total - children : 0;
+    fprintf(out, "%*s%-*s %10llu %12.3f %12.3f\n", depth * 2, "", 32 - depth * 2, nodes[index].name,
+            (unsigned long long)atomic_load(&nodes[index].calls), total / 1e6, self / 1e6);
+
+    for (int i = 1; i < count; i++) {
+        if (nodes[i].parent == index) print_node(out, i, depth + 1);
+    }
+}
+
+
+static void write_summary(FILE *out) {
+    fprintf(out, "%-32s %10s %12s %12s\n", "phase", "calls", "total ms", "self ms");
+    int count = atomic_load(&node_count);
+    for (int i = 1; i < count; i++) {
+        if (nodes[i].parent == 0) print_node(out, i, 0);
+    }
+    fprintf(out, "\n");
+    for (int c = 0; c < TRACE_COUNTER_COUNT; c++) {
+        fprintf(out, "%-32s %10llu\n", counter_names[c], (unsigned long long)atomic_load(&trace_counters[c]));
+    }
+}
+
+
+static void write_json(FILE *out) {
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (size_t i = 0; i < event_count; i++) {
+        const TraceEvent *e = &events[i];
+        fprintf(out, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f},\n",
+                e->name, e->tid, e->start_ns / 1e3, e->dur_ns / 1e3);
+    }
+    double end = (now_ns() - epoch_ns) / 1e3;
+    for (int c = 0; c < TRACE_COUNTER_COUNT; c++) {
+        fprintf(out, "{\"name\": \"%s\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, \"args\": {\"value\": %llu}}%s\n",
+                counter_names[c], end, (unsigned long long)atomic_load(&trace_counters[c]),
+                c + 1 < TRACE_COUNTER_COUNT ? "," : "");
+    }
+    fprintf(out, "]}\n");
+}
+
+
+static void trace_flush(void) {
+    FILE *out = out_path ? fopen(out_path, json_mode ? "w" : "a") : stderr;
+    if (!out) { perror(out_path); return; }
+    if (json_mode) write_json(out); else write_summary(out);
+    if (out != stderr) fclose(out);
+    free(events);
+    free(out_path);
+}
+
+
+void trace_init(void) {
+    const char *value = getenv("GIT_TRACE_PERFORMANCE");
+    if (!value || !*value) return;
+
+    if (value[0] == '/') {
+        out_path = strdup(value);
+        if (!out_path) return;
+        size_t len = strlen(value);
+        json_mode = len > 5 && strcmp(value + len - 5, ".json") == 0;
+    } else if (strcmp(value, "1") != 0 && strcmp(value, "2") != 0 && strcmp(value, "true") != 0) {
+        return;
+    }
+
+    nodes[0].name = "(root)";
+    epoch_ns = now_ns();
+    trace_enabled = 1;
+    atexit(trace_flush);
+}
@@ -0,0 +1,51 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Opt-in performance tracing, in the spirit of git's GIT_TRACE_PERFORMANCE.
+//   GIT_TRACE_PERFORMANCE=1 (or 2, true)  per-phase summary on stderr at exit
+//   GIT_TRACE_PERFORMANCE=/abs/path       the same summary into that file
+//   GIT_TRACE_PERFORMANCE=/abs/path.json  Chrome trace events instead, for
+//                                         chrome://tracing or Perfetto
+// Spans nest per thread and are aggregated by call path. With the variable
+// unset every hook below is a single branch on trace_enabled.
+
+typedef enum {
+    TRACE_BYTES_HASHED,
+    TRACE_BYTES_DEFLATED,
+    TRACE_OBJECTS_WRITTEN,
+    TRACE_OBJECTS_SKIPPED,   // already in the object database
+    TRACE_CACHE_HITS,        // reads served by the object cache
+    TRACE_CACHE_MISSES,      // objects inflated instead
+    TRACE_COUNTER_COUNT,
+} TraceCounter;
+
+typedef struct {
+    int node, parent;
+    uint64_t start_ns;
+} TraceSpan;
+
+extern int trace_enabled;
+extern atomic_uint_fast64_t trace_counters[TRACE_COUNTER_COUNT];
+
+void trace_init(void); // reads the environment; call before any thread starts
+void trace_span_begin(TraceSpan *span, const char *name);
+void trace_span_end(TraceSpan *span);
+
+// `name` should be a string literal: nodes keep the pointer
+static inline void trace_begin(TraceSpan *span, const char *name) {
+    if (__builtin_expect(trace_enabled, 0)) trace_span_begin(span, name);
+}
+
+static inline void trace_end(TraceSpan *span) {
+    if (__builtin_expect(trace_enabled, 0)) trace_span_end(span);
+}
+
+static inline void trace_count(TraceCounter counter, uint64_t n) {
+    if (__builtin_expect(trace_enabled, 0))
+        atomic_fetch_add_explicit(&trace_counters[counter], n, memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,161 @@
+#include "tree.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "object_cache.h"
+
+
+int tree_iter_open(TreeIterator *it, const unsigned char raw_hash[20]) {
+    memset(it, 0, sizeof(*it));
+    ObjectView view;
+    it->tree = read_object_cached(raw_hash, &view);
+    if (!it->tree) return -1;
+    if (view.type != OBJ_TREE) {
+        fprintf(stderr, "fatal: not a tree object\n");
+        tree_iter_close(it);
+        return -1;
+    }
+    it->pos = view.data;
+    it->end = view.data + view.size;
+    return 0;
+}
+
+
+void tree_iter_close(TreeIterator *it) {
+    object_cache_release(it->tree);
+    memset(it, 0, sizeof(*it));
+}
+
+
+int tree_iter_next(TreeIterator *it, TreeEntryView *entry) {
+    const unsigned char *p = it->pos, *end = it->end;
+    if (p == end) return 0;
+
+    // Mode: at most 6 octal digits, then a space
+    uint32_t mode = 0;
+    const unsigned char *q = p;
+    while (q < end && *q != ' ') {
+        if (*q < '0' || *q > '7' || q - p >= 6) return -1;
+        mode = mode << 3 | (uint32_t)(*q - '0');
+        q++;
+    }
+    if (q == end || q == p) return -1;
+
+    const unsigned char *name = q + 1;
+    const unsigned char *nul = memchr(name, '\0', (size_t)(end - name));
+    if (!nul || nul == name || end - (nul + 1) < 20) return -1;
+
+    entry->mode = mode;
+    entry->name = (const char *)name;
+    entry->name_len = (size_t)(nul - name);
+    entry->raw_hash = nul + 1;
+    it->pos = nul + 1 + 20;
+    return 1;
+}
+
+
+int peel_to_tree(const unsigned char raw_hash[20], unsigned char tree_hash[20]) {
+    ObjectStream s;
+    char hex[41];
+    if (object_stream_open(&s, raw_hash) < 0) {
+        hash_to_hex(hex, raw_hash);
+        fprintf(stderr, "fatal: not a valid object name %s\n", hex);
+        return -1;
+    }
+
+    // "tree <40 hex digits>\n" opens every commit
+    char line[46];
+    size_t got = 0;
+    ssize_t n = 1;
+    while (s.type == OBJ_COMMIT && got < sizeof(line) && n > 0) {
+        n = object_stream_read(&s, (unsigned char *)line + got, sizeof(line) - got);
+        if (n > 0) got += (size_t)n;
+    }
+    int ret = -1;
+    if (s.type == OBJ_TREE) {
+        memcpy(tree_hash, raw_hash, 20);
+        ret = 0;
+    } else if (got == sizeof(line) && memcmp(line, "tree ", 5) == 0 && line[45] == '\n') {
+        line[45] = '\0';
+        ret = hex_to_hash(tree_hash, line + 5);
+    }
+    object_stream_close(&s);
+    if (ret < 0) {
+        hash_to_hex(hex, raw_hash);
+        fprintf(stderr, "fatal: %s is not a tree or a commit\n", hex);
+    }
+    return ret;
+}
+
+
+int tree_entry_cmp(const char *a, size_t a_len, int a_is_tree, const char *b, size_t b_len, int b_is_tree) {
+    size_t n = a_len < b_len ? a_len : b_len;
+    int c = memcmp(a, b, n);
+    if (c != 0) return c;
+    unsigned char ca = n < a_len ? (unsigned char)a[n] : a_is_tree ? '/' : 0;
+    unsigned char cb = n < b_len ? (unsigned char)b[n] : b_is_tree ? '/' : 0;
+    return ca - cb;
+}
+
+
+static int cmp_entry_by_name(const void *a, const void *b) {
+    const Entry *ea = (const Entry *)a, *eb = (const Entry *)b;
+    return tree_entry_cmp(ea->file_name, ea->name_len, strcmp(ea->mode, "40000") == 0,
+                          eb->file_name, eb->name_len, strcmp(eb->mode, "40000") == 0);
+}
+
+
+int tree_serialize(Tree *tree, TreeBuffer *out) {
+    // Canonicalize order: sort entries by filename before hashing/writing
+    if (tree->count > 1) {
+        qsort(tree->entries, tree->count, sizeof(Entry), cmp_entry_by_name);
+    }
+
+    // "<mode> <name>\0<20-byte sha>" per entry, appended in one pass
+    out->len = 0;
+    for (size_t i = 0; i < tree->count; i++) {
+        const Entry *e = &tree->entries[i];
+        size_t mode_len = strlen(e->mode), record = mode_len + 1 + e->name_len + 1 + 20;
+        if (out->len + record > out->cap) {
+            size_t cap = out->cap ? out->cap * 2 : 4096;
+            while (cap < out->len + record) cap *= 2;
+            unsigned char *grown = realloc(out->data, cap);
+            if (!grown) { perror("realloc"); return -1; }
+            out->data = grown;
+            out->cap = cap;
+        }
+        unsigned char *p = out->data + out->len;
+        memcpy(p, e->mode, mode_len);
+        p[mode_len] = ' ';
+        p += mode_len + 1;
+        memcpy(p, e->file_name, e->name_len);
+        p[e->name_len] = '\0';
+        memcpy(p + e->name_len + 1, e->raw_hash, 20);
+        out->len += record;
+    }
+    return 0;
+}
+
+
+unsigned char *serialize_tree_entries(Tree *tree, size_t *len) {
+    TreeBuffer out = { 0 };
+    if (tree_serialize(tree, &out) < 0) {
+        free(out.data);
+        return NULL;
+    }
+    if (!out.data && !(out.data = malloc(1))) { perror("malloc"); return NULL; } // the empty tree
+    *len = out.len;
+    return out.data;
+}
+
+
+int write_tree_entries(Tree *tree, TreeBuffer *out, unsigned char tree_hash[20]) {
+    if (tree_serialize(tree, out) < 0) return -1;
+
+    // Hash, then deflate and write only if the object is new
+    int status = write_loose_object("tree", out->len ? out->data : (const unsigned char *)"", out->len, tree_hash);
+    if (status < 0) fprintf(stderr, "failed to write tree object\n");
+    return status;
+}
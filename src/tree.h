@@ -0,0 +1,78 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "object_store.h"
+
+// Reader for tree objects. The tree comes from read_object_cached(), so a
+// tree walked a second time (a path-limited log compares each commit's tree
+// with its parent's, and that one again with the next parent's) is not
+// inflated again. Records ("<octal mode> <name>\0<20-byte sha>") are parsed
+// in place: nothing is copied or allocated per entry, and entries stay valid
+// until tree_iter_close().
+
+typedef struct {
+    uint32_t mode;                 // e.g. 0100644, 040000
+    const char *name;              // NUL-terminated, inside the tree's payload
+    size_t name_len;
+    const unsigned char *raw_hash;
+} TreeEntryView;
+
+typedef struct {
+    CachedObject *tree;
+    const unsigned char *pos, *end; // the records not parsed yet
+} TreeIterator;
+
+// Opens the tree named by raw_hash. Returns 0, or -1 when the object is
+// missing (silently) or is not a tree (reported).
+int tree_iter_open(TreeIterator *it, const unsigned char raw_hash[20]);
+
+// Returns 1 with the next entry in *entry, 0 after the last one, -1 if corrupt
+int tree_iter_next(TreeIterator *it, TreeEntryView *entry);
+
+void tree_iter_close(TreeIterator *it);
+
+// Writing side: a tree being assembled in memory, one Entry per record
+typedef struct {
+    char mode[7];               // e.g. "100644" is a file, "40000" a subtree
+    char *file_name;            // owned by whoever built the tree (write-tree: an arena)
+    size_t name_len;
+    unsigned char raw_hash[20];
+} Entry;
+
+typedef struct {
+    Entry *entries;
+    size_t count;
+} Tree;
+
+// Where trees are serialized: kept across trees so that a build reuses one
+// buffer, which only ever grows
+typedef struct {
+    unsigned char *data;
+    size_t len, cap;
+} TreeBuffer;
+
+// Git's record order: names compared bytewise, as if every subtree's name
+// ended in '/'
+int tree_entry_cmp(const char *a, size_t a_len, int a_is_tree, const char *b, size_t b_len, int b_is_tree);
+
+// Sorts the entries into that order and serializes them into out, replacing
+// what it held. Returns 0, or -1 when out of memory (reported).
+int tree_serialize(Tree *tree, TreeBuffer *out);
+
+// The same into a fresh buffer: returns the payload (malloc'd, its length
+// in *len), or NULL when out of memory (reported)
+unsigned char *serialize_tree_entries(Tree *tree, size_t *len);
+
+// Serializes into out, then hashes and writes the tree (through
+// write_loose_object). Returns 0, or -1 on error (reported).
+int write_tree_entries(Tree *tree, TreeBuffer *out, unsigned char tree_hash[20]);
+
+// The tree itself, or the tree a commit points at (only the commit's first
+// line is inflated). Returns 0, or -1 when the object is missing or neither
+// (reported).
+int peel_to_tree(const unsigned char raw_hash[20], unsigned char tree_hash[20]);
+
+#endif